@@ -7,17 +7,24 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <asm/types.h>
-#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <list>
 #include <string>
 #include <stdlib.h>
 #include <malloc.h>
 #include <unistd.h>
 
-#include <queue>
+#include <deque>
+#include <vector>
 
 #include "ca_ci.h"
 #include "hal_debug.h"
+#include "hal_trace.h"
+#include "hal_metrics.h"
 #include <cs_api.h>
 #include <hardware_caps.h>
 
@@ -95,7 +102,10 @@ cCA *cCA::GetInstance()
 
 bool cCA::checkQueueSize(eDVBCISlot *slot)
 {
-	return (slot->sendqueue.size() > 0);
+	pthread_mutex_lock(&slot->sendqueue_mutex);
+	bool ret = !slot->sendqueue.empty();
+	pthread_mutex_unlock(&slot->sendqueue_mutex);
+	return ret;
 }
 
 /* write ci info file */
@@ -138,12 +148,38 @@ void cCA::del_ci_info(int slot)
 /* helper function to call the cpp thread loop */
 void *execute_thread(void *c)
 {
-	eDVBCISlot *slot = (eDVBCISlot *) c;
-	cCA *obj = (cCA *)slot->pClass;
-	obj->slot_pollthread(c);
+	cCA *obj = (cCA *)c;
+	obj->ci_event_loop();
 	return NULL;
 }
 
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* something to send or a state change, let the event loop look at the slot */
+static void ci_wakeup(eDVBCISlot *slot)
+{
+	if (slot->send_fd >= 0)
+		eventfd_write(slot->send_fd, 1);
+}
+
+#if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
+/* the input source of a slot became free: wake the slots which are not
+ * initialized yet, the first one with a ready module takes it over in
+ * ci_housekeeping() */
+static void ci_set_last_source(std::list<eDVBCISlot *> &slots, int source)
+{
+	__atomic_store_n(&last_source, source, __ATOMIC_RELEASE);
+	for (std::list<eDVBCISlot *>::iterator it = slots.begin(); it != slots.end(); ++it)
+		if (!(*it)->init)
+			ci_wakeup(*it);
+}
+#endif
+
 /* from dvb-apps */
 int asn_1_decode(uint16_t *length, unsigned char *asn_1_array,
 	uint32_t asn_1_array_len)
@@ -180,75 +216,203 @@ int asn_1_decode(uint16_t *length, unsigned char *asn_1_array,
 	return -1;
 }
 
-//wait for a while for some data und read it if some
-eData waitData(int fd, unsigned char *buffer, int *len)
+/* send buffers: most APDUs are small, CA PMTs and CI+ messages go up to
+ * 4k. Keep a few of both sizes instead of a malloc/free per APDU. */
+#define CI_BUF_SMALL 256
+#define CI_BUF_LARGE (1024 * 4 + 16)
+#define CI_BUF_KEEP 16
+
+static pthread_mutex_t ci_buf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<unsigned char *> ci_buf_free[2];
+
+static int ci_buf_class(unsigned int len)
 {
-	int retval;
-	struct pollfd fds;
-	fds.fd = fd;
-	fds.events = POLLOUT | POLLPRI | POLLIN;
-	retval = poll(&fds, 1, 200);
-	if (retval < 0)
+	if (len <= CI_BUF_SMALL)
+		return 0;
+	if (len <= CI_BUF_LARGE)
+		return 1;
+	return -1;
+}
+
+static unsigned char *ci_buf_get(unsigned int len)
+{
+	int c = ci_buf_class(len);
+	unsigned char *b = NULL;
+	if (c < 0)
+		return (unsigned char *) malloc(len);
+	pthread_mutex_lock(&ci_buf_mutex);
+	if (!ci_buf_free[c].empty())
 	{
-		printf("%s data error\n", FILENAME);
-		return eDataError;
+		b = ci_buf_free[c].back();
+		ci_buf_free[c].pop_back();
 	}
-	else if (retval == 0)
+	pthread_mutex_unlock(&ci_buf_mutex);
+	if (!b)
+		b = (unsigned char *) malloc(c ? CI_BUF_LARGE : CI_BUF_SMALL);
+	return b;
+}
+
+/* len must be the len the buffer was requested with */
+static void ci_buf_put(unsigned char *b, unsigned int len)
+{
+	int c = ci_buf_class(len);
+	if (c >= 0)
 	{
-#if wd_debug
-		printf("**** wd DataTimeout\n");
-#endif
-		return eDataTimeout;
+		pthread_mutex_lock(&ci_buf_mutex);
+		if (ci_buf_free[c].size() < CI_BUF_KEEP)
+		{
+			ci_buf_free[c].push_back(b);
+			b = NULL;
+		}
+		pthread_mutex_unlock(&ci_buf_mutex);
 	}
-	else if (retval > 0)
+	free(b);
+}
+
+#define CAPMT_LM_UPDATE 0x05
+
+/* session and program number if the SPDU carries a CA PMT, *lm is set
+ * to the offset of its ca_pmt_list_management byte */
+static uint32_t ci_capmt_key(unsigned char *d, unsigned int len, unsigned int *lm)
+{
+	static const unsigned char tag[3] = { 0x9f, 0x80, 0x32 };
+	uint16_t l;
+	int n;
+
+	if (len < 2 || d[0] != 0x90)
+		return 0;
+	n = asn_1_decode(&l, d + 1, len - 1);
+	if (n < 0 || l < 2)
+		return 0;
+	unsigned int apdu = 1 + n + l;
+	if (apdu + 4 > len || memcmp(d + apdu, tag, 3))
+		return 0;
+	uint16_t session = (d[apdu - 2] << 8) | d[apdu - 1];
+	n = asn_1_decode(&l, d + apdu + 3, len - apdu - 3);
+	if (n < 0)
+		return 0;
+	unsigned int body = apdu + 3 + n;
+	if (body + 3 > len)
+		return 0;
+	*lm = body;
+	return ((uint32_t)session << 16) | (d[body + 1] << 8) | d[body + 2];
+}
+
+static hal_metric *ci_sent = hal_metric_counter("hal_ci_sent_total", "messages written to the CI modules");
+static hal_metric *ci_coalesced = hal_metric_counter("hal_ci_coalesced_total", "CA PMTs replaced while still queued");
+static hal_metric *ci_queue_latency = hal_metric_histogram("hal_ci_queue_latency_seconds", "time messages waited in the CI send queue");
+static hal_metric *ci_round_trip = hal_metric_histogram("hal_ci_apdu_round_trip_seconds", "time from a write to the next read from the CI module");
+
+/* queue a message. A CA PMT replaces a CA PMT for the same program that
+ * is still waiting, only the latest one is of any use to the module.
+ * the list management of the queued one is kept */
+static void ci_queue_push(eDVBCISlot *slot, unsigned char *d, unsigned int len)
+{
+	unsigned int lm = 0, qlm = 0;
+	uint32_t capmt = ci_capmt_key(d, len, &lm);
+	pthread_mutex_lock(&slot->sendqueue_mutex);
+	if (capmt)
 	{
-		if (fds.revents & POLLIN)
+		/* only the newest queued one, replacing an older one would
+		 * reorder it behind the newer */
+		for (std::deque<queueData>::reverse_iterator it = slot->sendqueue.rbegin(); it != slot->sendqueue.rend(); ++it)
 		{
-			int n = read(fd, buffer, *len);
-			if (n > 0)
-			{
-				*len = n;
-#if wd_debug
-				printf("**** wd DataReceived\n");
-#endif
-				return eDataReady;
-			}
-			*len = 0;
-			printf("%s data error\n", FILENAME);
-			return eDataError;
+			if (it->capmt != capmt)
+				continue;
+			if (!ci_capmt_key(it->data, it->len, &qlm))
+				break;
+			/* an update must not turn a queued only/add into an update,
+			 * the module has not seen the program yet. any other change
+			 * of the list management is queued as it is */
+			if (d[lm] == CAPMT_LM_UPDATE)
+				d[lm] = it->data[qlm];
+			else if (d[lm] != it->data[qlm])
+				break;
+			ci_buf_put(it->data, it->len);
+			it->data = d;
+			it->len = len;
+			slot->sq_coalesced++;
+			hal_metric_add(ci_coalesced, 1);
+			pthread_mutex_unlock(&slot->sendqueue_mutex);
+			return;
 		}
-		else if (fds.revents & POLLOUT)
+	}
+	slot->sendqueue.push_back(queueData(d, len, now_us(), capmt));
+	hal_trace(HAL_DEBUG_CA, HAL_TRACE_CI_QUEUE, slot->slot, len, slot->sendqueue.size());
+	if (slot->sendqueue.size() > slot->sq_depth_max)
+		slot->sq_depth_max = slot->sendqueue.size();
+	pthread_mutex_unlock(&slot->sendqueue_mutex);
+}
+
+static void ci_queue_flush(eDVBCISlot *slot)
+{
+	pthread_mutex_lock(&slot->sendqueue_mutex);
+	while (!slot->sendqueue.empty())
+	{
+		ci_buf_put(slot->sendqueue.front().data, slot->sendqueue.front().len);
+		slot->sendqueue.pop_front();
+	}
+	pthread_mutex_unlock(&slot->sendqueue_mutex);
+}
+
+#define CI_QUEUE_REPORT 64
+
+/* write everything that is queued, the driver takes one message per write */
+static void ci_queue_send(eDVBCISlot *slot)
+{
+	pthread_mutex_lock(&slot->sendqueue_mutex);
+	while (!slot->sendqueue.empty())
+	{
+		queueData &qe = slot->sendqueue.front();
+		int res = write(slot->fd, qe.data, qe.len);
+		if (res < 0 || (unsigned int)res != qe.len)
 		{
-#if wd_debug
-			printf("**** wd DataWrite\n");
-#endif
-			return eDataWrite;
+			printf("r = %d, %m\n", res);
+			break;
 		}
-		else if (fds.revents & POLLPRI)
+		int64_t now = now_us();
+		int64_t latency = now - qe.queued;
+		hal_trace(HAL_DEBUG_CA, HAL_TRACE_CI_WRITE, slot->slot, qe.len, latency);
+		hal_metric_observe(ci_queue_latency, latency);
+		hal_metric_add(ci_sent, 1);
+		if (!slot->apdu_sent)
+			slot->apdu_sent = now;
+		slot->sq_latency_sum += latency;
+		if (latency > slot->sq_latency_max)
+			slot->sq_latency_max = latency;
+		ci_buf_put(qe.data, qe.len);
+		slot->sendqueue.pop_front();
+		if (++slot->sq_sent % CI_QUEUE_REPORT == 0)
 		{
-#if wd_debug
-			printf("**** wd StatusChanged\n");
-#endif
-			return eDataStatusChanged;
+			printf("%s slot %d sendqueue: sent=%u coalesced=%u depth_max=%u latency_avg=%lldus latency_max=%lldus\n",
+				FILENAME, slot->slot, slot->sq_sent, slot->sq_coalesced, slot->sq_depth_max,
+				(long long)(slot->sq_latency_sum / CI_QUEUE_REPORT), (long long)slot->sq_latency_max);
+			slot->sq_depth_max = slot->sendqueue.size();
+			slot->sq_latency_sum = 0;
+			slot->sq_latency_max = 0;
 		}
 	}
-	return eDataError;
+	pthread_mutex_unlock(&slot->sendqueue_mutex);
 }
 
 static bool transmitData(eDVBCISlot *slot, unsigned char *d, int len)
 {
-	printf("%s -> %s len(%d) -> ", FILENAME, __func__, len);
-
 #if BOXMODEL_VUSOLO4K || BOXMODEL_VUDUO4K || BOXMODEL_VUDUO4KSE || BOXMODEL_VUULTIMO4K || BOXMODEL_VUZERO4K
 #if y_debug
 	for (int i = 0; i < len; i++)
 		printf("%02x ", d[i]);
-#endif
 	printf("\n");
+#endif
 	int res = write(slot->fd, d, len);
-	printf("send: %d len: %d\n", res, len);
+	hal_trace(HAL_DEBUG_CA, HAL_TRACE_CI_TRANSMIT, slot->slot, len, res);
+	if (res == len)
+	{
+		hal_metric_add(ci_sent, 1);
+		if (!slot->apdu_sent)
+			slot->apdu_sent = now_us();
+	}
 
-	free(d);
+	ci_buf_put(d, len);
 	if (res < 0 || res != len)
 	{
 		printf("error writing data to fd %d, slot %d: %m\n", slot->fd, slot->slot);
@@ -260,7 +424,8 @@ static bool transmitData(eDVBCISlot *slot, unsigned char *d, int len)
 		printf("%02x ", d[i]);
 	printf("\n");
 #endif
-	slot->sendqueue.push(queueData(d, len));
+	ci_queue_push(slot, d, len);
+	ci_wakeup(slot);
 #endif
 	return true;
 }
@@ -269,7 +434,7 @@ static bool transmitData(eDVBCISlot *slot, unsigned char *d, int len)
 eData sendData(eDVBCISlot *slot, unsigned char *data, int len)
 {
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
-	unsigned char *d = (unsigned char *) malloc(len);
+	unsigned char *d = ci_buf_get(len);
 	memcpy(d, data, len);
 	transmitData(slot, d, len);
 #else
@@ -279,7 +444,7 @@ eData sendData(eDVBCISlot *slot, unsigned char *data, int len)
 	//send data_last and data
 	if (len < 127)
 	{
-		unsigned char *d = (unsigned char *) malloc(len + 5);
+		unsigned char *d = ci_buf_get(len + 5);
 		memcpy(d + 5, data, len);
 		d[0] = slot->slot;
 		d[1] = slot->connection_id;
@@ -291,7 +456,7 @@ eData sendData(eDVBCISlot *slot, unsigned char *data, int len)
 	}
 	else if (len > 126 && len < 255)
 	{
-		unsigned char *d = (unsigned char *) malloc(len + 6);
+		unsigned char *d = ci_buf_get(len + 6);
 		memcpy(d + 6, data, len);
 		d[0] = slot->slot;
 		d[1] = slot->connection_id;
@@ -304,7 +469,7 @@ eData sendData(eDVBCISlot *slot, unsigned char *data, int len)
 	}
 	else if (len > 254)
 	{
-		unsigned char *d = (unsigned char *) malloc(len + 7);
+		unsigned char *d = ci_buf_get(len + 7);
 		memcpy(d + 7, data, len);
 		d[0] = slot->slot;
 		d[1] = slot->connection_id;
@@ -485,6 +650,7 @@ bool cCA::StopLiveCI(u64 TP, u16 SID, u8 source, u32 calen)
 			{
 				(*it)->SID[j] = 0;
 				(*it)->liveUse[j] = false;
+				ci_index_slot((eDVBCISlot *)(*it));
 				return true;
 			}
 		}
@@ -504,6 +670,7 @@ bool cCA::StopRecordCI(u64 TP, u16 SID, u8 source, u32 calen)
 			{
 				(*it)->SID[j] = 0;
 				(*it)->recordUse[j] = false;
+				ci_index_slot((eDVBCISlot *)(*it));
 				return true;
 			}
 		}
@@ -511,39 +678,82 @@ bool cCA::StopRecordCI(u64 TP, u16 SID, u8 source, u32 calen)
 	return false;
 }
 
-SlotIt cCA::FindFreeSlot(u64 TP, u8 source, u16 SID, ca_map_t camap, u8 scrambled)
+/* services the module can descramble at once */
+static int ci_capacity(eDVBCISlot *slot)
+{
+	return slot->multi ? CI_MAX_MULTI : 1;
+}
+
+void cCA::ci_index_slot(eDVBCISlot *slot)
+{
+	pthread_mutex_lock(&sched_mutex);
+	ci_service_map_t::iterator it = service_index.begin();
+	while (it != service_index.end())
+	{
+		if (it->second == slot)
+			it = service_index.erase(it);
+		else
+			++it;
+	}
+	for (int j = 0; j < CI_MAX_MULTI; j++)
+	{
+		if (!slot->SID[j])
+			continue;
+		struct ci_service_key k = { slot->TP, slot->SID[j], slot->source };
+		service_index[k] = slot;
+	}
+	pthread_mutex_unlock(&sched_mutex);
+}
+
+eDVBCISlot *cCA::ci_lookup(u64 TP, u8 source, u16 SID)
+{
+	eDVBCISlot *slot = NULL;
+	struct ci_service_key k = { TP, SID, source };
+	pthread_mutex_lock(&sched_mutex);
+	ci_service_map_t::iterator it = service_index.find(k);
+	if (it != service_index.end())
+		slot = it->second;
+	pthread_mutex_unlock(&sched_mutex);
+	return slot;
+}
+
+/* pick a module for the service. a service which is already descrambled
+ * keeps its module, a multi decrypt module on the same TP takes more
+ * services. otherwise every ready module with a matching caid is a
+ * candidate: live tv prefers the module already used for live tv and
+ * recordings prefer a module without live tv, so that a second module
+ * takes the recording instead of the live service losing its module.
+ * among equally preferred modules the one with the larger capacity wins. */
+SlotIt cCA::FindFreeSlot(u64 TP, u8 source, u16 SID, ca_map_t camap, u8 scrambled, int mode)
 {
 	printf("%s -> %s\n", FILENAME, __func__);
 	std::list<eDVBCISlot *>::iterator it;
-	ca_map_iterator_t caIt;
 	unsigned int i;
 	int count = 0;
 	int loop_count = 0;
 
+	if (!scrambled)
+		return slot_data.end();
+
 	for (it = slot_data.begin(); it != slot_data.end(); ++it)
 	{
-		if (!scrambled)
-		{
-			continue;
-		}
-
 		if ((*it)->init)
 			count++;
 	}
 
-	if (!count || !scrambled)
+	if (!count)
 		return it;
 
-	for (it = slot_data.begin(); it != slot_data.end(); ++it)
+	eDVBCISlot *found = ci_lookup(TP, source, SID);
+	if (found)
 	{
-		for (int j = 0; j < CI_MAX_MULTI; j++)
-		{
-			if ((*it)->TP == TP && (*it)->SID[j] == SID && (*it)->source == source)
-			{
-				(*it)->scrambled = scrambled;
-				return it;
-			}
-		}
+		for (it = slot_data.begin(); it != slot_data.end(); ++it)
+			if (*it == found)
+				break;
+		found->scrambled = scrambled;
+		printf("%s sched: sid=%04x tp=%llx source=%d mode=%s -> slot=%d reason=running\n",
+			FILENAME, SID, TP, source, mode ? "record" : "live", found->slot);
+		return it;
 	}
 
 	for (it = slot_data.begin(); it != slot_data.end(); ++it)
@@ -551,16 +761,24 @@ SlotIt cCA::FindFreeSlot(u64 TP, u8 source, u16 SID, ca_map_t camap, u8 scramble
 		if ((*it)->multi && (*it)->TP == TP && (*it)->source == source && (*it)->ci_use_count < CI_MAX_MULTI)
 		{
 			(*it)->scrambled = scrambled;
+			printf("%s sched: sid=%04x tp=%llx source=%d mode=%s -> slot=%d reason=multi used=%d capacity=%d\n",
+				FILENAME, SID, TP, source, mode ? "record" : "live", (*it)->slot, (*it)->ci_use_count, ci_capacity(*it));
 			return it;
 		}
 	}
 
+	SlotIt best = slot_data.end();
+	int best_score = 0;
+	eDVBCISlot *nomatch = NULL;
+
 	for (it = slot_data.begin(); it != slot_data.end(); ++it)
 	{
 		bool tmpSidBlackListed = false;
-		bool recordUse_found = false;
-		bool liveUse_found = false;
+		int live = 0;
+		int record = 0;
 		int found_count = 0;
+		int caid = -1;
+		const char *verdict;
 		loop_count++;
 
 		if ((*it)->bsids.size())
@@ -582,61 +800,89 @@ SlotIt cCA::FindFreeSlot(u64 TP, u8 source, u16 SID, ca_map_t camap, u8 scramble
 		for (int j = 0; j < CI_MAX_MULTI; j++)
 		{
 			if ((*it)->recordUse[j])
-				recordUse_found = true;
+				record++;
 			if ((*it)->liveUse[j])
 			{
-				liveUse_found = true;
+				live++;
 				found_count = j;
 			}
 		}
 
-		if ((*it)->camIsReady && (*it)->hasCAManager && (*it)->hasAppManager && !recordUse_found)
+		if (!(*it)->camIsReady || !(*it)->hasCAManager || !(*it)->hasAppManager)
+			verdict = "not_ready";
+		else if (record)
+			verdict = "recording";
+		else if (tmpSidBlackListed)
 		{
-
-			if (tmpSidBlackListed)
+			verdict = "blacklisted";
+			if ((*it)->source == source && (!checkLiveSlot || !live))
+			{
+				SendNullPMT((eDVBCISlot *)(*it));
+				(*it)->SidBlackListed = true;
+				for (int j = 0; j < CI_MAX_MULTI; j++)
+					(*it)->SID[j] = 0;
+				(*it)->TP = 0;
+				(*it)->scrambled = 0;
+				ci_index_slot((eDVBCISlot *)(*it));
+			}
+		}
+		else if (checkLiveSlot && live && !((*it)->TP == TP && (*it)->SID[found_count] == SID))
+			verdict = "live_busy";
+		else
+		{
+#if x_debug
+			printf("Slot Caids: %d > ", (*it)->cam_caids.size());
+			for (i = 0; i < (*it)->cam_caids.size(); i++)
+				printf("%04x ", (*it)->cam_caids[i]);
+			printf("\n");
+#endif
+			for (i = 0; i < (*it)->cam_caids.size(); i++)
 			{
-				if ((*it)->source == source && (!checkLiveSlot || !liveUse_found))
+				if (camap.find((*it)->cam_caids[i]) != camap.end())
 				{
-					SendNullPMT((eDVBCISlot *)(*it));
-					(*it)->SidBlackListed = true;
-					for (int j = 0; j < CI_MAX_MULTI; j++)
-						(*it)->SID[j] = 0;
-					(*it)->TP = 0;
-					(*it)->scrambled = 0;
-					continue;
+					caid = (*it)->cam_caids[i];
+					break;
 				}
-				else
-					continue;
 			}
-
-			if (!checkLiveSlot || (!liveUse_found || ((*it)->liveUse[found_count] && (*it)->TP == TP && (*it)->SID[found_count] == SID)))
+			if (caid < 0)
 			{
-#if x_debug
-				printf("Slot Caids: %d > ", (*it)->cam_caids.size());
-				for (i = 0; i < (*it)->cam_caids.size(); i++)
-					printf("%04x ", (*it)->cam_caids[i]);
-				printf("\n");
-#endif
-				for (i = 0; i < (*it)->cam_caids.size(); i++)
+				verdict = "no_caid";
+				if (loop_count == count)
+					nomatch = (eDVBCISlot *)(*it);
+			}
+			else
+			{
+				/* lower is better: the live/record preference first, then
+				 * the larger capacity, so that a multi decrypt module takes
+				 * the TP and later services on it need no second module.
+				 * ties go to the lower slot */
+				int score = (mode ? live : !live) * (CI_MAX_MULTI + 1) + CI_MAX_MULTI - ci_capacity(*it);
+				verdict = "candidate";
+				if (best == slot_data.end() || score < best_score)
 				{
-					caIt = camap.find((*it)->cam_caids[i]);
-					if (caIt != camap.end())
-					{
-						printf("Found: %04x\n", *caIt);
-						(*it)->scrambled = scrambled;
-						return it;
-					}
-					else
-					{
-						//printf("Not Found\n");
-						if (loop_count == count)
-							(*it)->scrambled = 0;
-					}
+					best = it;
+					best_score = score;
 				}
 			}
 		}
+		printf("%s sched:   slot=%d live=%d record=%d capacity=%d caid=%04x verdict=%s\n",
+			FILENAME, (*it)->slot, live, record, ci_capacity(*it), caid < 0 ? 0 : caid, verdict);
 	}
-	return it;
+
+	if (best != slot_data.end())
+	{
+		(*best)->scrambled = scrambled;
+		printf("%s sched: sid=%04x tp=%llx source=%d mode=%s -> slot=%d reason=%s\n",
+			FILENAME, SID, TP, source, mode ? "record" : "live", (*best)->slot, best_score > CI_MAX_MULTI ? "busy" : "preferred");
+	}
+	else
+	{
+		if (nomatch)
+			nomatch->scrambled = 0;
+		printf("%s sched: sid=%04x tp=%llx source=%d mode=%s -> none\n",
+			FILENAME, SID, TP, source, mode ? "record" : "live");
+	}
+	return best;
 }
 
 /* erstmal den capmt wie er von Neutrino kommt in den Slot puffern */
@@ -676,7 +922,7 @@ bool cCA::SendCAPMT(u64 tpid, u8 source, u8 camask, const unsigned char *cabuf,
 
 	if (calen == 0)
 		return true;
-	SlotIt It = FindFreeSlot(TP, source, SID, cm, scrambled);
+	SlotIt It = FindFreeSlot(TP, source, SID, cm, scrambled, mode);
 
 	if (It != slot_data.end())
 	{
@@ -706,6 +952,7 @@ bool cCA::SendCAPMT(u64 tpid, u8 source, u8 camask, const unsigned char *cabuf,
 					(*It2)->TP = 0;
 					for (int j = 0; j < CI_MAX_MULTI; j++)
 						(*It2)->SID[j] = 0;
+					ci_index_slot((eDVBCISlot *)(*It2));
 				}
 			}
 		}
@@ -753,10 +1000,14 @@ bool cCA::SendCAPMT(u64 tpid, u8 source, u8 camask, const unsigned char *cabuf,
 			(*It)->newCapmt = true;
 		}
 
+		if ((*It)->newCapmt)
+			ci_index_slot((eDVBCISlot *)(*It));
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
 		if ((*It)->newCapmt)
 			extractPids((eDVBCISlot *)(*It));
 #endif
+		if ((*It)->newCapmt)
+			ci_wakeup((eDVBCISlot *)(*It));
 		if ((*It)->scrambled && !(*It)->SidBlackListed)
 		{
 			for (int j = 0; j < CI_MAX_MULTI; j++)
@@ -783,6 +1034,7 @@ bool cCA::SendCAPMT(u64 tpid, u8 source, u8 camask, const unsigned char *cabuf,
 	{
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
 		std::list<eDVBCISlot *>::iterator it;
+		bool waiting = false;
 		recordUse_found = false;
 		for (it = slot_data.begin(); it != slot_data.end(); ++it)
 		{
@@ -799,8 +1051,10 @@ bool cCA::SendCAPMT(u64 tpid, u8 source, u8 camask, const unsigned char *cabuf,
 				}
 			}
 			if (!(*it)->init)
-				last_source = (int)source;
+				waiting = true;
 		}
+		if (waiting)
+			ci_set_last_source(slot_data, (int)source);
 #endif
 		printf("No free ci-slot\n");
 	}
@@ -1110,15 +1364,33 @@ cCA::cCA(int Slots)
 	memset(op, 0, sizeof(op));
 	zapitReady = false;
 	num_slots = Slots;
+	action_pending = false;
+	pthread_mutex_init(&sched_mutex, NULL);
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
 	setInputs();
 #endif
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epoll_fd < 0 || timer_fd < 0)
+		printf("%s: epoll/timerfd: %m\n", FILENAME);
+	else
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = timer_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+	}
+	bool have_slot = false;
 
 	for (int i = 0; i < Slots; i++)
 	{
-		eDVBCISlot *slot = (eDVBCISlot *) malloc(sizeof(eDVBCISlot));
+		eDVBCISlot *slot = new eDVBCISlot();
 		slot->slot = i;
 		slot->fd = -1;
+		slot->send_fd = -1;
+		slot->epoll_events = 0;
+		slot->backoff = 0;
+		pthread_mutex_init(&slot->sendqueue_mutex, NULL);
 		slot->connection_id = 0;
 		slot->status = eStatusNone;
 		slot->receivedLen = 0;
@@ -1170,13 +1442,23 @@ cCA::cCA(int Slots)
 		}
 		ioctl(slot->fd, 0);
 		usleep(200000);
-		/* create a thread for each slot */
-		if (slot->fd > 0)
+		if (slot->fd > 0 && epoll_fd >= 0)
 		{
-			if (pthread_create(&slot->slot_thread, 0, execute_thread, (void *)slot))
-			{
-				printf("pthread_create");
-			}
+			struct epoll_event ev;
+			slot->send_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			ev.events = EPOLLIN;
+			ev.data.fd = slot->send_fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slot->send_fd, &ev);
+			ci_update_events(slot);
+			have_slot = true;
+		}
+	}
+	/* one thread for all slots */
+	if (have_slot)
+	{
+		if (pthread_create(&slot_thread, 0, execute_thread, (void *)this))
+		{
+			printf("pthread_create");
 		}
 	}
 }
@@ -1201,7 +1483,7 @@ void cCA::ModuleReset(enum CA_SLOT_TYPE, uint32_t slot)
 		(*it)->status = eStatusReset;
 		usleep(200000);
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
-		last_source = (int)(*it)->source;
+		ci_set_last_source(slot_data, (int)(*it)->source);
 		setInputSource((eDVBCISlot *)(*it), false);
 #endif
 		if ((*it)->hasCCManager)
@@ -1243,16 +1525,14 @@ void cCA::ModuleReset(enum CA_SLOT_TYPE, uint32_t slot)
 		(*it)->source = TUNER_A;
 		(*it)->camask = 0;
 		memset((*it)->pmtdata, 0, sizeof((*it)->pmtdata));
+		ci_index_slot((eDVBCISlot *)(*it));
 
-		while ((*it)->sendqueue.size())
-		{
-			delete [](*it)->sendqueue.top().data;
-			(*it)->sendqueue.pop();
-		}
+		ci_queue_flush((eDVBCISlot *)(*it));
 
 		ioctl((*it)->fd, 0);
 		usleep(200000);
 		(*it)->status = eStatusNone;
+		ci_wakeup((eDVBCISlot *)(*it));
 	}
 }
 
@@ -1285,7 +1565,7 @@ void cCA::ci_removed(eDVBCISlot *slot)
 {
 	printf("cam (%d) status changed ->cam now _not_ present\n", slot->slot);
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
-	last_source = (int)slot->source;
+	ci_set_last_source(slot_data, (int)slot->source);
 	setInputSource(slot, false);
 #endif
 	if (slot->hasCCManager)
@@ -1327,6 +1607,7 @@ void cCA::ci_removed(eDVBCISlot *slot)
 	slot->source = TUNER_A;
 	slot->camask = 0;
 	memset(slot->pmtdata, 0, sizeof(slot->pmtdata));
+	ci_index_slot(slot);
 
 	/* delete ci info file */
 	del_ci_info(slot->slot);
@@ -1338,26 +1619,177 @@ void cCA::ci_removed(eDVBCISlot *slot)
 	pMsg->Slot = slot->slot;
 	SendMessage(pMsg);
 
-	while (slot->sendqueue.size())
-	{
-		delete [] slot->sendqueue.top().data;
-		slot->sendqueue.pop();
-	}
+	ci_queue_flush(slot);
 	slot->camIsReady = false;
 	usleep(100000);
 }
 
-void cCA::slot_pollthread(void *c)
+/* (un)register the CI fd with the event loop as needed. A slot in reset
+ * or in backoff is removed completely, else EPOLLERR would still wake us */
+void cCA::ci_update_events(eDVBCISlot *slot)
+{
+	uint32_t events = 0;
+	if (slot->status != eStatusReset && !slot->backoff)
+	{
+		events = EPOLLIN | EPOLLPRI;
+		/* only ask for POLLOUT if there is something to write */
+		if (checkQueueSize(slot))
+			events |= EPOLLOUT;
+	}
+	if (events == slot->epoll_events)
+		return;
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = slot->fd;
+	int op = EPOLL_CTL_MOD;
+	if (!events)
+		op = EPOLL_CTL_DEL;
+	else if (!slot->epoll_events)
+		op = EPOLL_CTL_ADD;
+	if (epoll_ctl(epoll_fd, op, slot->fd, &ev) < 0)
+		printf("%s: slot %d epoll_ctl(%d): %m\n", FILENAME, slot->slot, op);
+	slot->epoll_events = events;
+}
+
+/* the timer runs pending session actions and ends slot backoffs */
+void cCA::ci_update_timer(void)
+{
+	int64_t due = 0;
+	for (std::list<eDVBCISlot *>::iterator it = slot_data.begin(); it != slot_data.end(); ++it)
+		if ((*it)->backoff && (!due || (*it)->backoff < due))
+			due = (*it)->backoff;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (action_pending)
+		its.it_value.tv_nsec = 1; /* as soon as the pending events are handled */
+	else if (due)
+	{
+		int64_t t = due - now_us();
+		if (t < 1)
+			t = 1;
+		its.it_value.tv_sec = t / 1000000;
+		its.it_value.tv_nsec = (t % 1000000) * 1000;
+	}
+	timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+void cCA::ci_event(eDVBCISlot *slot, uint32_t events)
 {
 	unsigned char data[1024 * 4];
-	eDVBCISlot *slot = (eDVBCISlot *) c;
-	bool wait = false;
+
+	if (slot->status == eStatusReset)
+		return;
+	if (events & EPOLLIN)
+	{
+		int len = read(slot->fd, data, sizeof(data));
+		hal_trace(HAL_DEBUG_CA, HAL_TRACE_CI_READ, slot->slot, len, 0);
+		if (len > 0 && slot->apdu_sent)
+		{
+			hal_metric_observe(ci_round_trip, now_us() - slot->apdu_sent);
+			slot->apdu_sent = 0;
+		}
+		if (len <= 0)
+		{
+			printf("%s data error\n", FILENAME);
+			/* don't spin on a fd that keeps reporting POLLIN */
+			slot->backoff = now_us() + 1000000;
+			return;
+		}
+		if (slot->status == eStatusNone)
+		{
+			if (slot->camIsReady)
+				return;
+#if y_debug
+			printf("1. received : > ");
+			for (int i = 0; i < len; i++)
+				printf("%02x ", data[i]);
+			printf("\n");
+#endif
+			ci_inserted(slot);
+		}
+		slot->pollConnection = false;
+		eDVBCISession::receiveData(slot, data, len);
+		if (eDVBCISession::pollAll())
+			action_pending = true;
+	}
+	else if (events & EPOLLOUT)
+		ci_queue_send(slot);
+	else if (events & (EPOLLPRI | EPOLLERR | EPOLLHUP))
+	{
+		if (slot->camIsReady)
+			ci_removed(slot);
+		else
+			slot->backoff = now_us() + 1000000;
+	}
+}
+
+void cCA::ci_housekeeping(eDVBCISlot *slot)
+{
+#if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
+	if (!slot->init && slot->camIsReady && __atomic_load_n(&last_source, __ATOMIC_ACQUIRE) > -1)
+	{
+		int source = __atomic_exchange_n(&last_source, -1, __ATOMIC_ACQ_REL);
+		if (source > -1)
+		{
+			slot->source = (u8)source;
+			setInputSource(slot, true);
+		}
+	}
+#endif
+	if (slot->hasCAManager && slot->hasAppManager && !slot->init)
+	{
+		slot->init = true;
+
+		slot->cam_caids = slot->camgrSession->getCAIDs();
+
+		printf("Anzahl Caids: %d Slot: %d > ", slot->cam_caids.size(), slot->slot);
+		for (unsigned int i = 0; i < slot->cam_caids.size(); i++)
+		{
+			printf("%04x ", slot->cam_caids[i]);
+
+		}
+		printf("\n");
+
+		/* write ci info file */
+		write_ci_info(slot->slot, slot->cam_caids);
+
+		/* Send a message to Neutrino cam_menu handler */
+		CA_MESSAGE *pMsg = (CA_MESSAGE *) malloc(sizeof(CA_MESSAGE));
+		memset(pMsg, 0, sizeof(CA_MESSAGE));
+		pMsg->MsgId = CA_MESSAGE_MSG_INIT_OK;
+		pMsg->SlotType = CA_SLOT_TYPE_CI;
+		pMsg->Slot = slot->slot;
+		SendMessage(pMsg);
+		/* resend a capmt if we have one. this is not very proper but I cant any mechanism in
+		neutrino currently. so if a cam is inserted a pmt is not resend */
+		/* not necessary: the arrived capmt will be automaticly send */
+		//SendCaPMT(slot);
+	}
+	if (slot->hasCAManager && slot->hasAppManager && slot->newCapmt)
+	{
+		SendCaPMT(slot);
+		slot->newCapmt = false;
+		if (slot->ccmgr_ready && slot->hasCCManager && slot->scrambled && !slot->SidBlackListed)
+			slot->ccmgrSession->resendKey(slot);
+	}
+}
+
+/* All slots are served by one thread. It sleeps in epoll_wait until
+ * - a CI device has data, or can take data we have queued (EPOLLOUT is
+ *   only requested while the send queue is not empty)
+ * - a module was inserted / removed (EPOLLPRI)
+ * - the slot's eventfd is written: data was queued, a new CA PMT is
+ *   waiting or a reset has finished
+ * - the timer expires: session actions are pending or a backoff ended */
+void cCA::ci_event_loop(void)
+{
+	struct epoll_event events[8];
 
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
 	//prevert zapit fail on booting with CI
 	if (!zapitReady)
 	{
-		printf("[CA] Slot%d: Waiting for zapit\n", slot->slot);
+		printf("[CA] Waiting for zapit\n");
 		const int waiting = 3 * 1000000; // wait for 3 seconds
 		const int maxwait = waiting * 6;
 		int timeout = 0;
@@ -1370,145 +1802,66 @@ void cCA::slot_pollthread(void *c)
 			else
 				timeout += waiting;
 		}
-		printf("[CA] Slot%d: %s\n", slot->slot, timeout >= maxwait ? "waiting timeout!" : "zapit is ready");
+		printf("[CA] %s\n", timeout >= maxwait ? "waiting timeout!" : "zapit is ready");
 	}
-	printf("[CA] Slot%d: start pollthread\n", slot->slot);
+	printf("[CA] start event loop\n");
 #endif
 	while (1)
 	{
-#if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE /* Armbox/Mipsbox */
-
-		int len = 1024 * 4;
-		eData status;
-
-		switch (slot->status)
+		int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n < 0)
 		{
-			case eStatusReset:
-				while (slot->status == eStatusReset)
-				{
-					usleep(1000);
-				}
-				break;
-			case eStatusNone:
-			{
-				status = waitData(slot->fd, data, &len);
-				if (status == eDataReady)
-				{
-					if (!slot->camIsReady)
-					{
-#if y_debug
-// test was kommt
-						if (len)
-						{
-							printf("1. received : > ");
-							for (int i = 0; i < len; i++)
-								printf("%02x ", data[i]);
-							printf("\n");
-						}
-#endif
-						ci_inserted(slot);
-						//setInputSource(slot, true);
-						goto FROM_FIRST;
-					}
-				}
-				/* slow down the loop, if no CI cam present */
-//				printf("***sleep\n");
-				sleep(1);
-				} /* case statusnone */
+			if (errno == EINTR)
+				continue;
+			printf("%s: epoll_wait: %m\n", FILENAME);
 			break;
-			case eStatusWait:
+		}
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == timer_fd)
 			{
-				status = waitData(slot->fd, data, &len);
-FROM_FIRST:
-				if (status == eDataReady)
-				{
-					wait = false;
-					slot->pollConnection = false;
-					if (len)
-					{
-						eDVBCISession::receiveData(slot, data, len);
-						eDVBCISession::pollAll();
-					}
-				} /*if data ready */
-				else if (status == eDataWrite)
+				uint64_t exp;
+				if (read(timer_fd, &exp, sizeof(exp)) < 0)
+					continue;
+				action_pending = false;
+				if (eDVBCISession::pollAll())
+					action_pending = true;
+				int64_t now = now_us();
+				for (std::list<eDVBCISlot *>::iterator it = slot_data.begin(); it != slot_data.end(); ++it)
 				{
-					wait = true;
-					/* only writing any data here while status = eDataWrite */
-					if (!slot->sendqueue.empty())
+					eDVBCISlot *slot = *it;
+					if (slot->backoff && slot->backoff <= now)
 					{
-						const queueData &qe = slot->sendqueue.top();
-						int res = write(slot->fd, qe.data, qe.len);
-						if (res >= 0 && (unsigned int)res == qe.len)
-						{
-							delete [] qe.data;
-							slot->sendqueue.pop();
-						}
-						else
-						{
-							printf("r = %d, %m\n", res);
-						}
+						slot->backoff = 0;
+						ci_update_events(slot);
 					}
+					ci_housekeeping(slot);
 				}
-				else if (status == eDataStatusChanged)
+				continue;
+			}
+			eDVBCISlot *slot = NULL;
+			for (std::list<eDVBCISlot *>::iterator it = slot_data.begin(); it != slot_data.end(); ++it)
+			{
+				if ((*it)->fd == fd || (*it)->send_fd == fd)
 				{
-					if (slot->camIsReady)
-					{
-						ci_removed(slot);
-					}
+					slot = *it;
+					break;
 				}
 			}
-			break;
-			default:
-				printf("unknown state %d\n", slot->status);
-				break;
-		} /* switch(slot->status) */
-
-		if (!slot->init && slot->camIsReady && last_source > -1)
-		{
-			slot->source = (u8)last_source;
-			setInputSource(slot, true);
-			last_source = -1;
-		}
-#endif
-		if (slot->hasCAManager && slot->hasAppManager && !slot->init)
-		{
-			slot->init = true;
-
-			slot->cam_caids = slot->camgrSession->getCAIDs();
-
-			printf("Anzahl Caids: %d Slot: %d > ", slot->cam_caids.size(), slot->slot);
-			for (unsigned int i = 0; i < slot->cam_caids.size(); i++)
+			if (!slot)
+				continue;
+			if (fd == slot->send_fd)
 			{
-				printf("%04x ", slot->cam_caids[i]);
-
+				eventfd_t v;
+				eventfd_read(fd, &v);
 			}
-			printf("\n");
-
-			/* write ci info file */
-			write_ci_info(slot->slot, slot->cam_caids);
-
-			/* Send a message to Neutrino cam_menu handler */
-			CA_MESSAGE *pMsg = (CA_MESSAGE *) malloc(sizeof(CA_MESSAGE));
-			memset(pMsg, 0, sizeof(CA_MESSAGE));
-			pMsg->MsgId = CA_MESSAGE_MSG_INIT_OK;
-			pMsg->SlotType = CA_SLOT_TYPE_CI;
-			pMsg->Slot = slot->slot;
-			SendMessage(pMsg);
-			/* resend a capmt if we have one. this is not very proper but I cant any mechanism in
-			neutrino currently. so if a cam is inserted a pmt is not resend */
-			/* not necessary: the arrived capmt will be automaticly send */
-			//SendCaPMT(slot);
-		}
-		if (slot->hasCAManager && slot->hasAppManager && slot->newCapmt)
-		{
-			SendCaPMT(slot);
-			slot->newCapmt = false;
-			if (slot->ccmgr_ready && slot->hasCCManager && slot->scrambled && !slot->SidBlackListed)
-				slot->ccmgrSession->resendKey(slot);
+			else
+				ci_event(slot, events[i].events);
+			ci_housekeeping(slot);
+			ci_update_events(slot);
 		}
-		/* slow down for hd51 to avoid high cpu load */
-		if (wait && slot->init && !slot->mmiOpened)
-			usleep(300000);
+		ci_update_timer();
 	}
 }
 
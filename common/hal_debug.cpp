@@ -7,6 +7,9 @@
 #include <sys/prctl.h>
 #include <string.h>
 #include "config.h"
+#include "hal_debug.h"
+#include "hal_trace.h"
+#include "hal_metrics.h"
 
 
 int cnxt_debug = 0; /* compat, unused */
@@ -41,7 +44,7 @@ void _hal_info(int facility, const void *func, const char *fmt, ...)
 }
 
 
-void _hal_debug(int facility, const void *func, const char *fmt, ...)
+void _hal_debug_out(int facility, const void *func, const char *fmt, ...)
 {
 	if (debuglevel < 0)
 		fprintf(stderr, "[\033[36mHAL:\033[0m hal_debug] debuglevel not initialized!\n");
@@ -90,6 +93,8 @@ void hal_debug_init(void)
 		}
 		fprintf(stderr, "\n");
 	}
+	hal_trace_init();
+	hal_metrics_init();
 }
 
 void hal_set_threadname(const char *name)
@@ -0,0 +1,389 @@
+/* libstb-hal metrics registry and Prometheus text export */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hal_metrics.h"
+#include "hal_debug.h"
+
+#define hal_info_c(args...) _hal_info(HAL_DEBUG_INIT, NULL, args)
+
+#define METRICS_PATH "/tmp/stb-hal-metrics"
+#define METRICS_MAX 64
+
+/* <METRICS_PATH>.<process>.<pid>, .sock is appended for the socket */
+static char metrics_file[96];
+static char metrics_tmp[sizeof(metrics_file) + 8];
+static char metrics_socket[sizeof(metrics_file) + 8];
+
+/* HDR style buckets: 4 sub-buckets per power of 2, i.e. the bucket
+ * boundaries are at most 25% apart, from 1us to 2^32us (71 minutes) */
+#define SUB_BITS 2
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS (32 * SUB_BUCKETS)
+
+enum metric_type
+{
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+};
+
+struct hal_metric
+{
+	const char *name;
+	const char *help;
+	enum metric_type type;
+	int64_t value;			/* counter, gauge */
+	int64_t sum;			/* histogram, us */
+	uint64_t *buckets;
+};
+
+/* 32 bit MIPS has no lock free 64 bit atomics, gcc would call
+ * __atomic_*_8 from libatomic, which is not linked. Use a lock there */
+#if __GCC_ATOMIC_LLONG_LOCK_FREE < 2
+static pthread_mutex_t value_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+template <typename T> static inline void value_add(T *p, T v)
+{
+	pthread_mutex_lock(&value_mutex);
+	*p += v;
+	pthread_mutex_unlock(&value_mutex);
+}
+
+template <typename T> static inline void value_set(T *p, T v)
+{
+	pthread_mutex_lock(&value_mutex);
+	*p = v;
+	pthread_mutex_unlock(&value_mutex);
+}
+
+template <typename T> static inline T value_get(T *p)
+{
+	pthread_mutex_lock(&value_mutex);
+	T v = *p;
+	pthread_mutex_unlock(&value_mutex);
+	return v;
+}
+#else
+template <typename T> static inline void value_add(T *p, T v)
+{
+	__atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+}
+
+template <typename T> static inline void value_set(T *p, T v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+template <typename T> static inline T value_get(T *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+#endif
+
+static pthread_mutex_t reg_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hal_metric metrics[METRICS_MAX];
+static int num_metrics = 0;
+
+static hal_metric *metric_register(const char *name, const char *help, enum metric_type type)
+{
+	hal_metric *m = NULL;
+	pthread_mutex_lock(&reg_mutex);
+	for (int i = 0; i < num_metrics; i++)
+	{
+		if (!strcmp(metrics[i].name, name))
+		{
+			m = &metrics[i];
+			break;
+		}
+	}
+	if (!m && num_metrics < METRICS_MAX)
+	{
+		m = &metrics[num_metrics];
+		m->name = name;
+		m->help = help;
+		m->type = type;
+		if (type == METRIC_HISTOGRAM)
+			m->buckets = (uint64_t *)calloc(HIST_BUCKETS, sizeof(uint64_t));
+		/* publish after the fields are set, the exporter does not lock */
+		__atomic_store_n(&num_metrics, num_metrics + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&reg_mutex);
+	if (!m)
+		hal_info_c("%s: too many metrics, %s not registered\n", __func__, name);
+	else if (m->type != type)
+		hal_info_c("%s: %s registered with another type\n", __func__, name);
+	return m;
+}
+
+hal_metric *hal_metric_counter(const char *name, const char *help)
+{
+	return metric_register(name, help, METRIC_COUNTER);
+}
+
+hal_metric *hal_metric_gauge(const char *name, const char *help)
+{
+	return metric_register(name, help, METRIC_GAUGE);
+}
+
+hal_metric *hal_metric_histogram(const char *name, const char *help)
+{
+	return metric_register(name, help, METRIC_HISTOGRAM);
+}
+
+void hal_metric_add(hal_metric *m, int64_t v)
+{
+	if (m)
+		value_add(&m->value, v);
+}
+
+void hal_metric_set(hal_metric *m, int64_t v)
+{
+	if (m)
+		value_set(&m->value, v);
+}
+
+static int bucket_index(uint64_t us)
+{
+	if (us < SUB_BUCKETS)
+		return us;
+	int msb = 63 - __builtin_clzll(us);
+	if (msb >= 32)
+		return HIST_BUCKETS - 1;
+	int sub = (us >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+	return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/* lowest index value of the next bucket, since the index is us - 1 this
+ * is the highest us the bucket holds */
+static uint64_t bucket_limit(int index)
+{
+	if (index < SUB_BUCKETS)
+		return index + 1;
+	int msb = index / SUB_BUCKETS + SUB_BITS - 1;
+	uint64_t sub = index % SUB_BUCKETS;
+	return (SUB_BUCKETS + sub + 1) << (msb - SUB_BITS);
+}
+
+void hal_metric_observe(hal_metric *m, int64_t us)
+{
+	if (!m || !m->buckets)
+		return;
+	if (us < 0)
+		us = 0;
+	/* us - 1: the buckets include their upper limit, like the
+	 * Prometheus le, e.g. 16us counts for le 16us */
+	value_add(&m->buckets[bucket_index(us ? us - 1 : 0)], (uint64_t)1);
+	value_add(&m->sum, us);
+}
+
+int64_t hal_metric_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool write_all(int fd, const char *buf, int len)
+{
+	while (len > 0)
+	{
+		ssize_t r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+/* buffered output, a line that does not fit flushes the buffer first */
+struct metrics_out
+{
+	int fd;
+	int len;
+	bool failed;
+	char buf[4096];
+};
+
+static void out_flush(struct metrics_out *o)
+{
+	if (!o->failed && o->len && !write_all(o->fd, o->buf, o->len))
+		o->failed = true;
+	o->len = 0;
+}
+
+static void out_printf(struct metrics_out *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void out_printf(struct metrics_out *o, const char *fmt, ...)
+{
+	for (int tries = 0; tries < 2; tries++)
+	{
+		int room = sizeof(o->buf) - o->len;
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(o->buf + o->len, room, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (n < room)
+		{
+			o->len += n;
+			return;
+		}
+		if (!o->len)
+		{
+			/* longer than the whole buffer, cut it */
+			o->len = sizeof(o->buf) - 1;
+			o->buf[o->len - 1] = '\n';
+			return;
+		}
+		out_flush(o);
+	}
+}
+
+int hal_metrics_write(int fd)
+{
+	struct metrics_out o;
+	int n = __atomic_load_n(&num_metrics, __ATOMIC_ACQUIRE);
+
+	o.fd = fd;
+	o.len = 0;
+	o.failed = false;
+	for (int i = 0; i < n && !o.failed; i++)
+	{
+		struct hal_metric *m = &metrics[i];
+		static const char *type_name[] = { "counter", "gauge", "histogram" };
+		out_printf(&o, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, type_name[m->type]);
+		if (m->type != METRIC_HISTOGRAM)
+			out_printf(&o, "%s %lld\n", m->name, (long long)value_get(&m->value));
+		else
+		{
+			/* the fine buckets are too many to export, use powers of 2
+			 * from 16us to ~67s. _count is the sum of the buckets, so
+			 * that it matches +Inf even while others update */
+			uint64_t cum = 0;
+			int b = 0;
+			for (int e = 4; e <= 26; e++)
+			{
+				uint64_t le = 1ULL << e;
+				while (b < HIST_BUCKETS && bucket_limit(b) <= le)
+					cum += value_get(&m->buckets[b++]);
+				out_printf(&o, "%s_bucket{le=\"%g\"} %llu\n", m->name, le / 1e6, (unsigned long long)cum);
+			}
+			while (b < HIST_BUCKETS)
+				cum += value_get(&m->buckets[b++]);
+			out_printf(&o, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+				m->name, (unsigned long long)cum,
+				m->name, value_get(&m->sum) / 1e6,
+				m->name, (unsigned long long)cum);
+		}
+	}
+	out_flush(&o);
+	return o.failed ? -1 : 0;
+}
+
+static void metrics_write_file(void)
+{
+	int fd = open(metrics_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	int r = hal_metrics_write(fd);
+	close(fd);
+	if (r == 0)
+		rename(metrics_tmp, metrics_file);
+	else
+		unlink(metrics_tmp);
+}
+
+static void *metrics_thread(void *arg)
+{
+	int interval = *(int *)arg;
+	hal_set_threadname("hal:metrics");
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock >= 0)
+	{
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", metrics_socket);
+		unlink(metrics_socket);
+		if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 4))
+		{
+			hal_info_c("%s: %s: %m\n", __func__, metrics_socket);
+			close(sock);
+			sock = -1;
+		}
+	}
+
+	int64_t next = hal_metric_now();
+	while (true)
+	{
+		int64_t now = hal_metric_now();
+		if (now >= next)
+		{
+			metrics_write_file();
+			next = now + interval * 1000000LL;
+		}
+		if (sock < 0)
+		{
+			usleep(next - now);
+			continue;
+		}
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (next - now + 999) / 1000) <= 0)
+			continue;
+		int c = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (c < 0)
+			continue;
+		/* a client that does not read just gets cut off */
+		struct timeval tv = { 1, 0 };
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		hal_metrics_write(c);
+		close(c);
+	}
+	return NULL;
+}
+
+void hal_metrics_init(void)
+{
+	static bool initialized = false;
+	static int interval = 10;
+	if (initialized)
+		return;
+	initialized = true;
+
+	char *tmp = getenv("HAL_METRICS");
+	if (!tmp || !strcmp(tmp, "0"))
+		return;
+	tmp = getenv("HAL_METRICS_INTERVAL");
+	if (tmp && atoi(tmp) > 0)
+		interval = atoi(tmp);
+	/* several processes (neutrino, libbench, the players) may export */
+	snprintf(metrics_file, sizeof(metrics_file), "%s.%s.%d", METRICS_PATH, program_invocation_short_name, (int)getpid());
+	snprintf(metrics_tmp, sizeof(metrics_tmp), "%s.tmp", metrics_file);
+	snprintf(metrics_socket, sizeof(metrics_socket), "%s.sock", metrics_file);
+
+	pthread_t t;
+	if (pthread_create(&t, NULL, metrics_thread, &interval))
+	{
+		hal_info_c("%s: pthread_create: %m\n", __func__);
+		return;
+	}
+	pthread_detach(t);
+}
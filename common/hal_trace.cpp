@@ -0,0 +1,185 @@
+/* libstb-hal binary trace rings */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "hal_trace.h"
+
+struct hal_trace_ring
+{
+	struct hal_trace_ring *next;
+	int owner;			/* tid, 0 = free for the next thread */
+	uint32_t tid;			/* last owner, for the dump */
+	char name[16];
+	uint32_t head;			/* entries ever written */
+	struct hal_trace_entry e[HAL_TRACE_ENTRIES];
+};
+
+int hal_trace_on = 0;
+
+/* rings of finished threads are kept for the dump and only reused
+ * once there are that many */
+#define HAL_TRACE_RINGS 64
+
+static struct hal_trace_ring *rings = NULL;
+static int num_rings = 0;
+static __thread struct hal_trace_ring *ring = NULL;
+static pthread_key_t ring_key;
+static char dump_path[256] = "/tmp/hal-trace.bin";
+
+/* thread exit: leave the records for the dump, but let the ring be reused */
+static void ring_release(void *p)
+{
+	struct hal_trace_ring *r = (struct hal_trace_ring *)p;
+	__atomic_store_n(&r->owner, 0, __ATOMIC_RELEASE);
+}
+
+static struct hal_trace_ring *ring_get(void)
+{
+	int tid = (int)syscall(SYS_gettid);
+	struct hal_trace_ring *r = NULL;
+
+	if (__atomic_fetch_add(&num_rings, 1, __ATOMIC_RELAXED) >= HAL_TRACE_RINGS)
+	{
+		__atomic_fetch_sub(&num_rings, 1, __ATOMIC_RELAXED);
+		for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		{
+			int free_ = 0;
+			if (__atomic_compare_exchange_n(&r->owner, &free_, tid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				break;
+		}
+		if (!r)
+			return NULL; /* no tracing for this thread */
+	}
+	if (!r)
+	{
+		r = (struct hal_trace_ring *)calloc(1, sizeof(*r));
+		if (!r)
+			return NULL;
+		r->owner = tid;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	r->tid = tid;
+	prctl(PR_GET_NAME, (unsigned long)r->name);
+	__atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+	pthread_setspecific(ring_key, r);
+	return r;
+}
+
+void hal_trace_add(int facility, int event, uint32_t a, uint32_t b, uint32_t c)
+{
+	struct timespec ts;
+	if (!ring && !(ring = ring_get()))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint32_t h = ring->head;
+	struct hal_trace_entry *e = &ring->e[h & (HAL_TRACE_ENTRIES - 1)];
+	e->ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	e->facility = facility;
+	e->event = event;
+	e->arg[0] = a;
+	e->arg[1] = b;
+	e->arg[2] = c;
+	__atomic_store_n(&ring->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/* only open/write, so that it can run from a signal handler. Records
+ * written while dumping may be torn, that's fine for a post mortem. */
+int hal_trace_dump(const char *path)
+{
+	struct hal_trace_header hdr;
+	struct hal_trace_ring *r;
+	struct hal_trace_ring *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	bool ok = true;
+
+	if (!path)
+		path = dump_path;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HAL_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = HAL_TRACE_VERSION;
+	for (r = first; r; r = r->next)
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+			hdr.threads++;
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+
+	for (r = first; r && ok; r = r->next)
+	{
+		struct hal_trace_thread t;
+		uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (!head)
+			continue;
+		if (hdr.threads-- == 0)
+			break; /* a ring that became active while dumping */
+		memset(&t, 0, sizeof(t));
+		t.tid = r->tid;
+		memcpy(t.name, r->name, sizeof(t.name));
+		t.count = head < HAL_TRACE_ENTRIES ? head : HAL_TRACE_ENTRIES;
+		ok = write(fd, &t, sizeof(t)) == sizeof(t);
+		/* oldest first: from head to the end of the ring, then the start */
+		uint32_t start = head - t.count;
+		uint32_t i = start & (HAL_TRACE_ENTRIES - 1);
+		uint32_t n1 = HAL_TRACE_ENTRIES - i;
+		if (n1 > t.count)
+			n1 = t.count;
+		ssize_t l = n1 * sizeof(struct hal_trace_entry);
+		if (ok)
+			ok = write(fd, &r->e[i], l) == l;
+		l = (t.count - n1) * sizeof(struct hal_trace_entry);
+		if (ok && l)
+			ok = write(fd, &r->e[0], l) == l;
+	}
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction old_action[sizeof(fatal_signals) / sizeof(fatal_signals[0])];
+
+static void fatal_handler(int sig)
+{
+	hal_trace_dump(NULL);
+	for (unsigned int i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+		if (fatal_signals[i] == sig)
+			sigaction(sig, &old_action[i], NULL);
+	raise(sig);
+}
+
+void hal_trace_init(void)
+{
+	static bool initialized = false;
+	if (initialized)
+		return;
+	initialized = true;
+
+	char *tmp = getenv("HAL_TRACE");
+	if (tmp && !strcmp(tmp, "0"))
+		return;
+	pthread_key_create(&ring_key, ring_release);
+
+	tmp = getenv("HAL_TRACE_DUMP");
+	if (tmp && *tmp)
+	{
+		snprintf(dump_path, sizeof(dump_path), "%s", tmp);
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = fatal_handler;
+		sigemptyset(&sa.sa_mask);
+		for (unsigned int i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+			sigaction(fatal_signals[i], &sa, &old_action[i]);
+	}
+	hal_trace_on = 1;
+}
@@ -0,0 +1,382 @@
+/*
+ * cache for still pictures converted to MPEG-2 I-frame PES
+ *
+ * License: GPLv2 or later
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pic_cache.h"
+
+/* bump the version when the encoder output changes */
+#define PIC_CACHE_MAGIC "HALPIC1"
+#define PIC_CACHE_DIR "/var/cache/stb-hal-pic"
+#define PIC_CACHE_MEM (8 * 1024 * 1024)
+/* the spill directory is pruned to this, least recently used first */
+#define PIC_CACHE_DISK (32 * 1024 * 1024)
+
+struct pic_cache_header
+{
+	char magic[8];
+	uint64_t hash;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct pic_entry
+{
+	struct pic_entry *prev, *next;	/* most recently used first */
+	uint64_t hash;
+	char *path;			/* last path seen with this content */
+	off_t size;
+	struct timespec mtime;
+	unsigned char *data;
+	size_t len;
+};
+
+static pthread_mutex_t pic_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pic_entry *head = NULL, *tail = NULL;
+static size_t mem_used = 0;
+
+static const char *cache_dir(void)
+{
+	const char *dir = getenv("HAL_PIC_CACHE");
+	return dir ? dir : PIC_CACHE_DIR;
+}
+
+/* FNV-1a of the file content */
+static int file_hash(const char *path, uint64_t *hash)
+{
+	unsigned char buf[16384];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	ssize_t n, i;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			h = (h ^ buf[i]) * 0x100000001b3ULL;
+	close(fd);
+	if (n < 0)
+		return -1;
+	*hash = h;
+	return 0;
+}
+
+static void disk_name(char *name, size_t size, uint64_t hash)
+{
+	snprintf(name, size, "%s/%016llx.pes", cache_dir(), (unsigned long long)hash);
+}
+
+/* called with pic_mutex held */
+static void lru_unlink(struct pic_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		tail = e->prev;
+}
+
+/* called with pic_mutex held */
+static void lru_front(struct pic_entry *e)
+{
+	e->prev = NULL;
+	e->next = head;
+	if (head)
+		head->prev = e;
+	head = e;
+	if (!tail)
+		tail = e;
+}
+
+/* called with pic_mutex held */
+static void entry_set_path(struct pic_entry *e, const char *path, const struct stat *st)
+{
+	if (!e->path || strcmp(e->path, path))
+	{
+		free(e->path);
+		e->path = strdup(path);
+	}
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+}
+
+/* called with pic_mutex held, takes data */
+static void mem_insert(uint64_t hash, const char *path, const struct stat *st, unsigned char *data, size_t len)
+{
+	struct pic_entry *e;
+	if (len > PIC_CACHE_MEM)
+	{
+		free(data);
+		return;
+	}
+	for (e = head; e; e = e->next)
+	{
+		if (e->hash != hash)
+			continue;
+		lru_unlink(e);
+		mem_used -= e->len;
+		free(e->data);
+		break;
+	}
+	if (!e)
+	{
+		e = (struct pic_entry *)calloc(1, sizeof(*e));
+		if (!e)
+		{
+			free(data);
+			return;
+		}
+		e->hash = hash;
+	}
+	while (tail && mem_used + len > PIC_CACHE_MEM)
+	{
+		struct pic_entry *old = tail;
+		lru_unlink(old);
+		mem_used -= old->len;
+		free(old->data);
+		free(old->path);
+		free(old);
+	}
+	entry_set_path(e, path, st);
+	e->data = data;
+	e->len = len;
+	mem_used += len;
+	lru_front(e);
+}
+
+/* called with pic_mutex held */
+static unsigned char *entry_copy(struct pic_entry *e, size_t *len)
+{
+	unsigned char *d = (unsigned char *)malloc(e->len);
+	if (!d)
+		return NULL;
+	memcpy(d, e->data, e->len);
+	*len = e->len;
+	lru_unlink(e);
+	lru_front(e);
+	return d;
+}
+
+static unsigned char *disk_read(uint64_t hash, size_t *len)
+{
+	char name[256];
+	struct pic_cache_header hdr;
+	unsigned char *d = NULL;
+	if (!*cache_dir())
+		return NULL;
+	disk_name(name, sizeof(name), hash);
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	/* mtime is the age for disk_prune() */
+	futimens(fd, NULL);
+	if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		!memcmp(hdr.magic, PIC_CACHE_MAGIC, sizeof(hdr.magic)) && hdr.hash == hash && hdr.len > 0 &&
+		(d = (unsigned char *)malloc(hdr.len)) != NULL)
+	{
+		if (read(fd, d, hdr.len) == (ssize_t)hdr.len)
+			*len = hdr.len;
+		else
+		{
+			free(d);
+			d = NULL;
+		}
+	}
+	close(fd);
+	return d;
+}
+
+struct disk_file
+{
+	char name[24];
+	off_t size;
+	time_t mtime;
+};
+
+static int disk_file_cmp(const void *a, const void *b)
+{
+	time_t ta = ((const struct disk_file *)a)->mtime;
+	time_t tb = ((const struct disk_file *)b)->mtime;
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* remove the oldest <hash>.pes files until the rest fits PIC_CACHE_DISK */
+static void disk_prune(const char *dir)
+{
+	char name[256];
+	struct disk_file *files = NULL;
+	size_t num = 0, alloc = 0, i;
+	off_t total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	while ((de = readdir(d)) != NULL)
+	{
+		struct disk_file f;
+		size_t l = strlen(de->d_name);
+		if (l != 20 || strcmp(de->d_name + 16, ".pes"))
+			continue;
+		memcpy(f.name, de->d_name, l + 1);
+		snprintf(name, sizeof(name), "%s/%s", dir, f.name);
+		if (stat(name, &st) || !S_ISREG(st.st_mode))
+			continue;
+		if (num == alloc)
+		{
+			size_t n = alloc ? alloc * 2 : 64;
+			struct disk_file *nf = (struct disk_file *)realloc(files, n * sizeof(*nf));
+			if (!nf)
+				break;
+			files = nf;
+			alloc = n;
+		}
+		f.size = st.st_size;
+		f.mtime = st.st_mtime;
+		files[num++] = f;
+		total += st.st_size;
+	}
+	closedir(d);
+	if (total > PIC_CACHE_DISK)
+	{
+		qsort(files, num, sizeof(*files), disk_file_cmp);
+		for (i = 0; i < num && total > PIC_CACHE_DISK; i++)
+		{
+			snprintf(name, sizeof(name), "%s/%s", dir, files[i].name);
+			if (!unlink(name))
+				total -= files[i].size;
+		}
+	}
+	free(files);
+}
+
+static int disk_write(uint64_t hash, const unsigned char *data, size_t len)
+{
+	char name[256], tmp[280];
+	struct pic_cache_header hdr;
+	const char *dir = cache_dir();
+	if (!*dir)
+		return 0;
+	mkdir(dir, 0755);
+	disk_name(name, sizeof(name), hash);
+	/* thread ids are per process, pic2m2v may write next to the box */
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lx", name, (int)getpid(), (unsigned long)pthread_self());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PIC_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.hash = hash;
+	hdr.len = len;
+	int ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && write(fd, data, len) == (ssize_t)len;
+	if (close(fd))
+		ok = 0;
+	/* readers see either nothing or the complete file */
+	if (!ok || rename(tmp, name))
+	{
+		unlink(tmp);
+		return -1;
+	}
+	disk_prune(dir);
+	return 0;
+}
+
+unsigned char *pic_cache_get(const char *path, size_t *len, struct pic_cache_key *key)
+{
+	struct stat st;
+	struct pic_entry *e;
+	unsigned char *d = NULL;
+	uint64_t hash;
+
+	if (key)
+		key->valid = 0;
+	if (stat(path, &st))
+		return NULL;
+	pthread_mutex_lock(&pic_mutex);
+	for (e = head; e; e = e->next)
+	{
+		if (e->path && !strcmp(e->path, path) && e->size == st.st_size &&
+			e->mtime.tv_sec == st.st_mtim.tv_sec && e->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		{
+			d = entry_copy(e, len);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pic_mutex);
+	if (d)
+		return d;
+
+	/* new or changed path, maybe known content */
+	if (file_hash(path, &hash))
+		return NULL;
+	if (key)
+	{
+		key->valid = 1;
+		key->hash = hash;
+		key->size = st.st_size;
+		key->mtime = st.st_mtim;
+	}
+	pthread_mutex_lock(&pic_mutex);
+	for (e = head; e; e = e->next)
+	{
+		if (e->hash == hash)
+		{
+			entry_set_path(e, path, &st);
+			d = entry_copy(e, len);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pic_mutex);
+	if (d)
+		return d;
+
+	d = disk_read(hash, len);
+	if (d)
+	{
+		unsigned char *m = (unsigned char *)malloc(*len);
+		if (m)
+		{
+			memcpy(m, d, *len);
+			pthread_mutex_lock(&pic_mutex);
+			mem_insert(hash, path, &st, m, *len);
+			pthread_mutex_unlock(&pic_mutex);
+		}
+	}
+	return d;
+}
+
+int pic_cache_add(const char *path, const struct pic_cache_key *key, const unsigned char *data, size_t len)
+{
+	struct stat st;
+	uint64_t hash;
+
+	if (!len || stat(path, &st))
+		return -1;
+	if (key && key->valid && key->size == st.st_size &&
+		key->mtime.tv_sec == st.st_mtim.tv_sec && key->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		hash = key->hash;
+	else if (file_hash(path, &hash))
+		return -1;
+	unsigned char *m = (unsigned char *)malloc(len);
+	if (m)
+	{
+		memcpy(m, data, len);
+		pthread_mutex_lock(&pic_mutex);
+		mem_insert(hash, path, &st, m, len);
+		pthread_mutex_unlock(&pic_mutex);
+	}
+	return disk_write(hash, data, len);
+}
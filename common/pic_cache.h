@@ -0,0 +1,41 @@
+/*
+ * cache for still pictures converted to MPEG-2 I-frame PES
+ *
+ * License: GPLv2 or later
+ *
+ * Entries are keyed by a hash of the picture file's content. A path is
+ * only hashed again when its size or mtime changed. Converted pictures
+ * are kept in memory (LRU, 8 MB) and spilled to $HAL_PIC_CACHE
+ * (default /var/cache/stb-hal-pic, empty = memory only) as
+ * <hash>.pes, so they survive a restart and can be created offline
+ * with pic2m2v. The directory is kept below 32 MB, files not read
+ * for the longest time are removed first.
+ */
+#ifndef __PIC_CACHE_H__
+#define __PIC_CACHE_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* what pic_cache_get() learned about a file it did not find, so that
+ * pic_cache_add() does not hash it again */
+struct pic_cache_key
+{
+	int valid;
+	uint64_t hash;
+	off_t size;
+	struct timespec mtime;
+};
+/* converted picture for path, NULL if not cached. free() the result.
+ * key may be NULL, else it is filled in for pic_cache_add() */
+unsigned char *pic_cache_get(const char *path, size_t *len, struct pic_cache_key *key);
+/* store the converted picture for path, returns 0 on success. key is
+ * from pic_cache_get() or NULL, the file is hashed if it changed since */
+int pic_cache_add(const char *path, const struct pic_cache_key *key, const unsigned char *data, size_t len);
+#ifdef __cplusplus
+}
+#endif
+#endif
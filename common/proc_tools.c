@@ -12,9 +12,207 @@
 #include <unistd.h>
 #include <ctype.h> /* isspace */
 #include <stdio.h> /* sscanf */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "proc_tools.h"
 
+/* nodes that are read are kept open and read with pread(). Values read
+ * with proc_get_cached() are kept for ttl_ms, or until a sysfs node
+ * signals a change with POLLPRI (sysfs_notify). procfs nodes have no
+ * change events, poll() can not tell them apart from a sysfs node that
+ * did not change yet, so only /sys is watched. proc_put() drops all cached
+ * values, a write to one node often changes others as well.
+ * HAL_PROC_CACHE=0 turns the value cache off. */
+
+#define PROC_ENTRIES 64
+#define PROC_PATH_MAX 64
+#define PROC_VALUE_MAX 64
+
+struct proc_entry
+{
+	char path[PROC_PATH_MAX];
+	int fd;
+	int notify;		/* sysfs node, may wake up POLLPRI on changes */
+	int armed;		/* read since the last change, watched */
+	int valid;
+	int64_t expires;	/* ms, monotonic */
+	int len;
+	char value[PROC_VALUE_MAX];
+};
+
+static pthread_mutex_t proc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct proc_entry entries[PROC_ENTRIES];
+static int num_entries = 0;
+static int cache_enabled = -1;
+static int watch_pipe[2] = { -1, -1 };
+/* reopened nodes, closed once the watcher no longer polls them */
+static int stale_fds[PROC_ENTRIES];
+static int num_stale = 0;
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void watch_kick(void)
+{
+	char c = 0;
+	if (write(watch_pipe[1], &c, 1) < 0)
+		return; /* pipe full, the watcher wakes up anyway */
+}
+
+/* waits for POLLPRI on all armed nodes and drops their cached values */
+static void *proc_watch(void *arg)
+{
+	struct pollfd pfd[PROC_ENTRIES + 1];
+	int idx[PROC_ENTRIES + 1];
+	(void)arg;
+
+	while (1)
+	{
+		int i, n = 1;
+		pfd[0].fd = watch_pipe[0];
+		pfd[0].events = POLLIN;
+		pthread_mutex_lock(&proc_mutex);
+		while (num_stale)
+			close(stale_fds[--num_stale]);
+		for (i = 0; i < num_entries; i++)
+		{
+			if (!entries[i].notify || !entries[i].armed || entries[i].fd < 0)
+				continue;
+			pfd[n].fd = entries[i].fd;
+			pfd[n].events = POLLPRI;
+			idx[n++] = i;
+		}
+		pthread_mutex_unlock(&proc_mutex);
+
+		if (poll(pfd, n, -1) <= 0)
+			continue;
+		if (pfd[0].revents & POLLIN)
+		{
+			char buf[16];
+			if (read(watch_pipe[0], buf, sizeof(buf)) < 0)
+				continue;
+		}
+		pthread_mutex_lock(&proc_mutex);
+		for (i = 1; i < n; i++)
+		{
+			struct proc_entry *e = &entries[idx[i]];
+			/* sysfs keeps signalling until the node is read again */
+			if ((pfd[i].revents & (POLLPRI | POLLERR)) && e->fd == pfd[i].fd)
+			{
+				e->valid = 0;
+				e->armed = 0;
+			}
+		}
+		pthread_mutex_unlock(&proc_mutex);
+	}
+	return NULL;
+}
+
+static void watch_start(void)
+{
+	pthread_t t;
+	if (watch_pipe[0] >= 0)
+		return;
+	if (pipe(watch_pipe))
+		return;
+	for (int i = 0; i < 2; i++)
+	{
+		fcntl(watch_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(watch_pipe[i], F_SETFL, O_NONBLOCK);
+	}
+	if (pthread_create(&t, NULL, proc_watch, NULL))
+	{
+		close(watch_pipe[0]);
+		close(watch_pipe[1]);
+		watch_pipe[0] = watch_pipe[1] = -1;
+		return;
+	}
+	pthread_detach(t);
+}
+
+/* called with proc_mutex held, NULL if the table is full */
+static struct proc_entry *entry_get(const char *path)
+{
+	int i;
+	if (cache_enabled < 0)
+	{
+		char *tmp = getenv("HAL_PROC_CACHE");
+		cache_enabled = !(tmp && !strcmp(tmp, "0"));
+	}
+	for (i = 0; i < num_entries; i++)
+		if (!strcmp(entries[i].path, path))
+			return &entries[i];
+	if (num_entries == PROC_ENTRIES || strlen(path) >= PROC_PATH_MAX)
+		return NULL;
+	struct proc_entry *e = &entries[num_entries++];
+	strcpy(e->path, path);
+	e->fd = -1;
+	e->notify = !strncmp(path, "/sys/", 5);
+	return e;
+}
+
+/* called with proc_mutex held */
+static int entry_read(struct proc_entry *e, char *value, const int len)
+{
+	int ret, retry = (e->fd >= 0);
+	if (e->fd < 0)
+		e->fd = open(e->path, O_RDONLY | O_CLOEXEC);
+	if (e->fd < 0)
+		return e->fd;
+	ret = pread(e->fd, value, len, 0);
+	/* the node went away and came back, or the driver does not like
+	 * being read twice: try once more with a fresh fd */
+	if (retry && ret <= 0)
+	{
+		/* the watcher might be polling the old fd, it closes it
+		 * after it rebuilt its set, so the number is not reused
+		 * under it */
+		if (e->notify && watch_pipe[0] >= 0 && num_stale < PROC_ENTRIES)
+		{
+			stale_fds[num_stale++] = e->fd;
+			watch_kick();
+		}
+		else
+			close(e->fd);
+		e->armed = 0;
+		e->fd = open(e->path, O_RDONLY | O_CLOEXEC);
+		if (e->fd < 0)
+			return e->fd;
+		ret = pread(e->fd, value, len, 0);
+	}
+	if (ret < 0)
+		return ret;
+	if (e->notify && !e->armed)
+	{
+		e->armed = 1;
+		watch_start();
+		watch_kick();
+	}
+	return ret;
+}
+
+static int read_fixup(char *value, const int len, int ret)
+{
+	value[len - 1] = '\0'; /* make sure string is terminated */
+	if (ret >= 0)
+	{
+		while (ret > 0 && isspace(value[ret - 1]))
+			ret--; /* remove trailing whitespace */
+		value[ret] = '\0'; /* terminate, even if ret = 0 */
+	}
+	return ret;
+}
+
 int proc_put(const char *path, const char *value, const int len)
 {
 	int ret, ret2;
@@ -23,6 +221,7 @@ int proc_put(const char *path, const char *value, const int len)
 		return pfd;
 	ret = write(pfd, value, len);
 	ret2 = close(pfd);
+	proc_invalidate(NULL);
 	if (ret2 < 0)
 		return ret2;
 	return ret;
@@ -30,24 +229,67 @@ int proc_put(const char *path, const char *value, const int len)
 
 int proc_get(const char *path, char *value, const int len)
 {
-	int ret, ret2;
+	int ret;
+	pthread_mutex_lock(&proc_mutex);
+	struct proc_entry *e = entry_get(path);
+	if (e)
+	{
+		ret = entry_read(e, value, len);
+		pthread_mutex_unlock(&proc_mutex);
+		return read_fixup(value, len, ret);
+	}
+	pthread_mutex_unlock(&proc_mutex);
+
+	int ret2;
 	int pfd = open(path, O_RDONLY);
 	if (pfd < 0)
 		return pfd;
-	ret = read(pfd, value, len);
-	value[len - 1] = '\0'; /* make sure string is terminated */
-	if (ret >= 0)
-	{
-		while (ret > 0 && isspace(value[ret - 1]))
-			ret--; /* remove trailing whitespace */
-		value[ret] = '\0'; /* terminate, even if ret = 0 */
-	}
+	ret = read_fixup(value, len, read(pfd, value, len));
 	ret2 = close(pfd);
 	if (ret2 < 0)
 		return ret2;
 	return ret;
 }
 
+int proc_get_cached(const char *path, char *value, const int len, const int ttl_ms)
+{
+	int ret;
+	pthread_mutex_lock(&proc_mutex);
+	struct proc_entry *e = entry_get(path);
+	if (!e || !cache_enabled || len > PROC_VALUE_MAX)
+	{
+		pthread_mutex_unlock(&proc_mutex);
+		return proc_get(path, value, len);
+	}
+	if (e->valid && now_ms() < e->expires)
+	{
+		memcpy(value, e->value, len);
+		ret = e->len;
+		pthread_mutex_unlock(&proc_mutex);
+		return ret;
+	}
+	ret = read_fixup(value, len, entry_read(e, value, len));
+	if (ret >= 0)
+	{
+		memcpy(e->value, value, len);
+		e->len = ret;
+		e->expires = now_ms() + ttl_ms;
+		e->valid = 1;
+	}
+	pthread_mutex_unlock(&proc_mutex);
+	return ret;
+}
+
+void proc_invalidate(const char *prefix)
+{
+	int i;
+	pthread_mutex_lock(&proc_mutex);
+	for (i = 0; i < num_entries; i++)
+		if (!prefix || !strncmp(entries[i].path, prefix, strlen(prefix)))
+			entries[i].valid = 0;
+	pthread_mutex_unlock(&proc_mutex);
+}
+
 unsigned int proc_get_hex(const char *path)
 {
 	unsigned int n, ret = 0;
@@ -57,3 +299,13 @@ unsigned int proc_get_hex(const char *path)
 		sscanf(buf, "%x", &ret);
 	return ret;
 }
+
+unsigned int proc_get_hex_cached(const char *path, const int ttl_ms)
+{
+	unsigned int n, ret = 0;
+	char buf[16];
+	n = proc_get_cached(path, buf, 16, ttl_ms);
+	if (n > 0)
+		sscanf(buf, "%x", &ret);
+	return ret;
+}
@@ -14,6 +14,11 @@ extern "C" {
 int proc_put(const char *path, const char *value, const int len);
 int proc_get(const char *path, char *value, const int len);
 unsigned int proc_get_hex(const char *path);
+/* same, but the value may be up to ttl_ms old */
+int proc_get_cached(const char *path, char *value, const int len, const int ttl_ms);
+unsigned int proc_get_hex_cached(const char *path, const int ttl_ms);
+/* drop cached values of all paths starting with prefix, NULL = all */
+void proc_invalidate(const char *prefix);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,115 @@
+/*
+ * time-to-first-frame accounting for channel changes
+ *
+ * License: GPLv2 or later
+ */
+
+#include <config.h>
+#include <cstdio>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "zap_timing.h"
+#include "hal_debug.h"
+
+#define hal_info_c(args...) _hal_info(HAL_DEBUG_INIT, NULL, args)
+
+static const char *zap_event_name[HAL_ZAP_MAX] =
+{
+	"tune",
+	"PAT",
+	"PMT",
+	"vstart",
+	"I-frame",
+	"display"
+};
+
+static pthread_mutex_t zap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t zap_start;		/* monotonic time in us, 0 = no zap running */
+static int64_t zap_time[HAL_ZAP_MAX];	/* 0 = not seen yet */
+static int zap_last[HAL_ZAP_MAX];
+static bool zap_last_valid = false;
+static bool zap_armed = false;		/* the next PAT starts a new zap */
+static unsigned int zap_count = 0;
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* called with zap_mutex held */
+static void zap_report(void)
+{
+	char buf[256];
+	int len = 0;
+	for (int i = 0; i < HAL_ZAP_MAX; i++)
+	{
+		zap_last[i] = zap_time[i] ? (int)((zap_time[i] - zap_start) / 1000) : -1;
+		if (zap_last[i] < 0)
+			len += snprintf(buf + len, sizeof(buf) - len, " %s -", zap_event_name[i]);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len, " %s %d", zap_event_name[i], zap_last[i]);
+	}
+	zap_last_valid = true;
+	zap_count++;
+	hal_info_c("zap timing [ms]:%s%s\n", buf, zap_time[HAL_ZAP_DISPLAY] ? "" : " (incomplete)");
+}
+
+void hal_zap_mark(HAL_ZAP_EVENT event)
+{
+	if (event < 0 || event >= HAL_ZAP_MAX)
+		return;
+	int64_t now = now_us();
+	pthread_mutex_lock(&zap_mutex);
+	/* a new zap starts with tuning, or with the first PAT after the
+	 * decoder was stopped if the application does not tell us about
+	 * tuning. PATs which are just sent again do not restart the timer */
+	bool restart = (event == HAL_ZAP_TUNE) ||
+		(event == HAL_ZAP_PAT && (zap_start == 0 || zap_armed));
+	if (restart)
+	{
+		zap_armed = false;
+		/* the previous zap did not finish. If the decoder was not even
+		 * started, it was just someone else reading the PAT */
+		if (zap_time[HAL_ZAP_VIDEO_START] && !zap_time[HAL_ZAP_DISPLAY])
+			zap_report();
+		zap_start = now;
+		for (int i = 0; i < HAL_ZAP_MAX; i++)
+			zap_time[i] = 0;
+	}
+	if (zap_start && !zap_time[event] && !zap_time[HAL_ZAP_DISPLAY])
+	{
+		zap_time[event] = now;
+		if (event == HAL_ZAP_DISPLAY)
+			zap_report();
+	}
+	pthread_mutex_unlock(&zap_mutex);
+}
+
+void hal_zap_arm(void)
+{
+	pthread_mutex_lock(&zap_mutex);
+	zap_armed = true;
+	pthread_mutex_unlock(&zap_mutex);
+}
+
+bool hal_zap_get_last(int ms[HAL_ZAP_MAX])
+{
+	pthread_mutex_lock(&zap_mutex);
+	bool ret = zap_last_valid;
+	for (int i = 0; i < HAL_ZAP_MAX; i++)
+		ms[i] = zap_last[i];
+	pthread_mutex_unlock(&zap_mutex);
+	return ret;
+}
+
+unsigned int hal_zap_count(void)
+{
+	pthread_mutex_lock(&zap_mutex);
+	unsigned int ret = zap_count;
+	pthread_mutex_unlock(&zap_mutex);
+	return ret;
+}
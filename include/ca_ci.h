@@ -6,9 +6,10 @@
 #include <asm/types.h>
 #include <pthread.h>
 #include <list>
-#include <queue>
+#include <deque>
 #include <vector>
 #include <set>
+#include <unordered_map>
 
 #include "mmi.h"
 #include "cs_types.h"
@@ -178,18 +179,15 @@ typedef enum
 
 struct queueData
 {
-	__u8 prio;
 	unsigned char *data;
 	unsigned int len;
-	queueData(unsigned char *_data, unsigned int _len, __u8 _prio = 0)
-		: prio(_prio), data(_data), len(_len)
+	int64_t queued;		/* monotonic us */
+	uint32_t capmt;		/* session << 16 | program number of a CA PMT, else 0 */
+	queueData(unsigned char *_data, unsigned int _len, int64_t _queued, uint32_t _capmt = 0)
+		: data(_data), len(_len), queued(_queued), capmt(_capmt)
 	{
 
 	}
-	bool operator < (const struct queueData &a) const
-	{
-		return prio < a.prio;
-	}
 };
 
 class eDVBCIMMISession;
@@ -199,9 +197,11 @@ class eDVBCIContentControlManagerSession;
 
 typedef struct
 {
-	pthread_t slot_thread;
 	unsigned int slot;
 	int fd;
+	int send_fd;		/* eventfd, wakes the event loop */
+	uint32_t epoll_events;	/* events fd is registered for, 0 = not registered */
+	int64_t backoff;	/* ignore fd until then (monotonic us), 0 = no backoff */
 	int connection_id;
 	eStatus status;
 
@@ -246,7 +246,15 @@ typedef struct
 
 	int counter;
 	CaIdVector cam_caids;
-	std::priority_queue<queueData> sendqueue;
+	/* FIFO, filled by any thread, drained by the event loop */
+	std::deque<queueData> sendqueue;
+	pthread_mutex_t sendqueue_mutex;
+	unsigned int sq_sent;
+	unsigned int sq_coalesced;
+	unsigned int sq_depth_max;
+	int64_t sq_latency_sum;	/* us, since the last report */
+	int64_t sq_latency_max;
+	int64_t apdu_sent;	/* us, last write still waiting for an answer */
 
 	std::vector<u16> pids;
 
@@ -266,6 +274,28 @@ eData sendData(eDVBCISlot *slot, unsigned char *data, int len);
 
 typedef std::list<eDVBCISlot *>::iterator SlotIt;
 
+/* service index of the slot scheduler: (TP, source, SID) -> slot */
+struct ci_service_key
+{
+	u64 TP;
+	u16 SID;
+	u8 source;
+	bool operator == (const struct ci_service_key &a) const
+	{
+		return TP == a.TP && SID == a.SID && source == a.source;
+	}
+};
+
+struct ci_service_hash
+{
+	size_t operator()(const struct ci_service_key &k) const
+	{
+		return std::hash<u64>()(k.TP ^ ((u64)k.SID << 48) ^ ((u64)k.source << 40));
+	}
+};
+
+typedef std::unordered_map<ci_service_key, eDVBCISlot *, ci_service_hash> ci_service_map_t;
+
 /// CA module class
 class cCA
 {
@@ -295,7 +325,7 @@ class cCA
 		/// set flag of running ci live-tv to false
 		bool StopLiveCI(u64 TP, u16 SID, u8 source, u32 calen);
 		/// find an unused ci slot for use with service
-		SlotIt FindFreeSlot(u64 tpid, u8 source, u16 sid, ca_map_t camap, u8 scrambled);
+		SlotIt FindFreeSlot(u64 tpid, u8 source, u16 sid, ca_map_t camap, u8 scrambled, int mode);
 		/// get slot iterator by slot number
 		SlotIt GetSlot(unsigned int slot);
 		/// send buffered capmt to ci modul
@@ -316,6 +346,19 @@ class cCA
 		std::list<eDVBCISlot *> slot_data;
 		pthread_t slot_thread;
 		bool zapitReady;
+		/* one event loop thread serves all slots */
+		int epoll_fd;
+		int timer_fd;
+		bool action_pending;
+		void ci_event(eDVBCISlot *slot, uint32_t events);
+		void ci_housekeeping(eDVBCISlot *slot);
+		void ci_update_events(eDVBCISlot *slot);
+		void ci_update_timer(void);
+		/* slot scheduler */
+		pthread_mutex_t sched_mutex;
+		ci_service_map_t service_index;
+		void ci_index_slot(eDVBCISlot *slot);
+		eDVBCISlot *ci_lookup(u64 TP, u8 source, u16 SID);
 
 	public:
 		/// sh4 unused
@@ -383,7 +426,7 @@ class cCA
 		/// sh4 unused
 		bool SendDateTime(void);
 		/// the main loop
-		void slot_pollthread(void *c);
+		void ci_event_loop(void);
 		/// check if current channel uses any ci module
 		bool checkChannelID(u64 chanID);
 		/// set checking for live-tv use ci to true
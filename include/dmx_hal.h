@@ -98,6 +98,10 @@ class cDemux
 		int getUnit(void);
 		static bool SetSource(int unit, int source);
 		static int GetSource(int unit);
+#if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
+		/* called on every TP channel read, e.g. for the software descrambler */
+		static void SetTSFilter(int (*filter)(unsigned char *buf, int len));
+#endif
 		int getFD(void) { return fd; }; /* needed by cPlayback class */
 		cDemux(int num = 0);
 		~cDemux();
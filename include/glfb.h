@@ -30,6 +30,7 @@ class GLFramebuffer : public OpenThreads::Thread
 		~GLFramebuffer();
 		std::vector<unsigned char> *getOSDBuffer() { return &osd_buf; } /* pointer to OSD bounce buffer */
 		void blit();
+		void blit(int x, int y, int dx, int dy); /* only upload the given damaged rectangle */
 		fb_var_screeninfo getScreenInfo() { return si; }
 
 	private:
@@ -1,6 +1,8 @@
 #ifndef __HAL_DEBUG_H__
 #define __HAL_DEBUG_H__
 
+#include <config.h>
+
 #define HAL_DEBUG_AUDIO     0
 #define HAL_DEBUG_VIDEO     1
 #define HAL_DEBUG_DEMUX     2
@@ -12,17 +14,29 @@
 #define HAL_DEBUG_PLAYER    8
 #define HAL_DEBUG_ALL       ((1<<9)-1)
 
+/* facilities whose hal_debug() calls are compiled in at all,
+ * configure --with-debug-mask=<mask> */
+#ifndef HAL_DEBUG_COMPILED
+#define HAL_DEBUG_COMPILED HAL_DEBUG_ALL
+#endif
+
 extern int debuglevel;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
-void _hal_debug(int facility, const void *, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void _hal_debug_out(int facility, const void *, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 void _hal_info(int facility, const void *, const char *fmt, ...)  __attribute__((format(printf, 3, 4)));
 #ifdef __cplusplus
 }
 #endif
 
+/* the arguments are only evaluated if the facility is enabled */
+#define _hal_debug(facility, func, args...) do { \
+	if (((1 << (facility)) & HAL_DEBUG_COMPILED) && ((1 << (facility)) & debuglevel)) \
+		_hal_debug_out(facility, func, args); \
+} while (0)
+
 void hal_debug_init(void);
 void hal_set_threadname(const char *name);
 
@@ -0,0 +1,38 @@
+#ifndef __HAL_METRICS_H__
+#define __HAL_METRICS_H__
+
+/* counters, gauges and latency histograms, exported in the Prometheus
+ * text format. The metrics are always collected. With HAL_METRICS=1 they
+ * are written to /tmp/stb-hal-metrics.<process>.<pid> every
+ * HAL_METRICS_INTERVAL seconds (default 10) and to everyone connecting
+ * to the unix socket /tmp/stb-hal-metrics.<process>.<pid>.sock.
+ *
+ * Registering the same name again returns the same metric, so a metric
+ * can be looked up where it is used. Updates are lock free. */
+
+#include <stdint.h>
+
+typedef struct hal_metric hal_metric;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+hal_metric *hal_metric_counter(const char *name, const char *help);
+hal_metric *hal_metric_gauge(const char *name, const char *help);
+/* latency histogram, observations in microseconds, exported in seconds */
+hal_metric *hal_metric_histogram(const char *name, const char *help);
+
+void hal_metric_add(hal_metric *m, int64_t v);		/* counter, gauge */
+void hal_metric_set(hal_metric *m, int64_t v);		/* gauge */
+void hal_metric_observe(hal_metric *m, int64_t us);	/* histogram */
+
+/* monotonic clock in microseconds, for measuring what to observe */
+int64_t hal_metric_now(void);
+/* write all metrics to fd, returns 0 on success */
+int hal_metrics_write(int fd);
+void hal_metrics_init(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HAL_METRICS_H__
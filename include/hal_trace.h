@@ -0,0 +1,73 @@
+#ifndef __HAL_TRACE_H__
+#define __HAL_TRACE_H__
+
+/* binary trace: every thread writes fixed size records into its own ring,
+ * no locks, no formatting. The rings are dumped to a file on failure or on
+ * request, tools/hal_trace_decode prints such a dump.
+ *
+ * HAL_TRACE=0 turns tracing off, HAL_TRACE_DUMP=<file> sets the dump file
+ * (default /tmp/hal-trace.bin) and also dumps on fatal signals. */
+
+#include <stdint.h>
+
+#define HAL_TRACE_ENTRIES 1024	/* per thread, power of 2 */
+#define HAL_TRACE_MAGIC "HALTRACE"
+#define HAL_TRACE_VERSION 1
+
+/* event ids, the decoder knows their arguments */
+enum
+{
+	HAL_TRACE_NONE = 0,
+	HAL_TRACE_RECORD_READ,		/* buf_pos, read result, free */
+	HAL_TRACE_RECORD_AIO,		/* aio result, free */
+	HAL_TRACE_RECORD_FAIL,		/* exit_flag, errno */
+	HAL_TRACE_CI_QUEUE,		/* slot, len, queue depth */
+	HAL_TRACE_CI_WRITE,		/* slot, len, latency us */
+	HAL_TRACE_CI_READ,		/* slot, len */
+	HAL_TRACE_CI_TRANSMIT,		/* slot, len, write result */
+	HAL_TRACE_EVENT_MAX
+};
+
+struct hal_trace_entry
+{
+	uint64_t ts;			/* CLOCK_MONOTONIC ns */
+	uint16_t facility;		/* HAL_DEBUG_* */
+	uint16_t event;
+	uint32_t arg[3];
+};
+
+/* dump file: a header, then per thread a hal_trace_thread followed by
+ * count entries, oldest first */
+struct hal_trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t threads;
+};
+
+struct hal_trace_thread
+{
+	uint32_t tid;
+	char name[16];
+	uint32_t count;
+};
+
+extern int hal_trace_on;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void hal_trace_init(void);
+void hal_trace_add(int facility, int event, uint32_t a, uint32_t b, uint32_t c);
+/* path NULL: HAL_TRACE_DUMP or the default. Returns 0 on success */
+int hal_trace_dump(const char *path);
+#ifdef __cplusplus
+}
+#endif
+
+#define hal_trace(facility, event, a, b, c) do { \
+	if (hal_trace_on) \
+		hal_trace_add(facility, event, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c)); \
+} while (0)
+
+#endif // __HAL_TRACE_H__
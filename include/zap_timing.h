@@ -0,0 +1,35 @@
+/*
+ * time-to-first-frame accounting for channel changes
+ *
+ * License: GPLv2 or later
+ *
+ * Every zap is a series of events. The HAL marks the events it can see
+ * itself (PAT/PMT received, decoder started, first picture decoded and
+ * displayed), the application should mark HAL_ZAP_TUNE when it starts
+ * tuning; without it, the first PAT after cVideo::Stop() starts the
+ * zap. When the first picture is displayed, or the next zap starts
+ * before that, the breakdown is logged and kept for hal_zap_get_last().
+ */
+#ifndef __ZAP_TIMING_H__
+#define __ZAP_TIMING_H__
+
+typedef enum
+{
+	HAL_ZAP_TUNE = 0,	/* application starts tuning */
+	HAL_ZAP_PAT,		/* first PAT section read */
+	HAL_ZAP_PMT,		/* first PMT section read */
+	HAL_ZAP_VIDEO_START,	/* cVideo::Start() */
+	HAL_ZAP_IFRAME,		/* first picture decoded, i.e. the first I-frame */
+	HAL_ZAP_DISPLAY,	/* first picture displayed */
+	HAL_ZAP_MAX
+} HAL_ZAP_EVENT;
+
+void hal_zap_mark(HAL_ZAP_EVENT event);
+/* the decoder was stopped, the next PAT belongs to a new zap */
+void hal_zap_arm(void);
+/* milliseconds since the start of the last complete zap, -1 if not seen */
+bool hal_zap_get_last(int ms[HAL_ZAP_MAX]);
+/* number of zaps reported so far, to wait for the next one */
+unsigned int hal_zap_count(void);
+
+#endif // __ZAP_TIMING_H__
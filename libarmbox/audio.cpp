@@ -13,6 +13,7 @@
 
 #include "audio_lib.h"
 #include "hal_debug.h"
+#include "hal_metrics.h"
 
 #define hal_debug(args...) _hal_debug(HAL_DEBUG_AUDIO, this, args)
 #define hal_info(args...) _hal_info(HAL_DEBUG_AUDIO, this, args)
@@ -226,11 +227,14 @@ int cAudio::setVolume(unsigned int left, unsigned int right)
 
 int cAudio::Start(void)
 {
+	static hal_metric *start_time = hal_metric_histogram("hal_audio_start_seconds", "duration of cAudio::Start");
+	int64_t t0 = hal_metric_now();
 	int ret;
 	ret = ioctl(fd, AUDIO_PLAY);
 #if BOXMODEL_HISILICON
 	ioctl(fd, AUDIO_CONTINUE);
 #endif
+	hal_metric_observe(start_time, hal_metric_now() - t0);
 	return ret;
 }
 
@@ -35,6 +35,8 @@
 #include <OpenThreads/ScopedLock>
 #include "dmx_hal.h"
 #include "hal_debug.h"
+#include "zap_timing.h"
+#include "hal_metrics.h"
 
 #include "video_lib.h"
 /* needed for getSTC... */
@@ -94,6 +96,8 @@ static int dmx_source[NUM_DEMUX] = { 0, 0, 0, 0 };
 #endif
 
 char dmxdev[32];
+static int (*ts_filter)(unsigned char *buf, int len) = NULL;
+
 static char *devname(int adapter, int demux)
 {
 	snprintf(dmxdev, sizeof(dmxdev), "/dev/dvb/adapter%d/demux%d", adapter, demux);
@@ -292,6 +296,8 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 
 	if (to > 0)
 	{
+		static hal_metric *read_wait = hal_metric_histogram("hal_demux_read_wait_seconds", "time cDemux::Read waited for data");
+		int64_t t0 = hal_metric_now();
 retry:
 		rc = ::poll(&ufds, 1, to);
 		if (ufds.fd != fd)
@@ -336,6 +342,7 @@ retry:
 			dmx_err("received %s, please report!", "POLLIN", ufds.revents);
 			return 0;
 		}
+		hal_metric_observe(read_wait, hal_metric_now() - t0);
 	}
 	if (ufds.fd != fd) /* does this ever happen? and if, is it harmful? */
 	{
@@ -344,10 +351,23 @@ retry:
 		return -1;
 	}
 
+	/* the filter works on whole packets */
+	if (ts_filter && dmx_type == DMX_TP_CHANNEL && len >= 188)
+		len -= len % 188;
+
 	rc = ::read(fd, buff, len);
 	//fprintf(stderr, "fd %d ret: %d\n", fd, rc);
 	if (rc < 0)
 		dmx_err("read: %s", strerror(errno), 0);
+	if (rc > 0 && ts_filter && dmx_type == DMX_TP_CHANNEL)
+		ts_filter(buff, rc);
+	if (rc > 0 && dmx_type == DMX_PSI_CHANNEL)
+	{
+		if (flt == 0x00)
+			hal_zap_mark(HAL_ZAP_PAT);
+		else if (flt == 0x02)
+			hal_zap_mark(HAL_ZAP_PMT);
+	}
 
 	return rc;
 }
@@ -666,3 +686,9 @@ int cDemux::GetSource(int unit)
 	hal_debug_c("%s(%d) => %d\n", __func__, unit, dmx_source[unit]);
 	return dmx_source[unit];
 }
+
+void cDemux::SetTSFilter(int (*filter)(unsigned char *buf, int len))
+{
+	hal_info_c("%s: %s\n", __func__, filter ? "set" : "cleared");
+	ts_filter = filter;
+}
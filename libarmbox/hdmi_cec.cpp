@@ -39,6 +39,7 @@
 #include "hdmi_cec.h"
 #include "hdmi_cec_types.h"
 #include "hal_debug.h"
+#include "hal_metrics.h"
 
 #include <hardware_caps.h>
 
@@ -86,8 +87,14 @@ hdmi_cec::hdmi_cec()
 	volume = 0;
 	fallback = false;
 	tv_off = true;
+	running = false;
 	deviceType = CEC_LOG_ADDR_TYPE_UNREGISTERED;
 	audio_destination = CEC_OP_PRIM_DEVTYPE_AUDIOSYSTEM;
+	rcFd = -1;
+	tx_head = tx_count = 0;
+	tx_running = false;
+	pthread_mutex_init(&tx_mutex, NULL);
+	pthread_cond_init(&tx_cond, NULL);
 }
 
 hdmi_cec::~hdmi_cec()
@@ -97,6 +104,11 @@ hdmi_cec::~hdmi_cec()
 		close(hdmiFd);
 		hdmiFd = -1;
 	}
+	if (rcFd >= 0)
+	{
+		close(rcFd);
+		rcFd = -1;
+	}
 }
 
 hdmi_cec *hdmi_cec::getInstance()
@@ -311,6 +323,106 @@ void hdmi_cec::ReportPhysicalAddress()
 }
 
 void hdmi_cec::SendCECMessage(struct cec_message &txmessage, int sleeptime)
+{
+	QueueCECMessage(txmessage, sleeptime, false);
+}
+
+/* requests which only make the other side report its state */
+static bool is_poll(const struct cec_message &message)
+{
+	if (message.length != 1)
+		return false;
+	switch (message.data[0])
+	{
+		case CEC_MSG_GIVE_DEVICE_POWER_STATUS:
+		case CEC_MSG_GIVE_AUDIO_STATUS:
+		case CEC_MSG_GET_CEC_VERSION:
+			return true;
+	}
+	return false;
+}
+
+void hdmi_cec::QueueCECMessage(struct cec_message &txmessage, int sleeptime, bool if_tv_off)
+{
+	if (hdmiFd < 0)
+		return;
+
+	pthread_mutex_lock(&tx_mutex);
+	/* a poll still waiting at the end of the queue answers the new one as
+	 * well. Not across other messages, those might change the answer */
+	if (is_poll(txmessage) && !if_tv_off)
+	{
+		for (int i = tx_count - 1; i >= 0; i--)
+		{
+			struct cec_tx *tx = &tx_queue[(tx_head + i) % CEC_TX_QUEUE];
+			if (tx->if_tv_off || !is_poll(tx->message))
+				break;
+			if (tx->message.data[0] == txmessage.data[0] && tx->message.destination == txmessage.destination)
+			{
+				pthread_mutex_unlock(&tx_mutex);
+				hal_debug(GREEN "[CEC] %s: '%s' already queued\n" NORMAL, __func__, ToString((cec_opcode)txmessage.data[0]));
+				return;
+			}
+		}
+	}
+	if (tx_count == CEC_TX_QUEUE)
+	{
+		pthread_mutex_unlock(&tx_mutex);
+		hal_metric_add(hal_metric_counter("hal_cec_tx_dropped_total", "CEC messages dropped because the queue was full"), 1);
+		hal_info(RED "[CEC] %s: queue full, dropping '%s'\n" NORMAL, __func__, ToString((cec_opcode)txmessage.data[0]));
+		return;
+	}
+	struct cec_tx *tx = &tx_queue[(tx_head + tx_count) % CEC_TX_QUEUE];
+	tx->message = txmessage;
+	tx->sleeptime = sleeptime;
+	tx->if_tv_off = if_tv_off;
+	tx_count++;
+	pthread_cond_signal(&tx_cond);
+	pthread_mutex_unlock(&tx_mutex);
+}
+
+void *hdmi_cec::tx_thread_func(void *arg)
+{
+	hal_set_threadname("hdmi_cec:tx");
+	((hdmi_cec *)arg)->tx_loop();
+	return NULL;
+}
+
+void hdmi_cec::tx_loop()
+{
+	hal_metric *tx_time = hal_metric_histogram("hal_cec_tx_seconds", "time to transmit a CEC message");
+	hal_metric *tx_sent = hal_metric_counter("hal_cec_tx_total", "CEC messages transmitted");
+	pthread_mutex_lock(&tx_mutex);
+	/* on Stop() send what is queued, e.g. the standby message, then exit */
+	while (tx_running || tx_count)
+	{
+		if (!tx_count)
+		{
+			pthread_cond_wait(&tx_cond, &tx_mutex);
+			continue;
+		}
+		struct cec_tx tx = tx_queue[tx_head];
+		tx_head = (tx_head + 1) % CEC_TX_QUEUE;
+		tx_count--;
+		pthread_mutex_unlock(&tx_mutex);
+
+		if (!tx.if_tv_off || __atomic_load_n(&tv_off, __ATOMIC_ACQUIRE))
+		{
+			int64_t t0 = hal_metric_now();
+			Transmit(tx.message);
+			hal_metric_observe(tx_time, hal_metric_now() - t0);
+			hal_metric_add(tx_sent, 1);
+			/* give the bus and the other side some time */
+			if (tx.sleeptime)
+				usleep(tx.sleeptime * 1000);
+		}
+
+		pthread_mutex_lock(&tx_mutex);
+	}
+	pthread_mutex_unlock(&tx_mutex);
+}
+
+void hdmi_cec::Transmit(struct cec_message &txmessage)
 {
 	if (hdmiFd >= 0)
 	{
@@ -338,8 +450,6 @@ void hdmi_cec::SendCECMessage(struct cec_message &txmessage, int sleeptime)
 			memcpy(&message.data, txmessage.data, txmessage.length);
 			::write(hdmiFd, &message, 2 + message.length);
 		}
-
-		usleep(sleeptime * 1000);
 	}
 }
 
@@ -389,28 +499,27 @@ void hdmi_cec::SetCECState(bool state)
 		SendCECMessage(message);
 
 #if BOXMODEL_VUPLUS_ALL || BOXMODEL_HISILICON
-		int cnt = 0;
-
-		while (tv_off && (cnt < 5))
-		{
+		/* up to 5 tries, the tx thread skips the rest once the TV reports "on" */
+		int tries = 5;
+		bool if_tv_off = true;
+#else
+		int tries = 1;
+		bool if_tv_off = false;
 #endif
-
+		for (int cnt = 0; cnt < tries; cnt++)
+		{
 			message.initiator = logicalAddress;
 			message.destination = CEC_OP_PRIM_DEVTYPE_TV;
 			message.data[0] = CEC_MSG_IMAGE_VIEW_ON;
 			message.length = 1;
-			SendCECMessage(message);
+			QueueCECMessage(message, 250, if_tv_off);
 
 			message.initiator = logicalAddress;
 			message.destination = CEC_OP_PRIM_DEVTYPE_TV;
 			message.data[0] = CEC_MSG_GIVE_DEVICE_POWER_STATUS;
 			message.length = 1;
-			SendCECMessage(message);
-
-#if BOXMODEL_VUPLUS_ALL || BOXMODEL_HISILICON
-			cnt++;
+			QueueCECMessage(message, 250, if_tv_off);
 		}
-#endif
 
 		GetCECAddressInfo();
 
@@ -567,6 +676,14 @@ bool hdmi_cec::Start()
 		return false;
 
 	running = true;
+
+	tx_running = true;
+	if (pthread_create(&tx_thread, NULL, tx_thread_func, this))
+	{
+		hal_info(RED "[CEC] %s: tx thread: %m\n" NORMAL, __func__);
+		tx_running = false;
+	}
+
 	OpenThreads::Thread::setSchedulePriority(THREAD_PRIORITY_MIN);
 	return (OpenThreads::Thread::start() == 0);
 }
@@ -580,6 +697,15 @@ bool hdmi_cec::Stop()
 
 	OpenThreads::Thread::cancel();
 
+	if (tx_running)
+	{
+		pthread_mutex_lock(&tx_mutex);
+		tx_running = false;
+		pthread_cond_signal(&tx_cond);
+		pthread_mutex_unlock(&tx_mutex);
+		pthread_join(tx_thread, NULL);
+	}
+
 	if (hdmiFd >= 0)
 	{
 		close(hdmiFd);
@@ -712,20 +838,20 @@ void hdmi_cec::Receive(int what)
 					{
 						hal_info(GREEN "[CEC] %s reporting state on (%d)\n" NORMAL, ToString((cec_logical_address)rxmessage.initiator), rxmessage.data[1]);
 						if (rxmessage.initiator == CEC_OP_PRIM_DEVTYPE_TV)
-							tv_off = false;
+							__atomic_store_n(&tv_off, false, __ATOMIC_RELEASE);
 					}
 					else
 					{
 						hal_info(GREEN "[CEC] %s reporting state off (%d)\n" NORMAL, ToString((cec_logical_address)rxmessage.initiator), rxmessage.data[1]);
 						if (rxmessage.initiator == CEC_OP_PRIM_DEVTYPE_TV)
-							tv_off = true;
+							__atomic_store_n(&tv_off, true, __ATOMIC_RELEASE);
 					}
 					break;
 				}
 				case CEC_OPCODE_STANDBY:
 				{
 					if (rxmessage.initiator == CEC_OP_PRIM_DEVTYPE_TV)
-						tv_off = true;
+						__atomic_store_n(&tv_off, true, __ATOMIC_RELEASE);
 					break;
 				}
 				case CEC_OPCODE_USER_CONTROL_PRESSED: /* key pressed */
@@ -747,33 +873,22 @@ void hdmi_cec::Receive(int what)
 
 void hdmi_cec::handleCode(long code, bool keypressed)
 {
-	int evd = open(RC_DEVICE, O_RDWR);
-	if (evd < 0)
+	/* kept open, reopened after an error */
+	if (rcFd < 0)
+		rcFd = open(RC_DEVICE, O_RDWR | O_CLOEXEC);
+	if (rcFd < 0)
 	{
 		hal_info(RED "[CEC] opening " RC_DEVICE " failed" NORMAL);
 		return;
 	}
-	if (keypressed)
+	if (rc_send(rcFd, code, keypressed ? CEC_KEY_PRESSED : CEC_KEY_RELEASED) < 0)
 	{
-		if (rc_send(evd, code, CEC_KEY_PRESSED) < 0)
-		{
-			hal_info(RED "[CEC] writing 'KEY_PRESSED' event failed" NORMAL);
-			close(evd);
-			return;
-		}
-		rc_sync(evd);
-	}
-	else
-	{
-		if (rc_send(evd, code, CEC_KEY_RELEASED) < 0)
-		{
-			hal_info(RED "[CEC] writing 'KEY_RELEASED' event failed" NORMAL);
-			close(evd);
-			return;
-		}
-		rc_sync(evd);
+		hal_info(RED "[CEC] writing '%s' event failed" NORMAL, keypressed ? "KEY_PRESSED" : "KEY_RELEASED");
+		close(rcFd);
+		rcFd = -1;
+		return;
 	}
-	close(evd);
+	rc_sync(rcFd);
 }
 
 int hdmi_cec::rc_send(int fd, unsigned int code, unsigned int value)
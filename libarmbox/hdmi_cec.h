@@ -20,6 +20,8 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 
+#include <pthread.h>
+
 #include <OpenThreads/Thread>
 #include <OpenThreads/Condition>
 
@@ -48,6 +50,16 @@ struct addressinfo
 	unsigned char type;
 };
 
+/* queued for the transmit thread */
+struct cec_tx
+{
+	struct cec_message message;
+	int sleeptime;		/* ms to leave the bus alone afterwards */
+	bool if_tv_off;		/* drop it if the TV reported "on" meanwhile */
+};
+
+#define CEC_TX_QUEUE 32
+
 enum
 {
 	CEC_KEY_RELEASED = 0,
@@ -78,8 +90,21 @@ class hdmi_cec : public OpenThreads::Thread
 		bool muted;
 		int volume;
 		bool fallback;
-		bool tv_off;
+		bool tv_off;	/* written by the rx thread, read by the tx thread, __atomic_* only */
 		unsigned char audio_destination;
+		int rcFd;
+		/* SendCECMessage only queues, the tx thread sends */
+		struct cec_tx tx_queue[CEC_TX_QUEUE];
+		int tx_head;
+		int tx_count;
+		bool tx_running;
+		pthread_t tx_thread;
+		pthread_mutex_t tx_mutex;
+		pthread_cond_t tx_cond;
+		static void *tx_thread_func(void *arg);
+		void tx_loop();
+		void Transmit(struct cec_message &message);
+		void QueueCECMessage(struct cec_message &message, int sleeptime, bool if_tv_off);
 	protected:
 		bool running;
 	public:
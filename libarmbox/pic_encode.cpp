@@ -0,0 +1,311 @@
+/*
+ * convert still pictures to MPEG-2 I-frames for the video decoder,
+ * used by cVideo::ShowPicture() and pic2m2v
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cstdlib>
+#include <string>
+
+#include "pic_encode.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(58, 133, 100)
+static void get_packet_defaults(AVPacket *pkt)
+{
+	memset(pkt, 0, sizeof(*pkt));
+
+	pkt->pts = AV_NOPTS_VALUE;
+	pkt->dts = AV_NOPTS_VALUE;
+	pkt->pos = -1;
+}
+#endif
+
+static void init_parameters(AVFrame *in_frame, AVCodecContext *codec_context)
+{
+	/* put sample parameters */
+	codec_context->bit_rate = 400000;
+	/* resolution must be a multiple of two */
+	codec_context->width = (in_frame->width / 2) * 2;
+	codec_context->height = (in_frame->height / 2) * 2;
+	/* frames per second */
+	codec_context->time_base = (AVRational)
+	{
+		1, 60
+	};
+	codec_context->gop_size = 10; /* emit one intra frame every ten frames */
+	codec_context->max_b_frames = 1;
+	codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+}
+
+static void write_frame(AVFrame *in_frame, std::string &out)
+{
+	if (in_frame == NULL)
+		return;
+	static const unsigned char pes_header[] = {0x0, 0x0, 0x1, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x5, 0x21, 0x0, 0x1, 0x0, 0x1};
+
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59,0,100)
+	AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO);
+#else
+	const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO);
+#endif
+	if (codec)
+	{
+		AVCodecContext *codec_context = avcodec_alloc_context3(codec);
+		if (codec_context)
+		{
+			init_parameters(in_frame, codec_context);
+			if (avcodec_open2(codec_context, codec, 0) != -1)
+			{
+				AVPacket pkt;
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 133, 100)
+				av_init_packet(&pkt);
+#else
+				get_packet_defaults(&pkt);
+#endif
+				/* encode the image */
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57,37,100)
+				int got_output = 0;
+				int ret = avcodec_encode_video2(codec_context, &pkt, in_frame, &got_output);
+				if (ret != -1)
+				{
+#else
+				int ret = avcodec_send_frame(codec_context, in_frame);
+				if (!ret)
+				{
+					/* signalling end of stream */
+					ret = avcodec_send_frame(codec_context, NULL);
+				}
+				if (!ret)
+				{
+#endif
+					int i = 1;
+					/* get the delayed frames */
+					in_frame->pts = i;
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57,37,100)
+					ret = avcodec_encode_video2(codec_context, &pkt, 0, &got_output);
+					if (ret != -1 && got_output)
+					{
+#else
+					ret = avcodec_receive_packet(codec_context, &pkt);
+					if (!ret)
+					{
+#endif
+						if ((pkt.data[3] >> 4) != 0xE)
+						{
+							out.append((const char *)pes_header, sizeof(pes_header));
+						}
+						else
+						{
+							pkt.data[4] = pkt.data[5] = 0x00;
+						}
+						out.append((const char *)pkt.data, pkt.size);
+						av_packet_unref(&pkt);
+					}
+				}
+			}
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57, 83, 100)
+			avcodec_close(codec_context);
+			av_free(codec_context);
+#else
+			avcodec_free_context(&codec_context);
+#endif
+		}
+	}
+}
+
+/* returns 0 when the frame was encoded to out, -1 otherwise */
+static int decode_frame(AVCodecContext *codecContext, AVPacket &packet, std::string &out)
+{
+	int ret = -1;
+	AVFrame *frame = av_frame_alloc();
+	if (frame)
+	{
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57,37,100)
+		int decode_ok = 0;
+		if ((avcodec_decode_video2(codecContext, frame, &decode_ok, &packet)) < 0 || !decode_ok)
+		{
+			av_frame_free(&frame);
+			return -1;
+		}
+#else
+		ret = avcodec_send_packet(codecContext, &packet);
+		// In particular, we don't expect AVERROR(EAGAIN), because we read all
+		// decoded frames with avcodec_receive_frame() until done.
+		if (ret < 0)
+		{
+			av_frame_free(&frame);
+			return -1;
+		}
+		ret = avcodec_receive_frame(codecContext, frame);
+		if (ret < 0)
+		{
+			av_frame_free(&frame);
+			return -1;
+		}
+#endif
+		ret = -1;
+		AVFrame *dest_frame = av_frame_alloc();
+		if (dest_frame)
+		{
+			dest_frame->height = (frame->height / 2) * 2;
+			dest_frame->width = (frame->width / 2) * 2;
+			dest_frame->format = AV_PIX_FMT_YUV420P;
+			/* validate dimensions before swscale to prevent assertion failure */
+			if (frame->width <= 0 || frame->height <= 0 || dest_frame->width <= 0 || dest_frame->height <= 0)
+			{
+				av_frame_free(&dest_frame);
+				av_frame_free(&frame);
+				return -1;
+			}
+			av_frame_get_buffer(dest_frame, 32);
+			struct SwsContext *convert = NULL;
+			/* validate pixel format before swscale */
+			AVPixelFormat src_fmt = (AVPixelFormat)frame->format;
+			if (src_fmt >= 0 && src_fmt < AV_PIX_FMT_NB && av_pix_fmt_desc_get(src_fmt) != NULL)
+				convert = sws_getContext(frame->width, frame->height, src_fmt, dest_frame->width, dest_frame->height, AV_PIX_FMT_YUVJ420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+			if (convert)
+			{
+				size_t old_size = out.size();
+				sws_scale(convert, frame->data, frame->linesize, 0, frame->height, dest_frame->data, dest_frame->linesize);
+				sws_freeContext(convert);
+				write_frame(dest_frame, out);
+				if (out.size() > old_size)
+					ret = 0;
+			}
+			av_frame_free(&dest_frame);
+		}
+		av_frame_free(&frame);
+	}
+	return ret;
+}
+
+static AVCodecContext *open_codec(AVMediaType mediaType, AVFormatContext *formatContext)
+{
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59,0,100)
+	AVCodec *codec = NULL;
+#else
+	const AVCodec *codec = NULL;
+#endif
+	AVCodecContext *codecContext = NULL;
+	int stream_index;
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57,25,101)
+	stream_index = av_find_best_stream(formatContext, mediaType, -1, -1, NULL, 0);
+	if (stream_index >= 0)
+	{
+		codecContext = formatContext->streams[stream_index]->codec;
+		if (codecContext)
+		{
+			codec = avcodec_find_decoder(codecContext->codec_id);
+			if (codec)
+			{
+				if ((avcodec_open2(codecContext, codec, NULL)) != 0)
+				{
+					return NULL;
+				}
+			}
+			return codecContext;
+		}
+	}
+	return NULL;
+#else
+	stream_index = av_find_best_stream(formatContext, mediaType, -1, -1, &codec, 0);
+	if (stream_index >= 0)
+	{
+		codec = avcodec_find_decoder(formatContext->streams[stream_index]->codecpar->codec_id);
+		if (codec)
+		{
+			codecContext = avcodec_alloc_context3(codec);
+		}
+		if (codecContext)
+		{
+			if ((avcodec_open2(codecContext, codec, NULL)) != 0)
+			{
+				return NULL;
+			}
+			return codecContext;
+		}
+	}
+	return NULL;
+#endif
+}
+
+static int image_to_pes(const char *image_name, std::string &out)
+{
+	int ret = 0;
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+	av_register_all();
+	avcodec_register_all();
+#endif
+
+	AVFormatContext *formatContext = avformat_alloc_context();
+	if (formatContext && (ret = avformat_open_input(&formatContext, image_name, NULL, NULL)) == 0)
+	{
+		AVCodecContext *codecContext = open_codec(AVMEDIA_TYPE_VIDEO, formatContext);
+		if (codecContext)
+		{
+			AVPacket packet;
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 133, 100)
+			av_init_packet(&packet);
+#else
+			get_packet_defaults(&packet);
+#endif
+			if ((ret = av_read_frame(formatContext, &packet)) != -1)
+			{
+				if ((ret = decode_frame(codecContext, packet, out)) == 0)
+				{
+					/* add sequence end code to have a real mpeg file */
+					uint8_t endcode[] = { 0, 0, 1, 0xb7 };
+					out.append((const char *)endcode, sizeof(endcode));
+				}
+				else
+					out.clear();	/* nothing that could be shown or cached */
+				av_packet_unref(&packet);
+			}
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57, 83, 100)
+			avcodec_close(codecContext);
+			av_free(codecContext);
+#else
+			avcodec_free_context(&codecContext);
+#endif
+		}
+		avformat_close_input(&formatContext);
+	}
+	av_free(formatContext);
+	return ret;
+}
+
+unsigned char *image_to_mpeg2(const char *image_name, size_t *len)
+{
+	std::string out;
+	image_to_pes(image_name, out);
+	if (out.empty())
+		return NULL;
+	unsigned char *d = (unsigned char *)malloc(out.size());
+	if (!d)
+		return NULL;
+	memcpy(d, out.data(), out.size());
+	*len = out.size();
+	return d;
+}
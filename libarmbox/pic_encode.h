@@ -0,0 +1,19 @@
+/*
+ * convert still pictures to MPEG-2 I-frames for the video decoder
+ *
+ * License: GPLv2 or later
+ */
+#ifndef __PIC_ENCODE_H__
+#define __PIC_ENCODE_H__
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* decode, scale and encode image_name as an MPEG-2 I-frame PES that
+ * can be written to the decoder as is. NULL on error, free() the result.
+ * Safe to call from several threads. */
+unsigned char *image_to_mpeg2(const char *image_name, size_t *len);
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -58,7 +58,7 @@ bool cPlayback::Open(playmode_t PlayMode)
 
 	if (!player)
 	{
-		player = (Context_t *) malloc(sizeof(Context_t));
+		player = (Context_t *) calloc(1, sizeof(Context_t));
 	}
 
 	if (player)
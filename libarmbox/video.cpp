@@ -19,6 +19,9 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -36,10 +39,14 @@
 #include <linux/fb.h>
 #include "video_lib.h"
 #include "hal_debug.h"
+#include "zap_timing.h"
+#include "hal_metrics.h"
 #include "hdmi_cec.h"
 
 #include <hardware_caps.h>
 #include <proc_tools.h>
+#include <pic_cache.h>
+#include "pic_encode.h"
 
 extern "C"
 {
@@ -87,6 +94,25 @@ int system_rev = 0;
 
 static bool stillpicture = false;
 
+/* ms, the status queries below are polled from the GUI all the time */
+#define PROC_TTL 250
+
+/* cVideo::event_state: width, height, frame rate, aspect, progressive */
+#define EV_WIDTH(e)		((int)((e) & 0xffff))
+#define EV_HEIGHT(e)		((int)(((e) >> 16) & 0xffff))
+#define EV_RATE(e)		((int)(((e) >> 32) & 0xffff))
+#define EV_ASPECT(e)		((int)(((e) >> 48) & 0xf))
+#define EV_PROGRESSIVE(e)	((int)(((e) >> 52) & 0x1))
+#define EV_HAVE_SIZE		(1ULL << 56)
+#define EV_HAVE_RATE		(1ULL << 57)
+#define EV_HAVE_PROGRESSIVE	(1ULL << 58)
+#define EV_ZAP			(1ULL << 63)	/* Start() was called, no event yet */
+#define EV_HAVE_ANY		(EV_HAVE_SIZE | EV_HAVE_RATE | EV_HAVE_PROGRESSIVE)
+
+#ifndef VIDEO_EVENT_PROGRESSIVE_CHANGED
+#define VIDEO_EVENT_PROGRESSIVE_CHANGED 16
+#endif
+
 static const char *VDEV[] =
 {
 	"/dev/dvb/adapter0/video0",
@@ -207,16 +233,6 @@ static const char *vid_modes[] =
 #define VIDEO_STREAMTYPE_MPEG1 6
 #define VIDEO_STREAMTYPE_H265_HEVC 7
 #define VIDEO_STREAMTYPE_AVS 16
-#if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(58, 133, 100)
-static void get_packet_defaults(AVPacket *pkt)
-{
-	memset(pkt, 0, sizeof(*pkt));
-
-	pkt->pts = AV_NOPTS_VALUE;
-	pkt->dts = AV_NOPTS_VALUE;
-	pkt->pos = -1;
-}
-#endif
 ssize_t write_all(int fd, const void *buf, size_t count)
 {
 	int retval;
@@ -238,254 +254,6 @@ ssize_t write_all(int fd, const void *buf, size_t count)
 	return handledcount;
 }
 
-void init_parameters(AVFrame *in_frame, AVCodecContext *codec_context)
-{
-	/* put sample parameters */
-	codec_context->bit_rate = 400000;
-	/* resolution must be a multiple of two */
-	codec_context->width = (in_frame->width / 2) * 2;
-	codec_context->height = (in_frame->height / 2) * 2;
-	/* frames per second */
-	codec_context->time_base = (AVRational)
-	{
-		1, 60
-	};
-	codec_context->gop_size = 10; /* emit one intra frame every ten frames */
-	codec_context->max_b_frames = 1;
-	codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
-}
-
-void write_frame(AVFrame *in_frame, int fd)
-{
-	if (in_frame == NULL)
-		return;
-	static const unsigned char pes_header[] = {0x0, 0x0, 0x1, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x5, 0x21, 0x0, 0x1, 0x0, 0x1};
-
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59,0,100)
-	AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO);
-#else
-	const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO);
-#endif
-	if (codec)
-	{
-		AVCodecContext *codec_context = avcodec_alloc_context3(codec);
-		if (codec_context)
-		{
-			init_parameters(in_frame, codec_context);
-			if (avcodec_open2(codec_context, codec, 0) != -1)
-			{
-				AVPacket pkt;
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 133, 100)
-				av_init_packet(&pkt);
-#else
-				get_packet_defaults(&pkt);
-#endif
-				/* encode the image */
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57,37,100)
-				int got_output = 0;
-				int ret = avcodec_encode_video2(codec_context, &pkt, in_frame, &got_output);
-				if (ret != -1)
-				{
-#else
-				int ret = avcodec_send_frame(codec_context, in_frame);
-				if (!ret)
-				{
-					/* signalling end of stream */
-					ret = avcodec_send_frame(codec_context, NULL);
-				}
-				if (!ret)
-				{
-#endif
-					int i = 1;
-					/* get the delayed frames */
-					in_frame->pts = i;
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57,37,100)
-					ret = avcodec_encode_video2(codec_context, &pkt, 0, &got_output);
-					if (ret != -1 && got_output)
-					{
-#else
-					ret = avcodec_receive_packet(codec_context, &pkt);
-					if (!ret)
-					{
-#endif
-						if ((pkt.data[3] >> 4) != 0xE)
-						{
-							write_all(fd, pes_header, sizeof(pes_header));
-						}
-						else
-						{
-							pkt.data[4] = pkt.data[5] = 0x00;
-						}
-						write_all(fd, pkt.data, pkt.size);
-						av_packet_unref(&pkt);
-					}
-				}
-			}
-#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57, 83, 100)
-			avcodec_close(codec_context);
-			av_free(codec_context);
-#else
-			avcodec_free_context(&codec_context);
-#endif
-		}
-	}
-}
-
-int decode_frame(AVCodecContext *codecContext, AVPacket &packet, int fd)
-{
-	AVFrame *frame = av_frame_alloc();
-	if (frame)
-	{
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(57,37,100)
-		int decode_ok = 0;
-		if ((avcodec_decode_video2(codecContext, frame, &decode_ok, &packet)) < 0 || !decode_ok)
-		{
-			av_frame_free(&frame);
-			return -1;
-		}
-#else
-		int ret;
-		ret = avcodec_send_packet(codecContext, &packet);
-		// In particular, we don't expect AVERROR(EAGAIN), because we read all
-		// decoded frames with avcodec_receive_frame() until done.
-		if (ret < 0)
-		{
-			av_frame_free(&frame);
-			return -1;
-		}
-		ret = avcodec_receive_frame(codecContext, frame);
-		if (ret < 0)
-		{
-			av_frame_free(&frame);
-			return -1;
-		}
-#endif
-		AVFrame *dest_frame = av_frame_alloc();
-		if (dest_frame)
-		{
-			dest_frame->height = (frame->height / 2) * 2;
-			dest_frame->width = (frame->width / 2) * 2;
-			dest_frame->format = AV_PIX_FMT_YUV420P;
-			/* validate dimensions before swscale to prevent assertion failure */
-			if (frame->width <= 0 || frame->height <= 0 || dest_frame->width <= 0 || dest_frame->height <= 0)
-			{
-				av_frame_free(&dest_frame);
-				av_frame_free(&frame);
-				return -1;
-			}
-			av_frame_get_buffer(dest_frame, 32);
-			struct SwsContext *convert = NULL;
-			/* validate pixel format before swscale */
-			AVPixelFormat src_fmt = (AVPixelFormat)frame->format;
-			if (src_fmt >= 0 && src_fmt < AV_PIX_FMT_NB && av_pix_fmt_desc_get(src_fmt) != NULL)
-				convert = sws_getContext(frame->width, frame->height, src_fmt, dest_frame->width, dest_frame->height, AV_PIX_FMT_YUVJ420P, SWS_FAST_BILINEAR, NULL, NULL, NULL);
-			if (convert)
-			{
-				sws_scale(convert, frame->data, frame->linesize, 0, frame->height, dest_frame->data, dest_frame->linesize);
-				sws_freeContext(convert);
-			}
-			write_frame(dest_frame, fd);
-			av_frame_free(&dest_frame);
-		}
-		av_frame_free(&frame);
-	}
-	return 0;
-
-}
-
-AVCodecContext *open_codec(AVMediaType mediaType, AVFormatContext *formatContext)
-{
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59,0,100)
-	AVCodec *codec = NULL;
-#else
-	const AVCodec *codec = NULL;
-#endif
-	AVCodecContext *codecContext = NULL;
-	int stream_index;
-#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57,25,101)
-	stream_index = av_find_best_stream(formatContext, mediaType, -1, -1, NULL, 0);
-	if (stream_index >= 0)
-	{
-		codecContext = formatContext->streams[stream_index]->codec;
-		if (codecContext)
-		{
-			codec = avcodec_find_decoder(codecContext->codec_id);
-			if (codec)
-			{
-				if ((avcodec_open2(codecContext, codec, NULL)) != 0)
-				{
-					return NULL;
-				}
-			}
-			return codecContext;
-		}
-	}
-	return NULL;
-#else
-	stream_index = av_find_best_stream(formatContext, mediaType, -1, -1, &codec, 0);
-	if (stream_index >= 0)
-	{
-		codec = avcodec_find_decoder(formatContext->streams[stream_index]->codecpar->codec_id);
-		if (codec)
-		{
-			codecContext = avcodec_alloc_context3(codec);
-		}
-		if (codecContext)
-		{
-			if ((avcodec_open2(codecContext, codec, NULL)) != 0)
-			{
-				return NULL;
-			}
-			return codecContext;
-		}
-	}
-	return NULL;
-#endif
-}
-
-int image_to_mpeg2(const char *image_name, int fd)
-{
-	int ret = 0;
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
-	av_register_all();
-	avcodec_register_all();
-#endif
-
-	AVFormatContext *formatContext = avformat_alloc_context();
-	if (formatContext && (ret = avformat_open_input(&formatContext, image_name, NULL, NULL)) == 0)
-	{
-		AVCodecContext *codecContext = open_codec(AVMEDIA_TYPE_VIDEO, formatContext);
-		if (codecContext)
-		{
-			AVPacket packet;
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 133, 100)
-			av_init_packet(&packet);
-#else
-			get_packet_defaults(&packet);
-#endif
-			if ((ret = av_read_frame(formatContext, &packet)) != -1)
-			{
-				if ((ret = decode_frame(codecContext, packet, fd)) != 1)
-				{
-					/* add sequence end code to have a real mpeg file */
-					uint8_t endcode[] = { 0, 0, 1, 0xb7 };
-					write_all(fd, endcode, sizeof(endcode));
-				}
-				av_packet_unref(&packet);
-			}
-#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57, 83, 100)
-			avcodec_close(codecContext);
-			av_free(codecContext);
-#else
-			avcodec_free_context(&codecContext);
-#endif
-		}
-		avformat_close_input(&formatContext);
-	}
-	av_free(formatContext);
-	return ret;
-}
-
 #ifndef VIDEO_SOURCE_HDMI
 #define VIDEO_SOURCE_HDMI 2
 #endif
@@ -563,6 +331,11 @@ cVideo::cVideo(int, void *, void *, unsigned int unit)
 		devnum = unit;
 	fd = -1;
 	fdd = false;
+	event_state = 0;
+	event_stop_fd = -1;
+	pthread_mutex_init(&event_mutex, NULL);
+	event_cb = NULL;
+	event_cb_data = NULL;
 	openDevice();
 #if 0
 	setAVInput(ENCODER);
@@ -579,6 +352,7 @@ cVideo::~cVideo(void)
 		hdmi_cec::getInstance()->SetCECState(true);
 
 	closeDevice();
+	pthread_mutex_destroy(&event_mutex);
 }
 
 void cVideo::openDevice(void)
@@ -601,6 +375,8 @@ retry:
 		hal_info("#%d: %s cannot open %s: %m, retries %d\n", devnum, __func__, VDEV[devnum], n);
 	}
 	playstate = VIDEO_STOPPED;
+	if (fd >= 0)
+		event_start();
 }
 
 void cVideo::closeDevice(void)
@@ -608,6 +384,7 @@ void cVideo::closeDevice(void)
 	hal_debug("%s\n", __func__);
 	/* looks like sometimes close is unhappy about non-empty buffers */
 //	Start();
+	event_stop();
 	if (fd >= 0)
 		close(fd);
 	fd = -1;
@@ -658,9 +435,12 @@ int cVideo::getAspectRatio(void)
 	if (fd == -1)
 	{
 		/* in movieplayer mode, fd is not opened -> fall back to procfs */
-		int n = proc_get_hex(VMPEG_aspect[devnum]);
+		int n = proc_get_hex_cached(VMPEG_aspect[devnum], PROC_TTL);
 		return n;
 	}
+	uint64_t e = event_get();
+	if (e & EV_HAVE_SIZE)
+		return EV_ASPECT(e) * 2 + 1;
 	if (fop(ioctl, VIDEO_GET_SIZE, &s) < 0)
 	{
 		hal_info("%s: VIDEO_GET_SIZE %m\n", __func__);
@@ -688,6 +468,8 @@ int cVideo::setCroppingMode(int /*vidDispMode_t format*/)
 
 int cVideo::Start(void * /*PcrChannel*/, unsigned short /*PcrPid*/, unsigned short /*VideoPid*/, void * /*hChannel*/)
 {
+	static hal_metric *start_time = hal_metric_histogram("hal_video_start_seconds", "duration of cVideo::Start");
+	int64_t t0 = hal_metric_now();
 	hal_debug("#%d: %s playstate=%d\n", devnum, __func__, playstate);
 #if 0
 	if (playstate == VIDEO_PLAYING)
@@ -703,6 +485,10 @@ int cVideo::Start(void * /*PcrChannel*/, unsigned short /*PcrPid*/, unsigned sho
 		Stop(1);
 	}
 	playstate = VIDEO_PLAYING;
+	hal_zap_mark(HAL_ZAP_VIDEO_START);
+	/* the old values are of no use for the new stream, ask the driver
+	 * until it reports the new ones */
+	event_set(EV_ZAP);
 	fop(ioctl, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
 	int res = fop(ioctl, VIDEO_PLAY);
 #if BOXMODEL_HISILICON
@@ -729,6 +515,7 @@ int cVideo::Start(void * /*PcrChannel*/, unsigned short /*PcrPid*/, unsigned sho
 		hue = -1;
 	}
 	blank_mode = 0;
+	hal_metric_observe(start_time, hal_metric_now() - t0);
 	return res;
 }
 
@@ -742,6 +529,7 @@ int cVideo::Stop(bool blank)
 	}
 	playstate = blank ? VIDEO_STOPPED : VIDEO_FREEZED;
 	blank_mode = blank;
+	hal_zap_arm();
 	return fop(ioctl, VIDEO_STOP, blank ? 1 : 0);
 }
 
@@ -793,7 +581,7 @@ int cVideo::SetVideoSystem(int video_system, bool remember)
 int cVideo::GetVideoSystem(void)
 {
 	char current[32];
-	proc_get("/proc/stb/video/videomode", current, 32);
+	proc_get_cached("/proc/stb/video/videomode", current, 32, PROC_TTL);
 	for (int i = 0; vid_modes[i]; i++)
 	{
 		if (strcmp(current, vid_modes[i]) == 0)
@@ -868,6 +656,16 @@ bool cVideo::ShowPicture(const char *fname)
 	{
 		return ret;
 	}
+	/* convert before touching the decoder, usually it is cached */
+	size_t pes_len = 0;
+	struct pic_cache_key key;
+	unsigned char *pes = pic_cache_get(fname, &pes_len, &key);
+	if (!pes)
+	{
+		pes = image_to_mpeg2(fname, &pes_len);
+		if (pes && pic_cache_add(fname, &key, pes, pes_len))
+			hal_info("%s: could not cache %s\n", __func__, fname);
+	}
 	closeDevice();
 	openDevice();
 	if (fd >= 0)
@@ -879,15 +677,28 @@ bool cVideo::ShowPicture(const char *fname)
 		ioctl(fd, VIDEO_PLAY);
 		ioctl(fd, VIDEO_CONTINUE);
 		ioctl(fd, VIDEO_CLEAR_BUFFER);
-		image_to_mpeg2(fname, fd);
+		/* the picture and the stuffing that pushes it out of the
+		 * decoder in one go */
 		unsigned char iframe[8192];
 		memset(iframe, 0xff, sizeof(iframe));
-		write_all(fd, iframe, 8192);
+		struct iovec iov[2];
+		iov[0].iov_base = pes;
+		iov[0].iov_len = pes ? pes_len : 0;
+		iov[1].iov_base = iframe;
+		iov[1].iov_len = sizeof(iframe);
+		ssize_t w = writev(fd, iov, 2);
+		if (w < 0)
+			w = 0;
+		if ((size_t)w < iov[0].iov_len)
+			write_all(fd, pes + w, iov[0].iov_len - w);
+		w = w > (ssize_t)iov[0].iov_len ? w - iov[0].iov_len : 0;
+		write_all(fd, iframe + w, sizeof(iframe) - w);
 		usleep(150000);
 		ioctl(fd, VIDEO_STOP, 0);
 		ioctl(fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
 		ret = true;
 	}
+	free(pes);
 	return ret;
 }
 
@@ -1085,14 +896,22 @@ void cVideo::getPictureInfo(int &width, int &height, int &rate)
 	{
 		/* in movieplayer mode, fd is not opened -> fall back to procfs */
 		char buf[16];
-		int n = proc_get(VMPEG_framerate[devnum], buf, 16);
+		int n = proc_get_cached(VMPEG_framerate[devnum], buf, 16, PROC_TTL);
 		if (n > 0)
 			sscanf(buf, "%i", &r);
-		width = proc_get_hex(VMPEG_xres[devnum]);
-		height = proc_get_hex(VMPEG_yres[devnum]);
+		width = proc_get_hex_cached(VMPEG_xres[devnum], PROC_TTL);
+		height = proc_get_hex_cached(VMPEG_yres[devnum], PROC_TTL);
 		rate = rate2csapi(r);
 		return;
 	}
+	uint64_t e = event_get();
+	if ((e & (EV_HAVE_SIZE | EV_HAVE_RATE)) == (EV_HAVE_SIZE | EV_HAVE_RATE))
+	{
+		width = EV_WIDTH(e);
+		height = EV_HEIGHT(e);
+		rate = rate2csapi(EV_RATE(e));
+		return;
+	}
 	ioctl(fd, VIDEO_GET_SIZE, &s);
 	ioctl(fd, VIDEO_GET_FRAME_RATE, &r);
 	rate = rate2csapi(r);
@@ -1101,6 +920,153 @@ void cVideo::getPictureInfo(int &width, int &height, int &rate)
 	hal_debug("#%d: %s: rate: %d, width: %d height: %d\n", devnum, __func__, rate, width, height);
 }
 
+int cVideo::getProgressive(void)
+{
+	uint64_t e = event_get();
+	if (fd == -1 || !(e & EV_HAVE_PROGRESSIVE))
+		return -1;
+	return EV_PROGRESSIVE(e);
+}
+
+uint64_t cVideo::event_get(void)
+{
+	pthread_mutex_lock(&event_mutex);
+	uint64_t e = event_state;
+	pthread_mutex_unlock(&event_mutex);
+	return e;
+}
+
+void cVideo::event_set(uint64_t e)
+{
+	pthread_mutex_lock(&event_mutex);
+	event_state = e;
+	pthread_mutex_unlock(&event_mutex);
+}
+
+void cVideo::SetEventCallback(void (*cb)(void *data), void *data)
+{
+	pthread_mutex_lock(&event_mutex);
+	event_cb = cb;
+	event_cb_data = data;
+	pthread_mutex_unlock(&event_mutex);
+}
+
+void *cVideo::event_thread_func(void *arg)
+{
+	hal_set_threadname("hal:video_ev");
+	((cVideo *)arg)->event_loop();
+	return NULL;
+}
+
+void cVideo::event_loop(void)
+{
+	struct pollfd pfd[2];
+	pfd[0].fd = fd;
+	pfd[0].events = POLLPRI;
+	pfd[1].fd = event_stop_fd;
+	pfd[1].events = POLLIN;
+
+	while (true)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			hal_info("#%d: %s: poll: %m\n", devnum, __func__);
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (pfd[0].revents & (POLLHUP | POLLNVAL))
+			break;
+		if (!(pfd[0].revents & POLLPRI))
+			continue;
+		struct video_event evt;
+		if (ioctl(fd, VIDEO_GET_EVENT, &evt) < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			/* the getters ask the driver from now on */
+			hal_info("#%d: %s: VIDEO_GET_EVENT: %m\n", devnum, __func__);
+			break;
+		}
+		uint64_t clear, set;
+		switch (evt.type)
+		{
+			case VIDEO_EVENT_SIZE_CHANGED:
+				clear = 0xffffffffULL | (0xfULL << 48);
+				set = (evt.u.size.w & 0xffff) | ((uint64_t)(evt.u.size.h & 0xffff) << 16) |
+					((uint64_t)(evt.u.size.aspect_ratio & 0xf) << 48) | EV_HAVE_SIZE;
+				break;
+			case VIDEO_EVENT_FRAME_RATE_CHANGED:
+				clear = 0xffffULL << 32;
+				set = ((uint64_t)(evt.u.frame_rate & 0xffff) << 32) | EV_HAVE_RATE;
+				break;
+			case VIDEO_EVENT_PROGRESSIVE_CHANGED:
+				clear = 1ULL << 52;
+				set = ((uint64_t)(evt.u.frame_rate ? 1 : 0) << 52) | EV_HAVE_PROGRESSIVE;
+				break;
+			default:
+				continue;
+		}
+		/* Start() resets the state concurrently. the callback is
+		 * called without the lock, it may set a new one */
+		pthread_mutex_lock(&event_mutex);
+		uint64_t old = event_state;
+		uint64_t e = ((old & ~clear) | set) & ~EV_ZAP;
+		event_state = e;
+		void (*cb)(void *) = event_cb;
+		void *cb_data = event_cb_data;
+		pthread_mutex_unlock(&event_mutex);
+		hal_debug("#%d: %s: event %d: %dx%d aspect %d rate %d progressive %d\n", devnum, __func__, evt.type,
+			EV_WIDTH(e), EV_HEIGHT(e), EV_ASPECT(e), EV_RATE(e), EV_PROGRESSIVE(e));
+		if ((old & EV_ZAP) && devnum == 0)
+		{
+			/* the decoder reports the stream as soon as it decoded the
+			 * first picture, which it shows right away */
+			hal_zap_mark(HAL_ZAP_IFRAME);
+			hal_zap_mark(HAL_ZAP_DISPLAY);
+		}
+		if (e == old)
+			continue;
+		if (cb)
+			cb(cb_data);
+	}
+	event_set(0);
+}
+
+void cVideo::event_start(void)
+{
+	if (event_stop_fd >= 0)
+		return;
+	event_set(0);
+	event_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (event_stop_fd < 0)
+	{
+		hal_info("#%d: %s: eventfd: %m\n", devnum, __func__);
+		return;
+	}
+	if (pthread_create(&event_thread, NULL, event_thread_func, this))
+	{
+		hal_info("#%d: %s: pthread_create: %m\n", devnum, __func__);
+		close(event_stop_fd);
+		event_stop_fd = -1;
+	}
+}
+
+void cVideo::event_stop(void)
+{
+	if (event_stop_fd < 0)
+		return;
+	uint64_t one = 1;
+	if (write(event_stop_fd, &one, sizeof(one)) < 0)
+		hal_info("#%d: %s: write: %m\n", devnum, __func__);
+	pthread_join(event_thread, NULL);
+	close(event_stop_fd);
+	event_stop_fd = -1;
+	event_set(0);
+}
+
 void cVideo::SetSyncMode(AVSYNC_TYPE mode)
 {
 	hal_debug("%s %d\n", __func__, mode);
@@ -1,6 +1,8 @@
 #ifndef __VIDEO_LIB_H__
 #define __VIDEO_LIB_H__
 
+#include <stdint.h>
+#include <pthread.h>
 #include <linux/dvb/video.h>
 #include "cs_types.h"
 #include "dmx_hal.h"
@@ -211,6 +213,22 @@ class cVideo
 		int zapping_mode;
 		int blank_mode;
 
+		/* decoder state, kept up to date from VIDEO_GET_EVENT by the
+		 * event thread while the device is open. event_mutex protects
+		 * it and the callback, 64 bit atomics are no option on mips32 */
+		pthread_mutex_t event_mutex;
+		uint64_t event_state;
+		int event_stop_fd;	/* -1: no event thread */
+		pthread_t event_thread;
+		void (*event_cb)(void *);
+		void *event_cb_data;
+		uint64_t event_get(void);
+		void event_set(uint64_t e);
+		static void *event_thread_func(void *arg);
+		void event_loop(void);
+		void event_start(void);
+		void event_stop(void);
+
 		/* used internally by dmx */
 		int64_t GetPTS(void);
 	public:
@@ -233,6 +251,11 @@ class cVideo
 		/* aspect ratio */
 		int getAspectRatio(void);
 		void getPictureInfo(int &width, int &height, int &rate);
+		/* 1 progressive, 0 interlaced, -1 not known */
+		int getProgressive(void);
+		/* called from the event thread when size, aspect, frame rate
+		 * or progressive state change */
+		void SetEventCallback(void (*cb)(void *data), void *data);
 		int setAspectRatio(int aspect, int mode);
 
 		/* cropping mode */
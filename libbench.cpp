@@ -0,0 +1,746 @@
+/* benchmark program for libstb-hal, generic-pc only
+ * License: GPL v2 or later
+ *
+ * Plays a recorded transport stream through cDemux, cVideo, cAudio and
+ * cRecord. The demux device is replaced by FIFOs (see HAL_FAKE_DMX in
+ * libgeneric-pc/dmx.cpp) which are fed from the file by a thread that
+ * does the PID filtering. Results are printed to stdout as one JSON
+ * object per line, the usual HAL debug output goes to stderr.
+ *
+ * It needs an X display, just like neutrino on generic-pc, e.g.
+ *   xvfb-run libstb-hal-bench -v 0x1ff -a 0x200 -t 1 rec.ts
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <include/init.h>
+#include <include/dmx_hal.h>
+#include <include/video_hal.h>
+#include <include/audio_hal.h>
+#include <include/record_hal.h>
+#include <include/zap_timing.h>
+
+extern cVideo *videoDecoder;
+extern cAudio *audioDecoder;
+extern cDemux *videoDemux;
+extern cDemux *audioDemux;
+
+#define TS_SIZE 188
+#define FEED_CHUNK (TS_SIZE * 348) /* ~64k, one FIFO buffer */
+
+static std::string fifo_dir;
+static const char *ts_file;
+static unsigned short vpid, apid;
+static int pmt_pid = -1;	/* -1 = the first program in the PAT */
+static int vtype = VIDEO_FORMAT_MPEG2;
+static int atype = AUDIO_FMT_MPEG;
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* copies the packets of the given PIDs from ts_file into a fake demux FIFO */
+class Feeder
+{
+	private:
+		struct out
+		{
+			std::vector<unsigned short> pids;
+			int fd;
+			unsigned char buf[FEED_CHUNK];
+			int len;
+			bool psi;	/* whole sections of psi_pid, like a section filter */
+		};
+		std::vector<out *> outs;
+		pthread_t thread;
+		bool running;
+		volatile bool stop;
+		bool loop;
+		int64_t rate;	/* bytes per second, 0 = as fast as the reader takes it */
+		pthread_mutex_t psi_mutex;
+		int psi_pid;	/* -1 = none */
+
+		bool flush(out *o);
+		void write_sections(out *o);
+		void feed_psi(out *o, const unsigned char *p);
+		void run(void);
+		static void *run_thread(void *c) { ((Feeder *)c)->run(); return NULL; }
+	public:
+		volatile int64_t bytes;	/* bytes written to all FIFOs */
+		volatile bool done;	/* end of file reached and written */
+
+		volatile bool hold;	/* the PES/TS outputs are not fed while set, like a stopped demux */
+
+		Feeder(bool _loop = false, int64_t _rate = 0) : running(false), stop(false), loop(_loop), rate(_rate), psi_pid(-1), bytes(0), done(false), hold(false)
+		{
+			pthread_mutex_init(&psi_mutex, NULL);
+		}
+		~Feeder() { Stop(); pthread_mutex_destroy(&psi_mutex); }
+		bool Add(const char *name, unsigned short pid1, unsigned short pid2 = 0);
+		bool AddPSI(const char *name);
+		/* the sections of which PID go to the PSI output. When this returns,
+		 * no section of the old PID is written anymore */
+		void SetPSIPid(int pid);
+		bool Start(void);
+		void Stop(void);
+};
+
+bool Feeder::Add(const char *name, unsigned short pid1, unsigned short pid2)
+{
+	std::string path = fifo_dir + "/" + name;
+	/* the demux has the FIFO open O_RDWR already, so this does not block */
+	int fd = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: open %s: %m\n", __func__, path.c_str());
+		return false;
+	}
+	out *o = new out;
+	o->fd = fd;
+	o->len = 0;
+	o->psi = false;
+	o->pids.push_back(pid1);
+	if (pid2)
+		o->pids.push_back(pid2);
+	outs.push_back(o);
+	return true;
+}
+
+bool Feeder::AddPSI(const char *name)
+{
+	std::string path = fifo_dir + "/" + name;
+	int fd = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: open %s: %m\n", __func__, path.c_str());
+		return false;
+	}
+	out *o = new out;
+	o->fd = fd;
+	o->len = 0;
+	o->psi = true;
+	outs.push_back(o);
+	return true;
+}
+
+void Feeder::SetPSIPid(int pid)
+{
+	pthread_mutex_lock(&psi_mutex);
+	psi_pid = pid;
+	for (std::vector<out *>::iterator i = outs.begin(); i != outs.end(); ++i)
+		if ((*i)->psi)
+			(*i)->len = 0;
+	pthread_mutex_unlock(&psi_mutex);
+}
+
+/* writes the complete sections at the start of o->buf, each with a
+ * single write(), so that every read() of the demux gets whole sections.
+ * If nobody reads them, they are dropped: the PES outputs must not stall
+ * because of the PSI output */
+void Feeder::write_sections(out *o)
+{
+	while (o->len >= 3)
+	{
+		if (o->buf[0] == 0xff)
+		{
+			/* stuffing, the rest of the packet is unused */
+			o->len = 0;
+			break;
+		}
+		int need = 3 + (((o->buf[1] & 0x0f) << 8) | o->buf[2]);
+		if (need > 4096)
+		{
+			o->len = 0;
+			break;
+		}
+		if (o->len < need)
+			break;
+		if (write(o->fd, o->buf, need) == need)
+			bytes += need;
+		o->len -= need;
+		memmove(o->buf, o->buf + need, o->len);
+	}
+}
+
+/* collects the sections of psi_pid in o->buf, called with psi_mutex held */
+void Feeder::feed_psi(out *o, const unsigned char *p)
+{
+	int afc = (p[3] >> 4) & 3;
+	int off = 4;
+	if (!(afc & 1))
+		return;
+	if (afc & 2)
+		off += 1 + p[4];
+	if (off >= TS_SIZE)
+		return;
+	if (p[1] & 0x40)
+	{
+		int ptr = p[off++];
+		if (off + ptr > TS_SIZE)
+		{
+			o->len = 0;
+			return;
+		}
+		/* the end of the previous section, if we have its start */
+		if (o->len > 0)
+		{
+			memcpy(o->buf + o->len, p + off, ptr);
+			o->len += ptr;
+			write_sections(o);
+		}
+		o->len = 0;
+		off += ptr;
+	}
+	else if (o->len == 0)
+		return; /* not in sync yet */
+	memcpy(o->buf + o->len, p + off, TS_SIZE - off);
+	o->len += TS_SIZE - off;
+	write_sections(o);
+}
+
+bool Feeder::Start(void)
+{
+	stop = false;
+	done = false;
+	bytes = 0;
+	if (pthread_create(&thread, NULL, run_thread, this))
+		return false;
+	running = true;
+	return true;
+}
+
+void Feeder::Stop(void)
+{
+	stop = true;
+	if (running)
+		pthread_join(thread, NULL);
+	running = false;
+	for (std::vector<out *>::iterator i = outs.begin(); i != outs.end(); ++i)
+	{
+		close((*i)->fd);
+		delete *i;
+	}
+	outs.clear();
+}
+
+bool Feeder::flush(out *o)
+{
+	unsigned char *p = o->buf;
+	while (o->len > 0)
+	{
+		struct pollfd pfd = { o->fd, POLLOUT, 0 };
+		if (stop)
+			return false;
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		ssize_t ret = write(o->fd, p, o->len);
+		if (ret < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: write: %m\n", __func__);
+			return false;
+		}
+		p += ret;
+		o->len -= ret;
+		bytes += ret;
+	}
+	return true;
+}
+
+void Feeder::run(void)
+{
+	unsigned char buf[FEED_CHUNK];
+	int64_t start = now_us();
+	int64_t in = 0;
+	int fd = open(ts_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: open %s: %m\n", __func__, ts_file);
+		done = true;
+		return;
+	}
+	while (!stop)
+	{
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0)
+		{
+			if (len < 0 || !loop)
+				break;
+			lseek(fd, 0, SEEK_SET);
+			continue;
+		}
+		in += len;
+		for (unsigned char *p = buf; p + TS_SIZE <= buf + len; p += TS_SIZE)
+		{
+			if (*p != 0x47)
+			{
+				/* resync, might drop one packet */
+				unsigned char *q = (unsigned char *)memchr(p + 1, 0x47, buf + len - p - 1);
+				if (!q || q + TS_SIZE > buf + len)
+					break;
+				p = q;
+			}
+			unsigned short pid = ((p[1] & 0x1f) << 8) | p[2];
+			for (std::vector<out *>::iterator i = outs.begin(); i != outs.end(); ++i)
+			{
+				out *o = *i;
+				if (o->psi)
+				{
+					pthread_mutex_lock(&psi_mutex);
+					if (pid == psi_pid)
+						feed_psi(o, p);
+					pthread_mutex_unlock(&psi_mutex);
+					continue;
+				}
+				if (hold)
+					continue;
+				for (std::vector<unsigned short>::iterator j = o->pids.begin(); j != o->pids.end(); ++j)
+				{
+					if (*j != pid)
+						continue;
+					memcpy(o->buf + o->len, p, TS_SIZE);
+					o->len += TS_SIZE;
+					if (o->len + TS_SIZE > FEED_CHUNK && !flush(o))
+						goto stopped;
+				}
+			}
+		}
+		if (rate)
+		{
+			int64_t ahead = in * 1000000 / rate - (now_us() - start);
+			if (ahead > 0)
+				usleep(ahead);
+		}
+	}
+	for (std::vector<out *>::iterator i = outs.begin(); i != outs.end(); ++i)
+		if (!(*i)->psi && !flush(*i))
+			break;
+stopped:
+	close(fd);
+	done = true;
+}
+
+/* the demuxes have to be open before the feeder opens the FIFOs */
+static void av_open(void)
+{
+	videoDemux->Open(DMX_VIDEO_CHANNEL);
+	videoDemux->pesFilter(vpid);
+	if (apid)
+	{
+		audioDemux->Open(DMX_AUDIO_CHANNEL);
+		audioDemux->pesFilter(apid);
+	}
+}
+
+static void av_start(void)
+{
+	videoDemux->Start();
+	if (apid)
+		audioDemux->Start();
+	videoDecoder->SetStreamType((VIDEO_FORMAT)vtype);
+	videoDecoder->Start(NULL, vpid, vpid);
+	if (apid)
+	{
+		audioDecoder->SetStreamType(atype);
+		audioDecoder->Start();
+	}
+}
+
+static void av_stop(void)
+{
+	if (apid)
+	{
+		audioDecoder->Stop();
+		audioDemux->Stop();
+		audioDemux->Close();
+	}
+	videoDecoder->Stop();
+	videoDemux->Stop();
+	videoDemux->Close();
+}
+
+static void feeder_add_av(Feeder &f)
+{
+	f.Add("video", vpid);
+	if (apid)
+		f.Add("audio", apid);
+}
+
+/* wait for the zap started before to be reported, false on timeout */
+static bool wait_zap(unsigned int count, int timeout_ms)
+{
+	int64_t end = now_us() + (int64_t)timeout_ms * 1000;
+	while (hal_zap_count() == count)
+	{
+		if (now_us() > end)
+			return false;
+		usleep(1000);
+	}
+	return true;
+}
+
+/* reads sections from dmx until one with table_id arrives, false on timeout */
+static bool read_section(cDemux *dmx, unsigned char *buf, int len, unsigned char table_id)
+{
+	int64_t end = now_us() + 3000000;
+	while (now_us() < end)
+	{
+		if (dmx->Read(buf, len, 500) > 3 && buf[0] == table_id)
+			return true;
+	}
+	return false;
+}
+
+/* what the application does before it starts the decoders: read the PAT
+ * and then the PMT, false on timeout */
+static bool read_psi(Feeder &f, cDemux *dmx)
+{
+	unsigned char filter[DMX_FILTER_SIZE], mask[DMX_FILTER_SIZE];
+	unsigned char buf[4096];
+	memset(filter, 0, sizeof(filter));
+	memset(mask, 0, sizeof(mask));
+	mask[0] = 0xff;
+
+	filter[0] = 0x00;
+	dmx->sectionFilter(0, filter, mask, 1);
+	f.SetPSIPid(0);
+	if (!read_section(dmx, buf, sizeof(buf), 0x00))
+		return false;
+	int pmt = pmt_pid;
+	int sec_len = ((buf[1] & 0x0f) << 8) | buf[2];
+	/* the program loop is between the 8 byte header and the CRC */
+	for (int i = 8; pmt < 0 && i + 4 <= 3 + sec_len - 4; i += 4)
+	{
+		if (((buf[i] << 8) | buf[i + 1]) != 0)
+			pmt = ((buf[i + 2] & 0x1f) << 8) | buf[i + 3];
+	}
+	if (pmt < 0)
+		return false;
+
+	/* no PAT sections are written anymore after this, drain the rest
+	 * so that the next read gets the PMT */
+	f.SetPSIPid(-1);
+	while (dmx->Read(buf, sizeof(buf), 1) > 0)
+		;
+	filter[0] = 0x02;
+	dmx->sectionFilter(pmt, filter, mask, 1);
+	f.SetPSIPid(pmt);
+	bool ret = read_section(dmx, buf, sizeof(buf), 0x02);
+	f.SetPSIPid(-1);
+	return ret;
+}
+
+/* fed at in_rate, so that PAT and PMT come at their broadcast intervals */
+static void bench_zap(int runs, int64_t in_rate)
+{
+	for (int run = 0; run < runs; run++)
+	{
+		Feeder f(true, in_rate);
+		cDemux psi(0);
+		unsigned int count = hal_zap_count();
+		hal_zap_mark(HAL_ZAP_TUNE);
+		psi.Open(DMX_PSI_CHANNEL);
+		av_open();
+		f.AddPSI("psi");
+		feeder_add_av(f);
+		/* the A/V demuxes deliver nothing before they are started */
+		f.hold = true;
+		f.Start();
+		bool ok = read_psi(f, &psi);
+		f.hold = false;
+		if (ok)
+		{
+			av_start();
+			ok = wait_zap(count, 10000);
+		}
+		int ms[HAL_ZAP_MAX];
+		hal_zap_get_last(ms);
+		if (ok)
+			printf("{\"bench\":\"zap\",\"run\":%d,\"pat\":%d,\"pmt\":%d,\"vstart\":%d,\"iframe\":%d,\"display\":%d}\n",
+				run, ms[HAL_ZAP_PAT], ms[HAL_ZAP_PMT], ms[HAL_ZAP_VIDEO_START], ms[HAL_ZAP_IFRAME], ms[HAL_ZAP_DISPLAY]);
+		else
+			printf("{\"bench\":\"zap\",\"run\":%d,\"error\":\"timeout\"}\n", run);
+		fflush(stdout);
+		f.Stop();
+		av_stop();
+	}
+}
+
+static void bench_decode(void)
+{
+	Feeder f;
+	int64_t pts_first = 0, pts_last = 0;
+	av_open();
+	av_start();
+	feeder_add_av(f);
+	int64_t start = now_us();
+	f.Start();
+	while (!f.done)
+	{
+		usleep(10000);
+		int64_t pts;
+		videoDemux->getSTC(&pts);
+		if (!pts_first)
+			pts_first = pts;
+		if (pts)
+			pts_last = pts;
+	}
+	int64_t t = now_us() - start;
+	int64_t bytes = f.bytes;
+	f.Stop();
+	av_stop();
+	if (t < 1)
+		t = 1;
+	/* PTS wrap around is ignored, it is a benchmark after all */
+	printf("{\"bench\":\"decode\",\"ms\":%" PRId64 ",\"bytes\":%" PRId64 ",\"mbyte_per_s\":%.2f,\"stream_s\":%.2f,\"realtime\":%.2f}\n",
+		t / 1000, bytes, bytes / (double)t, (pts_last - pts_first) / 90000.0,
+		(pts_last - pts_first) / 90000.0 / (t / 1000000.0));
+	fflush(stdout);
+}
+
+/* the "disk": drains the pipe cRecord writes to at a given rate */
+struct slow_disk
+{
+	int fd;
+	int64_t rate;
+	int64_t bytes;
+};
+
+static void *slow_disk_thread(void *c)
+{
+	slow_disk *d = (slow_disk *)c;
+	unsigned char buf[0x10000];
+	int64_t start = now_us();
+	while (true)
+	{
+		ssize_t len = read(d->fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+		d->bytes += len;
+		if (d->rate)
+		{
+			int64_t ahead = d->bytes * 1000000 / d->rate - (now_us() - start);
+			if (ahead > 0)
+				usleep(ahead);
+		}
+	}
+	close(d->fd);
+	return NULL;
+}
+
+static bool record_failed;
+
+static void record_failure(void *)
+{
+	record_failed = true;
+}
+
+static void bench_record(int64_t in_rate, int64_t disk_rate)
+{
+	int p[2];
+	if (pipe(p))
+	{
+		perror("pipe");
+		return;
+	}
+	slow_disk d = { p[0], disk_rate, 0 };
+	pthread_t disk;
+	pthread_create(&disk, NULL, slow_disk_thread, &d);
+
+	record_failed = false;
+	cRecord rec;
+	rec.setFailureCallback(record_failure, NULL);
+	rec.Open();
+	unsigned short apids[1] = { apid };
+	Feeder f(false, in_rate);
+	int64_t start = now_us();
+	rec.Start(p[1], vpid, apids, apid ? 1 : 0);	/* takes ownership of p[1] */
+	f.Add("tp", vpid, apid);
+	f.Start();
+	while (!f.done && !record_failed)
+		usleep(10000);
+	int64_t t_in = now_us() - start;
+	int64_t bytes = f.bytes;
+	f.Stop();
+	int64_t stop = now_us();
+	rec.Stop();
+	stop = now_us() - stop;
+	pthread_join(disk, NULL);
+	int64_t t = now_us() - start;
+	printf("{\"bench\":\"record\",\"in_rate\":%" PRId64 ",\"disk_rate\":%" PRId64 ",\"bytes_in\":%" PRId64
+		",\"bytes_out\":%" PRId64 ",\"in_ms\":%" PRId64 ",\"stop_ms\":%" PRId64 ",\"mbyte_per_s\":%.2f,\"failed\":%s}\n",
+		in_rate, disk_rate, bytes, d.bytes, t_in / 1000, stop / 1000, d.bytes / (double)(t ? t : 1),
+		record_failed ? "true" : "false");
+	fflush(stdout);
+}
+
+static void bench_screenshot(int runs)
+{
+	static const struct
+	{
+		const char *name;
+		bool video;
+		bool osd;
+		bool scale;
+	} mode[] =
+	{
+		{ "video", true, false, false },
+		{ "osd", false, true, false },
+		{ "video+osd", true, true, false },
+		{ "video+osd-scaled", true, true, true }
+	};
+	Feeder f(true);
+	unsigned int count = hal_zap_count();
+	hal_zap_mark(HAL_ZAP_TUNE);
+	av_open();
+	av_start();
+	feeder_add_av(f);
+	f.Start();
+	if (!wait_zap(count, 10000))
+	{
+		printf("{\"bench\":\"screenshot\",\"error\":\"no picture\"}\n");
+		runs = 0;
+	}
+	for (unsigned int m = 0; m < sizeof(mode) / sizeof(mode[0]) && runs > 0; m++)
+	{
+		int64_t sum = 0, max = 0;
+		int xres = 0, yres = 0;
+		for (int run = 0; run < runs; run++)
+		{
+			unsigned char *data = NULL;
+			int64_t t = now_us();
+			if (!videoDecoder->GetScreenImage(data, xres, yres, mode[m].video, mode[m].osd, mode[m].scale))
+				data = NULL;
+			t = now_us() - t;
+			free(data);
+			sum += t;
+			if (t > max)
+				max = t;
+		}
+		printf("{\"bench\":\"screenshot\",\"mode\":\"%s\",\"runs\":%d,\"xres\":%d,\"yres\":%d,\"avg_us\":%" PRId64 ",\"max_us\":%" PRId64 "}\n",
+			mode[m].name, runs, xres, yres, sum / runs, max);
+	}
+	fflush(stdout);
+	f.Stop();
+	av_stop();
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr,
+		"usage: %s [options] file.ts\n"
+		"\t-v pid   video PID (required)\n"
+		"\t-a pid   audio PID (default: none)\n"
+		"\t-t type  video type, VIDEO_FORMAT (default 0 = MPEG2)\n"
+		"\t-T type  audio type, AUDIO_FORMAT (default 1 = MPEG)\n"
+		"\t-p pid   PMT PID for the zap benchmark (default: first program in the PAT)\n"
+		"\t-z n     number of zaps (default 10)\n"
+		"\t-s n     screenshots per mode (default 20)\n"
+		"\t-i rate  zap and recording input rate in kB/s (default 2048)\n"
+		"\t-d rate  recording disk rate in kB/s, 0 = unlimited (default 0)\n"
+		"\t-b list  benchmarks to run, any of zap,decode,record,screenshot (default all)\n",
+		me);
+}
+
+int main(int argc, char **argv)
+{
+	int zaps = 10, shots = 20;
+	int64_t in_rate = 2048 * 1024, disk_rate = 0;
+	std::string benches = "zap,decode,record,screenshot";
+	int c;
+	while ((c = getopt(argc, argv, "v:a:p:t:T:z:s:i:d:b:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'v': vpid = strtol(optarg, NULL, 0); break;
+			case 'a': apid = strtol(optarg, NULL, 0); break;
+			case 'p': pmt_pid = strtol(optarg, NULL, 0); break;
+			case 't': vtype = atoi(optarg); break;
+			case 'T': atype = atoi(optarg); break;
+			case 'z': zaps = atoi(optarg); break;
+			case 's': shots = atoi(optarg); break;
+			case 'i': in_rate = strtoll(optarg, NULL, 0) * 1024; break;
+			case 'd': disk_rate = strtoll(optarg, NULL, 0) * 1024; break;
+			case 'b': benches = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc - 1 || !vpid)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	ts_file = argv[optind];
+
+	char tmpl[] = "/tmp/stb-hal-bench.XXXXXX";
+	if (!mkdtemp(tmpl))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	fifo_dir = tmpl;
+	static const char *fifos[] = { "video", "audio", "tp", "psi" };
+	for (unsigned int i = 0; i < sizeof(fifos) / sizeof(fifos[0]); i++)
+	{
+		std::string path = fifo_dir + "/" + fifos[i];
+		if (mkfifo(path.c_str(), 0600))
+		{
+			perror(path.c_str());
+			return 1;
+		}
+	}
+	/* a decoder closing its FIFO early must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	/* must be set before the first cDemux is opened */
+	setenv("HAL_FAKE_DMX", tmpl, 1);
+
+	hal_api_init();
+	videoDemux = new cDemux(0);
+	audioDemux = new cDemux(0);
+	videoDecoder = new cVideo(0, NULL, NULL);
+	audioDecoder = new cAudio(NULL, NULL, NULL);
+
+	std::string list = "," + benches + ",";
+	if (list.find(",zap,") != std::string::npos)
+		bench_zap(zaps, in_rate);
+	if (list.find(",decode,") != std::string::npos)
+		bench_decode();
+	if (list.find(",record,") != std::string::npos)
+		bench_record(in_rate, disk_rate);
+	if (list.find(",screenshot,") != std::string::npos)
+		bench_screenshot(shots);
+
+	delete audioDecoder;
+	delete videoDecoder;
+	delete audioDemux;
+	delete videoDemux;
+	audioDecoder = NULL;
+	videoDecoder = NULL;
+	audioDemux = NULL;
+	videoDemux = NULL;
+	hal_api_exit();
+
+	for (unsigned int i = 0; i < sizeof(fifos) / sizeof(fifos[0]); i++)
+		unlink((fifo_dir + "/" + fifos[i]).c_str());
+	rmdir(tmpl);
+	return 0;
+}
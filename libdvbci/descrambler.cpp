@@ -10,8 +10,10 @@
 
 #include "misc.h"
 #include "descrambler.h"
+#include "sw_descrambler.h"
 
 #include <config.h>
+#include "dmx_hal.h"
 
 static const char *FILENAME = "[descrambler]";
 
@@ -64,6 +66,8 @@ int descrambler_set_key(int index, int parity, unsigned char *data)
 
 	printf("%s -> %s\n", FILENAME, __FUNCTION__);
 
+	sw_descrambler_set_key(index, parity, data);
+
 	if (descrambler_open())
 	{
 		//printf("Complete Data-> Index: (%d) Parity: (%d) -> ", index, parity);
@@ -156,6 +160,11 @@ int descrambler_set_pid(int index, int enable, int pid)
 
 	p.index = flags;
 	p.pid = pid;
+
+	/* the software descrambler picks up whatever the hardware does not get */
+	sw_descrambler_set_pid(index, enable, pid);
+	if (desc_fd < 0)
+		return 0;
 #else
 	p.index = index;
 	if (enable)
@@ -188,6 +197,10 @@ int descrambler_init(void)
 {
 	desc_user_count++;
 	descrambler_open();
+#if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
+	if (sw_descrambler_init())
+		cDemux::SetTSFilter(sw_descrambler_process);
+#endif
 	printf("%s -> %s %d\n", FILENAME, __FUNCTION__, desc_user_count);
 	return 0;
 }
@@ -147,12 +147,31 @@ LBL_ERR:
 
 /* DH */
 
-int dh_gen_exp(uint8_t *dest, int dest_len, uint8_t *dh_g, int dh_g_len, uint8_t *dh_p, int dh_p_len)
+static int bn_to_bin(uint8_t *dest, int dest_len, const BIGNUM *bn)
 {
-	DH *dh;
-	int len;
+	int len = BN_num_bytes(bn);
 	unsigned int gap;
 
+	if (len > dest_len)
+	{
+		printf("len > dest_len\n");
+		return -1;
+	}
+
+	gap = dest_len - len;
+	memset(dest, 0, gap);
+	BN_bn2bin(bn, &dest[gap]);
+
+	return 0;
+}
+
+/* generate a new private exponent and the matching public key, DH_generate_key
+ * computes both anyway, so there is no need for another dh_mod_exp() */
+int dh_gen_key(uint8_t *exp, int exp_len, uint8_t *pub, int pub_len, uint8_t *dh_g, int dh_g_len, uint8_t *dh_p, int dh_p_len)
+{
+	DH *dh;
+	int ret = -1;
+
 	dh = DH_new();
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -165,33 +184,25 @@ int dh_gen_exp(uint8_t *dest, int dest_len, uint8_t *dh_g, int dh_g_len, uint8_t
 	DH_set0_pqg(dh, p, NULL, g);
 #endif
 
-	DH_generate_key(dh);
-
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-	len = BN_num_bytes(dh->priv_key);
-#else
-	const BIGNUM *pub_key, *priv_key;
-	DH_get0_key(dh, &pub_key, &priv_key);
-	len = BN_num_bytes(priv_key);
-#endif
-	if (len > dest_len)
+	if (DH_generate_key(dh) != 1)
 	{
-		printf("len > dest_len\n");
+		printf("DH_generate_key failed\n");
+		DH_free(dh);
 		return -1;
 	}
 
-	gap = dest_len - len;
-	memset(dest, 0, gap);
-
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-	BN_bn2bin(dh->priv_key, &dest[gap]);
+	const BIGNUM *pub_key = dh->pub_key, *priv_key = dh->priv_key;
 #else
-	BN_bn2bin(priv_key, &dest[gap]);
+	const BIGNUM *pub_key, *priv_key;
+	DH_get0_key(dh, &pub_key, &priv_key);
 #endif
+	if (!bn_to_bin(exp, exp_len, priv_key) && !bn_to_bin(pub, pub_len, pub_key))
+		ret = 0;
 
 	DH_free(dh);
 
-	return 0;
+	return ret;
 }
 
 /* dest = base ^ exp % mod */
@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <openssl/pem.h>
 #include <openssl/x509.h>
@@ -49,18 +50,36 @@ static void get_authdata_filename(char *dest, size_t len, unsigned int slot)
 	CheckFile(dest);
 }
 
-static bool get_authdata(uint8_t *host_id, uint8_t *dhsk, uint8_t *akh, unsigned int slot, unsigned int index)
+/* the file is only read once per slot and kept in memory, the CAM asks
+ * for up to 5 AKHs on every insertion */
+#define AUTHDATA_ENTRIES 5
+#define AUTHDATA_SIZE (8 + 256 + 32)
+#define AUTHDATA_SLOTS 8
+
+struct authdata
+{
+	bool loaded;
+	unsigned int entries;
+	uint8_t data[AUTHDATA_ENTRIES][AUTHDATA_SIZE];
+};
+
+static struct authdata authdata_cache[AUTHDATA_SLOTS];
+
+static struct authdata *authdata_load(unsigned int slot)
 {
 	char filename[FILENAME_MAX];
+	struct authdata *a;
 	int fd;
-	uint8_t chunk[8 + 256 + 32];
-	unsigned int i;
 
-	printf("%s -> %s\n", FILENAME, __FUNCTION__);
+	if (slot >= AUTHDATA_SLOTS)
+		return NULL;
 
-	/* 5 pairs of data only */
-	if (index > 5)
-		return false;
+	a = &authdata_cache[slot];
+	if (a->loaded)
+		return a;
+
+	a->loaded = true;
+	a->entries = 0;
 
 	get_authdata_filename(filename, sizeof(filename), slot);
 
@@ -68,30 +87,30 @@ static bool get_authdata(uint8_t *host_id, uint8_t *dhsk, uint8_t *akh, unsigned
 	if (fd <= 0)
 	{
 		fprintf(stderr, "cannot open %s\n", filename);
-		return false;
+		return a;
 	}
 
-	for (i = 0; i < 5; i++)
-	{
-		if (read(fd, chunk, sizeof(chunk)) != sizeof(chunk))
-		{
-			fprintf(stderr, "cannot read auth_data\n");
-			close(fd);
-			return false;
-		}
-
-		if (i == index)
-		{
-			memcpy(host_id, chunk, 8);
-			memcpy(dhsk, &chunk[8], 256);
-			memcpy(akh, &chunk[8 + 256], 32);
-			close(fd);
-			return true;
-		}
-	}
+	while (a->entries < AUTHDATA_ENTRIES && read(fd, a->data[a->entries], AUTHDATA_SIZE) == AUTHDATA_SIZE)
+		a->entries++;
 
 	close(fd);
-	return false;
+	return a;
+}
+
+static bool get_authdata(uint8_t *host_id, uint8_t *dhsk, uint8_t *akh, unsigned int slot, unsigned int index)
+{
+	struct authdata *a;
+
+	printf("%s -> %s\n", FILENAME, __FUNCTION__);
+
+	a = authdata_load(slot);
+	if (!a || index >= a->entries)
+		return false;
+
+	memcpy(host_id, a->data[index], 8);
+	memcpy(dhsk, &a->data[index][8], 256);
+	memcpy(akh, &a->data[index][8 + 256], 32);
+	return true;
 }
 
 static bool write_authdata(unsigned int slot, const uint8_t *host_id, const uint8_t *dhsk, const uint8_t *akh)
@@ -99,27 +118,32 @@ static bool write_authdata(unsigned int slot, const uint8_t *host_id, const uint
 	printf("%s -> %s\n", FILENAME, __FUNCTION__);
 
 	char filename[FILENAME_MAX];
-	int fd;
-	uint8_t buf[(8 + 256 + 32) * 5];
-	unsigned int entries;
+	struct authdata *a;
 	unsigned int i;
-	bool ret = false;
+	int fd;
 
-	for (entries = 0; entries < 5; entries++)
-	{
-		int offset = (8 + 256 + 32) * entries;
-		if (!get_authdata(&buf[offset], &buf[offset + 8], &buf[offset + 8 + 256], slot, entries))
-			break;
+	a = authdata_load(slot);
+	if (!a)
+		return false;
 
-		/* check if we got this pair already */
-		if (!memcmp(&buf[offset + 8 + 256], akh, 32))
+	/* check if we got this pair already */
+	for (i = 0; i < a->entries; i++)
+	{
+		if (!memcmp(&a->data[i][8 + 256], akh, 32))
 		{
 			printf("data already stored\n");
 			return true;
 		}
 	}
 
-	//printf("got %d entries\n", entries);
+	/* store new entry first, skip the last one if exists */
+	if (a->entries > 3)
+		a->entries = 3;
+	memmove(a->data[1], a->data[0], a->entries * AUTHDATA_SIZE);
+	memcpy(a->data[0], host_id, 8);
+	memcpy(&a->data[0][8], dhsk, 256);
+	memcpy(&a->data[0][8 + 256], akh, 32);
+	a->entries++;
 
 	get_authdata_filename(filename, sizeof(filename), slot);
 
@@ -130,44 +154,15 @@ static bool write_authdata(unsigned int slot, const uint8_t *host_id, const uint
 		return false;
 	}
 
-	/* store new entry first */
-	if (write(fd, host_id, 8) != 8)
-	{
-		fprintf(stderr, "error in write\n");
-		goto end;
-	}
-
-	if (write(fd, dhsk, 256) != 256)
-	{
-		fprintf(stderr, "error in write\n");
-		goto end;
-	}
-
-	if (write(fd, akh, 32) != 32)
+	if (write(fd, a->data, a->entries * AUTHDATA_SIZE) != (ssize_t)(a->entries * AUTHDATA_SIZE))
 	{
 		fprintf(stderr, "error in write\n");
-		goto end;
-	}
-
-	/* skip the last one if exists */
-	if (entries > 3)
-		entries = 3;
-
-	for (i = 0; i < entries; i++)
-	{
-		int offset = (8 + 256 + 32) * i;
-		if (write(fd, &buf[offset], (8 + 256 + 32)) != (8 + 256 + 32))
-		{
-			fprintf(stderr, "error in write\n");
-			goto end;
-		}
+		close(fd);
+		return false;
 	}
 
-	ret = true;
-end:
 	close(fd);
-
-	return ret;
+	return true;
 }
 
 /* CI+ certificates */
@@ -280,13 +275,14 @@ static X509 *certificate_load_and_check(struct cert_ctx *ctx, const char *filena
 		if (!ctx->store)
 		{
 			fprintf(stderr, "cannot create cert_store\n");
-			exit(-1);
+			return NULL;
 		}
 
 		if (X509_STORE_load_locations(ctx->store, filename, NULL) != 1)
 		{
 			fprintf(stderr, "load of first certificate (root_ca) failed\n");
-			exit(-1);
+			X509_STORE_free(ctx->store);
+			ctx->store = NULL;
 		}
 
 		return NULL;
@@ -340,6 +336,204 @@ static X509 *certificate_import_and_check(struct cert_ctx *ctx, const uint8_t *d
 	return cert;
 }
 
+/* CI+ crypto worker
+ *
+ * Loading and verifying the host certificates and generating a DH key pair
+ * takes seconds on the slower boxes. Both do not depend on anything the CAM
+ * sends, so a worker thread does it ahead of time: the host credentials are
+ * loaded once and kept, and a few DH key pairs are kept in stock. What is
+ * left for the CI thread is the signature over the CAM's nonce and the DHSK. */
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct host_creds
+{
+	bool ok;
+	X509 *root_cert;
+	X509 *cust_cert;
+	X509 *device_cert;
+	RSA *rsa_device_key;
+};
+
+static struct host_creds host_creds;
+static pthread_mutex_t host_creds_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void host_creds_free(void)
+{
+	if (host_creds.root_cert)
+		X509_free(host_creds.root_cert);
+	if (host_creds.cust_cert)
+		X509_free(host_creds.cust_cert);
+	if (host_creds.device_cert)
+		X509_free(host_creds.device_cert);
+	if (host_creds.rsa_device_key)
+		RSA_free(host_creds.rsa_device_key);
+	memset(&host_creds, 0, sizeof(host_creds));
+}
+
+/* called with host_creds_mutex held */
+static void host_creds_load(void)
+{
+	struct cert_ctx ctx;
+	int64_t start = now_us();
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	/* verify the chain once */
+	certificate_load_and_check(&ctx, ROOT_CERT);
+	if (!ctx.store)
+	{
+		printf("%s host certificates failed, will retry\n", FILENAME);
+		return;
+	}
+	host_creds.cust_cert = certificate_load_and_check(&ctx, CUSTOMER_CERT);
+	host_creds.device_cert = certificate_load_and_check(&ctx, DEVICE_CERT);
+	X509_STORE_free(ctx.store);
+
+	host_creds.root_cert = certificate_open(ROOT_CERT);
+	host_creds.rsa_device_key = rsa_privatekey_open(DEVICE_CERT);
+
+	host_creds.ok = host_creds.root_cert && host_creds.cust_cert && host_creds.device_cert && host_creds.rsa_device_key;
+	printf("%s host certificates %s (%lld ms)\n", FILENAME, host_creds.ok ? "loaded" : "failed, will retry",
+		(long long)(now_us() - start) / 1000);
+	/* e.g. not readable yet at boot: try again with the next session */
+	if (!host_creds.ok)
+		host_creds_free();
+}
+
+/* the credentials are kept once they were loaded successfully, they
+ * are never freed then, sessions use them without holding the mutex */
+static struct host_creds *host_creds_get(void)
+{
+	struct host_creds *ret;
+
+	pthread_mutex_lock(&host_creds_mutex);
+	if (!host_creds.ok)
+		host_creds_load();
+	ret = host_creds.ok ? &host_creds : NULL;
+	pthread_mutex_unlock(&host_creds_mutex);
+	return ret;
+}
+
+/* a fresh store per session, so that the certificates of one CAM are not
+ * trusted for another one */
+static struct cert_ctx *cert_ctx_new(struct host_creds *creds)
+{
+	struct cert_ctx *ctx = (struct cert_ctx *)calloc(1, sizeof(struct cert_ctx));
+
+	ctx->store = X509_STORE_new();
+	X509_STORE_add_cert(ctx->store, creds->root_cert);
+	X509_STORE_add_cert(ctx->store, creds->cust_cert);
+	X509_STORE_add_cert(ctx->store, creds->device_cert);
+	ctx->cust_cert = creds->cust_cert;
+	ctx->device_cert = creds->device_cert;
+
+	return ctx;
+}
+
+static void cert_ctx_free(struct cert_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	/* host certificates belong to host_creds */
+	if (ctx->ci_cust_cert)
+		X509_free(ctx->ci_cust_cert);
+	if (ctx->ci_device_cert)
+		X509_free(ctx->ci_device_cert);
+	X509_STORE_free(ctx->store);
+	free(ctx);
+}
+
+#define DH_POOL_SIZE 2
+
+struct dh_keypair
+{
+	uint8_t exp[256];
+	uint8_t dhph[256];	/* dh_g ^ exp % dh_p */
+};
+
+static struct dh_keypair dh_pool[DH_POOL_SIZE];
+static int dh_pool_count = 0;
+static bool dh_worker_running = false;
+static pthread_mutex_t dh_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dh_pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void *crypto_worker(void *)
+{
+	struct dh_keypair kp;
+
+	host_creds_get();
+	while (true)
+	{
+		pthread_mutex_lock(&dh_pool_mutex);
+		while (dh_pool_count >= DH_POOL_SIZE)
+			pthread_cond_wait(&dh_pool_cond, &dh_pool_mutex);
+		pthread_mutex_unlock(&dh_pool_mutex);
+
+		int64_t start = now_us();
+		if (dh_gen_key(kp.exp, sizeof(kp.exp), kp.dhph, sizeof(kp.dhph), dh_g, sizeof(dh_g), dh_p, sizeof(dh_p)))
+		{
+			sleep(1);
+			continue;
+		}
+		printf("%s DH key pair precomputed (%lld ms)\n", FILENAME, (long long)(now_us() - start) / 1000);
+
+		pthread_mutex_lock(&dh_pool_mutex);
+		dh_pool[dh_pool_count++] = kp;
+		pthread_mutex_unlock(&dh_pool_mutex);
+	}
+	return NULL;
+}
+
+static void crypto_worker_start(void)
+{
+	pthread_t thread;
+
+	pthread_mutex_lock(&dh_pool_mutex);
+	if (!dh_worker_running)
+	{
+		if (pthread_create(&thread, NULL, crypto_worker, NULL) == 0)
+		{
+			pthread_detach(thread);
+			dh_worker_running = true;
+		}
+		else
+			printf("%s cannot start crypto worker\n", FILENAME);
+	}
+	pthread_mutex_unlock(&dh_pool_mutex);
+}
+
+/* take a precomputed key pair, or compute one if the stock is empty.
+ * Returns 0 on success, -1 if no key pair could be generated */
+static int dh_keypair_get(struct dh_keypair *kp, bool *precomputed)
+{
+	*precomputed = false;
+
+	pthread_mutex_lock(&dh_pool_mutex);
+	if (dh_pool_count > 0)
+	{
+		*kp = dh_pool[--dh_pool_count];
+		memset(&dh_pool[dh_pool_count], 0, sizeof(struct dh_keypair));
+		*precomputed = true;
+	}
+	pthread_cond_signal(&dh_pool_cond);
+	pthread_mutex_unlock(&dh_pool_mutex);
+
+	if (!*precomputed &&
+		dh_gen_key(kp->exp, sizeof(kp->exp), kp->dhph, sizeof(kp->dhph), dh_g, sizeof(dh_g), dh_p, sizeof(dh_p)))
+	{
+		memset(kp, 0, sizeof(*kp));
+		return -1;
+	}
+
+	return 0;
+}
+
 /* CI+ credentials */
 
 #define MAX_ELEMENTS    33
@@ -391,6 +585,13 @@ struct cc_ctrl_data
 
 	/* private key of device-cert */
 	RSA *rsa_device_key;
+
+	/* authentication phases (monotonic us), reported with the first key */
+	int64_t t_open;
+	int64_t t_nonce;
+	int64_t t_dhsk;
+	int64_t t_sac;
+	bool timing_reported;
 };
 
 static struct element *element_get(struct cc_ctrl_data *cc_data, unsigned int id)
@@ -794,6 +995,7 @@ static bool check_dh_challenge(struct cc_ctrl_data *cc_data)
 
 	/* calculate DHSK - DHSK = DHPM ^ dh_exp % dh_p */
 	dh_mod_exp(cc_data->dhsk, 256, element_get_ptr(cc_data, 14), 256, dh_p, sizeof(dh_p), cc_data->dh_exp, 256);
+	cc_data->t_dhsk = now_us();
 
 	/* gen AKH */
 	generate_akh(cc_data);
@@ -809,70 +1011,64 @@ static bool check_dh_challenge(struct cc_ctrl_data *cc_data)
 
 static int restart_dh_challenge(struct cc_ctrl_data *cc_data)
 {
-	uint8_t dhph[256], sign_A[256];
-	struct cert_ctx *ctx;
+	uint8_t sign_A[256];
+	struct host_creds *creds;
+	struct dh_keypair kp;
 
 	printf("%s -> %s\n", FILENAME, __FUNCTION__);
 
-	if (!cc_data->cert_ctx)
-	{
-		ctx = (struct cert_ctx *)calloc(1, sizeof(struct cert_ctx));
-		cc_data->cert_ctx = ctx;
-	}
-	else
-	{
-		ctx = cc_data->cert_ctx;
-	}
-
-	/* load certificates and device key */
-	certificate_load_and_check(ctx, ROOT_CERT);
-	ctx->cust_cert = certificate_load_and_check(ctx, CUSTOMER_CERT);
-	ctx->device_cert = certificate_load_and_check(ctx, DEVICE_CERT);
+	cc_data->t_nonce = now_us();
 
-	if (!ctx->cust_cert || !ctx->device_cert)
+	/* certificates and device key are loaded once */
+	creds = host_creds_get();
+	if (!creds)
 	{
 		fprintf(stderr, "cannot loader certificates\n");
 		return -1;
 	}
 
+	if (!cc_data->cert_ctx)
+		cc_data->cert_ctx = cert_ctx_new(creds);
+	cc_data->rsa_device_key = creds->rsa_device_key;
+
 	/* add data to element store */
-	if (!element_set_certificate(cc_data, 7, ctx->cust_cert))
+	if (!element_set_certificate(cc_data, 7, creds->cust_cert))
 		fprintf(stderr, "cannot store cert in elements\n");
 
-	if (!element_set_certificate(cc_data, 15, ctx->device_cert))
+	if (!element_set_certificate(cc_data, 15, creds->device_cert))
 		fprintf(stderr, "cannot store cert in elements\n");
 
-	if (!element_set_hostid_from_certificate(cc_data, 5, ctx->device_cert))
+	if (!element_set_hostid_from_certificate(cc_data, 5, creds->device_cert))
 		fprintf(stderr, "cannot set hostid in elements\n");
 
-	cc_data->rsa_device_key = rsa_privatekey_open(DEVICE_CERT);
-	if (!cc_data->rsa_device_key)
-	{
-		fprintf(stderr, "cannot read private key\n");
-		return -1;
-	}
-
 	/* invalidate elements */
 	element_invalidate(cc_data, 6);
 	element_invalidate(cc_data, 14);
 	element_invalidate(cc_data, 18);
 	element_invalidate(cc_data, 22); /* this will refuse a unknown cam */
 
-	/* new dh_exponent */
-	dh_gen_exp(cc_data->dh_exp, 256, dh_g, sizeof(dh_g), dh_p, sizeof(dh_p));
-
-	/* new DHPH  - DHPH = dh_g ^ dh_exp % dh_p */
-	dh_mod_exp(dhph, sizeof(dhph), dh_g, sizeof(dh_g), dh_p, sizeof(dh_p), cc_data->dh_exp, 256);
+	/* new dh_exponent and DHPH - DHPH = dh_g ^ dh_exp % dh_p */
+	bool precomputed;
+	if (dh_keypair_get(&kp, &precomputed))
+	{
+		fprintf(stderr, "cannot generate DH key pair\n");
+		return -1;
+	}
+	memcpy(cc_data->dh_exp, kp.exp, sizeof(cc_data->dh_exp));
 
 	/* store DHPH */
-	element_set(cc_data, 13, dhph, sizeof(dhph));
+	element_set(cc_data, 13, kp.dhph, sizeof(kp.dhph));
 
 	/* create Signature_A */
-	dh_dhph_signature(sign_A, element_get_ptr(cc_data, 19), dhph, cc_data->rsa_device_key);
+	dh_dhph_signature(sign_A, element_get_ptr(cc_data, 19), kp.dhph, cc_data->rsa_device_key);
+	memset(&kp, 0, sizeof(kp));
 
 	/* store Signature_A */
 	element_set(cc_data, 17, sign_A, sizeof(sign_A));
 
+	printf("%s DH challenge answered in %lld ms (%s key pair)\n", FILENAME,
+		(long long)(now_us() - cc_data->t_nonce) / 1000, precomputed ? "precomputed" : "new");
+
 	return 0;
 }
 
@@ -933,6 +1129,20 @@ static void check_new_key(struct cc_ctrl_data *cc_data)
 	}
 	cc_data->slot->lastParity = slot;
 
+	if (!cc_data->timing_reported)
+	{
+		int64_t now = now_us();
+		cc_data->timing_reported = true;
+		/* no DHSK means the CAM accepted a stored AKH */
+		printf("%s slot %d CI+ authentication [ms]: nonce %lld, DHSK %lld, SAC %lld, first key %lld (%s)\n",
+			FILENAME, cc_data->slot->slot,
+			cc_data->t_nonce ? (long long)(cc_data->t_nonce - cc_data->t_open) / 1000 : -1LL,
+			cc_data->t_dhsk ? (long long)(cc_data->t_dhsk - cc_data->t_open) / 1000 : -1LL,
+			cc_data->t_sac ? (long long)(cc_data->t_sac - cc_data->t_open) / 1000 : -1LL,
+			(long long)(now - cc_data->t_open) / 1000,
+			cc_data->t_dhsk ? "full authentication" : "stored AKH");
+	}
+
 	if (cc_data->slot->scrambled)
 		cc_data->slot->ccmgrSession->resendKey(cc_data->slot);
 
@@ -970,6 +1180,8 @@ static int data_get_handle_new(struct cc_ctrl_data *cc_data, unsigned int id)
 			generate_ns_host(cc_data);
 			generate_key_seed(cc_data);
 			generate_SAK_SEK(cc_data->sak, cc_data->sek, cc_data->ks_host);
+			if (!cc_data->t_sac)
+				cc_data->t_sac = now_us();
 			break;
 		/* SAC data messages */
 		case 6:                 //CICAM_id
@@ -1119,6 +1331,7 @@ bool eDVBCIContentControlManagerSession::data_initialize(eDVBCISlot *tslot)
 
 	/* parent */
 	data->slot = tslot;
+	data->t_open = now_us();
 
 	/* clear storage of credentials */
 	element_init(data);
@@ -1340,6 +1553,8 @@ eDVBCIContentControlManagerSession::eDVBCIContentControlManagerSession(eDVBCISlo
 	slot->hasCCManager = true;
 	slot->ccmgrSession = this;
 	descrambler_init();
+	/* get the host certificates and DH keys ready before the CAM asks */
+	crypto_worker_start();
 }
 
 eDVBCIContentControlManagerSession::~eDVBCIContentControlManagerSession()
@@ -1355,6 +1570,9 @@ void eDVBCIContentControlManagerSession::ci_ccmgr_doClose(eDVBCISlot *tslot)
 
 	descrambler_deinit();
 
+	if (!data)
+		return;
+	cert_ctx_free(data->cert_ctx);
 	element_init(data);
 	free(data);
 	tslot->private_data = NULL;
@@ -1427,14 +1645,11 @@ void eDVBCIContentControlManagerSession::resendKey(eDVBCISlot *tslot)
 #if HAVE_ARM_HARDWARE || HAVE_MIPS_HARDWARE
 		if (slot->newPids)
 		{
-			if (slot->pids.size())
-			{
-				if (descrambler_open())
-				{
-					for (unsigned int i = 0; i < slot->pids.size(); i++)
-						descrambler_set_pid((int)tslot->slot, 1, (int) slot->pids[i]);
-				}
-			}
+			/* set the pids even without /dev/ciplus_ca0,
+			 * the software descrambler needs them too */
+			descrambler_open();
+			for (unsigned int i = 0; i < slot->pids.size(); i++)
+				descrambler_set_pid((int)tslot->slot, 1, (int) slot->pids[i]);
 			slot->newPids = false;
 		}
 		descrambler_set_key((int)tslot->slot, tslot->lastParity, tslot->lastKey);
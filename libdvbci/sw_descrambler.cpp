@@ -0,0 +1,339 @@
+/* software CI+ TS descrambler
+ *
+ * CI+ scrambles the TS packet payload with AES-128-CBC, the IV is reset for
+ * every packet and a residual of less than 16 bytes is left in the clear.
+ * Packets which are still scrambled when they are read from a TP demux
+ * (i.e. the hardware descrambler had no slot for their PID) are descrambled
+ * here with the keys the CAM sent for the slot the PID belongs to.
+ *
+ * Decryption goes through EVP, which uses AES-NI resp. the ARMv8 crypto
+ * extensions if the CPU has them. Big reads are split across a few worker
+ * threads, every packet is independent.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+
+#include "sw_descrambler.h"
+
+static const char *FILENAME = "[sw_descrambler]";
+
+#define TS_SIZE 188
+#define SW_DESCR_INDEXES 8
+#define SW_DESCR_MAX_WORKERS 3
+/* below that, waking up the workers costs more than it saves */
+#define SW_DESCR_MIN_BATCH 128
+
+struct sw_key
+{
+	unsigned char key[16];
+	unsigned char iv[16];
+	unsigned int version;	/* 0 = no key */
+};
+
+static pthread_mutex_t key_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sw_key keys[SW_DESCR_INDEXES][2];
+static signed char pid_index[8192];
+static bool have_keys = false;
+static bool sw_ok = false;
+
+/* the EVP contexts with the expanded keys are per thread */
+struct sw_ctx
+{
+	EVP_CIPHER_CTX *ctx[SW_DESCR_INDEXES][2];
+	unsigned int version[SW_DESCR_INDEXES][2];
+};
+
+static pthread_key_t ctx_key;
+
+static void sw_ctx_free(void *p)
+{
+	struct sw_ctx *c = (struct sw_ctx *)p;
+	for (int i = 0; i < SW_DESCR_INDEXES; i++)
+		for (int j = 0; j < 2; j++)
+			if (c->ctx[i][j])
+				EVP_CIPHER_CTX_free(c->ctx[i][j]);
+	free(c);
+}
+
+static struct sw_ctx *sw_ctx_get(void)
+{
+	struct sw_ctx *c = (struct sw_ctx *)pthread_getspecific(ctx_key);
+	if (!c)
+	{
+		c = (struct sw_ctx *)calloc(1, sizeof(struct sw_ctx));
+		pthread_setspecific(ctx_key, c);
+	}
+	return c;
+}
+
+/* a snapshot of the key table, taken once per call */
+struct sw_batch
+{
+	unsigned char *buf;
+	int packets;
+	struct sw_key keys[SW_DESCR_INDEXES][2];
+	signed char *pid_index;
+};
+
+static int descramble_packets(const struct sw_batch *b, unsigned char *p, int packets)
+{
+	struct sw_ctx *c = sw_ctx_get();
+	int done = 0;
+
+	if (!c)
+		return 0;
+
+	for (int n = 0; n < packets; n++, p += TS_SIZE)
+	{
+		if (p[0] != 0x47 || !(p[3] & 0x80) || !(p[3] & 0x10))
+			continue; /* no sync, not scrambled or no payload */
+		int pid = ((p[1] & 0x1f) << 8) | p[2];
+		int index = b->pid_index[pid];
+		if (index < 0)
+			continue;
+		int parity = (p[3] & 0x40) ? 1 : 0;
+		const struct sw_key *k = &b->keys[index][parity];
+		if (!k->version)
+			continue;
+
+		int off = 4;
+		if (p[3] & 0x20)
+			off += 1 + p[4];
+		if (off >= TS_SIZE)
+			continue;
+		int len = (TS_SIZE - off) & ~15;
+
+		EVP_CIPHER_CTX *ctx = c->ctx[index][parity];
+		if (!ctx || c->version[index][parity] != k->version)
+		{
+			if (!ctx)
+				ctx = c->ctx[index][parity] = EVP_CIPHER_CTX_new();
+			if (!ctx || !EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, k->key, k->iv))
+				continue;
+			EVP_CIPHER_CTX_set_padding(ctx, 0);
+			c->version[index][parity] = k->version;
+		}
+		else if (!EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, k->iv)) /* reset the IV */
+			continue;
+
+		int outl;
+		if (len > 0 && !EVP_DecryptUpdate(ctx, p + off, &outl, p + off, len))
+			continue;
+		p[3] &= 0x3f; /* clear transport_scrambling_control */
+		done++;
+	}
+	return done;
+}
+
+/* worker threads */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;	/* owner of the worker pool */
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int num_workers = 0;
+static unsigned int work_gen = 0;
+static int work_pending = 0;
+static int work_done = 0;
+static const struct sw_batch *work_batch;
+
+static void *sw_worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	unsigned int gen = 0;
+
+	while (true)
+	{
+		pthread_mutex_lock(&work_mutex);
+		while (work_gen == gen)
+			pthread_cond_wait(&work_cond, &work_mutex);
+		gen = work_gen;
+		const struct sw_batch *b = work_batch;
+		pthread_mutex_unlock(&work_mutex);
+
+		/* the caller does part 0, worker id does part id + 1 */
+		int parts = num_workers + 1;
+		int per = (b->packets + parts - 1) / parts;
+		int first = per * (id + 1);
+		int n = b->packets - first;
+		if (n > per)
+			n = per;
+		int done = (n > 0) ? descramble_packets(b, b->buf + first * TS_SIZE, n) : 0;
+
+		pthread_mutex_lock(&work_mutex);
+		work_done += done;
+		if (--work_pending == 0)
+			pthread_cond_signal(&done_cond);
+		pthread_mutex_unlock(&work_mutex);
+	}
+	return NULL;
+}
+
+/* AES-128-CBC known answer test from NIST SP 800-38A F.2.2, packed into a
+ * scrambled TS packet with a 4 byte residual which must stay untouched */
+static bool sw_descrambler_selftest(void)
+{
+	static const unsigned char key[16] =
+	{
+		0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+	};
+	static const unsigned char iv[16] =
+	{
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+	};
+	static const unsigned char cipher[64] =
+	{
+		0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+		0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+		0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+		0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7
+	};
+	static const unsigned char plain[64] =
+	{
+		0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+		0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+		0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+		0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+	};
+	static signed char test_pid_index[8192];
+	struct sw_batch b;
+	unsigned char p[TS_SIZE];
+	const int afl = TS_SIZE - 4 - 1 - 64 - 4;
+
+	memset(test_pid_index, -1, sizeof(test_pid_index));
+	test_pid_index[0x100] = 0;
+	memset(&b, 0, sizeof(b));
+	memcpy(b.keys[0][1].key, key, 16);
+	memcpy(b.keys[0][1].iv, iv, 16);
+	b.keys[0][1].version = 1;
+	b.pid_index = test_pid_index;
+
+	p[0] = 0x47;
+	p[1] = 0x01;
+	p[2] = 0x00;	/* PID 0x100 */
+	p[3] = 0xf0;	/* odd key, adaptation field and payload */
+	p[4] = afl;
+	memset(p + 5, 0xff, afl);
+	memcpy(p + 5 + afl, cipher, 64);
+	memcpy(p + TS_SIZE - 4, "\x01\x02\x03\x04", 4);
+
+	if (descramble_packets(&b, p, 1) != 1)
+		return false;
+	return p[3] == 0x30 && !memcmp(p + 5 + afl, plain, 64) && !memcmp(p + TS_SIZE - 4, "\x01\x02\x03\x04", 4);
+}
+
+bool sw_descrambler_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct init
+	{
+		static void run(void)
+		{
+			memset(pid_index, -1, sizeof(pid_index));
+			pthread_key_create(&ctx_key, sw_ctx_free);
+			if (getenv("HAL_NOSWDESCRAMBLER"))
+			{
+				printf("%s disabled by HAL_NOSWDESCRAMBLER\n", FILENAME);
+				return;
+			}
+			if (!sw_descrambler_selftest())
+			{
+				printf("%s self test failed, disabled\n", FILENAME);
+				return;
+			}
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			int want = (cpus > 1) ? cpus - 1 : 0;
+			if (want > SW_DESCR_MAX_WORKERS)
+				want = SW_DESCR_MAX_WORKERS;
+			for (int i = 0; i < want; i++)
+			{
+				pthread_t t;
+				if (pthread_create(&t, NULL, sw_worker, (void *)(intptr_t)i))
+					break;
+				pthread_detach(t);
+				num_workers++;
+			}
+			sw_ok = true;
+			printf("%s ready, %d worker threads\n", FILENAME, num_workers);
+		}
+	};
+	pthread_once(&once, init::run);
+	return sw_ok;
+}
+
+void sw_descrambler_set_key(int index, int parity, const unsigned char *data)
+{
+	if (index < 0 || index >= SW_DESCR_INDEXES || parity < 0 || parity > 1)
+		return;
+	pthread_mutex_lock(&key_mutex);
+	struct sw_key *k = &keys[index][parity];
+	memcpy(k->key, data, 16);
+	memcpy(k->iv, data + 16, 16);
+	if (++k->version == 0)
+		k->version = 1;
+	have_keys = true;
+	pthread_mutex_unlock(&key_mutex);
+}
+
+void sw_descrambler_set_pid(int index, int enable, int pid)
+{
+	if (index < 0 || index >= SW_DESCR_INDEXES || pid < 0 || pid > 0x1fff)
+		return;
+	pthread_mutex_lock(&key_mutex);
+	if (enable)
+		pid_index[pid] = index;
+	else if (pid_index[pid] == index)
+		pid_index[pid] = -1;
+	pthread_mutex_unlock(&key_mutex);
+}
+
+int sw_descrambler_process(unsigned char *buf, int len)
+{
+	signed char pid_snapshot[8192];
+	struct sw_batch b;
+	int packets = len / TS_SIZE;
+	int done;
+
+	if (!sw_ok || !have_keys || packets <= 0)
+		return 0;
+
+	/* each caller works on its own snapshot, concurrent readers only
+	 * share key_mutex for the copy */
+	pthread_mutex_lock(&key_mutex);
+	memcpy(b.keys, keys, sizeof(b.keys));
+	memcpy(pid_snapshot, pid_index, sizeof(pid_snapshot));
+	pthread_mutex_unlock(&key_mutex);
+	b.buf = buf;
+	b.packets = packets;
+	b.pid_index = pid_snapshot;
+
+	/* small reads, or the pool is busy with another reader's batch:
+	 * descramble in the calling thread instead of waiting for the pool */
+	if (num_workers == 0 || packets < SW_DESCR_MIN_BATCH || pthread_mutex_trylock(&pool_mutex))
+		return descramble_packets(&b, buf, packets);
+
+	pthread_mutex_lock(&work_mutex);
+	work_batch = &b;
+	work_pending = num_workers;
+	work_done = 0;
+	work_gen++;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+
+	int per = (packets + num_workers) / (num_workers + 1);
+	done = descramble_packets(&b, buf, per);
+
+	pthread_mutex_lock(&work_mutex);
+	while (work_pending)
+		pthread_cond_wait(&done_cond, &work_mutex);
+	done += work_done;
+	pthread_mutex_unlock(&work_mutex);
+
+	pthread_mutex_unlock(&pool_mutex);
+	return done;
+}
@@ -0,0 +1,14 @@
+#ifndef __SW_DESCR_H_
+#define __SW_DESCR_H_
+
+/* software AES-128-CBC TS descrambler, used for packets the hardware
+ * descrambler did not handle (no free slot, no /dev/ciplus_ca0) */
+
+bool sw_descrambler_init(void);
+/* data: byte 0 to 15 are the AES key, byte 16 to 31 the IV */
+void sw_descrambler_set_key(int index, int parity, const unsigned char *data);
+void sw_descrambler_set_pid(int index, int enable, int pid);
+/* descramble whole TS packets in place, returns the number of packets descrambled */
+int sw_descrambler_process(unsigned char *buf, int len);
+
+#endif
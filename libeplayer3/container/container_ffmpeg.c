@@ -51,6 +51,9 @@
 #include "aac.h"
 #include "pcm.h"
 #include "ffmpeg_metadata.h"
+#include "avdump.h"
+#include "e2i_channel.h"
+#include "probe_cache.h"
 
 /* ***************************** */
 /* Makros/Constants              */
@@ -146,22 +149,32 @@ const char *GetGraphicSubPath()
 	return g_graphic_sub_path;
 }
 
+/* EPLAYER3_SUBSHM=/name[:rgba], see subshm.h */
+const char *GetGraphicSubShm()
+{
+	const char *name = getenv("EPLAYER3_SUBSHM");
+	return (name && name[0] == '/') ? name : NULL;
+}
+
 void E2iSendMsg(const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	vfprintf(stderr, format, args);
+	if (E2iChannelSendV(format, args) < 0)
+		vfprintf(stderr, format, args);
 	va_end(args);
 }
 
 void E2iStartMsg(void)
 {
+	E2iChannelLock();
 	flockfile(stderr);
 }
 
 void E2iEndMsg(void)
 {
 	funlockfile(stderr);
+	E2iChannelUnlock();
 }
 
 /* Progressive playback means that we play local file
@@ -203,12 +216,46 @@ static void releaseMutex(const char *filename __attribute__((unused)), const cha
 
 typedef int32_t (* Write_FN)(Context_t *context, void *);
 
+/* EPLAYER3_AVDUMP=<file> records the packets for main/writer_bench.c */
+static void DumpPacket(Context_t *context, AudioVideoOut_t *out)
+{
+	static int32_t initialized = 0;
+	static FILE *dump = NULL;
+	char *Encoding = NULL;
+
+	if (!initialized)
+	{
+		char *path = getenv("EPLAYER3_AVDUMP");
+		initialized = 1;
+		if (path)
+			dump = AvDumpOpen(path, 1);
+	}
+	if (!dump)
+		return;
+
+	if (!strcmp(out->type, "video"))
+		context->manager->video->Command(context, MANAGER_GETENCODING, &Encoding);
+	else
+		context->manager->audio->Command(context, MANAGER_GETENCODING, &Encoding);
+
+	if (AvDumpWrite(dump, Encoding, out))
+	{
+		ffmpeg_err("packet dump failed, stopped\n");
+		fclose(dump);
+		dump = NULL;
+	}
+	free(Encoding);
+}
+
 static int32_t Write(Write_FN WriteFun, Context_t *context, void *privateData, int64_t pts __attribute__((unused)))
 {
 	/* Because Write is blocking we will release mutex which protect
 	 * avformat structures, during write time
 	 */
 	int32_t ret = 0;
+	/* subtitles are written with a SubtitleOut_t, they are not dumped */
+	if (WriteFun == context->output->video->Write || WriteFun == context->output->audio->Write)
+		DumpPacket(context, privateData);
 	releaseMutex(__FILE__, __FUNCTION__, __LINE__);
 	ret = WriteFun(context, privateData);
 	getMutex(__FILE__, __FUNCTION__, __LINE__);
@@ -2269,10 +2316,25 @@ int32_t container_ffmpeg_init_av_context(Context_t *context, char *filename, uin
 
 	if (!is_probable_live)
 	{
-		ffmpeg_printf(1, "avformat_find_stream_info\n");
-		if (avformat_find_stream_info(avContextTab[AVIdx], NULL) < 0)
+		/* local files that do not change while they are played */
+		int32_t cacheable = is_local_file && !progressive_playback && !use_custom_io[AVIdx] && !context->playback->isTSLiveMode;
+
+		if (cacheable && ProbeCacheApply(avContextTab[AVIdx], filename, context->playback->noprobe) == 0)
 		{
-			ffmpeg_err("Error avformat_find_stream_info\n");
+			ffmpeg_printf(1, "stream info from the probe cache\n");
+			ProbeCacheRevalidate(filename, context->playback->noprobe);
+		}
+		else
+		{
+			ffmpeg_printf(1, "avformat_find_stream_info\n");
+			if (avformat_find_stream_info(avContextTab[AVIdx], NULL) < 0)
+			{
+				ffmpeg_err("Error avformat_find_stream_info\n");
+			}
+			else if (cacheable)
+			{
+				ProbeCacheStore(avContextTab[AVIdx], filename, context->playback->noprobe);
+			}
 		}
 	}
 //for buffered io
@@ -2366,6 +2428,9 @@ int32_t container_ffmpeg_init(Context_t *context, PlayFiles_t *playFilesNames)
 #endif
 
 	context->playback->abortRequested = 0;
+	/* open and probe vs. building the track list, shows what the probe
+	 * cache saves and what is left */
+	int64_t t_open = av_gettime();
 	int32_t res = container_ffmpeg_init_av_context(context, playFilesNames->szFirstFile, playFilesNames->iFirstFileSize, \
 		playFilesNames->szFirstMoovAtomFile, playFilesNames->iFirstMoovAtomOffset, 0);
 
@@ -2387,7 +2452,10 @@ int32_t container_ffmpeg_init(Context_t *context, PlayFiles_t *playFilesNames)
 
 	terminating = 0;
 	latestPts = 0;
+	int64_t t_tracks = av_gettime();
 	res = container_ffmpeg_update_tracks(context, playFilesNames->szFirstFile, 1);
+	ffmpeg_printf(1, "open and probe %lld ms, tracks and chapters %lld ms\n",
+		(long long)(t_tracks - t_open) / 1000, (long long)(av_gettime() - t_tracks) / 1000);
 	return res;
 }
 
@@ -2992,7 +3060,7 @@ int32_t container_ffmpeg_update_tracks(Context_t *context, char *filename, int32
 						((get_codecpar(stream)->codec_id != AV_CODEC_ID_HDMV_PGS_SUBTITLE &&
 								get_codecpar(stream)->codec_id != AV_CODEC_ID_DVB_SUBTITLE &&
 								get_codecpar(stream)->codec_id != AV_CODEC_ID_XSUB) ||
-							!GetGraphicSubPath() || !GetGraphicSubPath()[0]))
+							((!GetGraphicSubPath() || !GetGraphicSubPath()[0]) && !GetGraphicSubShm())))
 					{
 						ffmpeg_printf(10, "subtitle with not supported codec codec_id[%u]\n", (uint32_t)get_codecpar(stream)->codec_id);
 					}
@@ -3143,6 +3211,9 @@ static int32_t container_ffmpeg_stop(Context_t *context)
 
 	ffmpeg_printf(10, "\n");
 
+	/* no probing in the background once the file is closed */
+	ProbeCacheCancel();
+
 	if (context->playback)
 	{
 		context->playback->isPlaying = 0;
@@ -0,0 +1,550 @@
+/*
+ * on-disk cache of the stream probing results, see probe_cache.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/* ***************************** */
+/* Includes                      */
+/* ***************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+
+#include "common.h"
+#include "debug.h"
+#include "probe_cache.h"
+
+#if (LIBAVFORMAT_VERSION_MAJOR > 57) || ((LIBAVFORMAT_VERSION_MAJOR == 57) && (LIBAVFORMAT_VERSION_MINOR > 32))
+
+/* ***************************** */
+/* Makros/Constants              */
+/* ***************************** */
+
+#define PROBE_CACHE_MAGIC "E2PROBE1"
+#define PROBE_CACHE_MAX_SIZE (16 * 1024 * 1024)
+/* the revalidation waits until the playback has started */
+#define PROBE_CACHE_REVALIDATE_DELAY 30
+/* entries younger than this are not revalidated, in seconds */
+#define PROBE_CACHE_MAXAGE (24 * 60 * 60)
+
+/* ***************************** */
+/* Types                         */
+/* ***************************** */
+
+/* followed by path_len bytes of the path and nb_streams times a
+ * ProbeCacheStream_t with its extradata */
+typedef struct ProbeCacheHeader_s
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t minimal;
+	int64_t  size;
+	int64_t  mtime_sec;
+	int64_t  mtime_nsec;
+	int64_t  duration;
+	int64_t  start_time;
+	int64_t  bit_rate;
+	uint32_t path_len;
+	uint32_t nb_streams;
+} ProbeCacheHeader_t;
+
+typedef struct ProbeCacheStream_s
+{
+	int32_t  codec_type;
+	int32_t  codec_id;
+	uint32_t codec_tag;
+	int32_t  format;
+	int64_t  bit_rate;
+	int32_t  bits_per_coded_sample;
+	int32_t  bits_per_raw_sample;
+	int32_t  profile;
+	int32_t  level;
+	int32_t  width;
+	int32_t  height;
+	int32_t  sample_aspect_ratio[2];
+	int32_t  field_order;
+	int32_t  color_range;
+	int32_t  color_primaries;
+	int32_t  color_trc;
+	int32_t  color_space;
+	int32_t  chroma_location;
+	int32_t  video_delay;
+	int32_t  sample_rate;
+	int32_t  channels;
+	uint64_t channel_mask;
+	int32_t  frame_size;
+	int32_t  block_align;
+	int32_t  initial_padding;
+	int32_t  seek_preroll;
+	int32_t  avg_frame_rate[2];
+	int32_t  r_frame_rate[2];
+	int64_t  start_time;
+	int64_t  duration;
+	int64_t  nb_frames;
+	uint32_t extradata_size;
+	uint32_t reserved;
+} ProbeCacheStream_t;
+
+typedef struct
+{
+	char    *filename;
+	int32_t  minimal;
+	uint32_t gen;         /* revalGen when it was started */
+} RevalidateArg_t;
+
+/* ***************************** */
+/* Variables                     */
+/* ***************************** */
+
+static pthread_mutex_t revalMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t revalCond = PTHREAD_COND_INITIALIZER;
+static int32_t revalRunning = 0;
+static uint32_t revalGen = 0;     /* ProbeCacheCancel() bumps it */
+
+/* ***************************** */
+/* MISC Functions                */
+/* ***************************** */
+
+static uint64_t HashPath(const char *path)
+{
+	/* FNV-1a */
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (*path)
+	{
+		h ^= (uint8_t)*path++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* the header an entry for filename must have and the cache file name */
+static int32_t GetKey(const char *filename, int32_t minimal, ProbeCacheHeader_t *hdr, char *path, char *cachefile, size_t size)
+{
+	const char *dir = getenv("EPLAYER3_PROBE_CACHE");
+	struct stat st;
+
+	if (!dir || !dir[0])
+		return -1;
+	if (!strncmp(filename, "file://", 7))
+		filename += 7;
+	if (strstr(filename, "://") || !realpath(filename, path))
+		return -1;
+	if (stat(path, &st) || !S_ISREG(st.st_mode))
+		return -1;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, PROBE_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->version = LIBAVFORMAT_VERSION_INT;
+	hdr->minimal = minimal ? 1 : 0;
+	hdr->size = st.st_size;
+	hdr->mtime_sec = st.st_mtim.tv_sec;
+	hdr->mtime_nsec = st.st_mtim.tv_nsec;
+	hdr->path_len = strlen(path);
+
+	snprintf(cachefile, size, "%s/%016llx.probe", dir, (unsigned long long)HashPath(path));
+	return 0;
+}
+
+static void FromStream(ProbeCacheStream_t *s, const AVStream *st)
+{
+	const AVCodecParameters *par = st->codecpar;
+
+	memset(s, 0, sizeof(*s));
+	s->codec_type             = par->codec_type;
+	s->codec_id               = par->codec_id;
+	s->codec_tag              = par->codec_tag;
+	s->format                 = par->format;
+	s->bit_rate               = par->bit_rate;
+	s->bits_per_coded_sample  = par->bits_per_coded_sample;
+	s->bits_per_raw_sample    = par->bits_per_raw_sample;
+	s->profile                = par->profile;
+	s->level                  = par->level;
+	s->width                  = par->width;
+	s->height                 = par->height;
+	s->sample_aspect_ratio[0] = par->sample_aspect_ratio.num;
+	s->sample_aspect_ratio[1] = par->sample_aspect_ratio.den;
+	s->field_order            = par->field_order;
+	s->color_range            = par->color_range;
+	s->color_primaries        = par->color_primaries;
+	s->color_trc              = par->color_trc;
+	s->color_space            = par->color_space;
+	s->chroma_location        = par->chroma_location;
+	s->video_delay            = par->video_delay;
+	s->sample_rate            = par->sample_rate;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 37, 100)
+	s->channels               = par->ch_layout.nb_channels;
+	s->channel_mask           = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0;
+#else
+	s->channels               = par->channels;
+	s->channel_mask           = par->channel_layout;
+#endif
+	s->frame_size             = par->frame_size;
+	s->block_align            = par->block_align;
+	s->initial_padding        = par->initial_padding;
+	s->seek_preroll           = par->seek_preroll;
+	s->avg_frame_rate[0]      = st->avg_frame_rate.num;
+	s->avg_frame_rate[1]      = st->avg_frame_rate.den;
+	s->r_frame_rate[0]        = st->r_frame_rate.num;
+	s->r_frame_rate[1]        = st->r_frame_rate.den;
+	s->start_time             = st->start_time;
+	s->duration               = st->duration;
+	s->nb_frames              = st->nb_frames;
+	s->extradata_size         = par->extradata ? par->extradata_size : 0;
+}
+
+static int32_t ToStream(const ProbeCacheStream_t *s, const uint8_t *extradata, AVStream *st)
+{
+	AVCodecParameters *par = st->codecpar;
+
+	/* the probing fills in extradata the header did not have */
+	if (s->extradata_size && !par->extradata)
+	{
+		par->extradata = av_mallocz(s->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (!par->extradata)
+			return -1;
+		memcpy(par->extradata, extradata, s->extradata_size);
+		par->extradata_size = s->extradata_size;
+	}
+
+	par->codec_tag                 = s->codec_tag;
+	par->format                    = s->format;
+	par->bit_rate                  = s->bit_rate;
+	par->bits_per_coded_sample     = s->bits_per_coded_sample;
+	par->bits_per_raw_sample       = s->bits_per_raw_sample;
+	par->profile                   = s->profile;
+	par->level                     = s->level;
+	par->width                     = s->width;
+	par->height                    = s->height;
+	par->sample_aspect_ratio.num   = s->sample_aspect_ratio[0];
+	par->sample_aspect_ratio.den   = s->sample_aspect_ratio[1];
+	par->field_order               = s->field_order;
+	par->color_range               = s->color_range;
+	par->color_primaries           = s->color_primaries;
+	par->color_trc                 = s->color_trc;
+	par->color_space               = s->color_space;
+	par->chroma_location           = s->chroma_location;
+	par->video_delay               = s->video_delay;
+	par->sample_rate               = s->sample_rate;
+	if (par->codec_type == AVMEDIA_TYPE_AUDIO)
+	{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 37, 100)
+		av_channel_layout_uninit(&par->ch_layout);
+		if (s->channel_mask)
+			av_channel_layout_from_mask(&par->ch_layout, s->channel_mask);
+		else if (s->channels)
+			av_channel_layout_default(&par->ch_layout, s->channels);
+#else
+		par->channels              = s->channels;
+		par->channel_layout        = s->channel_mask;
+#endif
+	}
+	par->frame_size                = s->frame_size;
+	par->block_align               = s->block_align;
+	par->initial_padding           = s->initial_padding;
+	par->seek_preroll              = s->seek_preroll;
+	st->avg_frame_rate.num         = s->avg_frame_rate[0];
+	st->avg_frame_rate.den         = s->avg_frame_rate[1];
+	st->r_frame_rate.num           = s->r_frame_rate[0];
+	st->r_frame_rate.den           = s->r_frame_rate[1];
+	st->start_time                 = s->start_time;
+	st->duration                   = s->duration;
+	st->nb_frames                  = s->nb_frames;
+	return 0;
+}
+
+static uint8_t *ReadEntry(const char *cachefile, size_t *len)
+{
+	FILE *f = fopen(cachefile, "r");
+	uint8_t *data = NULL;
+	long size;
+
+	if (!f)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && size <= PROBE_CACHE_MAX_SIZE &&
+		fseek(f, 0, SEEK_SET) == 0 && (data = malloc(size)) != NULL)
+	{
+		if (fread(data, size, 1, f) == 1)
+		{
+			*len = size;
+		}
+		else
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	return data;
+}
+
+static int32_t RevalidateCancelled(RevalidateArg_t *reval)
+{
+	return __atomic_load_n(&revalGen, __ATOMIC_RELAXED) != reval->gen;
+}
+
+/* aborts the probing once the playback stopped */
+static int RevalidateInterrupt(void *arg)
+{
+	return RevalidateCancelled(arg);
+}
+
+static void *RevalidateThread(void *arg)
+{
+	RevalidateArg_t *reval = arg;
+	AVFormatContext *ctx = NULL;
+	AVDictionary *opts = NULL;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += PROBE_CACHE_REVALIDATE_DELAY;
+	pthread_mutex_lock(&revalMutex);
+	while (!RevalidateCancelled(reval) && pthread_cond_timedwait(&revalCond, &revalMutex, &ts) == 0)
+		;
+	pthread_mutex_unlock(&revalMutex);
+
+	/* the same probing container_ffmpeg_init_av_context() does */
+	if (reval->minimal)
+		av_dict_set(&opts, "analyzeduration", "1", 0);
+	if (!RevalidateCancelled(reval) && (ctx = avformat_alloc_context()) != NULL)
+	{
+		ctx->interrupt_callback.callback = RevalidateInterrupt;
+		ctx->interrupt_callback.opaque = reval;
+		if (avformat_open_input(&ctx, reval->filename, NULL, &opts) == 0)
+		{
+			if (avformat_find_stream_info(ctx, NULL) >= 0 && !RevalidateCancelled(reval))
+				ProbeCacheStore(ctx, reval->filename, reval->minimal);
+			avformat_close_input(&ctx);
+		}
+	}
+	if (RevalidateCancelled(reval))
+		container_printf(10, "probe cache revalidation of %s cancelled\n", reval->filename);
+	av_dict_free(&opts);
+	free(reval->filename);
+	free(reval);
+
+	pthread_mutex_lock(&revalMutex);
+	revalRunning = 0;
+	pthread_mutex_unlock(&revalMutex);
+	return NULL;
+}
+
+/* ***************************** */
+/* Functions                     */
+/* ***************************** */
+
+int32_t ProbeCacheApply(AVFormatContext *ctx, const char *filename, int32_t minimal)
+{
+	ProbeCacheHeader_t key;
+	ProbeCacheHeader_t hdr;
+	char path[PATH_MAX];
+	char cachefile[PATH_MAX];
+	size_t len = 0;
+	size_t pos;
+	uint32_t i;
+	int32_t ret = -1;
+
+	if (!ctx || (ctx->ctx_flags & AVFMTCTX_NOHEADER))
+		return -1;
+	if (GetKey(filename, minimal, &key, path, cachefile, sizeof(cachefile)))
+		return -1;
+
+	uint8_t *data = ReadEntry(cachefile, &len);
+	if (!data)
+		return -1;
+
+	if (len < sizeof(hdr))
+		goto out;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (memcmp(hdr.magic, key.magic, sizeof(hdr.magic)) || hdr.version != key.version || hdr.minimal != key.minimal ||
+		hdr.size != key.size || hdr.mtime_sec != key.mtime_sec || hdr.mtime_nsec != key.mtime_nsec ||
+		hdr.path_len != key.path_len || len - sizeof(hdr) < hdr.path_len ||
+		memcmp(data + sizeof(hdr), path, hdr.path_len) || hdr.nb_streams != ctx->nb_streams)
+	{
+		container_printf(10, "no probe cache entry for %s\n", path);
+		goto out;
+	}
+
+	/* check all streams before anything is changed */
+	pos = sizeof(hdr) + hdr.path_len;
+	for (i = 0; i < hdr.nb_streams; i++)
+	{
+		ProbeCacheStream_t s;
+		if (len - pos < sizeof(s))
+			goto out;
+		memcpy(&s, data + pos, sizeof(s));
+		pos += sizeof(s);
+		if (len - pos < s.extradata_size || s.codec_type != (int32_t)ctx->streams[i]->codecpar->codec_type ||
+			s.codec_id != (int32_t)ctx->streams[i]->codecpar->codec_id)
+		{
+			container_printf(10, "probe cache entry for %s does not match stream %u\n", path, i);
+			goto out;
+		}
+		pos += s.extradata_size;
+	}
+
+	pos = sizeof(hdr) + hdr.path_len;
+	for (i = 0; i < hdr.nb_streams; i++)
+	{
+		ProbeCacheStream_t s;
+		memcpy(&s, data + pos, sizeof(s));
+		pos += sizeof(s);
+		if (ToStream(&s, data + pos, ctx->streams[i]))
+			goto out;
+		pos += s.extradata_size;
+	}
+	ctx->duration = hdr.duration;
+	ctx->start_time = hdr.start_time;
+	ctx->bit_rate = hdr.bit_rate;
+	ret = 0;
+
+out:
+	free(data);
+	return ret;
+}
+
+void ProbeCacheStore(AVFormatContext *ctx, const char *filename, int32_t minimal)
+{
+	ProbeCacheHeader_t hdr;
+	char path[PATH_MAX];
+	char cachefile[PATH_MAX];
+	char tmpfile[PATH_MAX + 32];
+	uint32_t i;
+
+	if (!ctx || GetKey(filename, minimal, &hdr, path, cachefile, sizeof(cachefile)))
+		return;
+
+	hdr.duration = ctx->duration;
+	hdr.start_time = ctx->start_time;
+	hdr.bit_rate = ctx->bit_rate;
+	hdr.nb_streams = ctx->nb_streams;
+
+	/* a new name per writer, rename() replaces the entry atomically */
+	mkdir(getenv("EPLAYER3_PROBE_CACHE"), 0755);
+	snprintf(tmpfile, sizeof(tmpfile), "%s.%d.%lx", cachefile, (int)getpid(), (unsigned long)pthread_self());
+	FILE *f = fopen(tmpfile, "w");
+	if (!f)
+	{
+		container_err("could not create %s: %m\n", tmpfile);
+		return;
+	}
+
+	int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(path, hdr.path_len, 1, f) == 1;
+	for (i = 0; ok && i < ctx->nb_streams; i++)
+	{
+		ProbeCacheStream_t s;
+		FromStream(&s, ctx->streams[i]);
+		ok = fwrite(&s, sizeof(s), 1, f) == 1 &&
+			(!s.extradata_size || fwrite(ctx->streams[i]->codecpar->extradata, s.extradata_size, 1, f) == 1);
+	}
+	if (fclose(f) || !ok || rename(tmpfile, cachefile))
+	{
+		container_err("could not write %s\n", cachefile);
+		unlink(tmpfile);
+		return;
+	}
+	container_printf(10, "probe cache entry for %s stored\n", path);
+}
+
+void ProbeCacheRevalidate(const char *filename, int32_t minimal)
+{
+	ProbeCacheHeader_t hdr;
+	char path[PATH_MAX];
+	char cachefile[PATH_MAX];
+	struct stat st;
+	time_t maxage = PROBE_CACHE_MAXAGE;
+	const char *tmp = getenv("EPLAYER3_PROBE_CACHE_MAXAGE");
+	RevalidateArg_t *reval;
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (tmp && atol(tmp) >= 0)
+		maxage = atol(tmp);
+	/* the entry was written by the last probe, its mtime is its age */
+	if (GetKey(filename, minimal, &hdr, path, cachefile, sizeof(cachefile)) ||
+		stat(cachefile, &st) || time(NULL) - st.st_mtime < maxage)
+		return;
+
+	pthread_mutex_lock(&revalMutex);
+	if (revalRunning)
+	{
+		pthread_mutex_unlock(&revalMutex);
+		return;
+	}
+	reval = malloc(sizeof(*reval));
+	if (!reval || !(reval->filename = strdup(filename)))
+	{
+		pthread_mutex_unlock(&revalMutex);
+		free(reval);
+		return;
+	}
+	reval->minimal = minimal;
+	reval->gen = revalGen;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, RevalidateThread, reval))
+	{
+		free(reval->filename);
+		free(reval);
+	}
+	else
+		revalRunning = 1;
+	pthread_attr_destroy(&attr);
+	pthread_mutex_unlock(&revalMutex);
+}
+
+void ProbeCacheCancel(void)
+{
+	pthread_mutex_lock(&revalMutex);
+	__atomic_add_fetch(&revalGen, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&revalCond);
+	pthread_mutex_unlock(&revalMutex);
+}
+
+#else
+
+/* streams without codecpar, no caching */
+int32_t ProbeCacheApply(AVFormatContext *ctx __attribute__((unused)), const char *filename __attribute__((unused)), int32_t minimal __attribute__((unused)))
+{
+	return -1;
+}
+
+void ProbeCacheStore(AVFormatContext *ctx __attribute__((unused)), const char *filename __attribute__((unused)), int32_t minimal __attribute__((unused)))
+{
+}
+
+void ProbeCacheRevalidate(const char *filename __attribute__((unused)), int32_t minimal __attribute__((unused)))
+{
+}
+
+void ProbeCacheCancel(void)
+{
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef avdump_123
+#define avdump_123
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "output.h"
+
+/* packet traces of what the container hands to the audio and video
+ * output, to replay them through the writers (main/writer_bench.c).
+ * EPLAYER3_AVDUMP=<file> makes FFMPEGThread record one.
+ *
+ * The file starts with AVDUMP_MAGIC, each packet is an AvDumpRecord_t
+ * followed by extralen bytes of extradata and len bytes of data. The
+ * byte order is the one of the box that recorded it. */
+
+#define AVDUMP_MAGIC "E2AVDMP1"
+
+/* AvDumpRead() takes records above these for a broken trace */
+#define AVDUMP_MAX_LEN      (32 * 1024 * 1024)
+#define AVDUMP_MAX_EXTRALEN (1024 * 1024)
+/* zero bytes AvDumpRead() puts behind the data, that much padding
+ * (AV_INPUT_BUFFER_PADDING_SIZE) is what the ffmpeg packets have */
+#define AVDUMP_PADDING      64
+
+typedef struct AvDumpRecord_s
+{
+	char      type;           /* 'a' or 'v' */
+	char      encoding[31];
+	uint32_t  len;
+	uint32_t  extralen;
+	int64_t   pts;
+	int64_t   dts;
+	uint32_t  frameRate;
+	uint32_t  timeScale;
+	uint32_t  width;
+	uint32_t  height;
+	uint32_t  infoFlags;
+	uint32_t  reserved;
+} AvDumpRecord_t;
+
+/* a packet read back, out points into data */
+typedef struct AvDumpPacket_s
+{
+	char             encoding[32];
+	AudioVideoOut_t  out;
+	uint8_t         *buffer;
+} AvDumpPacket_t;
+
+FILE *AvDumpOpen(const char *path, int write);
+int AvDumpWrite(FILE *f, const char *encoding, const AudioVideoOut_t *out);
+/* returns 1 for a packet, 0 at the end and -1 on errors */
+int AvDumpRead(FILE *f, AvDumpPacket_t *pkt);
+void AvDumpFreePacket(AvDumpPacket_t *pkt);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef bsf_123
+#define bsf_123
+
+#include <stdint.h>
+
+/* growing output buffer, kept between frames */
+typedef struct BsfBuffer_s
+{
+	uint8_t   *data;
+	uint32_t   size;
+} BsfBuffer_t;
+
+/* per track writer state. The player context holds one for audio and
+ * one for video, the output passes it to the writer with every frame,
+ * so the writers keep no state of their own. All zero is a valid
+ * initial state, BsfTrackSelect() sets it up for the writer */
+typedef struct BsfTrack_s
+{
+	const void  *owner;           /* writer the state belongs to */
+	int          initialHeader;   /* codec data still has to be sent */
+	uint32_t     flags;           /* writer specific */
+	uint32_t     NalLengthBytes;
+	uint8_t     *CodecData;       /* codec data as sent to the decoder */
+	uint32_t     CodecDataLen;
+	uint8_t     *CodecDataSrc;    /* private data CodecData was made from */
+	uint32_t     CodecDataSrcLen;
+	void        *priv;            /* writer specific, freed on reset */
+	BsfBuffer_t  Out;
+} BsfTrack_t;
+
+uint8_t *BsfReserve(BsfBuffer_t *buf, uint32_t size);
+void BsfFree(BsfBuffer_t *buf);
+
+/* BsfTrackReset() is for seeks and flushes, the codec data is kept.
+ * BsfTrackSelect() frees everything when another writer takes over */
+void BsfTrackReset(BsfTrack_t *track);
+void BsfTrackFree(BsfTrack_t *track);
+void BsfTrackSelect(BsfTrack_t *track, const void *owner);
+
+/* true if CodecData was not made from this private data */
+int BsfCodecDataChanged(const BsfTrack_t *track, const uint8_t *src, uint32_t len);
+/* remember the private data CodecData was made from */
+void BsfCodecDataSetSource(BsfTrack_t *track, const uint8_t *src, uint32_t len);
+void BsfCodecDataFree(BsfTrack_t *track);
+
+/* avcC and hvcC to Annex B parameter sets in track->CodecData, also
+ * sets track->NalLengthBytes, return 0 on success */
+int32_t BsfAvcCToAnnexB(BsfTrack_t *track, const uint8_t *data, uint32_t len);
+int32_t BsfHvcCToAnnexB(BsfTrack_t *track, const uint8_t *data, uint32_t len);
+
+/* maximal output size of BsfNalToAnnexB() */
+#define BSF_ANNEXB_MAX_SIZE(len, nal_length_bytes) ((len) + ((len) / (nal_length_bytes) + 1) * 4)
+
+/* replace the nal_length_bytes (1 to 4) big endian NAL sizes by start
+ * codes, returns the output length */
+uint32_t BsfNalToAnnexB(uint8_t *out, const uint8_t *in, uint32_t len, uint32_t nal_length_bytes);
+
+/* set frame length and VBR buffer fullness of a 7 byte ADTS header */
+void BsfAdtsSetFrameLength(uint8_t *adts, uint32_t frame_len);
+
+#endif
@@ -7,6 +7,7 @@
 #include "output.h"
 #include "manager.h"
 #include "playback.h"
+#include "bsf.h"
 #include <pthread.h>
 
 typedef struct PlayFiles_t
@@ -27,11 +28,15 @@ typedef struct Context_s
 	ContainerHandler_t  *container;
 	OutputHandler_t     *output;
 	ManagerHandler_t    *manager;
+	/* writer state of the output, allocate the context zeroed */
+	BsfTrack_t           videoTrack;
+	BsfTrack_t           audioTrack;
 } Context_t;
 
 int container_ffmpeg_update_tracks(Context_t *context, char *filename, int initial);
 
 const char *GetGraphicSubPath();
+const char *GetGraphicSubShm();
 int32_t GetGraphicWindowWidth();
 int32_t GetGraphicWindowHeight();
 
@@ -0,0 +1,86 @@
+#ifndef e2i_channel_123
+#define e2i_channel_123
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+/* binary control/event channel of exteplayer3 (exteplayer3 -C socket).
+ *
+ * The player listens on a unix stream socket and waits for the frontend
+ * to connect before it opens the file. Both directions carry records of
+ * an E2iRecord_t followed by len bytes of payload, in the byte order of
+ * the box. The player batches its records and writes several of them at
+ * once.
+ *
+ * player -> frontend:
+ *   E2I_REC_JSON      one of the JSON messages otherwise written to stderr,
+ *                     without the trailing newline
+ *   E2I_REC_POSITION  E2iPosition_t, pushed every pos_ms while it changes
+ *   E2I_REC_BUFFER    E2iBuffer_t, pushed every buf_ms while it changes
+ *
+ * frontend -> player:
+ *   E2I_REC_COMMAND   a command as written to stdin, e.g. "p" or "ai1"
+ *   E2I_REC_RATES     E2iRates_t, 0 stops the push
+ *
+ * Without -C, or when nobody connects, everything stays on stderr/stdin. */
+
+/* the version reported in the EPLAYER3_EXTENDED message */
+#define E2I_PROTOCOL_VERSION 68
+
+#define E2I_REC_JSON        1
+#define E2I_REC_POSITION    2
+#define E2I_REC_BUFFER      3
+#define E2I_REC_COMMAND     16
+#define E2I_REC_RATES       17
+
+#define E2I_MAX_PAYLOAD     (64 * 1024)
+
+typedef struct E2iRecord_s
+{
+	uint32_t len;
+	uint16_t type;
+	uint16_t reserved;
+} E2iRecord_t;
+
+typedef struct E2iPosition_s
+{
+	int64_t ms;           /* current position */
+	int64_t lms;          /* last pts of the container, -1 if unknown */
+} E2iPosition_t;
+
+typedef struct E2iBuffer_s
+{
+	uint32_t bytes;       /* queued in the linuxdvb output buffer */
+	uint32_t size;        /* its size, 0 without buffering */
+} E2iBuffer_t;
+
+typedef struct E2iRates_s
+{
+	uint32_t pos_ms;
+	uint32_t buf_ms;
+} E2iRates_t;
+
+/* fills the records that are pushed, returns 0 if they are valid */
+typedef int32_t (* E2iPollPosition_FN)(E2iPosition_t *pos);
+typedef int32_t (* E2iPollBuffer_FN)(E2iBuffer_t *buf);
+
+int32_t E2iChannelOpen(const char *path, int32_t timeout_ms);
+void E2iChannelClose(void);
+/* the poll functions run on the channel thread. This returns when the
+ * old ones are done, so NULL stops them before the player goes down */
+void E2iChannelSetPoll(E2iPollPosition_FN position, E2iPollBuffer_FN buffer);
+void E2iChannelSetRates(uint32_t pos_ms, uint32_t buf_ms);
+
+/* used by E2iSendMsg/E2iStartMsg/E2iEndMsg, returns -1 if the channel
+ * is not connected */
+int32_t E2iChannelSendV(const char *format, va_list args);
+void E2iChannelLock(void);
+void E2iChannelUnlock(void);
+
+/* waits up to timeout_ms or until wakefd is readable for a command,
+ * returns 1 with the command in buf, 0 if there is none and -1 if the
+ * channel is gone */
+int32_t E2iChannelGetCommand(char *buf, size_t size, int wakefd, int32_t timeout_ms);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef probe_cache_123
+#define probe_cache_123
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+/* on-disk cache of what avformat_find_stream_info() found out about a
+ * local file, so that opening it again can skip the probing.
+ * EPLAYER3_PROBE_CACHE=<dir> enables it.
+ *
+ * An entry is keyed by the real path, size and mtime of the file, the
+ * libavformat version and whether only minimal probing was done. It is
+ * only used if the streams the demuxer found in the header have the same
+ * types and codecs as the cached ones. */
+
+/* fills the streams from the cache, returns 0 if the probing can be
+ * skipped */
+int32_t ProbeCacheApply(AVFormatContext *ctx, const char *filename, int32_t minimal);
+/* stores the result of avformat_find_stream_info() */
+void ProbeCacheStore(AVFormatContext *ctx, const char *filename, int32_t minimal);
+/* probes the file again in the background and replaces the entry, if
+ * the entry is older than EPLAYER3_PROBE_CACHE_MAXAGE seconds (default
+ * one day). Only one revalidation runs at a time */
+void ProbeCacheRevalidate(const char *filename, int32_t minimal);
+/* stops a pending or running revalidation, e.g. when the playback stops */
+void ProbeCacheCancel(void);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef subshm_123
+#define subshm_123
+
+#include <stdint.h>
+
+/* shared memory ring for bitmap subtitles (output/graphic_subtitle.c).
+ * EPLAYER3_SUBSHM=/name[:rgba] makes the PGS/DVB/XSUB output put the
+ * bitmaps into the POSIX shared memory object /name instead of PNG files
+ * below GetGraphicSubPath(). The s_a message then has "m" (slot index)
+ * and "q" (slot sequence) instead of "f" for each rect:
+ *
+ *   {"s_a":{"id":3,"s":1234,"e":null,"r":[{"x":96,"y":580,"w":1088,"h":80,"m":2,"q":18}]}}
+ *
+ * x, y, w and h are in window coordinates as before. By default a slot
+ * holds the decoded bitmap in its source size with a palette and the
+ * reader scales it to w x h, with ":rgba" it holds the bitmap already
+ * scaled to w x h. Colours are RGBA in memory order, premultiplied with
+ * alpha.
+ *
+ * The object is a SubShmHeader_t, the slots follow at SUBSHM_SLOT_OFFSET,
+ * slot_size bytes apart. Slots are reused round robin. seq is odd while a
+ * slot is written; a rect is valid as long as the slot seq equals "q", so
+ * readers copy the pixels and check seq again afterwards. */
+
+#define SUBSHM_MAGIC        0x42533245  /* "E2SB" */
+#define SUBSHM_VERSION      1
+#define SUBSHM_SLOTS        8
+#define SUBSHM_SLOT_OFFSET  4096
+
+#define SUBSHM_FMT_PAL8     1
+#define SUBSHM_FMT_RGBA     2
+
+typedef struct SubShmHeader_s
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t reserved[4];
+} SubShmHeader_t;
+
+typedef struct SubShmSlot_s
+{
+	uint32_t seq;
+	uint32_t format;           /* SUBSHM_FMT_* */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t colors;           /* SUBSHM_FMT_PAL8 */
+	uint32_t reserved[2];
+	uint8_t  palette[256][4];  /* SUBSHM_FMT_PAL8 */
+	/* height * stride bytes of pixels follow */
+} SubShmSlot_t;
+
+#endif
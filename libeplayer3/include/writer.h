@@ -25,6 +25,7 @@ typedef struct
 	unsigned char          Version;
 	unsigned int           InfoFlags;
 	WriteV_t               WriteV;
+	struct BsfTrack_s     *track;       /* writer state, see bsf.h */
 } WriterAVCallData_t;
 
 typedef struct WriterCaps_s
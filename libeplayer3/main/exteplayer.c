@@ -41,11 +41,13 @@
 
 #include "common.h"
 #include "misc.h"
+#include "e2i_channel.h"
 
 #include "debug.h"
 
 #define DUMP_BOOL(x) x == 0 ? "false"  : "true"
 #define IPTV_MAX_FILE_PATH 1024
+#define E2I_CONNECT_TIMEOUT_MS 5000
 
 extern int ffmpeg_av_dict_set(const char *key, const char *value, int flags);
 extern void aac_software_decoder_set(const int32_t val);
@@ -68,6 +70,9 @@ extern void stereo_software_decoder_set(int32_t val);
 extern void insert_pcm_as_lpcm_set(int32_t val);
 extern void progressive_playback_set(int32_t val);
 
+extern uint32_t LinuxDvbBuffGetSize();
+extern uint32_t LinuxDvbBuffGetLevel();
+
 extern OutputHandler_t         OutputHandler;
 extern PlaybackHandler_t       PlaybackHandler;
 extern ContainerHandler_t      ContainerHandler;
@@ -99,6 +104,8 @@ static pthread_mutex_t playbackStartMtx;
 static int32_t g_windows_width = 1280;
 static int32_t g_windows_height = 720;
 static char *g_graphic_sub_path;
+static char *g_channel_path;
+static int g_channel_open = 0;
 
 int32_t GetGraphicWindowWidth()
 {
@@ -260,6 +267,34 @@ static void SetNice(int prio)
 #endif
 }
 
+static int32_t PollPosition(E2iPosition_t *pos)
+{
+	int64_t pts = 0;
+	int64_t lastPts = INVALID_PTS_VALUE;
+
+	if (!g_player->playback->isPlaying || g_player->playback->Command(g_player, PLAYBACK_PTS, &pts) != 0)
+	{
+		return -1;
+	}
+
+	if (g_player->container && g_player->container->selectedContainer &&
+		g_player->container->selectedContainer->Command((Context_t *)g_player->container, CONTAINER_LAST_PTS, &lastPts) != 0)
+	{
+		lastPts = INVALID_PTS_VALUE;
+	}
+
+	pos->ms = pts / 90;
+	pos->lms = lastPts != INVALID_PTS_VALUE ? lastPts / 90 : -1;
+	return 0;
+}
+
+static int32_t PollBuffer(E2iBuffer_t *buf)
+{
+	buf->bytes = LinuxDvbBuffGetLevel();
+	buf->size = LinuxDvbBuffGetSize();
+	return 0;
+}
+
 static int HandleTracks(const Manager_t *ptrManager, const PlaybackCmd_t playbackSwitchCmd, const char *argvBuff)
 {
 	int commandRetVal = 0;
@@ -412,13 +447,24 @@ static int ParseParams(int argc, char *argv[], PlayFiles_t *playbackFiles, int *
 {
 	int ret = 0;
 	int c;
-	while ((c = getopt(argc, argv, "G:W:H:A:V:U:we3dlsrimva:n:x:u:c:h:o:p:P:t:9:0:1:4:f:b:F:S:O:T:")) != -1)
+	while ((c = getopt(argc, argv, "G:W:H:C:R:A:V:U:we3dlsrimva:n:x:u:c:h:o:p:P:t:9:0:1:4:f:b:F:S:O:T:")) != -1)
 	{
 		switch (c)
 		{
 			case 'G':
 				g_graphic_sub_path = optarg;
 				break;
+			case 'C':
+				g_channel_path = optarg;
+				break;
+			case 'R':
+			{
+				unsigned int pos_ms = 0;
+				unsigned int buf_ms = 0;
+				if (sscanf(optarg, "%u,%u", &pos_ms, &buf_ms) == 2)
+					E2iChannelSetRates(pos_ms, buf_ms);
+				break;
+			}
 			case 'W':
 			{
 				int val = atoi(optarg);
@@ -627,7 +673,7 @@ int main(int argc, char *argv[])
 	int commandRetVal = -1;
 
 	/* inform client that we can handle additional commands */
-	E2iSendMsg("{\"EPLAYER3_EXTENDED\":{\"version\":%d}}\n", 68);
+	E2iSendMsg("{\"EPLAYER3_EXTENDED\":{\"version\":%d}}\n", E2I_PROTOCOL_VERSION);
 
 	PlayFiles_t playbackFiles;
 	memset(&playbackFiles, 0x00, sizeof(playbackFiles));
@@ -671,10 +717,12 @@ int main(int argc, char *argv[])
 		printf("[-G path (directory where graphic subtitles frames will be saved)\n");
 		printf("[-W osd window width (width of the window used to scale graphic subtitle frame)\n");
 		printf("[-H osd window height (height of the window used to scale graphic subtitle frame)\n");
+		printf("[-C socket] binary control/event channel on this unix socket instead of stdin/stderr (see e2i_channel.h)\n");
+		printf("[-R pos_ms,buf_ms] rates of the position and buffer level push on the channel, 0 - off (default 500,1000)\n");
 		exit(1);
 	}
 
-	g_player = malloc(sizeof(Context_t));
+	g_player = calloc(1, sizeof(Context_t));
 	if (NULL == g_player)
 	{
 		printf("g_player allocate error\n");
@@ -731,6 +779,14 @@ int main(int argc, char *argv[])
 		g_player->output->Command(g_player, OUTPUT_SET_BUFFER_SIZE, &linuxDvbBufferSizeMB);
 
 	g_player->manager->video->Command(g_player, MANAGER_REGISTER_UPDATED_TRACK_INFO, UpdateVideoTrack);
+
+	/* the frontend connects before anything else happens, it gets
+	 * everything from here on over the channel */
+	if (g_channel_path && E2iChannelOpen(g_channel_path, E2I_CONNECT_TIMEOUT_MS) == 0)
+	{
+		g_channel_open = 1;
+		E2iSendMsg("{\"EPLAYER3_EXTENDED\":{\"version\":%d}}\n", E2I_PROTOCOL_VERSION);
+	}
 	if (strncmp(playbackFiles.szFirstFile, "rtmp", 4) && strncmp(playbackFiles.szFirstFile, "ffrtmp", 4))
 	{
 		g_player->playback->noprobe = 1;
@@ -740,6 +796,7 @@ int main(int argc, char *argv[])
 	E2iSendMsg("{\"PLAYBACK_OPEN\":{\"OutputName\":\"%s\", \"file\":\"%s\", \"sts\":%d}}\n", g_player->output->Name, playbackFiles.szFirstFile, commandRetVal);
 	if (commandRetVal < 0)
 	{
+		E2iChannelClose();
 		if (NULL != g_player)
 		{
 			free(g_player);
@@ -760,6 +817,7 @@ int main(int argc, char *argv[])
 		if (g_player->playback->isPlaying)
 		{
 			PlaybackDieNowRegisterCallback(TerminateWakeUp);
+			E2iChannelSetPoll(PollPosition, PollBuffer);
 
 			HandleTracks(g_player->manager->video, (PlaybackCmd_t) -1, "vc");
 			HandleTracks(g_player->manager->audio, (PlaybackCmd_t) -1, "al");
@@ -783,8 +841,17 @@ int main(int argc, char *argv[])
 
 		while (g_player->playback->isPlaying && PlaybackDieNow(0) == 0)
 		{
+			if (g_channel_open)
+			{
+				/* wait for a command - max 1s, stdin again if the frontend is gone */
+				int ret = E2iChannelGetCommand(argvBuff, sizeof(argvBuff), g_pfd[0], 1000);
+				if (ret < 0)
+					g_channel_open = 0;
+				if (ret <= 0)
+					continue;
+			}
 			/* we made fgets non blocking */
-			if (NULL == fgets(argvBuff, sizeof(argvBuff) - 1, stdin))
+			else if (NULL == fgets(argvBuff, sizeof(argvBuff) - 1, stdin))
 			{
 				/* wait for data - max 1s */
 				kbhit();
@@ -815,6 +882,7 @@ int main(int argc, char *argv[])
 				}
 				case 'q':
 				{
+					E2iChannelSetPoll(NULL, NULL);
 					commandRetVal = g_player->playback->Command(g_player, PLAYBACK_STOP, NULL);
 					E2iSendMsg("{\"PLAYBACK_STOP\":{\"sts\":%d}}\n", commandRetVal);
 					break;
@@ -1014,9 +1082,14 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		/* the channel thread polls the playback and the output */
+		E2iChannelSetPoll(NULL, NULL);
 		g_player->output->Command(g_player, OUTPUT_CLOSE, NULL);
 	}
 
+	/* stops the push before g_player goes away */
+	E2iChannelClose();
+
 	if (NULL != g_player)
 	{
 		free(g_player);
@@ -0,0 +1,340 @@
+/*
+ * writer_bench: replay a packet dump through the writers
+ *
+ * Feeds a packet dump recorded with EPLAYER3_AVDUMP=<file> through the
+ * same writers linuxdvb_mipsel.c uses, collects the written PES stream
+ * in memory, compares it to (or stores it as) golden files and prints
+ * the throughput per writer. make check runs it on the dumps in
+ * tests/writer, see tests/writer_check.sh.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "writer.h"
+#include "bsf.h"
+#include "avdump.h"
+
+#define MAX_WRITERS 32
+
+typedef struct
+{
+	uint8_t *data;
+	size_t   len;
+	size_t   size;
+} Collected_t;
+
+typedef struct
+{
+	Writer_t *writer;
+	uint64_t  packets;
+	uint64_t  bytes_in;
+	uint64_t  bytes_out;
+	double    secs;
+} WriterStats_t;
+
+static int videofd = -1;
+static int audiofd = -1;
+static Collected_t collected[2];	/* video, audio */
+
+static WriterStats_t stats[MAX_WRITERS];
+static int num_stats = 0;
+
+/* libeplayer3 logs through the hal, only errors are shown here */
+int debuglevel = 0;
+
+void _hal_debug_out(int facility __attribute__((unused)), const void *func __attribute__((unused)), const char *fmt __attribute__((unused)), ...)
+{
+}
+
+void _hal_info(int facility __attribute__((unused)), const void *func __attribute__((unused)), const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* playback.c is not linked, nothing ever stops the replay */
+int8_t PlaybackDieNow(int8_t val __attribute__((unused)))
+{
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t CollectWriteV(int fd, const struct iovec *iov, int ic)
+{
+	Collected_t *c = &collected[fd == videofd ? 0 : 1];
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < ic; i++)
+	{
+		if (c->len + iov[i].iov_len > c->size)
+		{
+			size_t size = (c->len + iov[i].iov_len) * 2;
+			uint8_t *data = realloc(c->data, size);
+			if (!data)
+				return -1;
+			c->data = data;
+			c->size = size;
+		}
+		memcpy(c->data + c->len, iov[i].iov_base, iov[i].iov_len);
+		c->len += iov[i].iov_len;
+		len += iov[i].iov_len;
+	}
+	return len;
+}
+
+static WriterStats_t *GetStats(Writer_t *writer)
+{
+	int i;
+	for (i = 0; i < num_stats; i++)
+		if (stats[i].writer == writer)
+			return &stats[i];
+	if (num_stats == MAX_WRITERS)
+		return NULL;
+	stats[num_stats].writer = writer;
+	return &stats[num_stats++];
+}
+
+/* one pass over all packets, like linuxdvb_mipsel.c Write() does it */
+static int Replay(AvDumpPacket_t *pkts, int num_pkts)
+{
+	static BsfTrack_t videoTrack;
+	static BsfTrack_t audioTrack;
+	int i;
+
+	/* every pass starts like a new playback, with the writers used so
+	 * far reset and fresh tracks */
+	for (i = 0; i < num_stats; i++)
+		stats[i].writer->reset();
+	BsfTrackFree(&videoTrack);
+	BsfTrackFree(&audioTrack);
+	collected[0].len = 0;
+	collected[1].len = 0;
+
+	for (i = 0; i < num_pkts; i++)
+	{
+		AudioVideoOut_t *out = &pkts[i].out;
+		int video = !strcmp(out->type, "video");
+		Writer_t *writer = getWriter(pkts[i].encoding);
+		WriterAVCallData_t call;
+
+		if (!writer)
+			writer = video ? getDefaultVideoWriter() : getDefaultAudioWriter();
+		if (!writer || !writer->writeData)
+		{
+			fprintf(stderr, "writer_bench: no writer for %s\n", pkts[i].encoding);
+			return -1;
+		}
+
+		memset(&call, 0, sizeof(call));
+		call.fd           = video ? videofd : audiofd;
+		call.data         = out->data;
+		call.len          = out->len;
+		call.Pts          = out->pts;
+		call.Dts          = out->dts;
+		call.private_data = out->extradata;
+		call.private_size = out->extralen;
+		call.FrameRate    = out->frameRate;
+		call.FrameScale   = out->timeScale;
+		if (video)
+		{
+			call.Width    = out->width;
+			call.Height   = out->height;
+		}
+		call.InfoFlags    = out->infoFlags;
+		call.Version      = 0;
+		call.WriteV       = CollectWriteV;
+		call.track        = video ? &videoTrack : &audioTrack;
+		BsfTrackSelect(call.track, writer);
+
+		WriterStats_t *s = GetStats(writer);
+		size_t before = collected[video ? 0 : 1].len;
+		double t0 = now();
+		if (writer->writeData(&call) < 0)
+			fprintf(stderr, "writer_bench: %s failed on packet %d\n", writer->caps->textEncoding, i);
+		if (s)
+		{
+			s->secs += now() - t0;
+			s->packets++;
+			s->bytes_in += out->len;
+			s->bytes_out += collected[video ? 0 : 1].len - before;
+		}
+	}
+	return 0;
+}
+
+/* no golden file stands for an empty stream */
+static int Golden(const char *prefix, const char *suffix, Collected_t *c, int store)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s.%s", prefix, suffix);
+
+	if (store)
+	{
+		if (!c->len)
+		{
+			unlink(path);
+			return 0;
+		}
+		FILE *f = fopen(path, "w");
+		if (!f || (c->len && fwrite(c->data, c->len, 1, f) != 1) || fclose(f))
+		{
+			fprintf(stderr, "writer_bench: could not write %s\n", path);
+			return -1;
+		}
+		printf("%s: %zu bytes written\n", path, c->len);
+		return 0;
+	}
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		if (!c->len)
+			return 0;
+		fprintf(stderr, "writer_bench: could not open %s\n", path);
+		return -1;
+	}
+	size_t pos = 0;
+	int ch, ret = 0;
+	while ((ch = getc(f)) != EOF)
+	{
+		if (pos >= c->len || c->data[pos] != ch)
+		{
+			printf("%s: differs at offset %zu\n", path, pos);
+			ret = -1;
+			break;
+		}
+		pos++;
+	}
+	fclose(f);
+	if (!ret && pos != c->len)
+	{
+		printf("%s: %zu bytes expected, %zu written\n", path, pos, c->len);
+		ret = -1;
+	}
+	if (!ret)
+		printf("%s: ok (%zu bytes)\n", path, pos);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: writer_bench [-g] [-n loops] dump [golden]\n\n");
+	fprintf(stderr, "  -g  store the output as golden.video and golden.audio instead of comparing\n");
+	fprintf(stderr, "  -n  number of passes for the throughput (default: 10)\n");
+}
+
+int main(int argc, char **argv)
+{
+	AvDumpPacket_t *pkts = NULL;
+	int num_pkts = 0;
+	int loops = 10;
+	int store = 0;
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "gn:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'g':
+				store = 1;
+				break;
+			case 'n':
+				loops = atoi(optarg);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (optind >= argc || (store && optind + 1 >= argc))
+	{
+		usage();
+		return 1;
+	}
+	if (loops < 1)
+		loops = 1;
+
+	FILE *f = AvDumpOpen(argv[optind], 0);
+	if (!f)
+		return 1;
+	while (1)
+	{
+		pkts = realloc(pkts, (num_pkts + 1) * sizeof(*pkts));
+		int r = AvDumpRead(f, &pkts[num_pkts]);
+		if (r < 0)
+			fprintf(stderr, "writer_bench: %s is truncated after %d packets\n", argv[optind], num_pkts);
+		if (r <= 0)
+			break;
+		num_pkts++;
+	}
+	fclose(f);
+
+	/* the writers probe the fds with ioctls, which must fail like on
+	 * a box whose driver does not know them */
+	videofd = open("/dev/null", O_WRONLY);
+	audiofd = open("/dev/null", O_WRONLY);
+
+	if (Replay(pkts, num_pkts))
+		return 1;
+	if (optind + 1 < argc)
+	{
+		ret |= Golden(argv[optind + 1], "video", &collected[0], store);
+		ret |= Golden(argv[optind + 1], "audio", &collected[1], store);
+	}
+
+	for (i = 0; i < num_stats; i++)
+	{
+		stats[i].packets = 0;
+		stats[i].bytes_in = 0;
+		stats[i].bytes_out = 0;
+		stats[i].secs = 0;
+	}
+	for (i = 0; i < loops; i++)
+		Replay(pkts, num_pkts);
+
+	printf("%-24s %10s %12s %12s %10s\n", "writer", "packets", "bytes in", "bytes out", "MB/s");
+	for (i = 0; i < num_stats; i++)
+		printf("%-24s %10llu %12llu %12llu %10.1f\n", stats[i].writer->caps->textEncoding,
+			(unsigned long long)stats[i].packets / loops,
+			(unsigned long long)stats[i].bytes_in / loops,
+			(unsigned long long)stats[i].bytes_out / loops,
+			stats[i].secs > 0 ? stats[i].bytes_in / stats[i].secs / 1e6 : 0.0);
+
+	for (i = 0; i < num_pkts; i++)
+		AvDumpFreePacket(&pkts[i]);
+	free(pkts);
+	free(collected[0].data);
+	free(collected[1].data);
+	return ret ? 1 : 0;
+}
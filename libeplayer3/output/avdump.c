@@ -0,0 +1,140 @@
+/*
+ * audio/video packet traces for replaying them through the writers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/* ***************************** */
+/* Includes                      */
+/* ***************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "debug.h"
+#include "avdump.h"
+
+/* ***************************** */
+/* Functions                     */
+/* ***************************** */
+
+FILE *AvDumpOpen(const char *path, int write)
+{
+	char magic[sizeof(AVDUMP_MAGIC) - 1];
+	FILE *f = fopen(path, write ? "w" : "r");
+
+	if (!f)
+	{
+		output_err("%s: %m\n", path);
+		return NULL;
+	}
+	if (write)
+	{
+		if (fwrite(AVDUMP_MAGIC, sizeof(magic), 1, f) != 1)
+		{
+			output_err("%s: write failed\n", path);
+			fclose(f);
+			return NULL;
+		}
+	}
+	else if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, AVDUMP_MAGIC, sizeof(magic)))
+	{
+		output_err("%s: not a packet dump\n", path);
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+int AvDumpWrite(FILE *f, const char *encoding, const AudioVideoOut_t *out)
+{
+	AvDumpRecord_t rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = out->type[0];
+	strncpy(rec.encoding, encoding ? encoding : "", sizeof(rec.encoding) - 1);
+	rec.len       = out->len;
+	rec.extralen  = out->extradata ? out->extralen : 0;
+	rec.pts       = out->pts;
+	rec.dts       = out->dts;
+	rec.frameRate = out->frameRate;
+	rec.timeScale = out->timeScale;
+	rec.width     = out->width;
+	rec.height    = out->height;
+	rec.infoFlags = out->infoFlags;
+
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+		(rec.extralen && fwrite(out->extradata, rec.extralen, 1, f) != 1) ||
+		(rec.len && fwrite(out->data, rec.len, 1, f) != 1))
+	{
+		return -1;
+	}
+	/* keep the trace usable if the player gets killed */
+	return fflush(f) ? -1 : 0;
+}
+
+int AvDumpRead(FILE *f, AvDumpPacket_t *pkt)
+{
+	AvDumpRecord_t rec;
+
+	memset(pkt, 0, sizeof(*pkt));
+	if (fread(&rec, sizeof(rec), 1, f) != 1)
+	{
+		return feof(f) ? 0 : -1;
+	}
+	if ((rec.type != 'a' && rec.type != 'v') || rec.len > AVDUMP_MAX_LEN || rec.extralen > AVDUMP_MAX_EXTRALEN)
+	{
+		output_err("broken packet dump record (type %d len %u extralen %u)\n", rec.type, rec.len, rec.extralen);
+		return -1;
+	}
+	/* zeroed padding behind the data like AVPacket has it, the bit
+	 * readers of some writers rely on it */
+	pkt->buffer = calloc(1, rec.extralen + rec.len + AVDUMP_PADDING);
+	if (!pkt->buffer)
+	{
+		return -1;
+	}
+	if (fread(pkt->buffer, rec.extralen + rec.len, 1, f) != 1 && rec.extralen + rec.len)
+	{
+		AvDumpFreePacket(pkt);
+		return -1;
+	}
+
+	memcpy(pkt->encoding, rec.encoding, sizeof(rec.encoding));
+	pkt->encoding[sizeof(pkt->encoding) - 1] = 0;
+	pkt->out.extradata = rec.extralen ? pkt->buffer : NULL;
+	pkt->out.extralen  = rec.extralen;
+	pkt->out.data      = pkt->buffer + rec.extralen;
+	pkt->out.len       = rec.len;
+	pkt->out.pts       = rec.pts;
+	pkt->out.dts       = rec.dts;
+	pkt->out.frameRate = rec.frameRate;
+	pkt->out.timeScale = rec.timeScale;
+	pkt->out.width     = rec.width;
+	pkt->out.height    = rec.height;
+	pkt->out.infoFlags = rec.infoFlags;
+	pkt->out.type      = rec.type == 'v' ? "video" : "audio";
+	return 1;
+}
+
+void AvDumpFreePacket(AvDumpPacket_t *pkt)
+{
+	free(pkt->buffer);
+	memset(pkt, 0, sizeof(*pkt));
+}
@@ -0,0 +1,465 @@
+/*
+ * binary control/event channel of exteplayer3, see e2i_channel.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/* ***************************** */
+/* Includes                      */
+/* ***************************** */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "debug.h"
+#include "e2i_channel.h"
+
+/* ***************************** */
+/* Makros/Constants              */
+/* ***************************** */
+
+/* records are collected for up to E2I_BATCH_MS or E2I_BATCH_BYTES */
+#define E2I_BATCH_MS        20
+#define E2I_BATCH_BYTES     (16 * 1024)
+/* a frontend that does not read loses records beyond this */
+#define E2I_MAX_QUEUED      (1024 * 1024)
+
+/* ***************************** */
+/* Types                         */
+/* ***************************** */
+
+typedef struct
+{
+	uint8_t *data;
+	size_t   len;
+	size_t   size;
+} E2iBuf_t;
+
+/* ***************************** */
+/* Variables                     */
+/* ***************************** */
+
+static int chanFd = -1;
+static int32_t chanConnected = 0;
+static bool chanRunning = false;
+static pthread_t chanThread;
+
+/* one JSON message is built up from several E2iSendMsg calls between
+ * E2iStartMsg and E2iEndMsg */
+static pthread_mutex_t msgMtx = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static E2iBuf_t msgBuf;
+
+static pthread_mutex_t outMtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outCond;
+static E2iBuf_t outBuf;
+static uint32_t outDropped = 0;	/* since the frontend last kept up */
+
+static E2iBuf_t inBuf;
+
+static uint32_t ratePos = 500;
+static uint32_t rateBuf = 1000;
+/* held while the channel thread runs the poll functions */
+static pthread_mutex_t pollMtx = PTHREAD_MUTEX_INITIALIZER;
+static E2iPollPosition_FN pollPosition = NULL;
+static E2iPollBuffer_FN pollBuffer = NULL;
+
+/* ***************************** */
+/* MISC Functions                */
+/* ***************************** */
+
+static int64_t NowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int32_t BufReserve(E2iBuf_t *buf, size_t len)
+{
+	if (buf->len + len > buf->size)
+	{
+		size_t size = (buf->len + len) * 2;
+		uint8_t *data = realloc(buf->data, size);
+		if (!data)
+			return -1;
+		buf->data = data;
+		buf->size = size;
+	}
+	return 0;
+}
+
+static void Append(uint16_t type, const void *data, uint32_t len)
+{
+	E2iRecord_t rec = { len, type, 0 };
+
+	pthread_mutex_lock(&outMtx);
+	if (outBuf.len + sizeof(rec) + len > E2I_MAX_QUEUED || BufReserve(&outBuf, sizeof(rec) + len))
+	{
+		if (outDropped++ == 0)
+			output_err("frontend does not read, records are dropped\n");
+	}
+	else
+	{
+		if (outDropped)
+		{
+			output_err("frontend reads again, %u records were dropped\n", outDropped);
+			outDropped = 0;
+		}
+		memcpy(outBuf.data + outBuf.len, &rec, sizeof(rec));
+		memcpy(outBuf.data + outBuf.len + sizeof(rec), data, len);
+		outBuf.len += sizeof(rec) + len;
+		if (outBuf.len >= E2I_BATCH_BYTES)
+			pthread_cond_signal(&outCond);
+	}
+	pthread_mutex_unlock(&outMtx);
+}
+
+static int32_t SendAll(const uint8_t *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t r = send(chanFd, data, len, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static void *E2iChannelThread(void *arg __attribute__((unused)))
+{
+	E2iBuf_t sendBuf = { NULL, 0, 0 };
+	E2iPosition_t lastPos = { -1, -1 };
+	E2iBuffer_t lastBuf = { UINT32_MAX, UINT32_MAX };
+	int64_t lastPosPoll = 0;
+	int64_t lastBufPoll = 0;
+	bool stop = false;
+
+	while (!stop)
+	{
+		int64_t now = NowMs();
+		uint32_t posMs = __atomic_load_n(&ratePos, __ATOMIC_RELAXED);
+		uint32_t bufMs = __atomic_load_n(&rateBuf, __ATOMIC_RELAXED);
+		int64_t wake = now + E2I_BATCH_MS;
+
+		/* the deadlines follow the last poll, so new rates apply at once */
+		pthread_mutex_lock(&pollMtx);
+		if (posMs && pollPosition)
+		{
+			if (now >= lastPosPoll + posMs)
+			{
+				E2iPosition_t pos;
+				if (pollPosition(&pos) == 0 && memcmp(&pos, &lastPos, sizeof(pos)))
+				{
+					lastPos = pos;
+					Append(E2I_REC_POSITION, &pos, sizeof(pos));
+				}
+				lastPosPoll = now;
+			}
+			if (lastPosPoll + posMs < wake)
+				wake = lastPosPoll + posMs;
+		}
+		if (bufMs && pollBuffer)
+		{
+			if (now >= lastBufPoll + bufMs)
+			{
+				E2iBuffer_t buf;
+				if (pollBuffer(&buf) == 0 && memcmp(&buf, &lastBuf, sizeof(buf)))
+				{
+					lastBuf = buf;
+					Append(E2I_REC_BUFFER, &buf, sizeof(buf));
+				}
+				lastBufPoll = now;
+			}
+			if (lastBufPoll + bufMs < wake)
+				wake = lastBufPoll + bufMs;
+		}
+		pthread_mutex_unlock(&pollMtx);
+
+		pthread_mutex_lock(&outMtx);
+		if (chanRunning && outBuf.len < E2I_BATCH_BYTES)
+		{
+			struct timespec ts = { wake / 1000, (wake % 1000) * 1000000 };
+			pthread_cond_timedwait(&outCond, &outMtx, &ts);
+		}
+		/* send outside the lock, the player threads keep appending */
+		E2iBuf_t tmp = sendBuf;
+		sendBuf = outBuf;
+		outBuf = tmp;
+		outBuf.len = 0;
+		stop = !chanRunning;
+		pthread_mutex_unlock(&outMtx);
+
+		if (sendBuf.len && SendAll(sendBuf.data, sendBuf.len))
+		{
+			output_err("frontend is gone, back to stderr\n");
+			__atomic_store_n(&chanConnected, 0, __ATOMIC_RELEASE);
+			stop = true;
+		}
+	}
+
+	free(sendBuf.data);
+	return NULL;
+}
+
+/* ***************************** */
+/* Functions                     */
+/* ***************************** */
+
+int32_t E2iChannelOpen(const char *path, int32_t timeout_ms)
+{
+	struct sockaddr_un addr;
+	struct pollfd pfd;
+	pthread_condattr_t attr;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+	{
+		output_err("socket: %m\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1)
+	{
+		output_err("%s: %m\n", path);
+		close(fd);
+		return -1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	while (poll(&pfd, 1, timeout_ms) == -1 && errno == EINTR)
+		continue;
+	if (pfd.revents & POLLIN)
+		chanFd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	close(fd);
+	unlink(path);
+
+	if (chanFd < 0)
+	{
+		output_err("no frontend connected to %s\n", path);
+		return -1;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&outCond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	chanRunning = true;
+	outDropped = 0;
+	__atomic_store_n(&chanConnected, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&chanThread, NULL, E2iChannelThread, NULL))
+	{
+		output_err("pthread_create: %m\n");
+		__atomic_store_n(&chanConnected, 0, __ATOMIC_RELEASE);
+		chanRunning = false;
+		close(chanFd);
+		chanFd = -1;
+		return -1;
+	}
+	output_printf(10, "frontend connected to %s\n", path);
+	return 0;
+}
+
+void E2iChannelClose(void)
+{
+	if (chanFd < 0)
+		return;
+
+	pthread_mutex_lock(&outMtx);
+	chanRunning = false;
+	pthread_cond_signal(&outCond);
+	pthread_mutex_unlock(&outMtx);
+	pthread_join(chanThread, NULL);
+
+	__atomic_store_n(&chanConnected, 0, __ATOMIC_RELEASE);
+	close(chanFd);
+	chanFd = -1;
+	pthread_cond_destroy(&outCond);
+
+	free(outBuf.data);
+	memset(&outBuf, 0, sizeof(outBuf));
+	free(inBuf.data);
+	memset(&inBuf, 0, sizeof(inBuf));
+}
+
+void E2iChannelSetPoll(E2iPollPosition_FN position, E2iPollBuffer_FN buffer)
+{
+	pthread_mutex_lock(&pollMtx);
+	pollPosition = position;
+	pollBuffer = buffer;
+	pthread_mutex_unlock(&pollMtx);
+}
+
+void E2iChannelSetRates(uint32_t pos_ms, uint32_t buf_ms)
+{
+	__atomic_store_n(&ratePos, pos_ms, __ATOMIC_RELAXED);
+	__atomic_store_n(&rateBuf, buf_ms, __ATOMIC_RELAXED);
+	if (chanFd >= 0)
+	{
+		pthread_mutex_lock(&outMtx);
+		pthread_cond_signal(&outCond);
+		pthread_mutex_unlock(&outMtx);
+	}
+}
+
+int32_t E2iChannelSendV(const char *format, va_list args)
+{
+	int32_t ret = 0;
+
+	if (!__atomic_load_n(&chanConnected, __ATOMIC_ACQUIRE))
+		return -1;
+
+	pthread_mutex_lock(&msgMtx);
+	while (1)
+	{
+		va_list copy;
+		size_t avail = msgBuf.size - msgBuf.len;
+		va_copy(copy, args);
+		int len = vsnprintf(msgBuf.data ? (char *)msgBuf.data + msgBuf.len : NULL, avail, format, copy);
+		va_end(copy);
+		if (len < 0)
+		{
+			ret = -1;
+			break;
+		}
+		if ((size_t)len < avail)
+		{
+			msgBuf.len += len;
+			break;
+		}
+		if (msgBuf.len + len + 1 > E2I_MAX_PAYLOAD || BufReserve(&msgBuf, len + 1))
+		{
+			output_err("message too long, dropped\n");
+			msgBuf.len = 0;
+			break;
+		}
+	}
+
+	/* every message ends with a newline */
+	if (msgBuf.len && msgBuf.data[msgBuf.len - 1] == '\n')
+	{
+		if (msgBuf.len > 1)
+			Append(E2I_REC_JSON, msgBuf.data, msgBuf.len - 1);
+		msgBuf.len = 0;
+	}
+	pthread_mutex_unlock(&msgMtx);
+	return ret;
+}
+
+void E2iChannelLock(void)
+{
+	pthread_mutex_lock(&msgMtx);
+}
+
+void E2iChannelUnlock(void)
+{
+	pthread_mutex_unlock(&msgMtx);
+}
+
+int32_t E2iChannelGetCommand(char *buf, size_t size, int wakefd, int32_t timeout_ms)
+{
+	int64_t end = NowMs() + timeout_ms;
+
+	if (chanFd < 0 || !__atomic_load_n(&chanConnected, __ATOMIC_ACQUIRE))
+		return -1;
+
+	while (1)
+	{
+		/* complete records first, one read may bring several */
+		while (inBuf.len >= sizeof(E2iRecord_t))
+		{
+			E2iRecord_t rec;
+			memcpy(&rec, inBuf.data, sizeof(rec));
+			if (rec.len > E2I_MAX_PAYLOAD)
+			{
+				output_err("invalid record from frontend\n");
+				__atomic_store_n(&chanConnected, 0, __ATOMIC_RELEASE);
+				return -1;
+			}
+			if (inBuf.len < sizeof(rec) + rec.len)
+				break;
+
+			uint8_t *payload = inBuf.data + sizeof(rec);
+			int32_t ret = 0;
+			if (rec.type == E2I_REC_COMMAND && size > 0)
+			{
+				size_t len = rec.len < size - 1 ? rec.len : size - 1;
+				memcpy(buf, payload, len);
+				buf[len] = '\0';
+				ret = 1;
+			}
+			else if (rec.type == E2I_REC_RATES && rec.len >= sizeof(E2iRates_t))
+			{
+				E2iRates_t rates;
+				memcpy(&rates, payload, sizeof(rates));
+				E2iChannelSetRates(rates.pos_ms, rates.buf_ms);
+			}
+			inBuf.len -= sizeof(rec) + rec.len;
+			memmove(inBuf.data, inBuf.data + sizeof(rec) + rec.len, inBuf.len);
+			if (ret)
+				return ret;
+		}
+
+		int64_t left = end - NowMs();
+		if (left <= 0)
+			return 0;
+
+		struct pollfd pfd[2] = { { chanFd, POLLIN, 0 }, { wakefd, POLLIN, 0 } };
+		int r = poll(pfd, wakefd >= 0 ? 2 : 1, left);
+		if (r < 0 && errno != EINTR)
+			return -1;
+		if (r <= 0)
+			continue;
+		if (pfd[1].revents & POLLIN)
+			return 0;
+
+		if (BufReserve(&inBuf, 4096))
+			return -1;
+		ssize_t len = recv(chanFd, inBuf.data + inBuf.len, inBuf.size - inBuf.len, 0);
+		if (len < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (len <= 0)
+		{
+			output_err("frontend closed the channel\n");
+			__atomic_store_n(&chanConnected, 0, __ATOMIC_RELEASE);
+			return -1;
+		}
+		inBuf.len += len;
+	}
+}
@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
@@ -33,6 +35,7 @@
 #include "common.h"
 #include "debug.h"
 #include "writer.h"
+#include "subshm.h"
 #include "plugins/png.h"
 
 /* ***************************** */
@@ -41,6 +44,9 @@
 
 #define MAX_RECT_DESC 4
 
+/* largest PGS bitmap (UHD Blu-ray) */
+#define SUBSHM_MAX_PAL8 (3840 * 2160)
+
 /* ***************************** */
 /* Types                         */
 /* ***************************** */
@@ -56,18 +62,33 @@ typedef struct
 typedef struct
 {
 	char filename[50];
+	uint32_t slot;
+	uint32_t seq;
 	int x;
 	int y;
 	int w;
 	int h;
 } rec_desc_t;
 
+typedef struct
+{
+	SubShmHeader_t *hdr;
+	size_t size;
+	bool rgba;
+	uint32_t next;
+	uint32_t seq;
+} subshm_t;
+
 /* ***************************** */
 /* Variables                     */
 /* ***************************** */
 
 static decoder_sys_t *g_sys;
 
+/* mapped once and kept until exit, readers keep their mapping across
+ * playbacks */
+static subshm_t g_shm;
+
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -129,6 +150,127 @@ static void RemoveAllRegularFiles(const char *mainDir, const char *filePattern)
 	closedir(dirp);
 }
 
+static void SubShmOpen(void)
+{
+	static bool tried = false;
+	const char *arg = GetGraphicSubShm();
+	char name[NAME_MAX];
+
+	if (tried || !arg)
+		return;
+	tried = true;
+
+	snprintf(name, sizeof(name), "%s", arg);
+	char *opt = strchr(name, ':');
+	if (opt)
+	{
+		*opt++ = '\0';
+		g_shm.rgba = !strcmp(opt, "rgba");
+	}
+
+	/* tmpfs only backs the pages that are touched, the slots are sized
+	 * for the worst case */
+	size_t pixels = g_shm.rgba ? (size_t)GetGraphicWindowWidth() * GetGraphicWindowHeight() * 4 : SUBSHM_MAX_PAL8;
+	size_t slot_size = (sizeof(SubShmSlot_t) + pixels + 4095) & ~(size_t)4095;
+	size_t size = SUBSHM_SLOT_OFFSET + SUBSHM_SLOTS * slot_size;
+
+	int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		subtitle_err("shm_open %s: %m\n", name);
+		return;
+	}
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		subtitle_err("mapping %s failed: %m\n", name);
+		return;
+	}
+
+	g_shm.hdr = p;
+	g_shm.size = size;
+	g_shm.hdr->version = SUBSHM_VERSION;
+	g_shm.hdr->slots = SUBSHM_SLOTS;
+	g_shm.hdr->slot_size = slot_size;
+	__atomic_store_n(&g_shm.hdr->magic, SUBSHM_MAGIC, __ATOMIC_RELEASE);
+	subtitle_printf(10, "bitmaps go to %s (%s)\n", name, g_shm.rgba ? "rgba" : "pal8");
+}
+
+static inline void Premultiply(uint8_t *p, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+	p[0] = (r * a + 127) / 255;
+	p[1] = (g * a + 127) / 255;
+	p[2] = (b * a + 127) / 255;
+	p[3] = a;
+}
+
+/* puts one rect into the next slot, the bitmap is scaled to desc->w x
+ * desc->h for rgba only */
+static int32_t SubShmPut(AVSubtitleRect *rec, rec_desc_t *desc)
+{
+	uint32_t stride = g_shm.rgba ? desc->w * 4 : rec->w;
+	uint32_t height = g_shm.rgba ? desc->h : rec->h;
+
+	if ((size_t)stride * height > g_shm.hdr->slot_size - sizeof(SubShmSlot_t))
+	{
+		subtitle_err("bitmap %ux%u does not fit into a slot\n", stride, height);
+		return -1;
+	}
+
+	uint32_t idx = g_shm.next;
+	g_shm.next = (idx + 1) % SUBSHM_SLOTS;
+	g_shm.seq += 2;
+
+	SubShmSlot_t *slot = (SubShmSlot_t *)((uint8_t *)g_shm.hdr + SUBSHM_SLOT_OFFSET + (size_t)idx * g_shm.hdr->slot_size);
+	uint8_t *pixels = (uint8_t *)(slot + 1);
+
+	__atomic_store_n(&slot->seq, g_shm.seq - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->width = g_shm.rgba ? desc->w : rec->w;
+	slot->height = height;
+	slot->stride = stride;
+
+	if (g_shm.rgba)
+	{
+		uint8_t *data[AV_NUM_DATA_POINTERS] = { pixels };
+		int linesize[AV_NUM_DATA_POINTERS] = { stride };
+
+		slot->format = SUBSHM_FMT_RGBA;
+		slot->colors = 0;
+		g_sys->p_swctx = sws_getCachedContext(g_sys->p_swctx, rec->w, rec->h, AV_PIX_FMT_PAL8, desc->w, desc->h, AV_PIX_FMT_RGBA, SWS_BICUBIC, NULL, NULL, NULL);
+		sws_scale(g_sys->p_swctx, (const uint8_t *const *)rec->data, rec->linesize, 0, rec->h, data, linesize);
+
+		uint8_t *p = pixels;
+		uint8_t *end = pixels + (size_t)stride * height;
+		for (; p < end; p += 4)
+			if (p[3] != 0xff)
+				Premultiply(p, p[0], p[1], p[2], p[3]);
+	}
+	else
+	{
+		/* the palette is AV_PIX_FMT_RGB32, i.e. native 0xAARRGGBB */
+		const uint32_t *pal = (const uint32_t *)rec->data[1];
+		int colors = rec->nb_colors > 0 && rec->nb_colors <= 256 ? rec->nb_colors : 256;
+		int i;
+
+		slot->format = SUBSHM_FMT_PAL8;
+		slot->colors = colors;
+		for (i = 0; i < colors; i++)
+			Premultiply(slot->palette[i], pal[i] >> 16, pal[i] >> 8, pal[i], pal[i] >> 24);
+		for (i = 0; i < rec->h; i++)
+			memcpy(pixels + (size_t)i * stride, rec->data[0] + (size_t)i * rec->linesize[0], rec->w);
+	}
+
+	__atomic_store_n(&slot->seq, g_shm.seq, __ATOMIC_RELEASE);
+	desc->slot = idx;
+	desc->seq = g_shm.seq;
+	return 0;
+}
+
 /* ***************************** */
 /* Functions                     */
 /* ***************************** */
@@ -199,6 +341,10 @@ static int32_t Open(SubtitleCodecId_t codecId, uint8_t *extradata, int extradata
 		return -1;
 	}
 
+	SubShmOpen();
+	if (g_shm.hdr)
+		return 0;
+
 	/* Lazy PNG plugin init */
 	ret = PNGPlugin_init();
 	if (0 != ret)
@@ -241,11 +387,15 @@ static int32_t Write(WriterSubCallData_t *subPacket)
 	memset(&subtitle, 0, sizeof(subtitle));
 	AVPacket *pkt;
 	pkt = av_packet_alloc();
+	if (!pkt)
+		return -1;
 	pkt->data = subPacket->data;
 	pkt->size = subPacket->len;
 	pkt->pts  = subPacket->pts;
 	int has_subtitle = 0;
-	//int used = avcodec_decode_subtitle2(g_sys->p_context, &subtitle, &has_subtitle, &pkt);
+	if (avcodec_decode_subtitle2(g_sys->p_context, &subtitle, &has_subtitle, pkt) < 0)
+		subtitle_err("decoding failed\n");
+	av_packet_free(&pkt);
 	uint32_t width = g_sys->p_context->width > 0 ? g_sys->p_context->width : subPacket->width;
 	uint32_t height = g_sys->p_context->height > 0 ? g_sys->p_context->height : subPacket->height;
 
@@ -263,17 +413,6 @@ static int32_t Write(WriterSubCallData_t *subPacket)
 			{
 				case 0: /* 0 = graphics */
 				{
-					snprintf(desc_tab[j].filename, sizeof(desc_tab[j].filename), "%u_%"PRId64"_%u.png", subPacket->trackId, startTimestamp, i);
-					ssize_t bufsz = snprintf(NULL, 0, "%s/%s", GetGraphicSubPath(), desc_tab[j].filename);
-					char *filepath = malloc(bufsz + 1);
-
-					if (!filepath)
-					{
-						subtitle_err("out of memory\n");
-						break;
-					}
-
-					snprintf(filepath, bufsz + 1, "%s/%s", GetGraphicSubPath(), desc_tab[j].filename);
 					desc_tab[j].x = av_rescale(rec->x, GetGraphicWindowWidth(), width);
 					desc_tab[j].y = av_rescale(rec->y, GetGraphicWindowHeight(), height);
 					desc_tab[j].w = av_rescale(rec->w, GetGraphicWindowWidth(), width);
@@ -284,9 +423,27 @@ static int32_t Write(WriterSubCallData_t *subPacket)
 					if (rec->w <= 0 || rec->h <= 0 || desc_tab[j].w <= 0 || desc_tab[j].h <= 0)
 					{
 						subtitle_err("invalid dimensions src=%dx%d dst=%dx%d\n", rec->w, rec->h, desc_tab[j].w, desc_tab[j].h);
-						free(filepath);
 						break;
 					}
+
+					if (g_shm.hdr)
+					{
+						if (SubShmPut(rec, &desc_tab[j]) == 0)
+							j += 1;
+						break;
+					}
+
+					snprintf(desc_tab[j].filename, sizeof(desc_tab[j].filename), "%u_%"PRId64"_%u.png", subPacket->trackId, startTimestamp, i);
+					ssize_t bufsz = snprintf(NULL, 0, "%s/%s", GetGraphicSubPath(), desc_tab[j].filename);
+					char *filepath = malloc(bufsz + 1);
+
+					if (!filepath)
+					{
+						subtitle_err("out of memory\n");
+						break;
+					}
+
+					snprintf(filepath, bufsz + 1, "%s/%s", GetGraphicSubPath(), desc_tab[j].filename);
 					uint8_t *data[AV_NUM_DATA_POINTERS] = {NULL};
 					int linesize[AV_NUM_DATA_POINTERS] = {0};
 					data[0] = av_malloc(desc_tab[j].w * desc_tab[j].h * 4);
@@ -326,7 +483,10 @@ static int32_t Write(WriterSubCallData_t *subPacket)
 
 		for (i = 0; i < j; i++)
 		{
-			E2iSendMsg("%s{\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"f\":\"%s\"}", sep, desc_tab[i].x, desc_tab[i].y, desc_tab[i].w, desc_tab[i].h, desc_tab[i].filename);
+			if (g_shm.hdr)
+				E2iSendMsg("%s{\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"m\":%u,\"q\":%u}", sep, desc_tab[i].x, desc_tab[i].y, desc_tab[i].w, desc_tab[i].h, desc_tab[i].slot, desc_tab[i].seq);
+			else
+				E2iSendMsg("%s{\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"f\":\"%s\"}", sep, desc_tab[i].x, desc_tab[i].y, desc_tab[i].w, desc_tab[i].h, desc_tab[i].filename);
 			sep[0] = ',';
 		}
 		E2iSendMsg("]}}\n");
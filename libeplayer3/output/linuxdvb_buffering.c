@@ -39,6 +39,7 @@
 #include "debug.h"
 #include "misc.h"
 #include "writer.h"
+#include "hal_metrics.h"
 
 /* ***************************** */
 /* Types                         */
@@ -81,6 +82,9 @@ static BufferingNode_t *bufferingQueueTail = NULL;
 static uint32_t maxBufferingDataSize = 0;
 static uint32_t bufferingDataSize = 0;
 
+static hal_metric *bufferingQueueBytes = NULL;
+static hal_metric *bufferingQueueFull = NULL;
+
 static int videofd = -1;
 static int audiofd = -1;
 static int g_pfd[2] = {-1, -1};
@@ -195,6 +199,7 @@ static void LinuxDvbBuffThread(Context_t *context)
 				assert(bufferingDataSize == 0);
 				bufferingDataSize = 0;
 			}
+			hal_metric_set(bufferingQueueBytes, bufferingDataSize);
 		}
 
 		/* We will write data without mutex
@@ -244,6 +249,12 @@ uint32_t LinuxDvbBuffGetSize()
 	return maxBufferingDataSize;
 }
 
+/* bytes queued right now, read without the lock */
+uint32_t LinuxDvbBuffGetLevel()
+{
+	return __atomic_load_n(&bufferingDataSize, __ATOMIC_RELAXED);
+}
+
 int32_t LinuxDvbBuffOpen(Context_t *context, char *type, int outfd, void *mtx)
 {
 	int32_t error = 0;
@@ -251,6 +262,9 @@ int32_t LinuxDvbBuffOpen(Context_t *context, char *type, int outfd, void *mtx)
 
 	buff_printf(10, "\n");
 
+	bufferingQueueBytes = hal_metric_gauge("hal_player_buffering_queue_bytes", "bytes queued for the decoders by the player");
+	bufferingQueueFull = hal_metric_counter("hal_player_buffering_queue_full_total", "player writes that waited for queue space");
+
 	if (!hasBufferingThreadStarted)
 	{
 		pthread_attr_t attr;
@@ -373,6 +387,7 @@ int32_t LinuxDvbBuffFlush(Context_t *context __attribute__((unused)))
 	buff_printf(40, "bufferingDataSize [%u]\n", bufferingDataSize);
 	assert(bufferingDataSize == 0);
 	bufferingDataSize = 0;
+	hal_metric_set(bufferingQueueBytes, 0);
 
 	/* signal that queue is empty */
 	pthread_cond_signal(&bufferingDataConsumedCond);
@@ -456,6 +471,7 @@ ssize_t BufferingWriteV(int fd, const struct iovec *iov, int ic)
 		if (bufferingDataSize + chunkSize >= maxBufferingDataSize)
 		{
 			/* Buffering queue is full we need wait for space*/
+			hal_metric_add(bufferingQueueFull, 1);
 			pthread_cond_wait(&bufferingDataConsumedCond, &bufferingMtx);
 		}
 		else
@@ -473,6 +489,7 @@ ssize_t BufferingWriteV(int fd, const struct iovec *iov, int ic)
 			}
 
 			bufferingDataSize += chunkSize;
+			hal_metric_set(bufferingQueueBytes, bufferingDataSize);
 			chunkSize -= sizeof(BufferingNode_t);
 			nodePtr->dataSize = chunkSize;
 			nodePtr->dataType = dataType;
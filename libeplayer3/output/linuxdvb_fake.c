@@ -45,6 +45,7 @@
 #include "writer.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 
 /* ***************************** */
 /* Makros/Constants              */
@@ -116,8 +117,12 @@ int LinuxDvbOpen(Context_t *context __attribute__((unused)), char *type)
 	return 0;
 }
 
-int LinuxDvbClose(Context_t *context __attribute__((unused)), char *type __attribute__((unused)))
+int LinuxDvbClose(Context_t *context, char *type)
 {
+	if (!strcmp("video", type))
+		BsfTrackFree(&context->videoTrack);
+	else if (!strcmp("audio", type))
+		BsfTrackFree(&context->audioTrack);
 	return 0;
 }
 
@@ -324,6 +329,8 @@ static int Write(Context_t *context, void *_out)
 			call.InfoFlags    = out->infoFlags;
 			call.Version      = 0;
 			call.WriteV       = isBufferedOutput ? BufferingWriteV : writev_with_retry;
+			call.track        = &context->videoTrack;
+			BsfTrackSelect(&context->videoTrack, writer);
 
 			if (writer->writeData)
 			{
@@ -374,6 +381,8 @@ static int Write(Context_t *context, void *_out)
 			call.InfoFlags      = out->infoFlags;
 			call.Version        = 0;
 			call.WriteV         = isBufferedOutput ? BufferingWriteV : writev_with_retry;
+			call.track          = &context->audioTrack;
+			BsfTrackSelect(&context->audioTrack, writer);
 
 			if (writer->writeData)
 			{
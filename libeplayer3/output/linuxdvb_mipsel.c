@@ -47,6 +47,7 @@
 #include "writer.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 
 /* ***************************** */
 /* Makros/Constants              */
@@ -255,6 +256,11 @@ int LinuxDvbClose(Context_t *context, char *type)
 		audiofd = -1;
 	}
 
+	if (video)
+		BsfTrackFree(&context->videoTrack);
+	if (audio)
+		BsfTrackFree(&context->audioTrack);
+
 	releaseLinuxDVBMutex();
 	return cERR_LINUXDVB_NO_ERROR;
 }
@@ -931,6 +937,8 @@ static int Write(Context_t *context, void *_out)
 			call.InfoFlags    = out->infoFlags;
 			call.Version      = 0;
 			call.WriteV       = isBufferedOutput ? BufferingWriteV : writev_with_retry;
+			call.track        = &context->videoTrack;
+			BsfTrackSelect(&context->videoTrack, writer);
 
 			if (writer->writeData)
 			{
@@ -985,6 +993,8 @@ static int Write(Context_t *context, void *_out)
 			call.InfoFlags      = out->infoFlags;
 			call.Version        = 0;
 			call.WriteV         = isBufferedOutput ? BufferingWriteV : writev_with_retry;
+			call.track          = &context->audioTrack;
+			BsfTrackSelect(&context->audioTrack, writer);
 
 			if (writer->writeData)
 			{
@@ -1029,6 +1039,7 @@ static int reset(Context_t *context)
 	{
 		writer->reset();
 	}
+	BsfTrackReset(&context->videoTrack);
 
 	free(Encoding);
 
@@ -1045,6 +1056,7 @@ static int reset(Context_t *context)
 	{
 		writer->reset();
 	}
+	BsfTrackReset(&context->audioTrack);
 
 	free(Encoding);
 
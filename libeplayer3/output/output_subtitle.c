@@ -57,10 +57,23 @@ Number, Style, Name,, MarginL, MarginR, MarginV, Effect,, Text
 
 #define PUFFERSIZE 20
 
+/* word at a time scan for bytes that need escaping */
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define HAS_ZERO(v)    (((v) - ONES) & ~(v) & HIGHS)
+#define HAS_LESS(v, n) (((v) - ONES * (n)) & ~(v) & HIGHS)
+#define HAS_BYTE(v, c) HAS_ZERO((v) ^ (ONES * (c)))
+
 /* ***************************** */
 /* Types                         */
 /* ***************************** */
 
+typedef struct
+{
+	char     *data;
+	uint32_t  size;
+} TextBuffer_t;
+
 /* ***************************** */
 /* Variables                     */
 /* ***************************** */
@@ -69,6 +82,12 @@ static pthread_mutex_t mutex;
 static int isSubtitleOpened = 0;
 static SubWriter_t *g_subWriter;
 
+/* the codec is resolved once per track, the escaped text of its events
+ * reuses one buffer */
+static int32_t g_trackId = -1;
+static SubtitleCodecId_t g_codecId = SUBTITLE_CODEC_ID_UNKNOWN;
+static TextBuffer_t g_text;
+
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -97,72 +116,160 @@ static void releaseMutex(int line __attribute__((unused)))
 /* Functions                     */
 /* ***************************** */
 
-static char *ass_get_text(char *str)
+static SubtitleCodecId_t GetCodecId(const char *Encoding)
+{
+	if (!strncmp("S_TEXT/SUBRIP", Encoding, 13))
+		return SUBTITLE_CODEC_ID_SUBRIP;
+	else if (!strncmp("S_TEXT/ASS", Encoding, 10))
+		return SUBTITLE_CODEC_ID_ASS;
+	else if (!strncmp("S_TEXT/WEBVTT", Encoding, 18))
+		return SUBTITLE_CODEC_ID_WEBVTT;
+	else if (!strncmp("S_GRAPHIC/PGS", Encoding, 13))
+		return SUBTITLE_CODEC_ID_PGS;
+	else if (!strncmp("S_GRAPHIC/DVB", Encoding, 13))
+		return SUBTITLE_CODEC_ID_DVB;
+	else if (!strncmp("S_GRAPHIC/XSUB", Encoding, 14))
+		return SUBTITLE_CODEC_ID_XSUB;
+	return SUBTITLE_CODEC_ID_UNKNOWN;
+}
+
+static inline int NeedsEscape(uint8_t c, int ass)
 {
-	// Events are stored in the Block in this order:
-	// ReadOrder, Layer, Style, Name, MarginL, MarginR, MarginV, Effect, Text
-	// 91,0,Default,,0,0,0,,maar hij smaakt vast tof.
-	int i = 0;
-	char *p_str = str;
-	while (i < 8 && *p_str != '\0')
+	return c < 0x20 || c == '"' || c == '\\' || (ass && c == '{');
+}
+
+/* first byte from p on that is not copied as it is */
+static const uint8_t *ScanPlain(const uint8_t *p, const uint8_t *end, int ass)
+{
+	while (end - p >= 8)
 	{
-		if (*p_str == ',')
-			i++;
-		p_str++;
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		uint64_t hit = HAS_LESS(v, 0x20) | HAS_BYTE(v, '"') | HAS_BYTE(v, '\\');
+		if (ass)
+			hit |= HAS_BYTE(v, '{');
+		if (hit)
+			break;
+		p += 8;
 	}
-	// standardize hard break: '\N' -> '\n'
-	// http://docs.aegisub.org/3.2/ASS_Tags/
-	char *p_newline = NULL;
-	while ((p_newline = strstr(p_str, "\\N")) != NULL)
-		* (p_newline + 1) = 'n';
-	return p_str;
+	while (p < end && !NeedsEscape(*p, ass))
+		p++;
+	return p;
 }
 
-static char *json_string_escape(char *str)
+/* the event text as JSON string contents, in one pass. For ASS the event
+ * fields before the text are skipped, override blocks {...} are removed
+ * and the hard break \N (and \n) becomes a newline, \h a space.
+ * http://docs.aegisub.org/3.2/ASS_Tags/
+ * Control characters other than \b \f \n \r \t are sent as \u00XX.
+ * The old escaper passed them through raw, which is invalid JSON, so for
+ * texts containing them the output differs from before. */
+static const char *TextToJson(const uint8_t *data, uint32_t len, int ass)
 {
-	static char tmp[2048];
-	char *ptr1 = tmp;
-	char *ptr2 = str;
-	while (*ptr2 != '\0')
+	const uint8_t *p = data;
+	const uint8_t *end = data + strnlen((const char *)data, len);
+
+	if (ass)
 	{
-		switch (*ptr2)
+		// Events are stored in the Block in this order:
+		// ReadOrder, Layer, Style, Name, MarginL, MarginR, MarginV, Effect, Text
+		// 91,0,Default,,0,0,0,,maar hij smaakt vast tof.
+		int i;
+		for (i = 0; i < 8 && p < end; i++)
+		{
+			const uint8_t *comma = memchr(p, ',', end - p);
+			p = comma ? comma + 1 : end;
+		}
+	}
+
+	/* worst case is \u00XX for every byte */
+	uint32_t need = (end - p) * 6 + 1;
+	if (need > g_text.size)
+	{
+		char *buf = realloc(g_text.data, need);
+		if (!buf)
+			return NULL;
+		g_text.data = buf;
+		g_text.size = need;
+	}
+
+	static const char hex[] = "0123456789abcdef";
+	char *o = g_text.data;
+	while (p < end)
+	{
+		const uint8_t *q = ScanPlain(p, end, ass);
+		memcpy(o, p, q - p);
+		o += q - p;
+		p = q;
+		if (p == end)
+			break;
+
+		uint8_t c = *p++;
+		switch (c)
 		{
 			case '"':
-				*ptr1++ = '\\';
-				*ptr1++ = '\"';
+				*o++ = '\\';
+				*o++ = '"';
 				break;
 			case '\\':
-				*ptr1++ = '\\';
-				*ptr1++ = '\\';
+				if (ass && p < end && (*p == 'N' || *p == 'n'))
+				{
+					*o++ = '\\';
+					*o++ = 'n';
+					p++;
+				}
+				else if (ass && p < end && *p == 'h')
+				{
+					*o++ = ' ';
+					p++;
+				}
+				else
+				{
+					*o++ = '\\';
+					*o++ = '\\';
+				}
+				break;
+			case '{':
+			{
+				const uint8_t *close = memchr(p, '}', end - p);
+				if (close)
+					p = close + 1;
+				else
+					*o++ = '{';
 				break;
+			}
 			case '\b':
-				*ptr1++ = '\\';
-				*ptr1++ = 'b';
+				*o++ = '\\';
+				*o++ = 'b';
 				break;
 			case '\f':
-				*ptr1++ = '\\';
-				*ptr1++ = 'f';
+				*o++ = '\\';
+				*o++ = 'f';
 				break;
 			case '\n':
-				*ptr1++ = '\\';
-				*ptr1++ = 'n';
+				*o++ = '\\';
+				*o++ = 'n';
 				break;
 			case '\r':
-				*ptr1++ = '\\';
-				*ptr1++ = 'r';
+				*o++ = '\\';
+				*o++ = 'r';
 				break;
 			case '\t':
-				*ptr1++ = '\\';
-				*ptr1++ = 't';
+				*o++ = '\\';
+				*o++ = 't';
 				break;
 			default:
-				*ptr1++ = *ptr2;
+				*o++ = '\\';
+				*o++ = 'u';
+				*o++ = '0';
+				*o++ = '0';
+				*o++ = hex[c >> 4];
+				*o++ = hex[c & 0xf];
 				break;
 		}
-		++ptr2;
 	}
-	*ptr1 = '\0';
-	return tmp;
+	*o = '\0';
+	return g_text.data;
 }
 
 static int Flush()
@@ -170,15 +277,16 @@ static int Flush()
 	if (g_subWriter)
 		g_subWriter->reset();
 
+	g_trackId = -1;
 	E2iSendMsg("{\"s_f\":{\"r\":0}}\n");
 	return cERR_SUBTITLE_NO_ERROR;
 }
 
 static int Write(Context_t *context, void *data)
 {
-	char *Encoding      = NULL;
 	SubtitleOut_t *out  = NULL;
 	int32_t curtrackid  = -1;
+	const char *text    = NULL;
 
 	subtitle_printf(10, "\n");
 
@@ -195,43 +303,46 @@ static int Write(Context_t *context, void *data)
 	{
 		if (g_subWriter)
 		{
-			g_subWriter = NULL;
 			g_subWriter->close();
+			g_subWriter = NULL;
 		}
 		Flush();
 	}
-	context->manager->subtitle->Command(context, MANAGER_GETENCODING, &Encoding);
 
-	if (Encoding == NULL)
+	if (curtrackid != g_trackId)
 	{
-		subtitle_err("encoding unknown\n");
-		return cERR_SUBTITLE_ERROR;
-	}
+		char *Encoding = NULL;
+		context->manager->subtitle->Command(context, MANAGER_GETENCODING, &Encoding);
 
-	subtitle_printf(20, "Encoding:%s Text:%s Len:%d\n", Encoding, (const char *) out->data, out->len);
-	SubtitleCodecId_t subCodecId = SUBTITLE_CODEC_ID_UNKNOWN;
+		if (Encoding == NULL)
+		{
+			subtitle_err("encoding unknown\n");
+			return cERR_SUBTITLE_ERROR;
+		}
 
-	if (!strncmp("S_TEXT/SUBRIP", Encoding, 13))
-		subCodecId = SUBTITLE_CODEC_ID_SUBRIP;
-	else if (!strncmp("S_TEXT/ASS", Encoding, 10))
-		subCodecId = SUBTITLE_CODEC_ID_ASS;
-	else if (!strncmp("S_TEXT/WEBVTT", Encoding, 18))
-		subCodecId = SUBTITLE_CODEC_ID_WEBVTT;
-	else if (!strncmp("S_GRAPHIC/PGS", Encoding, 13))
-		subCodecId = SUBTITLE_CODEC_ID_PGS;
-	else if (!strncmp("S_GRAPHIC/DVB", Encoding, 13))
-		subCodecId = SUBTITLE_CODEC_ID_DVB;
-	else if (!strncmp("S_GRAPHIC/XSUB", Encoding, 14))
-		subCodecId = SUBTITLE_CODEC_ID_XSUB;
+		g_codecId = GetCodecId(Encoding);
+		if (g_codecId == SUBTITLE_CODEC_ID_UNKNOWN)
+			subtitle_err("unknown encoding %s\n", Encoding);
+		subtitle_printf(20, "track %d Encoding:%s\n", curtrackid, Encoding);
+		g_trackId = curtrackid;
+		free(Encoding);
+	}
+
+	subtitle_printf(20, "Text:%.*s Len:%d\n", (int)out->len, (const char *) out->data, out->len);
+	SubtitleCodecId_t subCodecId = g_codecId;
 
 	switch (subCodecId)
 	{
 		case SUBTITLE_CODEC_ID_SUBRIP:
 		case SUBTITLE_CODEC_ID_WEBVTT:
-			E2iSendMsg("{\"s_a\":{\"id\":%d,\"s\":%"PRId64",\"e\":%"PRId64",\"t\":\"%s\"}}\n", out->trackId, out->pts / 90, out->pts / 90 + out->durationMS, json_string_escape((char *)out->data));
-			break;
 		case SUBTITLE_CODEC_ID_ASS:
-			E2iSendMsg("{\"s_a\":{\"id\":%d,\"s\":%"PRId64",\"e\":%"PRId64",\"t\":\"%s\"}}\n", out->trackId, out->pts / 90, out->pts / 90 + out->durationMS, ass_get_text((char *)out->data));
+			text = TextToJson(out->data, out->len, subCodecId == SUBTITLE_CODEC_ID_ASS);
+			if (text == NULL)
+			{
+				subtitle_err("out of memory\n");
+				return cERR_SUBTITLE_ERROR;
+			}
+			E2iSendMsg("{\"s_a\":{\"id\":%d,\"s\":%"PRId64",\"e\":%"PRId64",\"t\":\"%s\"}}\n", out->trackId, out->pts / 90, out->pts / 90 + out->durationMS, text);
 			break;
 		case SUBTITLE_CODEC_ID_PGS:
 		case SUBTITLE_CODEC_ID_DVB:
@@ -260,7 +371,6 @@ static int Write(Context_t *context, void *data)
 		}
 		break;
 		default:
-			subtitle_err("unknown encoding %s\n", Encoding);
 			return  cERR_SUBTITLE_ERROR;
 	}
 	subtitle_printf(10, "<\n");
@@ -301,6 +411,11 @@ static int32_t subtitle_Close(Context_t *context __attribute__((unused)))
 		g_subWriter = NULL;
 	}
 
+	g_trackId = -1;
+	free(g_text.data);
+	g_text.data = NULL;
+	g_text.size = 0;
+
 	isSubtitleOpened = 0;
 	releaseMutex(__LINE__);
 
@@ -0,0 +1,359 @@
+/*
+ * bitstream helpers shared by the writers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/* ***************************** */
+/* Includes                      */
+/* ***************************** */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "debug.h"
+#include "bsf.h"
+
+/* ***************************** */
+/* Functions                     */
+/* ***************************** */
+
+uint8_t *BsfReserve(BsfBuffer_t *buf, uint32_t size)
+{
+	if (size > buf->size)
+	{
+		/* some headroom, frame sizes vary */
+		uint32_t new_size = size + size / 2;
+		uint8_t *data = realloc(buf->data, new_size);
+		if (!data)
+		{
+			return NULL;
+		}
+		buf->data = data;
+		buf->size = new_size;
+	}
+	return buf->data;
+}
+
+void BsfFree(BsfBuffer_t *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
+void BsfTrackReset(BsfTrack_t *track)
+{
+	track->initialHeader = 1;
+	track->flags = 0;
+	free(track->priv);
+	track->priv = NULL;
+}
+
+void BsfTrackFree(BsfTrack_t *track)
+{
+	BsfTrackReset(track);
+	BsfCodecDataFree(track);
+	BsfFree(&track->Out);
+	track->NalLengthBytes = 0;
+	track->owner = NULL;
+}
+
+void BsfTrackSelect(BsfTrack_t *track, const void *owner)
+{
+	if (track->owner != owner)
+	{
+		BsfTrackFree(track);
+		track->owner = owner;
+	}
+}
+
+int BsfCodecDataChanged(const BsfTrack_t *track, const uint8_t *src, uint32_t len)
+{
+	return !track->CodecData || !src || len != track->CodecDataSrcLen ||
+		memcmp(src, track->CodecDataSrc, len);
+}
+
+void BsfCodecDataSetSource(BsfTrack_t *track, const uint8_t *src, uint32_t len)
+{
+	free(track->CodecDataSrc);
+	track->CodecDataSrc = NULL;
+	track->CodecDataSrcLen = 0;
+	if (src && (track->CodecDataSrc = malloc(len)) != NULL)
+	{
+		memcpy(track->CodecDataSrc, src, len);
+		track->CodecDataSrcLen = len;
+	}
+}
+
+void BsfCodecDataFree(BsfTrack_t *track)
+{
+	free(track->CodecData);
+	track->CodecData = NULL;
+	track->CodecDataLen = 0;
+	free(track->CodecDataSrc);
+	track->CodecDataSrc = NULL;
+	track->CodecDataSrcLen = 0;
+}
+
+static int32_t BsfSetCodecData(BsfTrack_t *track, const uint8_t *data, uint32_t len)
+{
+	uint8_t *cd = malloc(len);
+	if (!cd)
+	{
+		return -1;
+	}
+	memcpy(cd, data, len);
+	free(track->CodecData);
+	track->CodecData = cd;
+	track->CodecDataLen = len;
+	return 0;
+}
+
+int32_t BsfAvcCToAnnexB(BsfTrack_t *track, const uint8_t *data, uint32_t cd_len)
+{
+	writer_printf(10, "H264 check codec data..!\n");
+	int32_t ret = -100;
+	if (data)
+	{
+		uint8_t tmp[2048];
+		uint32_t tmp_len = 0;
+
+		uint32_t cd_pos = 0;
+		writer_printf(10, "H264 have codec data..!\n");
+		if (cd_len > 7 && data[0] == 1)
+		{
+			uint16_t len = (data[6] << 8) | data[7];
+			if (cd_len >= (uint32_t)(len + 8) && len + 8 <= sizeof(tmp))
+			{
+				uint32_t i = 0;
+				uint8_t profile_num[] = { 66, 77, 88, 100 };
+				uint8_t profile_cmp[2] = { 0x67, 0x00 };
+				const char *profile_str[] = { "baseline", "main", "extended", "high" };
+				/* avoid compiler warning */
+				if (*profile_str) {}
+				memcpy(tmp, "\x00\x00\x00\x01", 4);
+				tmp_len += 4;
+				memcpy(tmp + tmp_len, data + 8, len);
+				for (i = 0; i < 4; ++i)
+				{
+					profile_cmp[1] = profile_num[i];
+					if (!memcmp(tmp + tmp_len, profile_cmp, 2))
+					{
+						uint8_t level_org = tmp[tmp_len + 3];
+						if (level_org > 0x29)
+						{
+							writer_printf(10, "H264 %s profile@%d.%d patched down to 4.1!", profile_str[i], level_org / 10, level_org % 10);
+							tmp[tmp_len + 3] = 0x29; // level 4.1
+						}
+						else
+						{
+							writer_printf(10, "H264 %s profile@%d.%d", profile_str[i], level_org / 10, level_org % 10);
+						}
+						break;
+					}
+				}
+				tmp_len += len;
+				cd_pos = 8 + len;
+				if (cd_len > (cd_pos + 2))
+				{
+					len = (data[cd_pos + 1] << 8) | data[cd_pos + 2];
+					cd_pos += 3;
+					if (cd_len >= (cd_pos + len) && tmp_len + 4 + len <= sizeof(tmp))
+					{
+						memcpy(tmp + tmp_len, "\x00\x00\x00\x01", 4);
+						tmp_len += 4;
+						memcpy(tmp + tmp_len, data + cd_pos, len);
+						tmp_len += len;
+
+						if (BsfSetCodecData(track, tmp, tmp_len) == 0)
+						{
+							track->NalLengthBytes = (data[4] & 0x03) + 1;
+							ret = 0;
+						}
+					}
+					else
+					{
+						writer_printf(10, "codec_data too short(4)");
+						ret = -4;
+					}
+				}
+				else
+				{
+					writer_printf(10,  "codec_data too short(3)");
+					ret = -3;
+				}
+			}
+			else
+			{
+				writer_printf(10, "codec_data too short(2)");
+				ret = -2;
+			}
+		}
+		else if (cd_len <= 7)
+		{
+			writer_printf(10, "codec_data too short(1)");
+			ret = -1;
+		}
+		else
+		{
+			writer_printf(10, "wrong avcC version %d!", data[0]);
+		}
+	}
+	else
+	{
+		track->NalLengthBytes = 0;
+	}
+
+	return ret;
+}
+
+int32_t BsfHvcCToAnnexB(BsfTrack_t *track, const uint8_t *data, uint32_t cd_len)
+{
+	writer_printf(10, "H265 check codec data..!\n");
+	int32_t ret = -100;
+	if (data)
+	{
+		uint8_t tmp[4096];
+		uint32_t tmp_len = 0;
+
+		writer_printf(10, "H265 have codec data..!");
+
+		if (cd_len > 3 && (data[0] || data[1] || data[2] > 1))
+		{
+			if (cd_len > 22)
+			{
+				int i;
+				if (data[0] != 0)
+				{
+					writer_printf(10, "Unsupported extra data version %d, decoding may fail", (int)data[0]);
+				}
+
+				track->NalLengthBytes = (data[21] & 3) + 1;
+				int num_param_sets = data[22];
+				uint32_t pos = 23;
+				for (i = 0; i < num_param_sets; i++)
+				{
+					int j;
+					if (pos + 3 > cd_len)
+					{
+						writer_printf(10, "Buffer underrun in extra header (%d >= %u)", pos + 3, cd_len);
+						break;
+					}
+					// ignore flags + NAL type (1 byte)
+					int nal_type = data[pos] & 0x3f;
+					int nal_count = data[pos + 1] << 8 | data[pos + 2];
+					pos += 3;
+					for (j = 0; j < nal_count; j++)
+					{
+						if (pos + 2 > cd_len)
+						{
+							writer_printf(10, "Buffer underrun in extra nal header (%d >= %u)\n", pos + 2, cd_len);
+							break;
+						}
+						int nal_size = data[pos] << 8 | data[pos + 1];
+						pos += 2;
+
+						if (pos + nal_size > cd_len)
+						{
+							writer_printf(10, "Buffer underrun in extra nal (%d >= %u)\n", pos + 2 + nal_size, cd_len);
+							break;
+						}
+
+						if ((nal_type == 0x20 || nal_type == 0x21 || nal_type == 0x22) && ((tmp_len + 4 + nal_size) < sizeof(tmp)))  // use only VPS, SPS, PPS nals
+						{
+							memcpy(tmp + tmp_len, "\x00\x00\x00\x01", 4);
+							tmp_len += 4;
+							memcpy(tmp + tmp_len, data + pos, nal_size);
+							tmp_len += nal_size;
+						}
+						else if ((tmp_len + 4 + nal_size) >= sizeof(tmp))
+						{
+							writer_err("Ignoring nal as tmp buffer is too small tmp_len + nal = %d\n", tmp_len + 4 + nal_size);
+						}
+						pos += nal_size;
+					}
+				}
+
+				BsfSetCodecData(track, tmp, tmp_len);
+			}
+		}
+	}
+	else
+	{
+		track->NalLengthBytes = 0;
+	}
+
+	return ret;
+}
+
+uint32_t BsfNalToAnnexB(uint8_t *out, const uint8_t *in, uint32_t len, uint32_t nal_length_bytes)
+{
+	uint8_t *o = out;
+	uint32_t pos = 0;
+
+	if (nal_length_bytes == 0 || nal_length_bytes > 4)
+	{
+		return 0;
+	}
+	do
+	{
+		uint32_t pack_len = 0;
+		uint32_t i;
+
+		if (pos + nal_length_bytes > len)
+		{
+			break;
+		}
+		for (i = 0; i < nal_length_bytes; i++, pos++)
+		{
+			pack_len = (pack_len << 8) | in[pos];
+		}
+		/* a truncated last NAL is passed on as far as it goes */
+		if ((pos + pack_len) > len)
+		{
+			pack_len = len - pos;
+		}
+
+		o[0] = 0;
+		o[1] = 0;
+		o[2] = 0;
+		o[3] = 1;
+		memcpy(o + 4, in + pos, pack_len);
+		o += 4 + pack_len;
+		pos += pack_len;
+	}
+	while ((pos + nal_length_bytes) < len);
+
+	return o - out;
+}
+
+void BsfAdtsSetFrameLength(uint8_t *adts, uint32_t frame_len)
+{
+	adts[3] &= 0xC0;
+	/* frame size over last 2 bits */
+	adts[3] |= (frame_len & 0x1800) >> 11;
+	/* frame size continued over full byte */
+	adts[4] = (frame_len & 0x1FF8) >> 3;
+	/* frame size continued first 3 bits */
+	adts[5] = (frame_len & 7) << 5;
+	/* buffer fullness(0x7FF for VBR) over 5 last bits */
+	adts[5] |= 0x1F;
+	/* buffer fullness(0x7FF for VBR) continued over 6 first bits + 2 zeros for
+	 * number of raw data blocks */
+	adts[6] = 0xFC;
+}
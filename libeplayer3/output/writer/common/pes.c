@@ -71,20 +71,11 @@
 
 int32_t InsertVideoPrivateDataHeader(uint8_t *data, int32_t payload_size)
 {
-	BitPacker_t ld2 = {data, 0, 32};
-	int32_t i = 0;
-
-	PutBits(&ld2, PES_PRIVATE_DATA_FLAG, 8);
-	PutBits(&ld2, payload_size & 0xff, 8);
-	PutBits(&ld2, (payload_size >> 8) & 0xff, 8);
-	PutBits(&ld2, (payload_size >> 16) & 0xff, 8);
-
-	for (i = 4; i < (PES_PRIVATE_DATA_LENGTH + 1); i++)
-	{
-		PutBits(&ld2, 0, 8);
-	}
-
-	FlushBits(&ld2);
+	data[0] = PES_PRIVATE_DATA_FLAG;
+	data[1] = payload_size & 0xff;
+	data[2] = (payload_size >> 8) & 0xff;
+	data[3] = (payload_size >> 16) & 0xff;
+	memset(data + 4, 0, PES_PRIVATE_DATA_LENGTH - 3);
 
 	return PES_PRIVATE_DATA_LENGTH + 1;
 }
@@ -99,12 +90,7 @@ void UpdatePesHeaderPayloadSize(uint8_t *data, int32_t size)
 
 int32_t InsertPesHeader(uint8_t *data, int32_t size, uint8_t stream_id, uint64_t pts, int32_t pic_start_code)
 {
-	BitPacker_t ld2 = {data, 0, 32};
-
-	PutBits(&ld2, 0x0, 8);
-	PutBits(&ld2, 0x0, 8);
-	PutBits(&ld2, 0x1, 8);       // Start Code
-	PutBits(&ld2, stream_id, 8); // Stream_id = Audio Stream
+	uint8_t *p = data;
 
 	if (size > 0)
 	{
@@ -116,68 +102,44 @@ int32_t InsertPesHeader(uint8_t *data, int32_t size, uint8_t stream_id, uint64_t
 		size = 0; // unbounded
 	}
 
-	//4
-	PutBits(&ld2, size, 16); // PES_packet_length
-
-	//6 = 4+2
-	PutBits(&ld2, 0x2, 2);  // 10
-	PutBits(&ld2, 0x0, 2);  // PES_Scrambling_control
-	PutBits(&ld2, 0x0, 1);  // PES_Priority
-	PutBits(&ld2, 0x0, 1);  // data_alignment_indicator
-	PutBits(&ld2, 0x0, 1);  // Copyright
-	PutBits(&ld2, 0x0, 1);  // Original or Copy
-	//7 = 6+1
-
-	if (pts != INVALID_PTS_VALUE)
-	{
-		PutBits(&ld2, 0x2, 2);
-	}
-	else
-	{
-		PutBits(&ld2, 0x0, 2); // PTS_DTS flag
-	}
-
-	PutBits(&ld2, 0x0, 1); // ESCR_flag
-	PutBits(&ld2, 0x0, 1); // ES_rate_flag
-	PutBits(&ld2, 0x0, 1); // DSM_trick_mode_flag
-	PutBits(&ld2, 0x0, 1); // additional_copy_ingo_flag
-	PutBits(&ld2, 0x0, 1); // PES_CRC_flag
-	PutBits(&ld2, 0x0, 1); // PES_extension_flag
-	//8 = 7+1
+	/* the header is byte aligned throughout, so every byte is stored
+	 * directly instead of going through PutBits() */
+	p[0] = 0x00;
+	p[1] = 0x00;
+	p[2] = 0x01;       // Start Code
+	p[3] = stream_id;  // Stream_id = Audio Stream
+	p[4] = size >> 8;  // PES_packet_length
+	p[5] = size & 0xff;
+	p[6] = 0x80;       // 10, not scrambled, no priority, alignment or copyright, copy
 
 	if (pts != INVALID_PTS_VALUE)
 	{
-		PutBits(&ld2, 0x5, 8);
+		p[7] = 0x80;   // PTS_DTS flag: PTS only, no other flags
+		p[8] = 0x05;   // PES_header_data_length
+		/* 0010, PTS[32..30], 1, PTS[29..15], 1, PTS[14..0], 1 */
+		p[9]  = 0x21 | ((pts >> 29) & 0x0e);
+		p[10] = (pts >> 22) & 0xff;
+		p[11] = ((pts >> 14) & 0xfe) | 0x01;
+		p[12] = (pts >> 7) & 0xff;
+		p[13] = ((pts << 1) & 0xfe) | 0x01;
+		p += 14;
 	}
 	else
 	{
-		PutBits(&ld2, 0x0, 8); // PES_header_data_length
+		p[7] = 0x00;
+		p[8] = 0x00;
+		p += 9;
 	}
-	//9 = 8+1
-
-	if (pts != INVALID_PTS_VALUE)
-	{
-		PutBits(&ld2, 0x2, 4);
-		PutBits(&ld2, (pts >> 30) & 0x7, 3);
-		PutBits(&ld2, 0x1, 1);
-		PutBits(&ld2, (pts >> 15) & 0x7fff, 15);
-		PutBits(&ld2, 0x1, 1);
-		PutBits(&ld2, pts & 0x7fff, 15);
-		PutBits(&ld2, 0x1, 1);
-	}
-	//14 = 9+5
 
 	if (pic_start_code)
 	{
-		PutBits(&ld2, 0x0, 8);
-		PutBits(&ld2, 0x0, 8);
-		PutBits(&ld2, 0x1, 8); // Start Code
-		PutBits(&ld2, pic_start_code & 0xff, 8); // 00, for picture start
-		PutBits(&ld2, (pic_start_code >> 8) & 0xff, 8); // For any extra information (like in mpeg4p2, the pic_start_code)
-		//14 + 4 = 18
+		p[0] = 0x00;
+		p[1] = 0x00;
+		p[2] = 0x01; // Start Code
+		p[3] = pic_start_code & 0xff; // 00, for picture start
+		p[4] = (pic_start_code >> 8) & 0xff; // For any extra information (like in mpeg4p2, the pic_start_code)
+		p += 5;
 	}
 
-	FlushBits(&ld2);
-
-	return (ld2.Ptr - data);
+	return (p - data);
 }
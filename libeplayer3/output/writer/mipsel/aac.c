@@ -52,6 +52,7 @@
 #include "debug.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 #include "writer.h"
 #include "aac.h"
 
@@ -67,8 +68,6 @@
 /* Variables                     */
 /* ***************************** */
 
-static bool needInitHeader = true;
-
 /// ** AAC ADTS format **
 ///
 /// AAAAAAAA AAAABCCD EEFFFFGH HHIJKLMM
@@ -116,8 +115,6 @@ static unsigned char DefaultAACHeader[] =
 	0xfc
 };
 
-LATMContext *pLATMCtx = NULL;
-
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -128,12 +125,6 @@ LATMContext *pLATMCtx = NULL;
 
 static int reset()
 {
-	if (pLATMCtx)
-	{
-		free(pLATMCtx);
-		pLATMCtx = NULL;
-	}
-	needInitHeader = true;
 	return 0;
 }
 
@@ -198,7 +189,7 @@ static int writeDataADTS(WriterAVCallData_t *call)
 {
 	aac_printf(10, "\n");
 
-	if (call == NULL || call->data == NULL || call->len <= 0 || call->fd < 0)
+	if (call == NULL || call->data == NULL || call->len <= 0 || call->fd < 0 || call->track == NULL)
 	{
 		aac_err("call data is NULL...\n");
 		return 0;
@@ -211,12 +202,12 @@ static int writeDataADTS(WriterAVCallData_t *call)
 		return _writeData(call, 0);
 	}
 
-	uint32_t adtsHeaderSize = (call->private_data == NULL || needInitHeader == false) ? AAC_HEADER_LENGTH : call->private_size;
+	uint32_t adtsHeaderSize = (call->private_data == NULL || !call->track->initialHeader) ? AAC_HEADER_LENGTH : call->private_size;
 	uint32_t PacketLength = call->len + adtsHeaderSize;
 	uint8_t PesHeader[PES_MAX_HEADER_SIZE + AAC_HEADER_LENGTH + MAX_PCE_SIZE];
 	uint32_t headerSize = InsertPesHeader(PesHeader, PacketLength, MPEG_AUDIO_PES_START_CODE, call->Pts, 0);
 	uint8_t *pExtraData = &PesHeader[headerSize];
-	needInitHeader = false;
+	call->track->initialHeader = 0;
 
 	aac_printf(10, "AudioPts %lld\n", call->Pts);
 	if (call->private_data == NULL)
@@ -229,18 +220,7 @@ static int writeDataADTS(WriterAVCallData_t *call)
 		memcpy(pExtraData, call->private_data, adtsHeaderSize);
 	}
 
-	pExtraData[3] &= 0xC0;
-	/* frame size over last 2 bits */
-	pExtraData[3] |= (PacketLength & 0x1800) >> 11;
-	/* frame size continued over full byte */
-	pExtraData[4] = (PacketLength & 0x1FF8) >> 3;
-	/* frame size continued first 3 bits */
-	pExtraData[5] = (PacketLength & 7) << 5;
-	/* buffer fullness(0x7FF for VBR) over 5 last bits */
-	pExtraData[5] |= 0x1F;
-	/* buffer fullness(0x7FF for VBR) continued over 6 first bits + 2 zeros for
-	 * number of raw data blocks */
-	pExtraData[6] = 0xFC;
+	BsfAdtsSetFrameLength(pExtraData, PacketLength);
 
 	//PesHeader[6] = 0x81;
 
@@ -269,6 +249,12 @@ static int writeDataLATM(WriterAVCallData_t *call)
 		return 0;
 	}
 
+	if (call->track == NULL)
+	{
+		aac_err("no track state. ignoring...\n");
+		return 0;
+	}
+
 	if (call->private_data && strncmp("LATM", (const char *)call->private_data, call->private_size) == 0)
 	{
 		return _writeData(call, 1);
@@ -276,12 +262,15 @@ static int writeDataLATM(WriterAVCallData_t *call)
 
 	aac_printf(10, "AudioPts %lld\n", call->Pts);
 
+	LATMContext *pLATMCtx = call->track->priv;
 	if (!pLATMCtx)
 	{
-		pLATMCtx = malloc(sizeof(LATMContext));
-		memset(pLATMCtx, 0x00, sizeof(LATMContext));
-		pLATMCtx->mod = 14;
-		pLATMCtx->counter = 0;
+		pLATMCtx = call->track->priv = calloc(1, sizeof(LATMContext));
+		if (pLATMCtx)
+		{
+			pLATMCtx->mod = 14;
+			pLATMCtx->counter = 0;
+		}
 	}
 
 	if (!pLATMCtx)
@@ -51,13 +51,16 @@
 #include "debug.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 #include "writer.h"
 
 /* ***************************** */
 /* Makros/Constants              */
 /* ***************************** */
 
-#define IOVEC_SIZE                              128
+/* BsfTrack_t flags */
+#define H264_AVC3               0x01
+#define H264_SPS_PPS_IN_STREAM  0x02
 
 /* ***************************** */
 /* Types                         */
@@ -67,14 +70,6 @@
 /* Variables                     */
 /* ***************************** */
 
-static unsigned char           Head[] = {0, 0, 0, 1};
-static int                     initialHeader = 1;
-static unsigned int            NalLengthBytes = 1;
-static unsigned char           *CodecData     = NULL;
-static unsigned int            CodecDataLen   = 0;
-static int                     avc3 = 0;
-static int                     sps_pps_in_stream = 0;
-
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -188,110 +183,8 @@ static int32_t UpdateExtraData(uint8_t **ppExtraData, uint32_t *pExtraDataSize,
 	return 0;
 }
 
-static int32_t PreparCodecData(unsigned char *data, unsigned int cd_len, unsigned int *NalLength)
-{
-	h264_printf(10, "H264 check codec data..!\n");
-	int32_t ret = -100;
-	if (data)
-	{
-		unsigned char tmp[2048];
-		unsigned int tmp_len = 0;
-
-		unsigned int cd_pos = 0;
-		h264_printf(10, "H264 have codec data..!\n");
-		if (cd_len > 7 && data[0] == 1)
-		{
-			unsigned short len = (data[6] << 8) | data[7];
-			if (cd_len >= (uint32_t)(len + 8))
-			{
-				unsigned int i = 0;
-				uint8_t profile_num[] = { 66, 77, 88, 100 };
-				uint8_t profile_cmp[2] = { 0x67, 0x00 };
-				const char *profile_str[] = { "baseline", "main", "extended", "high" };
-				/* avoid compiler warning */
-				if (*profile_str) {}
-				memcpy(tmp, Head, sizeof(Head));
-				tmp_len += 4;
-				memcpy(tmp + tmp_len, data + 8, len);
-				for (i = 0; i < 4; ++i)
-				{
-					profile_cmp[1] = profile_num[i];
-					if (!memcmp(tmp + tmp_len, profile_cmp, 2))
-					{
-						uint8_t level_org = tmp[tmp_len + 3];
-						if (level_org > 0x29)
-						{
-							h264_printf(10, "H264 %s profile@%d.%d patched down to 4.1!", profile_str[i], level_org / 10, level_org % 10);
-							tmp[tmp_len + 3] = 0x29; // level 4.1
-						}
-						else
-						{
-							h264_printf(10, "H264 %s profile@%d.%d", profile_str[i], level_org / 10, level_org % 10);
-						}
-						break;
-					}
-				}
-				tmp_len += len;
-				cd_pos = 8 + len;
-				if (cd_len > (cd_pos + 2))
-				{
-					len = (data[cd_pos + 1] << 8) | data[cd_pos + 2];
-					cd_pos += 3;
-					if (cd_len >= (cd_pos + len))
-					{
-						memcpy(tmp + tmp_len, "\x00\x00\x00\x01", 4);
-						tmp_len += 4;
-						memcpy(tmp + tmp_len, data + cd_pos, len);
-						tmp_len += len;
-
-						CodecData = malloc(tmp_len);
-						memcpy(CodecData, tmp, tmp_len);
-						CodecDataLen = tmp_len;
-
-						*NalLength = (data[4] & 0x03) + 1;
-						ret = 0;
-					}
-					else
-					{
-						h264_printf(10, "codec_data too short(4)");
-						ret = -4;
-					}
-				}
-				else
-				{
-					h264_printf(10,  "codec_data too short(3)");
-					ret = -3;
-				}
-			}
-			else
-			{
-				h264_printf(10, "codec_data too short(2)");
-				ret = -2;
-			}
-		}
-		else if (cd_len <= 7)
-		{
-			h264_printf(10, "codec_data too short(1)");
-			ret = -1;
-		}
-		else
-		{
-			h264_printf(10, "wrong avcC version %d!", data[0]);
-		}
-	}
-	else
-	{
-		*NalLength = 0;
-	}
-
-	return ret;
-}
-
 static int reset()
 {
-	initialHeader = 1;
-	avc3 = 0;
-	sps_pps_in_stream = 0;
 	return 0;
 }
 
@@ -303,7 +196,7 @@ static int writeData(WriterAVCallData_t *call)
 	unsigned int            TimeScale;
 	unsigned int            len = 0;
 	int ic = 0;
-	struct iovec iov[IOVEC_SIZE];
+	struct iovec iov[3];
 	h264_printf(20, "\n");
 
 	if (call == NULL)
@@ -333,13 +226,20 @@ static int writeData(WriterAVCallData_t *call)
 		return 0;
 	}
 
+	BsfTrack_t *track = call->track;
+	if (track == NULL)
+	{
+		h264_err("no track state. ignoring ...\n");
+		return 0;
+	}
+
 	/* AnnexA */
-	if (!avc3 && ((1 < call->private_size && call->private_data[0] == 0) ||
+	if (!(track->flags & H264_AVC3) && ((1 < call->private_size && call->private_data[0] == 0) ||
 			((call->len > 3) && ((call->data[0] == 0x00 && call->data[1] == 0x00 && call->data[2] == 0x00 && call->data[3] == 0x01) ||
 					(call->data[0] == 0xff && call->data[1] == 0xff && call->data[2] == 0xff && call->data[3] == 0xff)))))
 	{
 		uint32_t i = 0;
-		uint8_t InsertPrivData = !sps_pps_in_stream;
+		uint8_t InsertPrivData = !(track->flags & H264_SPS_PPS_IN_STREAM);
 		uint32_t PacketLength = 0;
 		uint32_t FakeStartCode = (call->Version << 8) | PES_VERSION_FAKE_START_CODE;
 		iov[ic++].iov_base = PesHeader;
@@ -349,14 +249,14 @@ static int writeData(WriterAVCallData_t *call)
 			if ((call->data[i] == 0x00 && call->data[i + 1] == 0x00 && call->data[i + 2] == 0x00 && call->data[i + 3] == 0x01 && (call->data[i + 4] == 0x67 || call->data[i + 4] == 0x68)))
 			{
 				InsertPrivData = 0;
-				sps_pps_in_stream = 1;
+				track->flags |= H264_SPS_PPS_IN_STREAM;
 			}
 			i += 1;
 		}
 
 		if (InsertPrivData && call->private_size > 0 /*&& initialHeader*/) // some rtsp streams can update codec data at runtime
 		{
-			initialHeader = 0;
+			track->initialHeader = 0;
 			iov[ic].iov_base  = call->private_data;
 			iov[ic++].iov_len = call->private_size;
 			PacketLength     += call->private_size;
@@ -377,85 +277,60 @@ static int writeData(WriterAVCallData_t *call)
 	}
 
 	uint32_t PacketLength = 0;
+	uint32_t CodecDataInsert = 0;
 
-	ic = 0;
-	iov[ic++].iov_base = PesHeader;
-
-	if (!avc3)
+	if (!(track->flags & H264_AVC3))
 	{
-		if (CodecData)
-		{
-			free(CodecData);
-			CodecData = NULL;
-		}
-
-		uint8_t  *private_data = call->private_data;
-		uint32_t  private_size = call->private_size;
-
-		if (PreparCodecData(private_data, private_size, &NalLengthBytes))
-		{
-			UpdateExtraData(&private_data, &private_size, call->data, call->len);
-			PreparCodecData(private_data, private_size, &NalLengthBytes);
-		}
-
-		if (private_data != call->private_data)
+		if (BsfCodecDataChanged(track, call->private_data, call->private_size))
 		{
-			avc3 = 1;
-			free(private_data);
-			private_data = NULL;
-		}
+			BsfCodecDataFree(track);
 
-		if (CodecData != NULL)
-		{
-			iov[ic].iov_base  = CodecData;
-			iov[ic++].iov_len = CodecDataLen;
-			PacketLength     += CodecDataLen;
-			initialHeader = 0;
-		}
-	}
+			uint8_t  *private_data = call->private_data;
+			uint32_t  private_size = call->private_size;
 
-	if (CodecData != NULL)
-	{
-		uint32_t pos = 0;
-		do
-		{
-			if (ic >= IOVEC_SIZE)
+			if (BsfAvcCToAnnexB(track, private_data, private_size))
 			{
-				h264_err(">> Drop data due to ic overflow\n");
-				break;
+				UpdateExtraData(&private_data, &private_size, call->data, call->len);
+				BsfAvcCToAnnexB(track, private_data, private_size);
 			}
 
-			uint32_t pack_len = 0;
-			uint32_t i = 0;
-			for (i = 0; i < NalLengthBytes; i++, pos++)
+			if (private_data != call->private_data)
 			{
-				pack_len <<= 8;
-				pack_len += call->data[pos];
+				track->flags |= H264_AVC3;
+				free(private_data);
+				private_data = NULL;
 			}
-
-			if ((pos + pack_len) > call->len)
+			else if (track->CodecData != NULL)
 			{
-				pack_len = call->len - pos;
+				BsfCodecDataSetSource(track, private_data, private_size);
 			}
+		}
 
-			iov[ic].iov_base  = Head;
-			iov[ic++].iov_len = sizeof(Head);
-			PacketLength += sizeof(Head);
-
-			iov[ic].iov_base  = call->data + pos;
-			iov[ic++].iov_len = pack_len;
-			PacketLength     += pack_len;
-
-			pos += pack_len;
+		if (track->CodecData != NULL)
+		{
+			CodecDataInsert = track->CodecDataLen;
+			track->initialHeader = 0;
+		}
+	}
 
+	if (track->CodecData != NULL)
+	{
+		/* PES header, codec data and the frame in Annex B, one write */
+		uint8_t *out = BsfReserve(&track->Out, PES_MAX_HEADER_SIZE + CodecDataInsert + BSF_ANNEXB_MAX_SIZE(call->len, track->NalLengthBytes));
+		if (out == NULL)
+		{
+			h264_err("out of memory\n");
+			return 0;
 		}
-		while ((pos + NalLengthBytes) < call->len);
+		PacketLength = InsertPesHeader(out, -1, MPEG_VIDEO_PES_START_CODE, VideoPts, 0);
+		memcpy(out + PacketLength, track->CodecData, CodecDataInsert);
+		PacketLength += CodecDataInsert;
+		PacketLength += BsfNalToAnnexB(out + PacketLength, call->data, call->len, track->NalLengthBytes);
 
 		h264_printf(10, "<<<< PacketLength [%d]\n", PacketLength);
-		iov[0].iov_len = InsertPesHeader(PesHeader, -1, MPEG_VIDEO_PES_START_CODE, VideoPts, 0);
-
-		len = call->WriteV(call->fd, iov, ic);
-		PacketLength += iov[0].iov_len;
+		iov[0].iov_base = out;
+		iov[0].iov_len = PacketLength;
+		len = call->WriteV(call->fd, iov, 1);
 		if (PacketLength != len)
 		{
 			h264_err("<<<< not all data have been written [%d/%d]\n", len, PacketLength);
@@ -50,14 +50,13 @@
 #include "debug.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 #include "writer.h"
 
 /* ***************************** */
 /* Makros/Constants              */
 /* ***************************** */
 
-#define IOVEC_SIZE                                      128
-
 /* ***************************** */
 /* Types                         */
 /* ***************************** */
@@ -66,12 +65,6 @@
 /* Variables                     */
 /* ***************************** */
 
-static unsigned char           Head[] = {0, 0, 0, 1};
-static int                     initialHeader = 1;
-static unsigned int            NalLengthBytes = 1;
-static unsigned char           *CodecData     = NULL;
-static unsigned int            CodecDataLen   = 0;
-
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -80,90 +73,8 @@ static unsigned int            CodecDataLen   = 0;
 /* MISC Functions                */
 /* ***************************** */
 
-static int32_t PreparCodecData(unsigned char *data, unsigned int cd_len, unsigned int *NalLength)
-{
-	h265_printf(10, "H265 check codec data..!\n");
-	int32_t ret = -100;
-	if (data)
-	{
-		unsigned char tmp[4096];
-		unsigned int tmp_len = 0;
-
-		h265_printf(10, "H265 have codec data..!");
-
-		if (cd_len > 3 && (data[0] || data[1] || data[2] > 1))
-		{
-			if (cd_len > 22)
-			{
-				int i;
-				if (data[0] != 0)
-				{
-					h265_printf(10, "Unsupported extra data version %d, decoding may fail", (int)data[0]);
-				}
-
-				*NalLength = (data[21] & 3) + 1;
-				int num_param_sets = data[22];
-				uint32_t pos = 23;
-				for (i = 0; i < num_param_sets; i++)
-				{
-					int j;
-					if (pos + 3 > cd_len)
-					{
-						h265_printf(10, "Buffer underrun in extra header (%d >= %u)", pos + 3, cd_len);
-						break;
-					}
-					// ignore flags + NAL type (1 byte)
-					int nal_type = data[pos] & 0x3f;
-					int nal_count = data[pos + 1] << 8 | data[pos + 2];
-					pos += 3;
-					for (j = 0; j < nal_count; j++)
-					{
-						if (pos + 2 > cd_len)
-						{
-							h265_printf(10, "Buffer underrun in extra nal header (%d >= %u)\n", pos + 2, cd_len);
-							break;
-						}
-						int nal_size = data[pos] << 8 | data[pos + 1];
-						pos += 2;
-
-						if (pos + nal_size > cd_len)
-						{
-							h265_printf(10, "Buffer underrun in extra nal (%d >= %u)\n", pos + 2 + nal_size, cd_len);
-							break;
-						}
-
-						if ((nal_type == 0x20 || nal_type == 0x21 || nal_type == 0x22) && ((tmp_len + 4 + nal_size) < sizeof(tmp)))  // use only VPS, SPS, PPS nals
-						{
-							memcpy(tmp + tmp_len, "\x00\x00\x00\x01", 4);
-							tmp_len += 4;
-							memcpy(tmp + tmp_len, data + pos, nal_size);
-							tmp_len += nal_size;
-						}
-						else if ((tmp_len + 4 + nal_size) >= sizeof(tmp))
-						{
-							h264_err("Ignoring nal as tmp buffer is too small tmp_len + nal = %d\n", tmp_len + 4 + nal_size);
-						}
-						pos += nal_size;
-					}
-				}
-
-				CodecData = malloc(tmp_len);
-				memcpy(CodecData, tmp, tmp_len);
-				CodecDataLen = tmp_len;
-			}
-		}
-	}
-	else
-	{
-		*NalLength = 0;
-	}
-
-	return ret;
-}
-
 static int reset()
 {
-	initialHeader = 1;
 	return 0;
 }
 
@@ -175,7 +86,7 @@ static int writeData(WriterAVCallData_t *call)
 	unsigned int            TimeScale;
 	unsigned int            len = 0;
 	int ic = 0;
-	struct iovec iov[IOVEC_SIZE];
+	struct iovec iov[4];
 	h265_printf(20, "\n");
 
 	if (call == NULL)
@@ -205,6 +116,13 @@ static int writeData(WriterAVCallData_t *call)
 		return 0;
 	}
 
+	BsfTrack_t *track = call->track;
+	if (track == NULL)
+	{
+		h264_err("no track state. ignoring ...\n");
+		return 0;
+	}
+
 	if (call->InfoFlags & 0x1) // TS container
 	{
 		h265_printf(10, "H265 simple inject method!\n");
@@ -212,10 +130,10 @@ static int writeData(WriterAVCallData_t *call)
 		uint32_t FakeStartCode = (call->Version << 8) | PES_VERSION_FAKE_START_CODE;
 
 		iov[ic++].iov_base = PesHeader;
-		initialHeader = 0;
-		if (initialHeader)
+		track->initialHeader = 0;
+		if (track->initialHeader)
 		{
-			initialHeader = 0;
+			track->initialHeader = 0;
 			iov[ic].iov_base  = call->private_data;
 			iov[ic++].iov_len = call->private_size;
 			PacketLength     += call->private_size;
@@ -234,75 +152,45 @@ static int writeData(WriterAVCallData_t *call)
 	}
 
 	uint32_t PacketLength = 0;
+	uint32_t CodecDataInsert = 0;
 
-	ic = 0;
-	iov[ic++].iov_base = PesHeader;
-
-	if (initialHeader)
+	if (track->initialHeader)
 	{
-		if (CodecData)
+		if (BsfCodecDataChanged(track, call->private_data, call->private_size))
 		{
-			free(CodecData);
-			CodecData = NULL;
+			BsfCodecDataFree(track);
+			BsfHvcCToAnnexB(track, call->private_data, call->private_size);
+			if (track->CodecData != NULL)
+			{
+				BsfCodecDataSetSource(track, call->private_data, call->private_size);
+			}
 		}
 
-		uint8_t  *private_data = call->private_data;
-		uint32_t  private_size = call->private_size;
-
-		PreparCodecData(private_data, private_size, &NalLengthBytes);
-
-		if (CodecData != NULL)
+		if (track->CodecData != NULL)
 		{
-			iov[ic].iov_base  = CodecData;
-			iov[ic++].iov_len = CodecDataLen;
-			PacketLength     += CodecDataLen;
-			initialHeader = 0;
+			CodecDataInsert = track->CodecDataLen;
+			track->initialHeader = 0;
 		}
 	}
 
-	if (CodecData != NULL)
+	if (track->CodecData != NULL)
 	{
-		uint32_t pos = 0;
-		do
+		/* PES header, codec data and the frame in Annex B, one write */
+		uint8_t *out = BsfReserve(&track->Out, PES_MAX_HEADER_SIZE + CodecDataInsert + BSF_ANNEXB_MAX_SIZE(call->len, track->NalLengthBytes));
+		if (out == NULL)
 		{
-			if (ic >= IOVEC_SIZE)
-			{
-				h264_err(">> Drop data due to ic overflow\n");
-				exit(-1);
-				break;
-			}
-
-			uint32_t pack_len = 0;
-			uint32_t i = 0;
-			for (i = 0; i < NalLengthBytes; i++, pos++)
-			{
-				pack_len <<= 8;
-				pack_len += call->data[pos];
-			}
-
-			if ((pos + pack_len) > call->len)
-			{
-				pack_len = call->len - pos;
-			}
-
-			iov[ic].iov_base  = Head;
-			iov[ic++].iov_len = sizeof(Head);
-			PacketLength += sizeof(Head);
-
-			iov[ic].iov_base  = call->data + pos;
-			iov[ic++].iov_len = pack_len;
-			PacketLength     += pack_len;
-
-			pos += pack_len;
-
+			h264_err("out of memory\n");
+			return 0;
 		}
-		while ((pos + NalLengthBytes) < call->len);
+		PacketLength = InsertPesHeader(out, -1, MPEG_VIDEO_PES_START_CODE, VideoPts, 0);
+		memcpy(out + PacketLength, track->CodecData, CodecDataInsert);
+		PacketLength += CodecDataInsert;
+		PacketLength += BsfNalToAnnexB(out + PacketLength, call->data, call->len, track->NalLengthBytes);
 
 		h265_printf(10, "<<<< PacketLength [%d]\n", PacketLength);
-		iov[0].iov_len = InsertPesHeader(PesHeader, -1, MPEG_VIDEO_PES_START_CODE, VideoPts, 0);
-
-		len = call->WriteV(call->fd, iov, ic);
-		PacketLength += iov[0].iov_len;
+		iov[0].iov_base = out;
+		iov[0].iov_len = PacketLength;
+		len = call->WriteV(call->fd, iov, 1);
 		if (PacketLength != len)
 		{
 			h264_err("<<<< not all data have been written [%d/%d]\n", len, PacketLength);
@@ -47,6 +47,7 @@
 #include "debug.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 #include "writer.h"
 
 /* ***************************** */
@@ -61,10 +62,6 @@
 /* Variables                     */
 /* ***************************** */
 
-static bool must_send_header = true;
-static uint8_t *private_data = NULL;
-static uint32_t private_size = 0;
-
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -75,13 +72,12 @@ static uint32_t private_size = 0;
 
 static int reset()
 {
-	must_send_header = true;
 	return 0;
 }
 
 static int writeData(WriterAVCallData_t *call)
 {
-	static uint8_t PesHeader[PES_MAX_HEADER_SIZE];
+	uint8_t PesHeader[PES_MAX_HEADER_SIZE];
 
 	mpeg2_printf(10, "\n");
 
@@ -105,10 +101,18 @@ static int writeData(WriterAVCallData_t *call)
 		return 0;
 	}
 
+	BsfTrack_t *track = call->track;
+	if (track == NULL)
+	{
+		mpeg2_err("no track state. ignoring ...\n");
+		return 0;
+	}
+
+	/* the sequence header found in the stream is kept as CodecData */
 	uint8_t *data = call->data;
 	uint32_t data_len = call->len;
 
-	if (!private_data && !call->private_data && data_len > 3 && !memcmp(data, "\x00\x00\x01\xb3", 4))
+	if (!track->CodecData && !call->private_data && data_len > 3 && !memcmp(data, "\x00\x00\x01\xb3", 4))
 	{
 		bool ok = true;
 		uint32_t pos = 4;
@@ -194,27 +198,27 @@ static int writeData(WriterAVCallData_t *call)
 					break;
 			}
 
-			free(private_data);
-			private_data = malloc(sheader_data_len);
-			if (private_data)
+			BsfCodecDataFree(track);
+			track->CodecData = malloc(sheader_data_len);
+			if (track->CodecData)
 			{
-				private_size = sheader_data_len;
-				memcpy(private_data, data + pos - sheader_data_len, sheader_data_len);
+				track->CodecDataLen = sheader_data_len;
+				memcpy(track->CodecData, data + pos - sheader_data_len, sheader_data_len);
 			}
-			must_send_header = false;
+			track->initialHeader = 0;
 			break;
 		}
 	}
-	else if ((private_data || call->private_data) && must_send_header)
+	else if ((track->CodecData || call->private_data) && track->initialHeader)
 	{
 		uint8_t *codec_data = NULL;
 		uint32_t codec_data_size = 0;
 		int pos = 0;
 
-		if (private_data)
+		if (track->CodecData)
 		{
-			codec_data = private_data;
-			codec_data_size = private_size;
+			codec_data = track->CodecData;
+			codec_data_size = track->CodecDataLen;
 		}
 		else
 		{
@@ -243,7 +247,7 @@ static int writeData(WriterAVCallData_t *call)
 			iov[3].iov_base = data + pos;
 			iov[3].iov_len = data_len - pos;
 
-			must_send_header = false;
+			track->initialHeader = 0;
 			return call->WriteV(call->fd, iov, 4);
 		}
 	}
@@ -47,6 +47,7 @@
 #include "debug.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 #include "writer.h"
 
 /* ***************************** */
@@ -61,8 +62,6 @@
 /* Variables                     */
 /* ***************************** */
 
-static int initialHeader = 1;
-
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -73,7 +72,6 @@ static int initialHeader = 1;
 
 static int reset()
 {
-	initialHeader = 1;
 	return 0;
 }
 
@@ -101,10 +99,17 @@ static int writeData(WriterAVCallData_t *call)
 		return 0;
 	}
 
+	BsfTrack_t *track = call->track;
+	if (track == NULL)
+	{
+		mpeg4_err("no track state. ignoring ...\n");
+		return 0;
+	}
+
 	mpeg4_printf(10, "VideoPts %lld\n", call->Pts);
 
 	unsigned int PacketLength = call->len;
-	if (initialHeader && call->private_size && call->private_data != NULL)
+	if (track->initialHeader && call->private_size && call->private_data != NULL)
 	{
 		PacketLength += call->private_size;
 	}
@@ -114,9 +119,9 @@ static int writeData(WriterAVCallData_t *call)
 	iov[ic].iov_base = PesHeader;
 	iov[ic++].iov_len = InsertPesHeader(PesHeader, PacketLength, MPEG_VIDEO_PES_START_CODE, call->Pts, 0);
 
-	if (initialHeader && call->private_size && call->private_data != NULL)
+	if (track->initialHeader && call->private_size && call->private_data != NULL)
 	{
-		initialHeader = 0;
+		track->initialHeader = 0;
 		iov[ic].iov_base = call->private_data;
 		iov[ic++].iov_len = call->private_size;
 	}
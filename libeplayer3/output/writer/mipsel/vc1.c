@@ -47,6 +47,7 @@
 #include "debug.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 #include "writer.h"
 
 /* ***************************** */
@@ -67,9 +68,6 @@ static const uint8_t Vc1FrameStartCode[] = {0, 0, 1, VC1_FRAME_START_CODE};
 /* Variables                     */
 /* ***************************** */
 
-static int initialHeader = 1;
-static video_codec_data_t videocodecdata = {0, 0};
-
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -80,7 +78,6 @@ static video_codec_data_t videocodecdata = {0, 0};
 
 static int reset()
 {
-	initialHeader = 1;
 	return 0;
 }
 
@@ -108,6 +105,13 @@ static int writeData(WriterAVCallData_t *call)
 		return 0;
 	}
 
+	BsfTrack_t *track = call->track;
+	if (track == NULL)
+	{
+		vc1_err("no track state. ignoring ...\n");
+		return 0;
+	}
+
 	vc1_printf(10, "VideoPts %lld\n", call->Pts);
 	vc1_printf(10, "Got Private Size %d\n", call->private_size);
 
@@ -115,16 +119,12 @@ static int writeData(WriterAVCallData_t *call)
 	int32_t ic = 0;
 	struct iovec iov[5];
 	unsigned int PacketLength = 0;
+	video_codec_data_t videocodecdata = {0, 0};
 
 	iov[ic++].iov_base = PesHeader;
-	if (initialHeader)
+	if (track->initialHeader)
 	{
-		initialHeader = 0;
-		if (videocodecdata.data)
-		{
-			free(videocodecdata.data);
-			videocodecdata.data = NULL;
-		}
+		track->initialHeader = 0;
 		videocodecdata.length = call->private_size + 8;
 		videocodecdata.data  = malloc(videocodecdata.length);
 		memset(videocodecdata.data, 0, videocodecdata.length);
@@ -160,13 +160,12 @@ static int writeData(WriterAVCallData_t *call)
 		iov[0].iov_len += sizeof(Vc1FrameStartCode);
 	}
 
-	if (videocodecdata.data)
-	{
-		free(videocodecdata.data);
-		videocodecdata.data = NULL;
-	}
+	/* the codec data is in iov, free it after the write */
+	int len = call->WriteV(call->fd, iov, ic);
+
+	free(videocodecdata.data);
 
-	return call->WriteV(call->fd, iov, ic);
+	return len;
 }
 
 /* ***************************** */
@@ -47,6 +47,7 @@
 #include "debug.h"
 #include "misc.h"
 #include "pes.h"
+#include "bsf.h"
 #include "writer.h"
 
 /* ***************************** */
@@ -65,9 +66,6 @@ static const  uint8_t Vc1FrameStartCode[]     = {0, 0, 1, WMV_FRAME_START_CODE};
 /* Variables                     */
 /* ***************************** */
 
-static int initialHeader = 1;
-static video_codec_data_t videocodecdata = {0, 0};
-
 /* ***************************** */
 /* Prototypes                    */
 /* ***************************** */
@@ -78,7 +76,6 @@ static video_codec_data_t videocodecdata = {0, 0};
 
 static int reset()
 {
-	initialHeader = 1;
 	return 0;
 }
 
@@ -104,6 +101,13 @@ static int writeData(WriterAVCallData_t *call)
 		return 0;
 	}
 
+	BsfTrack_t *track = call->track;
+	if (track == NULL)
+	{
+		wmv_err("no track state. ignoring ...\n");
+		return 0;
+	}
+
 	wmv_printf(10, "VideoPts %lld\n", call->Pts);
 	wmv_printf(10, "Got Private Size %d\n", call->private_size);
 
@@ -111,16 +115,12 @@ static int writeData(WriterAVCallData_t *call)
 	int32_t ic = 0;
 	struct iovec iov[5];
 	unsigned int PacketLength = 0;
+	video_codec_data_t videocodecdata = {0, 0};
 
 	iov[ic++].iov_base = PesHeader;
-	if (initialHeader)
+	if (track->initialHeader)
 	{
-		initialHeader = 0;
-		if (videocodecdata.data)
-		{
-			free(videocodecdata.data);
-			videocodecdata.data = NULL;
-		}
+		track->initialHeader = 0;
 
 		unsigned int codec_size = call->private_size;
 
@@ -172,13 +172,12 @@ static int writeData(WriterAVCallData_t *call)
 		iov[0].iov_len += sizeof(Vc1FrameStartCode);
 	}
 
-	if (videocodecdata.data)
-	{
-		free(videocodecdata.data);
-		videocodecdata.data = NULL;
-	}
+	/* the codec data is in iov, free it after the write */
+	int len = call->WriteV(call->fd, iov, ic);
+
+	free(videocodecdata.data);
 
-	return call->WriteV(call->fd, iov, ic);
+	return len;
 }
 
 /* ***************************** */
@@ -0,0 +1,359 @@
+/*
+ * pes_check: compare the PES header functions to the PutBits versions
+ *
+ * InsertPesHeader() and InsertVideoPrivateDataHeader() store the header
+ * bytes directly. The functions below are the PutBits() versions they
+ * replaced; both must write the same bytes for the size clamping, PTS,
+ * stream id and picture start code edge cases and for random input.
+ * The time per header of both versions is printed at the end.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "misc.h"
+#include "pes.h"
+
+/* bigger than the longest header, the bytes behind it must stay untouched */
+#define BUF_SIZE 32
+
+static int failed = 0;
+
+static int32_t RefInsertVideoPrivateDataHeader(uint8_t *data, int32_t payload_size)
+{
+	BitPacker_t ld2 = {data, 0, 32};
+	int32_t i = 0;
+
+	PutBits(&ld2, PES_PRIVATE_DATA_FLAG, 8);
+	PutBits(&ld2, payload_size & 0xff, 8);
+	PutBits(&ld2, (payload_size >> 8) & 0xff, 8);
+	PutBits(&ld2, (payload_size >> 16) & 0xff, 8);
+
+	for (i = 4; i < (PES_PRIVATE_DATA_LENGTH + 1); i++)
+	{
+		PutBits(&ld2, 0, 8);
+	}
+
+	FlushBits(&ld2);
+
+	return PES_PRIVATE_DATA_LENGTH + 1;
+}
+
+static int32_t RefInsertPesHeader(uint8_t *data, int32_t size, uint8_t stream_id, uint64_t pts, int32_t pic_start_code)
+{
+	BitPacker_t ld2 = {data, 0, 32};
+
+	PutBits(&ld2, 0x0, 8);
+	PutBits(&ld2, 0x0, 8);
+	PutBits(&ld2, 0x1, 8);       // Start Code
+	PutBits(&ld2, stream_id, 8); // Stream_id = Audio Stream
+
+	if (size > 0)
+	{
+		size += 3 + (pts != INVALID_PTS_VALUE ? 5 : 0) + (pic_start_code ? (5) : 0);
+	}
+
+	if (size > MAX_PES_PACKET_SIZE || size < 0)
+	{
+		size = 0; // unbounded
+	}
+
+	PutBits(&ld2, size, 16); // PES_packet_length
+
+	PutBits(&ld2, 0x2, 2);  // 10
+	PutBits(&ld2, 0x0, 2);  // PES_Scrambling_control
+	PutBits(&ld2, 0x0, 1);  // PES_Priority
+	PutBits(&ld2, 0x0, 1);  // data_alignment_indicator
+	PutBits(&ld2, 0x0, 1);  // Copyright
+	PutBits(&ld2, 0x0, 1);  // Original or Copy
+
+	if (pts != INVALID_PTS_VALUE)
+	{
+		PutBits(&ld2, 0x2, 2);
+	}
+	else
+	{
+		PutBits(&ld2, 0x0, 2); // PTS_DTS flag
+	}
+
+	PutBits(&ld2, 0x0, 1); // ESCR_flag
+	PutBits(&ld2, 0x0, 1); // ES_rate_flag
+	PutBits(&ld2, 0x0, 1); // DSM_trick_mode_flag
+	PutBits(&ld2, 0x0, 1); // additional_copy_ingo_flag
+	PutBits(&ld2, 0x0, 1); // PES_CRC_flag
+	PutBits(&ld2, 0x0, 1); // PES_extension_flag
+
+	if (pts != INVALID_PTS_VALUE)
+	{
+		PutBits(&ld2, 0x5, 8);
+	}
+	else
+	{
+		PutBits(&ld2, 0x0, 8); // PES_header_data_length
+	}
+
+	if (pts != INVALID_PTS_VALUE)
+	{
+		PutBits(&ld2, 0x2, 4);
+		PutBits(&ld2, (pts >> 30) & 0x7, 3);
+		PutBits(&ld2, 0x1, 1);
+		PutBits(&ld2, (pts >> 15) & 0x7fff, 15);
+		PutBits(&ld2, 0x1, 1);
+		PutBits(&ld2, pts & 0x7fff, 15);
+		PutBits(&ld2, 0x1, 1);
+	}
+
+	if (pic_start_code)
+	{
+		PutBits(&ld2, 0x0, 8);
+		PutBits(&ld2, 0x0, 8);
+		PutBits(&ld2, 0x1, 8); // Start Code
+		PutBits(&ld2, pic_start_code & 0xff, 8); // 00, for picture start
+		PutBits(&ld2, (pic_start_code >> 8) & 0xff, 8); // For any extra information (like in mpeg4p2, the pic_start_code)
+	}
+
+	FlushBits(&ld2);
+
+	return (ld2.Ptr - data);
+}
+
+static void Dump(const char *name, const uint8_t *buf, int len)
+{
+	int i;
+	printf("  %-4s", name);
+	for (i = 0; i < len; i++)
+		printf(" %02x", buf[i]);
+	printf("\n");
+}
+
+static void CheckPesHeader(int32_t size, uint8_t stream_id, uint64_t pts, int32_t pic_start_code)
+{
+	uint8_t ref[BUF_SIZE], buf[BUF_SIZE];
+	int32_t ref_len, len;
+
+	memset(ref, 0xaa, sizeof(ref));
+	memset(buf, 0xaa, sizeof(buf));
+	ref_len = RefInsertPesHeader(ref, size, stream_id, pts, pic_start_code);
+	len = InsertPesHeader(buf, size, stream_id, pts, pic_start_code);
+
+	if (len != ref_len || memcmp(ref, buf, sizeof(buf)))
+	{
+		printf("InsertPesHeader(size %d, stream_id 0x%02x, pts 0x%llx, pic_start_code 0x%x): length %d, expected %d\n",
+			size, stream_id, (unsigned long long)pts, pic_start_code, len, ref_len);
+		Dump("got", buf, sizeof(buf));
+		Dump("ref", ref, sizeof(ref));
+		failed++;
+	}
+}
+
+static void CheckPrivateDataHeader(int32_t payload_size)
+{
+	uint8_t ref[BUF_SIZE], buf[BUF_SIZE];
+	int32_t ref_len, len;
+
+	memset(ref, 0xaa, sizeof(ref));
+	memset(buf, 0xaa, sizeof(buf));
+	ref_len = RefInsertVideoPrivateDataHeader(ref, payload_size);
+	len = InsertVideoPrivateDataHeader(buf, payload_size);
+
+	if (len != ref_len || memcmp(ref, buf, sizeof(buf)))
+	{
+		printf("InsertVideoPrivateDataHeader(payload_size %d): length %d, expected %d\n", payload_size, len, ref_len);
+		Dump("got", buf, sizeof(buf));
+		Dump("ref", ref, sizeof(ref));
+		failed++;
+	}
+}
+
+/* the length field is patched in after the payload is known, it must
+ * read like InsertPesHeader() had been given the final size */
+static void CheckPayloadSize(int32_t size)
+{
+	uint8_t ref[BUF_SIZE], buf[BUF_SIZE];
+
+	memset(ref, 0xaa, sizeof(ref));
+	memset(buf, 0xaa, sizeof(buf));
+	InsertPesHeader(ref, size - 3, MPEG_VIDEO_PES_START_CODE, INVALID_PTS_VALUE, 0);
+	InsertPesHeader(buf, 0, MPEG_VIDEO_PES_START_CODE, INVALID_PTS_VALUE, 0);
+	UpdatePesHeaderPayloadSize(buf, size);
+
+	if (memcmp(ref, buf, sizeof(buf)))
+	{
+		printf("UpdatePesHeaderPayloadSize(size %d)\n", size);
+		Dump("got", buf, sizeof(buf));
+		Dump("ref", ref, sizeof(ref));
+		failed++;
+	}
+}
+
+static uint64_t rnd_state = 0x2545f4914f6cdd1dull;
+
+static uint64_t Rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct
+{
+	int32_t  size;
+	uint8_t  stream_id;
+	uint64_t pts;
+	int32_t  pic_start_code;
+} PesArgs_t;
+
+static void RandomArgs(PesArgs_t *a)
+{
+	uint64_t r = Rnd();
+
+	/* mostly sizes around the 16 bit limit and the 33 bit PTS range */
+	a->size = (r & 1) ? (int32_t)(Rnd() % 70000) - 100 : (int32_t)Rnd();
+	if (a->size > INT32_MAX - 13)
+		a->size = INT32_MAX - 13;
+	a->stream_id = Rnd() & 0xff;
+	a->pts = (r & 2) ? Rnd() & 0x1ffffffffull : (r & 4) ? INVALID_PTS_VALUE : Rnd();
+	a->pic_start_code = (r & 8) ? 0 : (int32_t)Rnd();
+}
+
+static double Bench(int32_t (*insert)(uint8_t *, int32_t, uint8_t, uint64_t, int32_t), const PesArgs_t *args, int num, int loops)
+{
+	static uint8_t buf[BUF_SIZE];
+	volatile int32_t sum = 0;
+	double start = now();
+	int i, j;
+
+	for (j = 0; j < loops; j++)
+		for (i = 0; i < num; i++)
+			sum += insert(buf, args[i].size, args[i].stream_id, args[i].pts, args[i].pic_start_code);
+
+	return (now() - start) * 1e9 / ((double)num * loops);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pes_check [-n random cases] [-l benchmark loops]\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const int32_t sizes[] =
+	{
+		INT32_MIN, -65536, -100, -1, 0, 1, 2, 255, 256,
+		MAX_PES_PACKET_SIZE - 16, MAX_PES_PACKET_SIZE - 13, MAX_PES_PACKET_SIZE - 12,
+		MAX_PES_PACKET_SIZE - 8, MAX_PES_PACKET_SIZE - 7, MAX_PES_PACKET_SIZE - 4,
+		MAX_PES_PACKET_SIZE - 3, MAX_PES_PACKET_SIZE - 2, MAX_PES_PACKET_SIZE,
+		MAX_PES_PACKET_SIZE + 1, 0x10000, 0xffffff, INT32_MAX - 13
+	};
+	static const uint64_t ptss[] =
+	{
+		0, 1, 0x7fff, 0x8000, 0x3fffffff, 0x40000000, 0x1fffffffeull, 0x1ffffffffull,
+		INVALID_PTS_VALUE, INVALID_PTS_VALUE + 1, 0x3ffffffffull, 0xffffffffffffffffull
+	};
+	static const uint8_t stream_ids[] =
+	{
+		0x00, PCM_PES_START_CODE, MPEG_AUDIO_PES_START_CODE, AAC_AUDIO_PES_START_CODE,
+		MPEG_VIDEO_PES_START_CODE, H264_VIDEO_PES_START_CODE, VC1_VIDEO_PES_START_CODE,
+		H263_VIDEO_PES_START_CODE, 0xff
+	};
+	static const int32_t pic_start_codes[] =
+	{
+		0, 0x00000001, 0xb6, 0x1b6, 0xff00, 0x12345678, -1
+	};
+	static const int32_t payload_sizes[] =
+	{
+		INT32_MIN, -1, 0, 1, 0xff, 0x100, 0xffff, 0x10000, 0xffffff, 0x1000000, INT32_MAX
+	};
+	int num = 1000000;
+	int loops = 10;
+	int c;
+	size_t a, b, d, e;
+	PesArgs_t *args;
+
+	while ((c = getopt(argc, argv, "n:l:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				num = atoi(optarg);
+				break;
+			case 'l':
+				loops = atoi(optarg);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (num < 1)
+		num = 1;
+	if (loops < 1)
+		loops = 1;
+
+	for (a = 0; a < sizeof(sizes) / sizeof(sizes[0]); a++)
+		for (b = 0; b < sizeof(stream_ids); b++)
+			for (d = 0; d < sizeof(ptss) / sizeof(ptss[0]); d++)
+				for (e = 0; e < sizeof(pic_start_codes) / sizeof(pic_start_codes[0]); e++)
+					CheckPesHeader(sizes[a], stream_ids[b], ptss[d], pic_start_codes[e]);
+
+	for (a = 0; a < sizeof(payload_sizes) / sizeof(payload_sizes[0]); a++)
+		CheckPrivateDataHeader(payload_sizes[a]);
+
+	/* InsertPesHeader() adds at least 3 bytes to a positive size */
+	for (a = 0; a < sizeof(sizes) / sizeof(sizes[0]); a++)
+		if (sizes[a] > 3)
+			CheckPayloadSize(sizes[a]);
+
+	args = malloc(num * sizeof(*args));
+	if (!args)
+		return 1;
+	for (a = 0; a < (size_t)num; a++)
+	{
+		RandomArgs(&args[a]);
+		CheckPesHeader(args[a].size, args[a].stream_id, args[a].pts, args[a].pic_start_code);
+		CheckPrivateDataHeader(args[a].size);
+		if (failed > 10)
+			break;
+	}
+
+	if (failed)
+	{
+		printf("pes_check: %d mismatches\n", failed);
+		free(args);
+		return 1;
+	}
+
+	printf("pes_check: ok (%d random cases)\n", num);
+	printf("%-24s %10s\n", "InsertPesHeader", "ns/header");
+	printf("%-24s %10.1f\n", "PutBits", Bench(RefInsertPesHeader, args, num, loops));
+	printf("%-24s %10.1f\n", "direct", Bench(InsertPesHeader, args, num, loops));
+
+	free(args);
+	return 0;
+}
@@ -0,0 +1,12 @@
+#!/bin/sh
+# make check: replay the packet dumps in tests/writer through the writers
+# and compare the written streams to the golden files next to them
+
+srcdir=${srcdir:-.}
+ret=0
+
+for dump in "$srcdir"/tests/writer/*.avdump; do
+	./writer_bench -n 1 "$dump" "${dump%.avdump}" || ret=1
+done
+
+exit $ret
@@ -24,7 +24,9 @@
 
 #include "audio_lib.h"
 #include "dmx_hal.h"
+#include "dmx_reader.h"
 #include "hal_debug.h"
+#include "zap_timing.h"
 
 #define hal_debug(args...) _hal_debug(HAL_DEBUG_AUDIO, this, args)
 #define hal_info(args...) _hal_info(HAL_DEBUG_AUDIO, this, args)
@@ -42,22 +44,20 @@ extern "C" {
 }
 /* ffmpeg buf 2k */
 #define INBUF_SIZE 0x0800
-/* my own buf 16k */
-#define DMX_BUF_SZ 0x4000
 
 cAudio *audioDecoder = NULL;
 extern cDemux *audioDemux;
-static uint8_t *dmxbuf = NULL;
-static int bufpos;
+static cDemuxReader dmx_reader;
 
 extern bool HAL_nodec;
+extern bool HAL_fastzap;
 
 static cAudio *gThiz = NULL;
 
 static ao_device *adevice = NULL;
 static ao_sample_format sformat;
 
-static AVCodecContext *c = NULL;
+static AVCodecContext *c = NULL; /* kept open across zaps in fast zap mode */
 static AVCodecParameters *p = NULL;
 #if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(58, 133, 100)
 static void get_packet_defaults(AVPacket *pkt)
@@ -70,12 +70,33 @@ static void get_packet_defaults(AVPacket *pkt)
 }
 #endif
 
+static AVCodecID codec_for_stream_type(int type)
+{
+	switch (type)
+	{
+		case AUDIO_FMT_MPEG:
+		case AUDIO_FMT_MPG1:
+			return AV_CODEC_ID_MP2;
+		case AUDIO_FMT_MP3:
+			return AV_CODEC_ID_MP3;
+		case AUDIO_FMT_DOLBY_DIGITAL:
+			return AV_CODEC_ID_AC3;
+		case AUDIO_FMT_AAC:
+			return AV_CODEC_ID_AAC;
+		case AUDIO_FMT_AAC_PLUS:
+			return AV_CODEC_ID_AAC_LATM;
+		case AUDIO_FMT_DD_PLUS:
+			return AV_CODEC_ID_EAC3;
+		case AUDIO_FMT_DTS:
+			return AV_CODEC_ID_DTS;
+		default:
+			return AV_CODEC_ID_NONE;
+	}
+}
+
 cAudio::cAudio(void *, void *, void *)
 {
 	thread_started = false;
-	if (!HAL_nodec)
-		dmxbuf = (uint8_t *)malloc(DMX_BUF_SZ);
-	bufpos = 0;
 	curr_pts = 0;
 	gThiz = this;
 	ao_initialize();
@@ -84,7 +105,6 @@ cAudio::cAudio(void *, void *, void *)
 cAudio::~cAudio(void)
 {
 	closeDevice();
-	free(dmxbuf);
 	if (adevice)
 		ao_close(adevice);
 	adevice = NULL;
@@ -117,7 +137,10 @@ int cAudio::Start(void)
 {
 	hal_debug("%s >\n", __func__);
 	if (! HAL_nodec)
+	{
+		dmx_reader.reset(); /* before the thread runs, a Stop() must not get lost */
 		OpenThreads::Thread::start();
+	}
 	hal_debug("%s <\n", __func__);
 	return 0;
 }
@@ -128,6 +151,7 @@ int cAudio::Stop(void)
 	if (thread_started)
 	{
 		thread_started = false;
+		dmx_reader.stop(); /* my_read() might be waiting for data */
 		OpenThreads::Thread::join();
 	}
 	hal_debug("%s <\n", __func__);
@@ -320,34 +344,15 @@ static int _my_read(void *, uint8_t *buf, int buf_size)
 	return gThiz->my_read(buf, buf_size);
 }
 
+/* read straight from the demux into the AVIO buffer */
 int cAudio::my_read(uint8_t *buf, int buf_size)
 {
-	int tmp = 0;
-	if (audioDecoder && bufpos < DMX_BUF_SZ - 4096)
-	{
-		while (bufpos < buf_size && ++tmp < 20) /* retry max 20 times */
-		{
-			int ret = audioDemux->Read(dmxbuf + bufpos, DMX_BUF_SZ - bufpos, 10);
-			if (ret > 0)
-				bufpos += ret;
-			if (! thread_started)
-				break;
-		}
-	}
-	if (bufpos == 0)
-		return 0;
-	//hal_info("%s buf_size %d bufpos %d th %d tmp %d\n", __func__, buf_size, bufpos, thread_started, tmp);
-	if (bufpos > buf_size)
-	{
-		memcpy(buf, dmxbuf, buf_size);
-		memmove(dmxbuf, dmxbuf + buf_size, bufpos - buf_size);
-		bufpos -= buf_size;
-		return buf_size;
-	}
-	memcpy(buf, dmxbuf, bufpos);
-	tmp = bufpos;
-	bufpos = 0;
-	return tmp;
+	if (!audioDecoder)
+		return AVERROR_EOF;
+	int ret = dmx_reader.read(audioDemux, buf, buf_size);
+	if (ret < 0)
+		return AVERROR_EOF; /* decoder is stopping */
+	return ret;
 }
 
 void cAudio::run()
@@ -384,12 +389,14 @@ void cAudio::run()
 	uint64_t o_layout; /* output channels layout */
 	char tmp[64] = "unknown";
 	int audio_stream_index = -1;
+	AVCodecID codec_id = AV_CODEC_ID_NONE;
 	int in_ch = 0;
 	int in_sr = 0;
 	uint64_t in_layout = 0;
 	bool output_ready = false;
 
 	curr_pts = 0;
+	p = NULL;
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 133, 100)
 	av_init_packet(&avpkt);
 #else
@@ -413,42 +420,67 @@ void cAudio::run()
 		hal_info("%s: avformat_open_input() failed.\n", __func__);
 		goto out;
 	}
-	ret = avformat_find_stream_info(avfc, NULL);
-	hal_debug("%s: avformat_find_stream_info: %d\n", __func__, ret);
-	if (avfc->nb_streams != 1)
-	{
-		hal_info("%s: nb_streams: %d, selecting audio stream\n", __func__, avfc->nb_streams);
-	}
-	for (unsigned int i = 0; i < avfc->nb_streams; i++)
+	/* in fast zap mode, trust the stream type from the PMT
+	 * instead of letting ffmpeg probe the stream */
+	if (HAL_fastzap)
+		codec_id = codec_for_stream_type(StreamType);
+	if (codec_id == AV_CODEC_ID_NONE)
 	{
-		if (avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+		ret = avformat_find_stream_info(avfc, NULL);
+		hal_debug("%s: avformat_find_stream_info: %d\n", __func__, ret);
+		if (avfc->nb_streams != 1)
 		{
-			audio_stream_index = i;
-			break;
+			hal_info("%s: nb_streams: %d, selecting audio stream\n", __func__, avfc->nb_streams);
 		}
+		for (unsigned int i = 0; i < avfc->nb_streams; i++)
+		{
+			if (avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+			{
+				audio_stream_index = i;
+				break;
+			}
+		}
+		if (audio_stream_index < 0)
+		{
+			hal_info("%s: no audio stream found\n", __func__);
+			goto out;
+		}
+		p = avfc->streams[audio_stream_index]->codecpar;
+		if (p->codec_type != AVMEDIA_TYPE_AUDIO)
+			hal_info("%s: stream %d no audio codec? 0x%x\n", __func__, audio_stream_index, p->codec_type);
+		codec_id = p->codec_id;
 	}
-	if (audio_stream_index < 0)
-	{
-		hal_info("%s: no audio stream found\n", __func__);
-		goto out;
-	}
-	p = avfc->streams[audio_stream_index]->codecpar;
-	if (p->codec_type != AVMEDIA_TYPE_AUDIO)
-		hal_info("%s: stream %d no audio codec? 0x%x\n", __func__, audio_stream_index, p->codec_type);
 
-	codec = avcodec_find_decoder(p->codec_id);
-	if (!codec)
+	if (c && c->codec_id == codec_id)
 	{
-		hal_info("%s: Codec for %s not found\n", __func__, avcodec_get_name(p->codec_id));
-		goto out;
+		/* same codec as before, just drop the old decoder state */
+		avcodec_flush_buffers(c);
+		hal_info("%s: fast zap, reusing %s decoder\n", __func__, avcodec_get_name(codec_id));
 	}
-	if (c)
-		av_free(c);
-	c = avcodec_alloc_context3(codec);
-	if (avcodec_open2(c, codec, NULL) < 0)
+	else
 	{
-		hal_info("%s: avcodec_open2() failed\n", __func__);
-		goto out;
+		if (c)
+		{
+			avcodec_close(c);
+			av_free(c);
+			c = NULL;
+		}
+		codec = avcodec_find_decoder(codec_id);
+		if (!codec)
+		{
+			hal_info("%s: Codec for %s not found\n", __func__, avcodec_get_name(codec_id));
+			goto out;
+		}
+		c = avcodec_alloc_context3(codec);
+		if (avcodec_open2(c, codec, NULL) < 0)
+		{
+			hal_info("%s: avcodec_open2() failed\n", __func__);
+			/* never keep an unopened context for the next fast zap */
+			avcodec_close(c);
+			av_free(c);
+			c = NULL;
+			goto out;
+		}
 	}
 	frame = av_frame_alloc();
 	if (!frame)
@@ -461,7 +493,8 @@ void cAudio::run()
 		int gotframe = 0;
 		if (av_read_frame(avfc, &avpkt) < 0)
 			break;
-		if (avpkt.stream_index != audio_stream_index)
+		/* without probing, the audio PID is the only stream anyway */
+		if (audio_stream_index >= 0 && avpkt.stream_index != audio_stream_index)
 		{
 			av_packet_unref(&avpkt);
 			continue;
@@ -492,16 +525,16 @@ void cAudio::run()
 		{
 			if (!output_ready)
 			{
-				in_sr = frame->sample_rate ? frame->sample_rate : (c->sample_rate ? c->sample_rate : p->sample_rate);
-				in_ch = frame->channels ? frame->channels : (c->channels ? c->channels : p->channels);
-				in_layout = frame->channel_layout ? frame->channel_layout : (c->channel_layout ? c->channel_layout : p->channel_layout);
+				in_sr = frame->sample_rate ? frame->sample_rate : (c->sample_rate ? c->sample_rate : (p ? p->sample_rate : 0));
+				in_ch = frame->channels ? frame->channels : (c->channels ? c->channels : (p ? p->channels : 0));
+				in_layout = frame->channel_layout ? frame->channel_layout : (c->channel_layout ? c->channel_layout : (p ? p->channel_layout : 0));
 				if (in_layout == 0 && in_ch > 0)
 					in_layout = av_get_default_channel_layout(in_ch);
 				if (in_sr == 0 || in_ch == 0)
 				{
 					av_get_sample_fmt_string(tmp, sizeof(tmp), c->sample_fmt);
 					hal_info("Header missing %s, sample_fmt %d (%s) sample_rate %d channels %d\n",
-						avcodec_get_name(p->codec_id), c->sample_fmt, tmp, in_sr, in_ch);
+						avcodec_get_name(c->codec_id), c->sample_fmt, tmp, in_sr, in_ch);
 					av_packet_unref(&avpkt);
 					continue;
 				}
@@ -542,7 +575,7 @@ void cAudio::run()
 #endif
 				av_get_sample_fmt_string(tmp, sizeof(tmp), c->sample_fmt);
 				hal_info("decoding %s, sample_fmt %d (%s) sample_rate %d channels %d\n",
-					avcodec_get_name(p->codec_id), c->sample_fmt, tmp, in_sr, in_ch);
+					avcodec_get_name(c->codec_id), c->sample_fmt, tmp, in_sr, in_ch);
 				swr = swr_alloc_set_opts(swr,
 						o_layout, AV_SAMPLE_FMT_S16, o_sr, /* output */
 						in_layout, c->sample_fmt, in_sr, /* input */
@@ -589,10 +622,14 @@ void cAudio::run()
 out3:
 	av_frame_free(&frame);
 out2:
-	avcodec_close(c);
-	av_free(c);
-	c = NULL;
+	if (!HAL_fastzap)
+	{
+		avcodec_close(c);
+		av_free(c);
+		c = NULL;
+	}
 out:
+	p = NULL;
 	avformat_close_input(&avfc);
 	av_free(pIOCtx->buffer);
 	av_free(pIOCtx);
@@ -45,6 +45,7 @@
 #include <clutter/x11/clutter-x11.h>
 
 #include "hal_debug.h"
+#include "zap_timing.h"
 
 #define hal_debug_c(args...) _hal_debug(HAL_DEBUG_INIT, NULL, args)
 #define hal_info_c(args...) _hal_info(HAL_DEBUG_INIT, NULL, args)
@@ -82,6 +83,11 @@ void GLFramebuffer::blit()
 	glfb_priv->blit();
 }
 
+void GLFramebuffer::blit(int x, int y, int dx, int dy)
+{
+	glfb_priv->blit(x, y, dx, dy);
+}
+
 GLFbPC::GLFbPC(int x, int y, std::vector<unsigned char> &buf): mReInit(true), mShutDown(false), mInitDone(false)
 {
 	osd_buf = &buf;
@@ -101,6 +107,8 @@ GLFbPC::GLFbPC(int x, int y, std::vector<unsigned char> &buf): mReInit(true), mS
 	const char *tmp = getenv("GLFB_FULLSCREEN");
 	mFullscreen = !!(tmp);
 
+	mDamage.unknown = true;
+	mDamage.x0 = mDamage.y0 = mDamage.x1 = mDamage.y1 = 0;
 	mState.blit = true;
 	last_apts = 0;
 
@@ -434,6 +442,12 @@ void GLFbPC::render()
 	clutter_timeline_start(tl);
 }
 
+void GLFbPC::blit(int, int, int, int)
+{
+	/* clutter_image_set_data() always takes the whole image anyway */
+	blit();
+}
+
 void GLFbPC::bltOSDBuffer()
 {
 	// hal_info("%s\n", __func__);
@@ -465,9 +479,13 @@ void GLFbPC::bltDisplayBuffer()
 		return;
 	}
 	warn = true;
+	hal_zap_mark(HAL_ZAP_DISPLAY);
 	int w = buf->width(), h = buf->height();
 	if (w == 0 || h == 0)
+	{
+		videoDecoder->putDecBuf(buf);
 		return;
+	}
 
 	AVRational a = buf->AR();
 	if (a.den != 0 && a.num != 0 && av_cmp_q(a, _mVA))
@@ -517,5 +535,6 @@ void GLFbPC::bltDisplayBuffer()
 			sleep_us = 1;
 	}
 	hal_debug("vpts: 0x%" PRIx64 " apts: 0x%" PRIx64 " diff: %6.3f sleep_us %d buf %d\n",
-		buf->pts(), apts, (buf->pts() - apts) / 90000.0, sleep_us, videoDecoder->buf_num);
+		buf->pts(), apts, (buf->pts() - apts) / 90000.0, sleep_us, videoDecoder->buf_num());
+	videoDecoder->putDecBuf(buf); /* the decoder may reuse it now */
 }
@@ -25,13 +25,18 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 #include <cstring>
 #include <cstdio>
 #include <string>
 #include <sys/ioctl.h>
 #include "dmx_hal.h"
+#include "dmx_reader.h"
 #include "hal_debug.h"
+#include "zap_timing.h"
+#include "hal_metrics.h"
 
 #include "video_lib.h"
 /* needed for getSTC... */
@@ -70,6 +75,28 @@ static const char *devname[] =
 	"/dev/dvb/adapter0/demux0"
 };
 
+/* export HAL_FAKE_DMX=<dir> to read from <dir>/video, <dir>/audio, ...
+ * instead of the demux device, e.g. FIFOs fed by libstb-hal-bench.
+ * The filter ioctls are skipped then, the feeder does the PID filtering
+ * and writes whole sections to "psi" */
+static const char *fake_dmx_name[] =
+{
+	"invalid",
+	"video",
+	"audio",
+	"pes",
+	"psi",
+	"pip",
+	"tp",
+	"pcr"
+};
+/* read when a demux is opened, not at static initialization time,
+ * so that a program can still set it in main() */
+static const char *fake_dmx_dir(void)
+{
+	return getenv("HAL_FAKE_DMX");
+}
+
 /* uuuugly */
 static int dmx_tp_count = 0;
 #define MAX_TS_COUNT 8
@@ -105,10 +132,15 @@ bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBuffe
 	if (pes_type != DMX_PSI_CHANNEL)
 		flags |= O_NONBLOCK;
 
-	fd = open(devname[devnum], flags);
+	std::string dev = devname[devnum];
+	const char *fake = fake_dmx_dir();
+	if (fake)
+		dev = std::string(fake) + "/" + fake_dmx_name[pes_type];
+
+	fd = open(dev.c_str(), flags);
 	if (fd < 0)
 	{
-		hal_info("%s %s: %m\n", __FUNCTION__, devname[devnum]);
+		hal_info("%s %s: %m\n", __FUNCTION__, dev.c_str());
 		return false;
 	}
 	hal_debug("%s #%d pes_type: %s(%d), uBufferSize: %d fd: %d\n",
@@ -128,7 +160,7 @@ bool cDemux::Open(DMX_CHANNEL_TYPE pes_type, void * /*hVideoBuffer*/, int uBuffe
 	if (ioctl(fd, DMX_SET_SOURCE, &n) < 0)
 		hal_info("%s DMX_SET_SOURCE %d failed! (%m)\n", __func__, n);
 #endif
-	if (uBufferSize > 0)
+	if (uBufferSize > 0 && !fake)
 	{
 		/* probably uBufferSize == 0 means "use default size". TODO: find a reasonable default */
 		if (ioctl(fd, DMX_SET_BUFFER_SIZE, uBufferSize) < 0)
@@ -211,6 +243,8 @@ int cDemux::Read(unsigned char *buff, int len, int timeout)
 
 	if (to > 0)
 	{
+		static hal_metric *read_wait = hal_metric_histogram("hal_demux_read_wait_seconds", "time cDemux::Read waited for data");
+		int64_t t0 = hal_metric_now();
 retry:
 		rc = ::poll(&ufds, 1, to);
 		if (!rc)
@@ -242,12 +276,20 @@ retry:
 			dmx_err("received %s, please report!", "POLLIN", ufds.revents);
 			return 0;
 		}
+		hal_metric_observe(read_wait, hal_metric_now() - t0);
 	}
 
 	rc = ::read(fd, buff, len);
 	//fprintf(stderr, "fd %d ret: %d\n", fd, rc);
 	if (rc < 0)
 		dmx_err("read: %s", strerror(errno), 0);
+	if (rc > 0 && dmx_type == DMX_PSI_CHANNEL)
+	{
+		if (flt == 0x00)
+			hal_zap_mark(HAL_ZAP_PAT);
+		else if (flt == 0x02)
+			hal_zap_mark(HAL_ZAP_PMT);
+	}
 
 	return rc;
 }
@@ -378,6 +420,8 @@ bool cDemux::sectionFilter(unsigned short _pid, const unsigned char *const filte
 		fprintf(stderr, "\n");
 	}
 
+	if (fake_dmx_dir())
+		return true;
 	ioctl(fd, DMX_STOP);
 	if (ioctl(fd, DMX_SET_FILTER, &s_flt) < 0)
 		return false;
@@ -437,6 +481,8 @@ bool cDemux::pesFilter(const unsigned short _pid)
 			hal_info("%s #%d invalid dmx_type %d!\n", __func__, num, dmx_type);
 			return false;
 	}
+	if (fake_dmx_dir())
+		return true;
 	return (ioctl(fd, DMX_SET_PES_FILTER, &p_flt) >= 0);
 }
 
@@ -472,6 +518,8 @@ bool cDemux::addPid(unsigned short Pid)
 	pfd.fd = fd; /* dummy */
 	pfd.pid = Pid;
 	pesfds.push_back(pfd);
+	if (fake_dmx_dir())
+		return true;
 	ret = (ioctl(fd, DMX_ADD_PID, &Pid));
 	if (ret < 0)
 		hal_info("%s: DMX_ADD_PID (%m)\n", __func__);
@@ -527,3 +575,91 @@ int cDemux::GetSource(int unit)
 	hal_info_c("%s(%d): not implemented yet\n", __func__, unit);
 	return 0;
 }
+
+cDemuxReader::cDemuxReader()
+{
+	stopped = false;
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd < 0)
+		hal_info_c("%s: eventfd: %m\n", __func__);
+}
+
+cDemuxReader::~cDemuxReader()
+{
+	if (wakeup_fd > -1)
+		close(wakeup_fd);
+}
+
+void cDemuxReader::stop(void)
+{
+	uint64_t one = 1;
+	stopped = true;
+	if (write(wakeup_fd, &one, sizeof(one)) < 0)
+		hal_info_c("%s: write: %m\n", __func__);
+}
+
+void cDemuxReader::reset(void)
+{
+	uint64_t dummy;
+	while (::read(wakeup_fd, &dummy, sizeof(dummy)) > 0)
+		;
+	stopped = false;
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* poll() at most that long, a closed or reopened demux fd is noticed then */
+#define DMX_READER_SLICE 100
+
+int cDemuxReader::read(cDemux *dmx, uint8_t *buf, int len, int timeout)
+{
+	struct pollfd pfd[2];
+	int64_t end = (timeout < 0) ? 0 : now_ms() + timeout;
+	pfd[1].fd = wakeup_fd;
+	pfd[1].events = POLLIN;
+	while (!stopped)
+	{
+		int wait = DMX_READER_SLICE;
+		if (timeout >= 0)
+		{
+			int64_t left = end - now_ms();
+			if (left <= 0)
+				return 0;
+			if (left < wait)
+				wait = left;
+		}
+		pfd[0].fd = dmx ? dmx->getFD() : -1;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = 0;
+		int ret = ::poll(pfd, 2, wait);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			hal_info_c("%s: poll: %m\n", __func__);
+			return -1;
+		}
+		if (stopped || (pfd[1].revents & POLLIN))
+			break;
+		if (ret == 0 || pfd[0].fd < 0 || pfd[0].fd != dmx->getFD())
+			continue;
+		if (pfd[0].revents & POLLHUP)
+		{
+			hal_info_c("%s: POLLHUP on fd %d\n", __func__, pfd[0].fd);
+			return -1;
+		}
+		/* the data is there, cDemux::Read() does not have to wait.
+		 * POLLERR is a buffer overflow, the read() reports and clears it */
+		ret = dmx->Read(buf, len, 0);
+		if (ret > 0)
+			return ret;
+		if (ret < 0 && errno != EAGAIN && errno != EINTR && errno != EOVERFLOW)
+			return -1;
+	}
+	return -1;
+}
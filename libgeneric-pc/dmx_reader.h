@@ -0,0 +1,44 @@
+/*
+ * (C) 2026 libstb-hal contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * feeds the ffmpeg AVIO read callbacks of the software decoders
+ * directly from a cDemux. read() waits until the demux has data, the
+ * timeout expires or stop() is called, e.g. when the decoder is stopped.
+ */
+
+#ifndef __DMX_READER_H__
+#define __DMX_READER_H__
+
+#include <inttypes.h>
+#include <atomic>
+#include "dmx_hal.h"
+
+class cDemuxReader
+{
+	public:
+		cDemuxReader();
+		~cDemuxReader();
+		/* returns > 0 bytes read, 0 if nothing arrived within timeout ms
+		 * (-1 waits forever) or -1 if stopped or on errors */
+		int read(cDemux *dmx, uint8_t *buf, int len, int timeout = -1);
+		void stop(void); /* read() returns -1 until reset() */
+		void reset(void);
+	private:
+		int wakeup_fd;
+		std::atomic<bool> stopped;
+};
+
+#endif // __DMX_READER_H__
@@ -24,6 +24,7 @@
 
 #include "config.h"
 #include <vector>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <signal.h>
@@ -43,6 +44,7 @@
 #include "audio_lib.h"
 
 #include "hal_debug.h"
+#include "zap_timing.h"
 
 #define hal_debug_c(args...) _hal_debug(HAL_DEBUG_INIT, NULL, args)
 #define hal_info_c(args...) _hal_info(HAL_DEBUG_INIT, NULL, args)
@@ -80,6 +82,11 @@ void GLFramebuffer::blit()
 	glfb_priv->blit();
 }
 
+void GLFramebuffer::blit(int x, int y, int dx, int dy)
+{
+	glfb_priv->blit(x, y, dx, dy);
+}
+
 GLFbPC::GLFbPC(int x, int y, std::vector<unsigned char> &buf): mReInit(true), mShutDown(false), mInitDone(false)
 {
 	osd_buf = &buf;
@@ -99,7 +106,11 @@ GLFbPC::GLFbPC(int x, int y, std::vector<unsigned char> &buf): mReInit(true), mS
 	const char *tmp = getenv("GLFB_FULLSCREEN");
 	mFullscreen = !!(tmp);
 
+	mDamage.unknown = true;
+	mDamage.x0 = mDamage.y0 = mDamage.x1 = mDamage.y1 = 0;
 	mState.blit = true;
+	mState.pbo_map = NULL;
+	mState.pbo_fence = 0;
 	last_apts = 0;
 
 	/* linux framebuffer compat mode */
@@ -296,6 +307,26 @@ void GLFbPC::setupGLObjects()
 	glGenBuffers(1, &mState.pbo);
 	glGenBuffers(1, &mState.displaypbo);
 
+	/* the new OSD texture is undefined, the next blit has to upload all of it */
+	osd_shadow.clear();
+	mState.blit = true;
+
+	/* the OSD PBO has a fixed size, so allocate it only once. If the driver
+	 * can do it, keep it mapped all the time and just copy damaged areas into it */
+	GLsizeiptr osd_size = mState.width * mState.height * 4;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.pbo);
+	if (GLEW_ARB_buffer_storage && GLEW_ARB_sync)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, osd_size, NULL, flags);
+		mState.pbo_map = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, osd_size, flags);
+	}
+	if (mState.pbo_map)
+		hal_info("GLFB: using persistently mapped OSD PBO\n");
+	else
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, osd_size, NULL, GL_STREAM_DRAW_ARB);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
 	/* hack to start with black video buffer instead of white */
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.displaypbo);
 	glBufferData(GL_PIXEL_UNPACK_BUFFER, sizeof(buf), buf, GL_STREAM_DRAW_ARB);
@@ -307,10 +338,21 @@ void GLFbPC::setupGLObjects()
 
 void GLFbPC::releaseGLObjects()
 {
+	if (mState.pbo_fence)
+		glDeleteSync(mState.pbo_fence);
+	mState.pbo_fence = 0;
+	if (mState.pbo_map)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.pbo);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		mState.pbo_map = NULL;
+	}
 	glDeleteBuffers(1, &mState.pbo);
 	glDeleteBuffers(1, &mState.displaypbo);
 	glDeleteTextures(1, &mState.osdtex);
 	glDeleteTextures(1, &mState.displaytex);
+	osd_shadow.clear();
 }
 
 
@@ -410,6 +452,9 @@ void GLFbPC::render()
 		glEnable(GL_TEXTURE_2D);
 		glDisable(GL_DEPTH_TEST);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		/* do not trust the texture contents after a mode switch */
+		osd_shadow.clear();
+		mState.blit = true;
 	}
 	mReInitLock.unlock();
 	if (!mFullscreen && (*mX != glutGet(GLUT_WINDOW_WIDTH) || *mY != glutGet(GLUT_WINDOW_HEIGHT)))
@@ -587,18 +632,168 @@ void GLFbPC::drawSquare(float size, float x_factor)
 }
 
 
-void GLFbPC::bltOSDBuffer()
+void GLFbPC::blit(int x, int y, int dx, int dy)
+{
+	int x1 = std::min(x + dx, mState.width);
+	int y1 = std::min(y + dy, mState.height);
+	x = std::max(x, 0);
+	y = std::max(y, 0);
+	if (x >= x1 || y >= y1)
+		return;
+	mDamageLock.lock();
+	if (mDamage.x1 <= mDamage.x0)
+	{
+		mDamage.x0 = x;
+		mDamage.y0 = y;
+		mDamage.x1 = x1;
+		mDamage.y1 = y1;
+	}
+	else
+	{
+		mDamage.x0 = std::min(mDamage.x0, x);
+		mDamage.y0 = std::min(mDamage.y0, y);
+		mDamage.x1 = std::max(mDamage.x1, x1);
+		mDamage.y1 = std::max(mDamage.y1, y1);
+	}
+	mDamageLock.unlock();
+	mState.blit = true;
+}
+
+#define OSD_TILE 64 /* pixels per tile when searching for changed columns */
+
+/* compare the OSD buffer with what was uploaded last time and return
+ * the bounding box of the changes. osd_shadow is updated on the fly */
+bool GLFbPC::diffOSDBuffer(int &x0, int &y0, int &x1, int &y1)
+{
+	const int stride = mState.width * 4;
+	const unsigned char *cur = osd_buf->data();
+	unsigned char *old = osd_shadow.data();
+	int y;
+
+	for (y = 0; y < mState.height; y++)
+		if (memcmp(cur + y * stride, old + y * stride, stride))
+			break;
+	if (y == mState.height)
+		return false;
+	y0 = y;
+	for (y = mState.height - 1; y > y0; y--)
+		if (memcmp(cur + y * stride, old + y * stride, stride))
+			break;
+	y1 = y + 1;
+
+	const int tiles = (mState.width + OSD_TILE - 1) / OSD_TILE;
+	int t0 = tiles, t1 = -1;
+	for (y = y0; y < y1; y++)
+	{
+		const unsigned char *c = cur + y * stride;
+		const unsigned char *o = old + y * stride;
+		/* only look at the tiles outside the box found so far */
+		for (int t = 0; t < t0; t++)
+		{
+			int len = std::min(OSD_TILE, mState.width - t * OSD_TILE) * 4;
+			if (memcmp(c + t * OSD_TILE * 4, o + t * OSD_TILE * 4, len))
+			{
+				t0 = t;
+				break;
+			}
+		}
+		for (int t = tiles - 1; t > t1 && t >= t0; t--)
+		{
+			int len = std::min(OSD_TILE, mState.width - t * OSD_TILE) * 4;
+			if (memcmp(c + t * OSD_TILE * 4, o + t * OSD_TILE * 4, len))
+			{
+				t1 = t;
+				break;
+			}
+		}
+	}
+	if (t1 < t0) /* cannot happen, but be paranoid */
+	{
+		t0 = 0;
+		t1 = tiles - 1;
+	}
+	x0 = t0 * OSD_TILE;
+	x1 = std::min((t1 + 1) * OSD_TILE, mState.width);
+	return true;
+}
+
+void GLFbPC::uploadOSDRect(int x0, int y0, int x1, int y1)
 {
-	/* FIXME: copy each time */
+	const int stride = mState.width * 4;
+	const int w = x1 - x0;
+	const unsigned char *src = osd_buf->data();
+	unsigned char *shadow = osd_shadow.data();
+
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mState.pbo);
-	glBufferData(GL_PIXEL_UNPACK_BUFFER, osd_buf->size(), osd_buf->data(), GL_STREAM_DRAW_ARB);
+	if (mState.pbo_map)
+	{
+		/* the GPU might still be reading from the last upload */
+		if (mState.pbo_fence)
+		{
+			glClientWaitSync(mState.pbo_fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(mState.pbo_fence);
+			mState.pbo_fence = 0;
+		}
+		for (int y = y0; y < y1; y++)
+		{
+			size_t off = y * stride + x0 * 4;
+			memcpy(mState.pbo_map + off, src + off, w * 4);
+			memcpy(shadow + off, src + off, w * 4);
+		}
+	}
+	else
+	{
+		/* plain GL 1.5: transfer the complete lines of the damaged area */
+		size_t off = y0 * stride;
+		size_t len = (y1 - y0) * stride;
+		glBufferSubData(GL_PIXEL_UNPACK_BUFFER, off, len, src + off);
+		memcpy(shadow + off, src + off, len);
+	}
 
 	glBindTexture(GL_TEXTURE_2D, mState.osdtex);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mState.width, mState.height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, mState.width);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, w, y1 - y0, GL_BGRA, GL_UNSIGNED_BYTE,
+		(GLvoid *)(intptr_t)(y0 * stride + x0 * 4));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	if (mState.pbo_map)
+		mState.pbo_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
+void GLFbPC::bltOSDBuffer()
+{
+	bool unknown;
+	int x0, y0, x1, y1;
+
+	mDamageLock.lock();
+	unknown = mDamage.unknown;
+	x0 = mDamage.x0;
+	y0 = mDamage.y0;
+	x1 = mDamage.x1;
+	y1 = mDamage.y1;
+	mDamage.unknown = false;
+	mDamage.x0 = mDamage.y0 = mDamage.x1 = mDamage.y1 = 0;
+	mDamageLock.unlock();
+
+	if (osd_shadow.empty())
+	{
+		/* first blit, the texture is still undefined */
+		osd_shadow.resize(mState.width * mState.height * 4);
+		unknown = false;
+		x0 = y0 = 0;
+		x1 = mState.width;
+		y1 = mState.height;
+	}
+	else if (unknown && !diffOSDBuffer(x0, y0, x1, y1))
+		return; /* nothing changed */
+
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	hal_debug("GLFB::%s %d/%d %dx%d\n", __func__, x0, y0, x1 - x0, y1 - y0);
+	uploadOSDRect(x0, y0, x1, y1);
+}
+
 void GLFbPC::bltDisplayBuffer()
 {
 	if (!videoDecoder) /* cannot start yet */
@@ -613,9 +808,13 @@ void GLFbPC::bltDisplayBuffer()
 		return;
 	}
 	warn = true;
+	hal_zap_mark(HAL_ZAP_DISPLAY);
 	int w = buf->width(), h = buf->height();
 	if (w == 0 || h == 0)
+	{
+		videoDecoder->putDecBuf(buf);
 		return;
+	}
 
 	AVRational a = buf->AR();
 	if (a.den != 0 && a.num != 0 && av_cmp_q(a, _mVA))
@@ -661,5 +860,6 @@ void GLFbPC::bltDisplayBuffer()
 			sleep_us = 1;
 	}
 	hal_debug("vpts: 0x%" PRIx64 " apts: 0x%" PRIx64 " diff: %6.3f sleep_us %d buf %d\n",
-		buf->pts(), apts, (buf->pts() - apts) / 90000.0, sleep_us, videoDecoder->buf_num);
+		buf->pts(), apts, (buf->pts() - apts) / 90000.0, sleep_us, videoDecoder->buf_num());
+	videoDecoder->putDecBuf(buf); /* the decoder may reuse it now */
 }
@@ -58,8 +58,12 @@ class GLFbPC
 		}
 		void blit()
 		{
+			mDamageLock.lock();
+			mDamage.unknown = true; /* let the GL thread find out what changed */
+			mDamageLock.unlock();
 			mState.blit = true;
 		};
+		void blit(int x, int y, int dx, int dy);
 		fb_var_screeninfo getScreenInfo()
 		{
 			return si;
@@ -90,6 +94,7 @@ class GLFbPC
 		bool mFullscreen; /* fullscreen? */
 		bool mReInit; /* setup things for GL */
 		OpenThreads::Mutex mReInitLock;
+		OpenThreads::Mutex mDamageLock;
 		bool mShutDown; /* if set main loop is left */
 		bool mInitDone; /* condition predicate */
 		// OpenThreads::Condition mInitCond; /* condition variable for init */
@@ -97,6 +102,16 @@ class GLFbPC
 
 		std::vector<unsigned char> *osd_buf; /* silly bounce buffer */
 
+		struct
+		{
+			bool unknown; /* blit() without rectangle => diff against osd_shadow */
+			int x0, y0; /* union of all rectangles passed to blit(x, y, dx, dy) */
+			int x1, y1; /* exclusive, x1 <= x0 means "empty" */
+		} mDamage;
+#if USE_OPENGL
+		std::vector<unsigned char> osd_shadow; /* what the OSD texture currently contains */
+#endif
+
 #if USE_OPENGL
 		std::map<unsigned char, int> mKeyMap;
 		std::map<int, int> mSpecialMap;
@@ -118,6 +133,8 @@ class GLFbPC
 		void setupGLObjects(); /* PBOs, textures and stuff */
 		void releaseGLObjects();
 		void drawSquare(float size, float x_factor = 1); /* do not be square */
+		bool diffOSDBuffer(int &x0, int &y0, int &x1, int &y1); /* find the changed area */
+		void uploadOSDRect(int x0, int y0, int x1, int y1);
 #endif
 #if USE_CLUTTER
 		static bool keyboardcb(ClutterActor *actor, ClutterEvent *event, gpointer user_data);
@@ -137,6 +154,8 @@ class GLFbPC
 #if USE_OPENGL
 			GLuint osdtex; /* holds the OSD texture */
 			GLuint pbo; /* PBO we use for transfer to texture */
+			unsigned char *pbo_map; /* persistent mapping of pbo, if supported */
+			GLsync pbo_fence; /* last texture upload from the mapped pbo */
 			GLuint displaytex; /* holds the display texture */
 			GLuint displaypbo;
 #endif
@@ -12,6 +12,7 @@
 static bool initialized = false;
 GLFramebuffer *glfb = NULL;
 bool HAL_nodec = false;
+bool HAL_fastzap = true;
 
 void hal_api_init()
 {
@@ -44,6 +45,10 @@ void hal_api_init()
 	 * valgrind-check other parts... export HAL_NOAVDEC=1 */
 	if (getenv("HAL_NOAVDEC"))
 		HAL_nodec = true;
+	/* keep decoders open across zaps and skip stream probing if the
+	 * stream type is known. export HAL_NOFASTZAP=1 to disable */
+	if (getenv("HAL_NOFASTZAP"))
+		HAL_fastzap = false;
 	/* hack, this triggers that the simple_display thread does not blit() once per second... */
 	setenv("SPARK_NOBLIT", "1", 1);
 	initialized = true;
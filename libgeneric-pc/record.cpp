@@ -13,6 +13,8 @@
 
 #include "record_lib.h"
 #include "hal_debug.h"
+#include "hal_trace.h"
+#include "hal_metrics.h"
 #define hal_debug(args...) _hal_debug(HAL_DEBUG_RECORD, this, args)
 #define hal_info(args...) _hal_info(HAL_DEBUG_RECORD, this, args)
 
@@ -253,6 +255,8 @@ void cRecord::RecordThread()
 	a.aio_fildes = file_fd;
 	a.aio_sigevent.sigev_notify = SIGEV_NONE;
 
+	static hal_metric *read_bytes = hal_metric_counter("hal_record_read_bytes_total", "bytes read by the record threads");
+	static hal_metric *buffer_full = hal_metric_counter("hal_record_buffer_full_total", "record thread reads skipped because the buffer was full");
 	dmx->Start();
 	int overflow_count = 0;
 	bool overflow = false;
@@ -270,7 +274,7 @@ void cRecord::RecordThread()
 			if (toread > readsize)
 				toread = readsize;
 			ssize_t s = dmx->Read(buf + buf_pos, toread, 50);
-			hal_debug("%s: buf_pos %6d s %6d / %6d\n", __func__, buf_pos, (int)s, bufsize - buf_pos);
+			hal_trace(HAL_DEBUG_RECORD, HAL_TRACE_RECORD_READ, buf_pos, s, bufsize - buf_pos);
 			if (s < 0)
 			{
 				if (errno != EAGAIN && (errno != EOVERFLOW || !overflow))
@@ -285,6 +289,7 @@ void cRecord::RecordThread()
 			{
 				overflow = false;
 				buf_pos += s;
+				hal_metric_add(read_bytes, s);
 				if (count > 100)
 				{
 					if (buf_pos < bufsize / 2)
@@ -301,6 +306,7 @@ void cRecord::RecordThread()
 			if (!overflow)
 				overflow_count = 0;
 			overflow = true;
+			hal_metric_add(buffer_full, 1);
 			if (!(overflow_count % 10))
 				hal_info("%s: buffer full! Overflow? (%d)\n", __func__, ++overflow_count);
 			state = REC_STATUS_SLOW;
@@ -308,7 +314,7 @@ void cRecord::RecordThread()
 		r = aio_error(&a);
 		if (r == EINPROGRESS)
 		{
-			hal_debug("%s: aio in progress, free: %d\n", __func__, bufsize - buf_pos);
+			hal_trace(HAL_DEBUG_RECORD, HAL_TRACE_RECORD_AIO, -EINPROGRESS, bufsize - buf_pos, 0);
 			continue;
 		}
 		// not calling aio_return causes a memory leak --martii
@@ -320,7 +326,7 @@ void cRecord::RecordThread()
 			break;
 		}
 		else
-			hal_debug("%s: aio_return = %d, free: %d\n", __func__, r, bufsize - buf_pos);
+			hal_trace(HAL_DEBUG_RECORD, HAL_TRACE_RECORD_AIO, r, bufsize - buf_pos, 0);
 		if (posix_fadvise(file_fd, 0, 0, POSIX_FADV_DONTNEED))
 			perror("posix_fadvise");
 		if (queued)
@@ -339,6 +345,11 @@ void cRecord::RecordThread()
 			break;
 		}
 	}
+	if (exit_flag != RECORD_RUNNING && exit_flag != RECORD_STOPPED)
+	{
+		hal_trace(HAL_DEBUG_RECORD, HAL_TRACE_RECORD_FAIL, exit_flag, errno, 0);
+		hal_trace_dump(NULL);
+	}
 	dmx->Stop();
 	while (true) /* write out the unwritten buffer content */
 	{
@@ -19,8 +19,7 @@
  * cVideo implementation with decoder.
  * uses ffmpeg <http://ffmpeg.org> for demuxing / decoding
  * decoded frames are stored in SWFramebuffer class
- *
- * TODO: buffer handling surely needs some locking...
+ * and handed over to the GL thread via a lock-free frame queue
  */
 
 #include "config.h"
@@ -39,8 +38,6 @@ extern "C" {
 
 /* ffmpeg buf 32k */
 #define INBUF_SIZE 0x8000
-/* my own buf 256k */
-#define DMX_BUF_SZ 0x20000
 
 #if USE_OPENGL
 #define VDEC_PIXFMT AV_PIX_FMT_RGB32
@@ -51,8 +48,10 @@ extern "C" {
 
 #include "video_lib.h"
 #include "dmx_hal.h"
+#include "dmx_reader.h"
 #include "glfb_priv.h"
 #include "hal_debug.h"
+#include "zap_timing.h"
 #define hal_debug(args...) _hal_debug(HAL_DEBUG_VIDEO, this, args)
 #define hal_info(args...) _hal_info(HAL_DEBUG_VIDEO, this, args)
 #define hal_info_c(args...) _hal_info(HAL_DEBUG_VIDEO, NULL, args)
@@ -63,9 +62,11 @@ extern GLFbPC *glfb_priv;
 int system_rev = 0;
 
 extern bool HAL_nodec;
+extern bool HAL_fastzap;
 
-static uint8_t *dmxbuf;
-static int bufpos;
+static cDemuxReader dmx_reader;
+/* fast zap: the decoder context is kept open across Stop() / Start() */
+static AVCodecContext *fz_ctx = NULL;
 #if LIBAVCODEC_VERSION_INT > AV_VERSION_INT(58, 133, 100)
 static void get_packet_defaults(AVPacket *pkt)
 {
@@ -118,15 +119,24 @@ cVideo::cVideo(int, void *, void *, unsigned int)
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
 	av_register_all();
 #endif
-	if (!HAL_nodec)
-		dmxbuf = (uint8_t *)malloc(DMX_BUF_SZ);
-	bufpos = 0;
 	thread_running = false;
 	w_h_changed = false;
 	dec_w = dec_h = 0;
-	buf_num = 0;
-	buf_in = 0;
-	buf_out = 0;
+	/* export HAL_VDEC_BUFS=n to change the decoded frame queue depth */
+	int bufs = VDEC_DEFBUFS;
+	const char *tmp = getenv("HAL_VDEC_BUFS");
+	if (tmp)
+		bufs = atoi(tmp);
+	for (buf_depth = 4; buf_depth < bufs && buf_depth < VDEC_MAXBUFS;)
+		buf_depth *= 2;
+	hal_info("%s: decoded frame queue depth %d\n", __func__, buf_depth);
+	buf_w = 0;
+	buf_rel = 0;
+	buf_flush = 0;
+	buf_dropped = 0;
+	buf_pin = 0;
+	buf_r = 0;
+	buf_taken = 0;
 	pig_x = pig_y = pig_w = pig_h = 0;
 	pig_changed = false;
 	display_aspect = DISPLAY_AR_16_9;
@@ -161,11 +171,11 @@ int cVideo::getAspectRatio(void)
 	int ret = 0;
 	int w, h, ar;
 	AVRational a;
-	if (buf_num == 0)
-		goto out;
-	a = buffers[buf_out].AR();
-	w = buffers[buf_out].width();
-	h = buffers[buf_out].height();
+	int slot = pinBuf();
+	a = buffers[slot].AR();
+	w = buffers[slot].width();
+	h = buffers[slot].height();
+	unpinBuf();
 	if (a.den == 0 || h == 0)
 		goto out;
 	ar = w * 100 * a.num / h / a.den;
@@ -192,8 +202,12 @@ int cVideo::setCroppingMode(int)
 int cVideo::Start(void *, unsigned short, unsigned short, void *)
 {
 	hal_debug("%s running %d >\n", __func__, thread_running);
+	hal_zap_mark(HAL_ZAP_VIDEO_START);
 	if (!thread_running && !HAL_nodec)
+	{
+		dmx_reader.reset(); /* before the thread runs, a Stop() must not get lost */
 		OpenThreads::Thread::start();
+	}
 	hal_debug("%s running %d <\n", __func__, thread_running);
 	return 0;
 }
@@ -201,9 +215,11 @@ int cVideo::Start(void *, unsigned short, unsigned short, void *)
 int cVideo::Stop(bool)
 {
 	hal_debug("%s running %d >\n", __func__, thread_running);
+	hal_zap_arm();
 	if (thread_running)
 	{
 		thread_running = false;
+		dmx_reader.stop(); /* my_read() might be waiting for data */
 		OpenThreads::Thread::join();
 	}
 	hal_debug("%s running %d <\n", __func__, thread_running);
@@ -284,9 +300,7 @@ bool cVideo::ShowPicture(const char *fname)
 		return ret;
 	still_m.lock();
 	stillpicture = true;
-	buf_num = 0;
-	buf_in = 0;
-	buf_out = 0;
+	flushBufs();
 	still_m.unlock();
 
 	unsigned int i = 0;
@@ -396,32 +410,25 @@ bool cVideo::ShowPicture(const char *fname)
 			hal_info("%s: ERROR setting up SWS context\n", __func__);
 		else
 		{
-			buf_m.lock();
-			SWFramebuffer *f = &buffers[buf_in];
-			if (f->size() < need)
-				f->resize(need);
-			av_image_fill_arrays(rgbframe->data, rgbframe->linesize, &(*f)[0], VDEC_PIXFMT,
-				c->width, c->height, 1);
-			sws_scale(convert, frame->data, frame->linesize, 0, c->height,
-				rgbframe->data, rgbframe->linesize);
-			sws_freeContext(convert);
-			f->width(c->width);
-			f->height(c->height);
-			f->pts(AV_NOPTS_VALUE);
-			AVRational a = av_guess_sample_aspect_ratio(avfc, avfc->streams[stream_id], frame);
-			f->AR(a);
-			buf_in++;
-			buf_in %= VDEC_MAXBUFS;
-			buf_num++;
-			if (buf_num > (VDEC_MAXBUFS - 1))
+			/* the renderer has to catch up with the flush first */
+			SWFramebuffer *f = getFreeBuf(true);
+			if (f)
 			{
-				hal_debug("%s: buf_num overflow\n", __func__);
-				buf_out++;
-				buf_out %= VDEC_MAXBUFS;
-				buf_num--;
+				if (f->size() < need)
+					f->resize(need);
+				av_image_fill_arrays(rgbframe->data, rgbframe->linesize, &(*f)[0], VDEC_PIXFMT,
+					c->width, c->height, 1);
+				sws_scale(convert, frame->data, frame->linesize, 0, c->height,
+					rgbframe->data, rgbframe->linesize);
+				f->width(c->width);
+				f->height(c->height);
+				f->pts(AV_NOPTS_VALUE);
+				AVRational a = av_guess_sample_aspect_ratio(avfc, avfc->streams[stream_id], frame);
+				f->AR(a);
+				putFreeBuf();
+				ret = true;
 			}
-			buf_m.unlock();
-			ret = true;
+			sws_freeContext(convert);
 		}
 	}
 	av_packet_unref(&avpkt);
@@ -505,47 +512,121 @@ int cVideo::SetStreamType(VIDEO_FORMAT v)
 	return 0;
 }
 
+/* GL thread: take the next decoded frame, it is owned by the
+ * renderer until it is given back with putDecBuf() */
 cVideo::SWFramebuffer *cVideo::getDecBuf(void)
 {
-	buf_m.lock();
-	if (buf_num == 0)
+	unsigned int r = buf_r.load();
+	for (;;)
 	{
-		buf_m.unlock();
-		return NULL;
+		unsigned int flush = buf_flush.load(std::memory_order_acquire);
+		unsigned int n = ((int)(flush - r) > 0) ? flush : r;
+		if (n == buf_w.load(std::memory_order_acquire))
+		{
+			if (n == r)
+				return NULL;
+			/* flushed, nothing new yet */
+			if (buf_r.compare_exchange_weak(r, n))
+			{
+				buf_rel.store(n);
+				return NULL;
+			}
+			continue;
+		}
+		/* the decoder may have dropped frame r meanwhile, then try again */
+		if (buf_r.compare_exchange_weak(r, n + 1))
+		{
+			buf_taken = n;
+			buf_rel.store(n); /* frames skipped by a flush are free now */
+			return &buffers[n & (buf_depth - 1)];
+		}
 	}
-	SWFramebuffer *p = &buffers[buf_out];
-	buf_out++;
-	buf_num--;
-	buf_out %= VDEC_MAXBUFS;
-	buf_m.unlock();
-	return p;
 }
 
-static int my_read(void *, uint8_t *buf, int buf_size)
+void cVideo::putDecBuf(SWFramebuffer *)
+{
+	buf_rel.store(buf_taken + 1);
+}
+
+/* decoder: get the next free frame. With wait, give the renderer up to
+ * 100ms to catch up, e.g. after a flush. Without, a full queue drops its
+ * oldest frame so that the newest ones get displayed; the new frame is
+ * only dropped if the renderer still holds on to a frame after 10ms.
+ * One slot is always kept for the frame which was displayed last */
+cVideo::SWFramebuffer *cVideo::getFreeBuf(bool wait)
 {
-	int tmp = 0;
-	if (videoDecoder && bufpos < DMX_BUF_SZ - 4096)
+	unsigned int w = buf_w.load(std::memory_order_relaxed);
+	int slot = w & (buf_depth - 1);
+	for (int i = 0; i < 50; i++)
 	{
-		while (bufpos < buf_size && ++tmp < 20) /* retry max 20 times */
+		unsigned int rel = buf_rel.load();
+		if (w - rel < (unsigned int)buf_depth - 1 && buf_pin.load() != slot + 1)
+			return &buffers[slot];
+		if (!wait)
 		{
-			int ret = videoDemux->Read(dmxbuf + bufpos, DMX_BUF_SZ - bufpos, 20);
-			if (ret > 0)
-				bufpos += ret;
+			/* take the oldest queued frame away from the renderer. This is
+			 * only possible while it does not hold one (rel == r), the slot
+			 * is then released right away */
+			unsigned int r = buf_r.load();
+			if (w - rel >= (unsigned int)buf_depth - 1 && r == rel && r != w &&
+				buf_r.compare_exchange_strong(r, r + 1))
+			{
+				buf_rel.compare_exchange_strong(rel, r + 1);
+				buf_dropped++;
+				hal_debug("%s: frame queue full, %u frames dropped\n", __func__, buf_dropped.load());
+				continue;
+			}
+			if (i >= 5)
+				break;
 		}
+		usleep(2000);
 	}
-	if (bufpos == 0)
-		return 0;
-	if (bufpos > buf_size)
+	buf_dropped++;
+	hal_debug("%s: frame queue full, %u frames dropped\n", __func__, buf_dropped.load());
+	return NULL;
+}
+
+void cVideo::putFreeBuf(void)
+{
+	buf_w.fetch_add(1, std::memory_order_release);
+}
+
+/* decoder: make the renderer skip all frames which are queued right now */
+void cVideo::flushBufs(void)
+{
+	buf_flush.store(buf_w.load(std::memory_order_relaxed), std::memory_order_release);
+}
+
+/* other threads, with buf_m held: get the slot of the frame which was
+ * displayed last and protect it from being overwritten until unpinBuf() */
+int cVideo::pinBuf(void)
+{
+	unsigned int rel;
+	int slot;
+	do
 	{
-		memcpy(buf, dmxbuf, buf_size);
-		memmove(dmxbuf, dmxbuf + buf_size, bufpos - buf_size);
-		bufpos -= buf_size;
-		return buf_size;
+		rel = buf_rel.load();
+		slot = (rel - 1) & (buf_depth - 1);
+		buf_pin.store(slot + 1);
 	}
-	memcpy(buf, dmxbuf, bufpos);
-	tmp = bufpos;
-	bufpos = 0;
-	return tmp;
+	while (buf_rel.load() != rel);
+	return slot;
+}
+
+void cVideo::unpinBuf(void)
+{
+	buf_pin.store(0);
+}
+
+/* read straight from the demux into the AVIO buffer */
+static int my_read(void *, uint8_t *buf, int buf_size)
+{
+	if (!videoDecoder)
+		return AVERROR_EOF;
+	int ret = dmx_reader.read(videoDemux, buf, buf_size);
+	if (ret < 0)
+		return AVERROR_EOF; /* decoder is stopping */
+	return ret;
 }
 
 void cVideo::run(void)
@@ -569,11 +650,13 @@ void cVideo::run(void)
 	time_t warn_r = 0; /* last read error */
 	time_t warn_d = 0; /* last decode error */
 	int av_ret = 0;
+	AVCodecID codec_id = AV_CODEC_ID_NONE;
+	bool first_frame = true;
 
-	bufpos = 0;
-	buf_num = 0;
-	buf_in = 0;
-	buf_out = 0;
+	buf_dropped = 0;
+	still_m.lock();
+	flushBufs();
+	still_m.unlock();
 	dec_r = 0;
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 133, 100)
 	av_init_packet(&avpkt);
@@ -598,42 +681,70 @@ void cVideo::run(void)
 		hal_info("%s: Could not open input\n", __func__);
 		goto out;
 	}
-	while (avfc->nb_streams < 1)
+	/* in fast zap mode, trust the stream type from the PMT
+	 * instead of waiting for ffmpeg to find the stream */
+	if (HAL_fastzap)
+		codec_id = fallback_codec_for_format(v_format);
+	if (codec_id == AV_CODEC_ID_NONE)
 	{
-		hal_info("%s: nb_streams %d, should be 1 => retry\n", __func__, avfc->nb_streams);
-		if (av_read_frame(avfc, &avpkt) < 0)
-			hal_info("%s: av_read_frame < 0\n", __func__);
-		av_packet_unref(&avpkt);
-		if (! thread_running)
-			goto out;
-	}
+		while (avfc->nb_streams < 1)
+		{
+			hal_info("%s: nb_streams %d, should be 1 => retry\n", __func__, avfc->nb_streams);
+			if (av_read_frame(avfc, &avpkt) < 0)
+				hal_info("%s: av_read_frame < 0\n", __func__);
+			av_packet_unref(&avpkt);
+			if (! thread_running)
+				goto out;
+		}
 
-	p = avfc->streams[0]->codecpar;
-	if (p->codec_type != AVMEDIA_TYPE_VIDEO)
-		hal_info("%s: no video codec? 0x%x\n", __func__, p->codec_type);
+		p = avfc->streams[0]->codecpar;
+		if (p->codec_type != AVMEDIA_TYPE_VIDEO)
+			hal_info("%s: no video codec? 0x%x\n", __func__, p->codec_type);
 
-	if (p->codec_id == AV_CODEC_ID_NONE || p->codec_type != AVMEDIA_TYPE_VIDEO)
-	{
-		AVCodecID forced = fallback_codec_for_format(v_format);
-		if (forced != AV_CODEC_ID_NONE && forced != p->codec_id)
+		if (p->codec_id == AV_CODEC_ID_NONE || p->codec_type != AVMEDIA_TYPE_VIDEO)
 		{
-			hal_info("%s: codec id missing, forcing %s from stream type %d\n",
-				__func__, avcodec_get_name(forced), v_format);
-			p->codec_id = forced;
-			p->codec_type = AVMEDIA_TYPE_VIDEO;
+			AVCodecID forced = fallback_codec_for_format(v_format);
+			if (forced != AV_CODEC_ID_NONE && forced != p->codec_id)
+			{
+				hal_info("%s: codec id missing, forcing %s from stream type %d\n",
+					__func__, avcodec_get_name(forced), v_format);
+				p->codec_id = forced;
+				p->codec_type = AVMEDIA_TYPE_VIDEO;
+			}
 		}
+		codec_id = p->codec_id;
 	}
-	codec = avcodec_find_decoder(p->codec_id);
-	if (!codec)
+	if (fz_ctx && fz_ctx->codec_id == codec_id)
 	{
-		hal_info("%s: Codec for %s not found\n", __func__, avcodec_get_name(p->codec_id));
-		goto out;
+		/* same codec as before, just drop the old decoder state */
+		c = fz_ctx;
+		fz_ctx = NULL;
+		avcodec_flush_buffers(c);
+		hal_info("%s: fast zap, reusing %s decoder\n", __func__, avcodec_get_name(codec_id));
 	}
-	c = avcodec_alloc_context3(codec);
-	if (avcodec_open2(c, codec, NULL) < 0)
+	else
 	{
-		hal_info("%s: Could not open codec\n", __func__);
-		goto out;
+		if (fz_ctx)
+		{
+			avcodec_close(fz_ctx);
+			av_free(fz_ctx);
+			fz_ctx = NULL;
+		}
+		codec = avcodec_find_decoder(codec_id);
+		if (!codec)
+		{
+			hal_info("%s: Codec for %s not found\n", __func__, avcodec_get_name(codec_id));
+			goto out;
+		}
+		c = avcodec_alloc_context3(codec);
+		if (avcodec_open2(c, codec, NULL) < 0)
+		{
+			hal_info("%s: Could not open codec\n", __func__);
+			avcodec_close(c);
+			av_free(c);
+			c = NULL;
+			goto out;
+		}
 	}
 	frame = av_frame_alloc();
 	rgbframe = av_frame_alloc();
@@ -686,6 +797,11 @@ void cVideo::run(void)
 		if (!av_ret)
 			got_frame = 1;
 #endif
+		if (got_frame && first_frame)
+		{
+			hal_zap_mark(HAL_ZAP_IFRAME);
+			first_frame = false;
+		}
 		still_m.lock();
 		if (got_frame && ! stillpicture)
 		{
@@ -715,10 +831,8 @@ void cVideo::run(void)
 					SWS_BICUBIC, 0, 0, 0);
 			if (!convert)
 				hal_info("%s: ERROR setting up SWS context\n", __func__);
-			else
+			else if (SWFramebuffer *f = getFreeBuf(false))
 			{
-				buf_m.lock();
-				SWFramebuffer *f = &buffers[buf_in];
 				if (f->size() < need)
 					f->resize(need);
 				av_image_fill_arrays(rgbframe->data, rgbframe->linesize, &(*f)[0], VDEC_PIXFMT, c->width, c->height, 1);
@@ -750,20 +864,10 @@ void cVideo::run(void)
 					vpts += 90000 * 3 / 10; /* 300ms */
 #endif
 				f->pts(vpts);
-				AVRational a = av_guess_sample_aspect_ratio(avfc, avfc->streams[0], frame);
+				AVRational a = av_guess_sample_aspect_ratio(avfc, avfc->streams[avpkt.stream_index], frame);
 				f->AR(a);
-				buf_in++;
-				buf_in %= VDEC_MAXBUFS;
-				buf_num++;
-				if (buf_num > (VDEC_MAXBUFS - 1))
-				{
-					hal_debug("%s: buf_num overflow\n", __func__);
-					buf_out++;
-					buf_out %= VDEC_MAXBUFS;
-					buf_num--;
-				}
+				putFreeBuf();
 				dec_r = c->time_base.den / (c->time_base.num * c->ticks_per_frame);
-				buf_m.unlock();
 			}
 			hal_debug("%s: time_base: %d/%d, ticks: %d rate: %d pts 0x%" PRIx64 "\n",
 				__func__, c->time_base.num, c->time_base.den, c->ticks_per_frame, dec_r,
@@ -781,8 +885,13 @@ void cVideo::run(void)
 	}
 	sws_freeContext(convert);
 out2:
-	avcodec_close(c);
-	av_free(c);
+	if (HAL_fastzap)
+		fz_ctx = c;
+	else
+	{
+		avcodec_close(c);
+		av_free(c);
+	}
 	av_frame_free(&frame);
 	av_frame_free(&rgbframe);
 out:
@@ -790,15 +899,12 @@ out:
 	av_free(pIOCtx->buffer);
 	av_free(pIOCtx);
 	/* reset output buffers */
-	bufpos = 0;
 	still_m.lock();
 	if (!stillpicture)
-	{
-		buf_num = 0;
-		buf_in = 0;
-		buf_out = 0;
-	}
+		flushBufs();
 	still_m.unlock();
+	if (buf_dropped)
+		hal_info("%s: %u frames dropped, renderer too slow\n", __func__, buf_dropped.load());
 	hal_info("======================== end decoder thread ================================\n");
 }
 
@@ -883,7 +989,8 @@ bool cVideo::GetScreenImage(unsigned char *&data, int &xres, int &yres, bool get
 	if (get_video)
 	{
 		buf_m.lock();
-		video = buffers[buf_out];
+		video = buffers[pinBuf()];
+		unpinBuf();
 		buf_m.unlock();
 		vid_w = video.width();
 		vid_h = video.height();
@@ -982,10 +1089,10 @@ bool cVideo::GetScreenImage(unsigned char *&data, int &xres, int &yres, bool get
 
 int64_t cVideo::GetPTS(void)
 {
-	int64_t pts = 0;
+	int64_t pts;
 	buf_m.lock();
-	if (buf_num != 0)
-		pts = buffers[buf_out].pts();
+	pts = buffers[pinBuf()].pts();
+	unpinBuf();
 	buf_m.unlock();
 	return pts;
 }
@@ -4,6 +4,7 @@
 #include <OpenThreads/Thread>
 #include <OpenThreads/Mutex>
 #include <vector>
+#include <atomic>
 #include <linux/dvb/video.h>
 #include "cs_types.h"
 #include "dmx_hal.h"
@@ -144,7 +145,8 @@ typedef enum
 } VIDEO_CONTROL;
 
 
-#define VDEC_MAXBUFS 0x40
+#define VDEC_MAXBUFS 0x40 /* upper limit for HAL_VDEC_BUFS */
+#define VDEC_DEFBUFS 0x08 /* default decoded frame queue depth */
 class cVideo : public OpenThreads::Thread
 {
 		friend class GLFbPC;
@@ -155,7 +157,7 @@ class cVideo : public OpenThreads::Thread
 		class SWFramebuffer : public std::vector<unsigned char>
 		{
 			public:
-				SWFramebuffer() : mWidth(0), mHeight(0) {}
+				SWFramebuffer() : mWidth(0), mHeight(0), mPts(0) { mAR.num = 0; mAR.den = 0; }
 				void width(int w) { mWidth = w; }
 				void height(int h) { mHeight = h; }
 				void pts(uint64_t p) { mPts = p; }
@@ -170,7 +172,26 @@ class cVideo : public OpenThreads::Thread
 				int64_t mPts;
 				AVRational mAR;
 		};
-		int buf_in, buf_out, buf_num;
+		/* single producer (decoder thread or ShowPicture, serialized by still_m),
+		 * single consumer (GL thread) queue of decoded frames. The counters only
+		 * ever increase, the slot is counter & (buf_depth - 1). The frame last
+		 * released by the renderer stays untouched so that it can still be
+		 * looked at, e.g. for screenshots. When the queue is full, the decoder
+		 * drops the oldest queued frame by advancing buf_r itself. */
+		int buf_depth; /* power of 2 */
+		std::atomic<unsigned int> buf_w; /* frames published by the decoder */
+		std::atomic<unsigned int> buf_rel; /* frames released by the renderer */
+		std::atomic<unsigned int> buf_flush; /* renderer skips frames before this */
+		std::atomic<unsigned int> buf_dropped; /* frames dropped because the queue was full */
+		std::atomic<int> buf_pin; /* slot + 1 which must not be reused, 0 = none */
+		std::atomic<unsigned int> buf_r; /* frames taken by the renderer or dropped by the decoder */
+		unsigned int buf_taken; /* the frame the renderer holds, only used by the GL thread */
+		int buf_num() { return buf_w - buf_rel; }
+		SWFramebuffer *getFreeBuf(bool wait);
+		void putFreeBuf(void);
+		void flushBufs(void);
+		int pinBuf(void);
+		void unpinBuf(void);
 		int64_t GetPTS(void);
 
 	public:
@@ -231,6 +252,7 @@ class cVideo : public OpenThreads::Thread
 		void SetDemux(cDemux *dmx);
 		bool GetScreenImage(unsigned char *&data, int &xres, int &yres, bool get_video = true, bool get_osd = false, bool scale_to_video = false);
 		SWFramebuffer *getDecBuf(void);
+		void putDecBuf(SWFramebuffer *buf);
 
 	private:
 		void run();
@@ -241,7 +263,7 @@ class cVideo : public OpenThreads::Thread
 		bool thread_running;
 		VIDEO_FORMAT v_format;
 		VIDEO_STD v_std;
-		OpenThreads::Mutex buf_m;
+		OpenThreads::Mutex buf_m; /* serializes pinBuf() users */
 		DISPLAY_AR display_aspect;
 		DISPLAY_AR_MODE display_crop;
 		int output_h;
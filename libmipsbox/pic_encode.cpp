@@ -0,0 +1 @@
+../libarmbox/pic_encode.cpp
\ No newline at end of file
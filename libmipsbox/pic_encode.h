@@ -0,0 +1 @@
+../libarmbox/pic_encode.h
\ No newline at end of file
@@ -0,0 +1,165 @@
+/*
+ * decode a libstb-hal trace dump (see include/hal_trace.h)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "hal_trace.h"
+
+static const char *facility_name[] =
+{
+	"audio", "video", "demux", "play", "power", "init", "ca", "record", "player"
+};
+
+static const struct
+{
+	const char *name;
+	const char *args;	/* printf format for the three arguments */
+} event_desc[HAL_TRACE_EVENT_MAX] =
+{
+	{ "none",		"%d %d %d" },
+	{ "record_read",	"buf_pos=%d read=%d free=%d" },
+	{ "record_aio",		"result=%d free=%d" },
+	{ "record_fail",	"exit_flag=%d errno=%d" },
+	{ "ci_queue",		"slot=%d len=%d depth=%d" },
+	{ "ci_write",		"slot=%d len=%d latency=%dus" },
+	{ "ci_read",		"slot=%d len=%d" },
+	{ "ci_transmit",	"slot=%d len=%d result=%d" },
+};
+
+struct record
+{
+	struct hal_trace_entry e;
+	const struct hal_trace_thread *t;
+};
+
+static int cmp_ts(const void *a, const void *b)
+{
+	const struct record *ra = (const struct record *)a;
+	const struct record *rb = (const struct record *)b;
+	if (ra->e.ts < rb->e.ts)
+		return -1;
+	return ra->e.ts > rb->e.ts;
+}
+
+int main(int argc, char **argv)
+{
+	struct hal_trace_header hdr;
+	struct hal_trace_thread *threads;
+	struct record *rec = NULL;
+	size_t nrec = 0;
+	uint32_t i, j;
+	long size, left;
+	FILE *f;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: hal_trace_decode /tmp/hal-trace.bin\n");
+		return 1;
+	}
+	f = fopen(argv[1], "r");
+	if (!f)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, HAL_TRACE_MAGIC, sizeof(hdr.magic)))
+	{
+		fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+		return 1;
+	}
+	if (hdr.version != HAL_TRACE_VERSION)
+	{
+		fprintf(stderr, "%s: version %u, can only decode %u\n", argv[1], hdr.version, HAL_TRACE_VERSION);
+		return 1;
+	}
+
+	/* the counts come from the file, nothing can be larger than it */
+	left = size - (long)sizeof(hdr);
+	if (hdr.threads > left / sizeof(struct hal_trace_thread))
+	{
+		fprintf(stderr, "%s: bad thread count %u\n", argv[1], hdr.threads);
+		return 1;
+	}
+	threads = calloc(hdr.threads ? hdr.threads : 1, sizeof(*threads));
+	if (!threads)
+	{
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < hdr.threads; i++)
+	{
+		if (fread(&threads[i], sizeof(threads[i]), 1, f) != 1)
+			break;
+		threads[i].name[sizeof(threads[i].name) - 1] = 0;
+		left -= sizeof(threads[i]);
+		if (threads[i].count > left / sizeof(struct hal_trace_entry))
+		{
+			fprintf(stderr, "%s: bad entry count %u, truncated\n", argv[1], threads[i].count);
+			break;
+		}
+		left -= threads[i].count * sizeof(struct hal_trace_entry);
+		struct record *r = realloc(rec, (nrec + threads[i].count + 1) * sizeof(*rec));
+		if (!r)
+		{
+			perror("realloc");
+			break;
+		}
+		rec = r;
+		for (j = 0; j < threads[i].count; j++)
+		{
+			if (fread(&rec[nrec].e, sizeof(rec[nrec].e), 1, f) != 1)
+				break;
+			rec[nrec++].t = &threads[i];
+		}
+		if (j < threads[i].count)
+		{
+			fprintf(stderr, "%s: truncated\n", argv[1]);
+			break;
+		}
+	}
+	fclose(f);
+
+	/* all threads in one timeline */
+	qsort(rec, nrec, sizeof(*rec), cmp_ts);
+	for (i = 0; i < nrec; i++)
+	{
+		const struct hal_trace_entry *e = &rec[i].e;
+		uint64_t rel = e->ts - rec[0].e.ts;
+		printf("%6" PRIu64 ".%06" PRIu64 " %5u %-15s %-6s ", rel / 1000000000, (rel / 1000) % 1000000,
+			rec[i].t->tid, rec[i].t->name,
+			e->facility < sizeof(facility_name) / sizeof(facility_name[0]) ? facility_name[e->facility] : "?");
+		if (e->event < HAL_TRACE_EVENT_MAX)
+		{
+			printf("%-12s ", event_desc[e->event].name);
+			printf(event_desc[e->event].args, (int)e->arg[0], (int)e->arg[1], (int)e->arg[2]);
+		}
+		else
+			printf("event_%u %d %d %d", e->event, (int)e->arg[0], (int)e->arg[1], (int)e->arg[2]);
+		printf("\n");
+	}
+	free(rec);
+	free(threads);
+	return 0;
+}
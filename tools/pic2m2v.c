@@ -15,67 +15,207 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * fill the still picture cache of cVideo::ShowPicture() ahead of time,
+ * e.g. at image build time or at first boot. Uses the same conversion
+ * as ShowPicture() and writes the same cache files (see pic_cache.h).
+ */
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <time.h>
-#include <utime.h>
+#include <sys/stat.h>
 
-#define TARGETRES "1280x720"
+#include "pic_cache.h"
+#include "pic_encode.h"
 
-int main(int argc, char **argv)
+static char **files = NULL;
+static int num_files = 0;
+static int next_file = 0;
+static int force = 0;
+
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int converted = 0, cached = 0, failed = 0;
+static long long bytes_in = 0, bytes_out = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_file(const char *name)
 {
-	char destname[448];
-	char cmd[512];
-	char *p;
-	char *fname;
-	struct stat st, st2;
+	files = realloc(files, (num_files + 1) * sizeof(*files));
+	files[num_files++] = strdup(name);
+}
 
-	if (argc < 2)
+static int is_picture(const char *name)
+{
+	static const char *ext[] = { ".jpg", ".jpeg", ".png", ".bmp", ".gif", NULL };
+	const char *dot = strrchr(name, '.');
+	int i;
+	if (!dot)
+		return 0;
+	for (i = 0; ext[i]; i++)
+		if (!strcasecmp(dot, ext[i]))
+			return 1;
+	return 0;
+}
+
+static void add_path(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st))
 	{
-		fprintf(stderr, "usage: pic2m2v /path/pic1.jpg [/path/pic2.jpg...]\n\n");
-		return 1;
+		fprintf(stderr, "pic2m2v: could not stat '%s' (%m)\n", path);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode))
+	{
+		add_file(path);
+		return;
+	}
+	DIR *d = opendir(path);
+	if (!d)
+	{
+		fprintf(stderr, "pic2m2v: could not open '%s' (%m)\n", path);
+		return;
 	}
-	strcpy(destname, "/var/cache");
-	mkdir(destname, 0755);
-	argv++;
-	for (fname = *argv; fname != NULL; fname = *++argv)
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL)
 	{
-		if (stat(fname, &st2))
+		char name[4096];
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", path, e->d_name);
+		if (e->d_type == DT_DIR)
+			add_path(name);
+		else if (is_picture(e->d_name))
+			add_file(name);
+	}
+	closedir(d);
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+	while (1)
+	{
+		int i = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED);
+		if (i >= num_files)
+			break;
+		const char *fname = files[i];
+		struct stat st;
+		size_t len = 0;
+		unsigned char *data = NULL;
+		struct pic_cache_key key;
+		double t0 = now();
+
+		key.valid = 0;
+		if (!force && (data = pic_cache_get(fname, &len, &key)) != NULL)
 		{
-			fprintf(stderr, "pic2m2v: could not stat '%s' (%m)\n", fname);
+			free(data);
+			pthread_mutex_lock(&out_mutex);
+			cached++;
+			printf("cached     %s\n", fname);
+			pthread_mutex_unlock(&out_mutex);
 			continue;
 		}
-		strcpy(destname, "/var/cache");
-		/* the cache filename is (example for /share/tuxbox/neutrino/icons/radiomode.jpg):
-		   /var/cache/share.tuxbox.neutrino.icons.radiomode.jpg.m2v
-		   build that filename first...
-		   TODO: this could cause name clashes, use a hashing function instead... */
-		strcat(destname, fname);
-		p = &destname[strlen("/var/cache/")];
-		while ((p = strchr(p, '/')) != NULL)
-			* p = '.';
-		strcat(destname, ".m2v");
-		/* ...then check if it exists already... */
-		if (stat(destname, &st) || (st.st_mtime != st2.st_mtime) || (st.st_size == 0))
+		data = image_to_mpeg2(fname, &len);
+		int ok = data && pic_cache_add(fname, &key, data, len) == 0;
+		free(data);
+
+		pthread_mutex_lock(&out_mutex);
+		if (ok)
 		{
-			struct utimbuf u;
-			u.actime = time(NULL);
-			u.modtime = st2.st_mtime;
-			printf("converting %s -> %s\n", fname, destname);
-			/* it does not exist or has a different date, so call ffmpeg... */
-			sprintf(cmd, "ffmpeg -y -f mjpeg -i '%s' -s %s '%s' </dev/null",
-				fname, TARGETRES, destname);
-			system(cmd); /* TODO: use libavcodec to directly convert it */
-			utime(destname, &u);
+			converted++;
+			if (!stat(fname, &st))
+				bytes_in += st.st_size;
+			bytes_out += len;
+			printf("converted  %s (%zu bytes, %d ms)\n", fname, len, (int)((now() - t0) * 1000));
 		}
 		else
-			printf("cache file %s already current\n", destname);
+		{
+			failed++;
+			fprintf(stderr, "pic2m2v: could not convert '%s'\n", fname);
+		}
+		pthread_mutex_unlock(&out_mutex);
 	}
+	return NULL;
+}
 
-	return 0;
+static void usage(void)
+{
+	fprintf(stderr, "usage: pic2m2v [-f] [-j threads] [-d cachedir] picture|directory...\n\n");
+	fprintf(stderr, "  -f  convert even if the picture is cached already\n");
+	fprintf(stderr, "  -j  number of threads (default: number of cpus)\n");
+	fprintf(stderr, "  -d  cache directory (default: $HAL_PIC_CACHE or /var/cache/stb-hal-pic)\n");
+}
+
+int main(int argc, char **argv)
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int c, i;
+
+	while ((c = getopt(argc, argv, "fj:d:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'f':
+				force = 1;
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'd':
+				setenv("HAL_PIC_CACHE", optarg, 1);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (optind >= argc)
+	{
+		usage();
+		return 1;
+	}
+	for (i = optind; i < argc; i++)
+		add_path(argv[i]);
+	if (threads < 1)
+		threads = 1;
+	if (threads > num_files)
+		threads = num_files;
+
+	double t0 = now();
+	pthread_t *t = calloc(threads, sizeof(*t));
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&t[i], NULL, worker, NULL))
+			break;
+	if (i == 0)
+		worker(NULL);
+	while (i-- > 0)
+		pthread_join(t[i], NULL);
+	double secs = now() - t0;
+
+	printf("%d pictures: %d converted, %d cached, %d failed in %.2f s with %d threads\n",
+		num_files, converted, cached, failed, secs, threads);
+	if (converted && secs > 0)
+		printf("%.1f pictures/s, %.2f MB/s in, %.2f MB/s out\n",
+			converted / secs, bytes_in / secs / 1e6, bytes_out / secs / 1e6);
+	free(t);
+	for (i = 0; i < num_files; i++)
+		free(files[i]);
+	free(files);
+	return failed ? 1 : 0;
 }